@@ -21,6 +21,9 @@
 #include "config.h"
 
 #include <atomic>
+#include <functional>
+
+#include <platform/platform.h>
 
 #define AtomicValue std::atomic
 
@@ -145,6 +148,109 @@ private:
     bool locked;
 };
 
+/**
+ * Pick the shard the calling thread should use out of 2^bits shards.
+ */
+inline size_t threadShardIndex(size_t bits) {
+    // Thread ids are often aligned addresses, so mix all their bits into
+    // the top ones and use those.
+    uint64_t h = std::hash<cb_thread_t>()(cb_thread_self());
+    h *= 0x9E3779B97F4A7C15ULL;
+    return static_cast<size_t>(h >> (64 - bits));
+}
+
+/**
+ * A counter that threads update in shards of their own, each on its own
+ * cache line, so that busy writers neither contend nor false share.
+ *
+ * Reads add the shards up, so they cost a cache line per shard and, while
+ * updates are in flight, need not match any single moment. Once updates
+ * stop the sum is exact, even for counters that go down as well as up,
+ * since the shards add up modulo 2^64. Counters that drive decisions on
+ * every operation, or that must never go below zero, are better off as
+ * a plain AtomicValue.
+ */
+class ShardedCounter {
+public:
+    ShardedCounter(size_t initial = 0) {
+        store(initial);
+    }
+
+    void operator++() {
+        add(1);
+    }
+
+    void operator++(int) {
+        add(1);
+    }
+
+    void operator--() {
+        add(static_cast<size_t>(-1));
+    }
+
+    void operator--(int) {
+        add(static_cast<size_t>(-1));
+    }
+
+    void operator+=(size_t n) {
+        add(n);
+    }
+
+    void operator-=(size_t n) {
+        add(0 - n);
+    }
+
+    void fetch_add(size_t n) {
+        add(n);
+    }
+
+    void fetch_sub(size_t n) {
+        add(0 - n);
+    }
+
+    size_t load() const {
+        size_t rv = 0;
+        for (size_t i = 0; i < numShards; ++i) {
+            rv += shards[i].value.load(std::memory_order_relaxed);
+        }
+        return rv;
+    }
+
+    operator size_t() const {
+        return load();
+    }
+
+    /**
+     * Set the counter. Updates that race with this may or may not be
+     * lost, as with a store to an AtomicValue.
+     */
+    void store(size_t v) {
+        shards[0].value.store(v, std::memory_order_relaxed);
+        for (size_t i = 1; i < numShards; ++i) {
+            shards[i].value.store(0, std::memory_order_relaxed);
+        }
+    }
+
+private:
+    static const size_t shardBits = 3;
+    static const size_t numShards = 1 << shardBits;
+    static const size_t cacheLineSize = 64;
+
+    struct Shard {
+        AtomicValue<size_t> value;
+        char pad[cacheLineSize - sizeof(AtomicValue<size_t>)];
+    };
+
+    void add(size_t n) {
+        shards[threadShardIndex(shardBits)].value.fetch_add(
+                                            n, std::memory_order_relaxed);
+    }
+
+    Shard shards[numShards];
+
+    DISALLOW_COPY_AND_ASSIGN(ShardedCounter);
+};
+
 template <class T> class RCPtr;
 template <class S> class SingleThreadedRCPtr;
 
@@ -309,6 +415,25 @@ public:
         return (bool)value;
     }
 
+    /**
+     * Hand out the pointer along with a reference of its own, for code
+     * that only deals in plain pointers. Give it back with release().
+     */
+    T *retain() const {
+        return gimme();
+    }
+
+    /**
+     * Drop a reference taken by retain(). A value that was never shared
+     * through a reference counted pointer is simply deleted.
+     */
+    static void release(T *v) {
+        RCValue *rc = static_cast<RCValue *>(v);
+        if (rc->_rc_refcount.load() == 0 || rc->_rc_decref() == 0) {
+            delete v;
+        }
+    }
+
 private:
     T *gimme() const {
         if (value) {
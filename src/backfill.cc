@@ -53,7 +53,7 @@ void ItemResidentCallback::callback(CacheLookup &lookup) {
     LockHolder lh = vb->ht.getLockedBucket(lookup.getKey(), &bucket_num);
     StoredValue *v = vb->ht.unlocked_find(lookup.getKey(), bucket_num);
     if (v && v->isResident() && v->getBySeqno() == lookup.getBySeqno()) {
-        Item* it = v->toItem(false, lookup.getVBucketId());
+        Item* it = v->toItem(false, lookup.getVBucketId(), vb->ht);
         lh.unlock();
         CompletedBGFetchTapOperation tapop(connToken,
                                            lookup.getVBucketId(), true);
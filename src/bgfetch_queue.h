@@ -0,0 +1,132 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2015 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef SRC_BGFETCH_QUEUE_H_
+#define SRC_BGFETCH_QUEUE_H_ 1
+
+#include "config.h"
+
+#include <string>
+
+#include "atomic.h"
+#include "common.h"
+
+/**
+ * Lock-free intake for background fetch requests.
+ *
+ * Any number of front-end threads may push() concurrently; a single
+ * consumer (the vbucket's bg fetch batch) takes everything queued so far
+ * with drain(). Producers link a node onto the head with a CAS, and the
+ * consumer swaps the head out in one exchange. Because nodes are never
+ * popped one at a time, there is no ABA problem.
+ *
+ * drain() groups the requests by key in arrival order, so several
+ * requests for the same key still end up as a single disk read.
+ */
+template <typename T>
+class BGFetchQueue {
+public:
+    BGFetchQueue() : head(NULL), numItems(0) { }
+
+    ~BGFetchQueue() {
+        // Items are owned by the caller; only release the list nodes.
+        Node *n = head.exchange(NULL);
+        while (n) {
+            Node *next = n->next;
+            delete n;
+            n = next;
+        }
+    }
+
+    /**
+     * Queue a fetch request for the given key.
+     *
+     * @return true if the queue was empty before this request, i.e. the
+     *         caller should make sure a consumer will drain it.
+     */
+    bool push(const std::string &key, T item) {
+        Node *n = new Node(key, item);
+        // Count before publishing so drain() never takes numItems below 0.
+        ++numItems;
+        Node *old = head.load();
+        do {
+            n->next = old;
+        } while (!head.compare_exchange_weak(old, n));
+        return old == NULL;
+    }
+
+    /**
+     * Move every queued request into the given map of key to list of
+     * requests. Must only be called by one thread at a time.
+     *
+     * @return the number of requests moved
+     */
+    template <typename M>
+    size_t drain(M &fetches) {
+        Node *n = head.exchange(NULL);
+        if (!n) {
+            return 0;
+        }
+
+        // The list is newest first; reverse it to keep arrival order.
+        Node *prev = NULL;
+        while (n) {
+            Node *next = n->next;
+            n->next = prev;
+            prev = n;
+            n = next;
+        }
+
+        size_t count = 0;
+        for (n = prev; n; ) {
+            Node *next = n->next;
+            fetches[n->key].push_back(n->item);
+            delete n;
+            ++count;
+            n = next;
+        }
+        numItems.fetch_sub(count);
+        return count;
+    }
+
+    bool empty() const {
+        return head.load() == NULL;
+    }
+
+    /**
+     * Number of queued requests. This is a dirty read that may briefly
+     * lag behind concurrent push() calls.
+     */
+    size_t size() const {
+        return numItems.load();
+    }
+
+private:
+    struct Node {
+        Node(const std::string &k, T i) : key(k), item(i), next(NULL) { }
+        std::string key;
+        T item;
+        Node *next;
+    };
+
+    AtomicValue<Node*> head;
+    AtomicValue<size_t> numItems;
+
+    DISALLOW_COPY_AND_ASSIGN(BGFetchQueue);
+};
+
+#endif  // SRC_BGFETCH_QUEUE_H_
@@ -47,6 +47,10 @@ void BgFetcher::stop() {
 
 void BgFetcher::notifyBGEvent(void) {
     ++stats.numRemainingBgJobs;
+    wakeUp();
+}
+
+void BgFetcher::wakeUp(void) {
     bool inverse = false;
     if (pendingFetch.compare_exchange_strong(inverse, true)) {
         cb_assert(taskId > 0);
@@ -54,7 +58,7 @@ void BgFetcher::notifyBGEvent(void) {
     }
 }
 
-size_t BgFetcher::doFetch(uint16_t vbId) {
+size_t BgFetcher::doFetch(uint16_t vbId, vb_bgfetch_queue_t &items2fetch) {
     hrtime_t startTime(gethrtime());
     LOG(EXTENSION_LOG_DEBUG, "BgFetcher is fetching data, vBucket = %d "
         "numDocs = %d, startTime = %lld\n", vbId, items2fetch.size(),
@@ -78,14 +82,15 @@ size_t BgFetcher::doFetch(uint16_t vbId) {
     if (totalfetches > 0) {
         store->completeBGFetchMulti(vbId, fetchedItems, startTime);
         stats.getMultiHisto.add((gethrtime()-startTime)/1000, totalfetches);
+        stats.bgFetchBatchSizeHisto.add(totalfetches);
     }
 
     // failed requests will get requeued for retry within clearItems()
-    clearItems(vbId);
+    clearItems(items2fetch);
     return totalfetches;
 }
 
-void BgFetcher::clearItems(uint16_t vbId) {
+void BgFetcher::clearItems(vb_bgfetch_queue_t &items2fetch) {
     vb_bgfetch_queue_t::iterator itr = items2fetch.begin();
 
     for(; itr != items2fetch.end(); ++itr) {
@@ -103,40 +108,43 @@ void BgFetcher::clearItems(uint16_t vbId) {
 }
 
 bool BgFetcher::run(GlobalTask *task) {
-    size_t num_fetched_items = 0;
     bool inverse = true;
     pendingFetch.compare_exchange_strong(inverse, false);
 
     std::vector<uint16_t> bg_vbs;
     LockHolder lh(queueMutex);
-    std::set<uint16_t>::iterator it = pendingVbs.begin();
-    for (; it != pendingVbs.end(); ++it) {
-        bg_vbs.push_back(*it);
+    if (!pendingVbs.empty()) {
+        stats.bgFetchQueueDepthHisto.add(pendingVbs.size());
     }
-    pendingVbs.clear();
-    lh.unlock();
-
-    std::vector<uint16_t>::iterator ita = bg_vbs.begin();
-    for (; ita != bg_vbs.end(); ++ita) {
-        uint16_t vbId = *ita;
+    std::set<uint16_t>::iterator it = pendingVbs.begin();
+    while (it != pendingVbs.end() && inflightVbs.size() < maxInflight) {
+        uint16_t vbId = *it;
+        if (inflightVbs.find(vbId) != inflightVbs.end()) {
+            // The running batch wakes us up again once it completes.
+            ++it;
+            continue;
+        }
         if (store->getVBuckets().isBucketCreation(vbId)) {
-            // Requeue the bg fetch task if a vbucket DB file is not
-            // created yet.
-            lh.lock();
-            pendingVbs.insert(vbId);
-            lh.unlock();
+            // Keep the vbucket pending until its DB file is created.
             bool inverse = false;
             pendingFetch.compare_exchange_strong(inverse, true);
+            ++it;
             continue;
         }
-        RCPtr<VBucket> vb = shard->getBucket(vbId);
-        if (vb && vb->getBGFetchItems(items2fetch)) {
-            num_fetched_items += doFetch(vbId);
-            items2fetch.clear();
-        }
+        stats.bgFetchConcurrencyHisto.add(inflightVbs.size());
+        inflightVbs.insert(vbId);
+        ++stats.numBgFetchInflight;
+        bg_vbs.push_back(vbId);
+        pendingVbs.erase(it++);
     }
+    lh.unlock();
 
-    stats.numRemainingBgJobs.fetch_sub(num_fetched_items);
+    EventuallyPersistentEngine *engine = &(store->getEPEngine());
+    std::vector<uint16_t>::iterator ita = bg_vbs.begin();
+    for (; ita != bg_vbs.end(); ++ita) {
+        ExTask batch = new BgFetchBatchTask(engine, this, *ita);
+        ExecutorPool::get()->schedule(batch, READER_TASK_IDX);
+    }
 
     if (!pendingFetch.load()) {
         // wait a bit until next fetch request arrives
@@ -152,6 +160,33 @@ bool BgFetcher::run(GlobalTask *task) {
     return true;
 }
 
+void BgFetcher::runBatch(uint16_t vbId) {
+    size_t num_fetched_items = 0;
+    vb_bgfetch_queue_t items2fetch;
+    RCPtr<VBucket> vb = shard->getBucket(vbId);
+    if (vb && vb->getBGFetchItems(items2fetch)) {
+        hrtime_t startTime(gethrtime());
+        num_fetched_items = doFetch(vbId, items2fetch);
+        ++vb->bgFetchBatches;
+        vb->bgFetchItems.fetch_add(num_fetched_items);
+        vb->bgFetchTime.fetch_add((gethrtime() - startTime) / 1000);
+    }
+
+    stats.numRemainingBgJobs.fetch_sub(num_fetched_items);
+
+    LockHolder lh(queueMutex);
+    inflightVbs.erase(vbId);
+    --stats.numBgFetchInflight;
+    bool morePending = !pendingVbs.empty();
+    lh.unlock();
+
+    if (morePending) {
+        // Vbuckets may have been held back by the in-flight limit, or
+        // queued more fetches while this batch was running.
+        wakeUp();
+    }
+}
+
 bool BgFetcher::pendingJob() {
     std::vector<int> vbIds = shard->getVBuckets();
     size_t numVbuckets = vbIds.size();
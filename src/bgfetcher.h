@@ -36,7 +36,11 @@ class GlobalTask;
 
 /**
  * Dispatcher job responsible for batching data reads and push to
- * underlying storage
+ * underlying storage.
+ *
+ * Each pending vbucket's batch is read by its own BgFetchBatchTask, so
+ * several READER threads can serve one shard at the same time. At most
+ * one batch per vbucket and maxInflight batches per shard run at once.
  */
 class BgFetcher {
 public:
@@ -45,10 +49,14 @@ public:
      * Construct a BgFetcher task.
      *
      * @param s the store
-     * @param d the dispatcher
+     * @param k the shard whose vbuckets are fetched
+     * @param st the engine stats
+     * @param inflight max number of batches running at once
      */
-    BgFetcher(EventuallyPersistentStore *s, KVShard *k, EPStats &st) :
-        store(s), shard(k), taskId(0), stats(st), pendingFetch(false) {}
+    BgFetcher(EventuallyPersistentStore *s, KVShard *k, EPStats &st,
+              size_t inflight = 1) :
+        store(s), shard(k), taskId(0), stats(st),
+        maxInflight(inflight > 0 ? inflight : 1), pendingFetch(false) {}
     ~BgFetcher() {
         LockHolder lh(queueMutex);
         if (!pendingVbs.empty()) {
@@ -62,6 +70,7 @@ public:
     void start(void);
     void stop(void);
     bool run(GlobalTask *task);
+    void runBatch(uint16_t vbId);
     bool pendingJob(void);
     void notifyBGEvent(void);
     void setTaskId(size_t newId) { taskId = newId; }
@@ -71,18 +80,20 @@ public:
     }
 
 private:
-    size_t doFetch(uint16_t vbId);
-    void clearItems(uint16_t vbId);
+    size_t doFetch(uint16_t vbId, vb_bgfetch_queue_t &items2fetch);
+    void clearItems(vb_bgfetch_queue_t &items2fetch);
+    void wakeUp(void);
 
     EventuallyPersistentStore *store;
     KVShard *shard;
-    vb_bgfetch_queue_t items2fetch;
     size_t taskId;
     Mutex queueMutex;
     EPStats &stats;
+    const size_t maxInflight;
 
     AtomicValue<bool> pendingFetch;
     std::set<uint16_t> pendingVbs;
+    std::set<uint16_t> inflightVbs;
 };
 
 #endif  // SRC_BGFETCHER_H_
@@ -15,6 +15,10 @@
  *   limitations under the License.
  */
 
+#include "config.h"
+
+#include <algorithm>
+
 #include "bloomfilter.h"
 #include "murmurhash3.h"
 
@@ -24,6 +28,11 @@
 #define MURMURHASH_3 MurmurHash3_x86_128
 #endif
 
+// Keys do not spread perfectly evenly over the blocks, which costs a
+// blocked filter some accuracy. Give it ~10% more bits so the measured
+// false positive rate stays at the configured probability.
+static const double blockOverhead = 1.1;
+
 BloomFilter::BloomFilter(size_t key_count, double false_positive_prob,
                          bfilter_status_t new_status) {
 
@@ -31,18 +40,33 @@ BloomFilter::BloomFilter(size_t key_count, double false_positive_prob,
     filterSize = estimateFilterSize(key_count, false_positive_prob);
     noOfHashes = estimateNoOfHashes(key_count);
     keyCounter = 0;
-    bitArray.assign(filterSize, false);
+
+    // Round the filter up to whole cache-line blocks.
+    numBlocks = std::max((filterSize + blockBits - 1) / blockBits,
+                         static_cast<size_t>(1));
+    filterSize = numBlocks * blockBits;
+
+    bitArrayAlloc = new uint8_t[numBlocks * blockBits / 8 + 63];
+    uintptr_t p = reinterpret_cast<uintptr_t>(bitArrayAlloc);
+    bitArray = reinterpret_cast<uint64_t *>((p + 63) & ~uintptr_t(63));
+    std::fill(bitArray, bitArray + numBlocks * blockWords, 0);
 }
 
 BloomFilter::~BloomFilter() {
     status = BFILTER_DISABLED;
-    bitArray.clear();
+    freeBitArray();
+}
+
+void BloomFilter::freeBitArray() {
+    delete []bitArrayAlloc;
+    bitArrayAlloc = NULL;
+    bitArray = NULL;
 }
 
 size_t BloomFilter::estimateFilterSize(size_t key_count,
                                        double false_positive_prob) {
     return round(-(((double)(key_count) * log(false_positive_prob))
-                                                    / (pow(log(2.0), 2))));
+                                      / (pow(log(2.0), 2))) * blockOverhead);
 }
 
 size_t BloomFilter::estimateNoOfHashes(size_t key_count) {
@@ -59,7 +83,7 @@ void BloomFilter::setStatus(bfilter_status_t to) {
         case BFILTER_PENDING:
             if (to == BFILTER_DISABLED) {
                 status = to;
-                bitArray.clear();
+                freeBitArray();
             } else if (to == BFILTER_COMPACTING) {
                 status = to;
             }
@@ -67,7 +91,7 @@ void BloomFilter::setStatus(bfilter_status_t to) {
         case BFILTER_COMPACTING:
             if (to == BFILTER_DISABLED) {
                 status = to;
-                bitArray.clear();
+                freeBitArray();
             } else if (to == BFILTER_ENABLED) {
                 status = to;
             }
@@ -75,7 +99,7 @@ void BloomFilter::setStatus(bfilter_status_t to) {
         case BFILTER_ENABLED:
             if (to == BFILTER_DISABLED) {
                 status = to;
-                bitArray.clear();
+                freeBitArray();
             } else if (to == BFILTER_COMPACTING) {
                 status = to;
             }
@@ -105,17 +129,39 @@ std::string BloomFilter::getStatusString() {
     }
 }
 
+uint64_t *BloomFilter::getBlock(const char *key, size_t keylen,
+                                uint64_t *mask) {
+    // Both MurmurHash3 variants write a 128 bit hash.
+    uint64_t hash[2];
+    MURMURHASH_3(key, keylen, 0, hash);
+    uint64_t result = hash[0];
+
+    // The high half of the hash picks the block, the low half derives the
+    // bit positions inside it by double hashing. The step is kept odd so
+    // the positions only repeat after a full cycle of the block.
+    uint64_t *block = bitArray + ((result >> 32) % numBlocks) * blockWords;
+    uint32_t pos = static_cast<uint32_t>(result & 0xffff);
+    uint32_t step = static_cast<uint32_t>((result >> 16) & 0xffff) | 1;
+
+    std::fill(mask, mask + blockWords, 0);
+    for (size_t i = 0; i < noOfHashes; i++) {
+        uint32_t bit = pos % blockBits;
+        mask[bit / 64] |= uint64_t(1) << (bit % 64);
+        pos += step;
+    }
+    return block;
+}
+
 void BloomFilter::addKey(const char *key, size_t keylen) {
     if (status == BFILTER_COMPACTING || status == BFILTER_ENABLED) {
+        uint64_t mask[blockWords];
+        uint64_t *block = getBlock(key, keylen, mask);
         bool overlap = true;
-        uint32_t i;
-        uint64_t result;
-        for (i = 0; i < noOfHashes; i++) {
-            MURMURHASH_3(key, keylen, i, &result);
-            if (overlap && bitArray[result % filterSize] == 0) {
+        for (size_t i = 0; i < blockWords; i++) {
+            if ((block[i] & mask[i]) != mask[i]) {
                 overlap = false;
             }
-            bitArray[result % filterSize] = 1;
+            block[i] |= mask[i];
         }
         if (!overlap) {
             keyCounter++;
@@ -125,14 +171,17 @@ void BloomFilter::addKey(const char *key, size_t keylen) {
 
 bool BloomFilter::maybeKeyExists(const char *key, uint32_t keylen) {
     if (status == BFILTER_COMPACTING || status == BFILTER_ENABLED) {
-        uint32_t i;
-        uint64_t result;
-        for (i = 0; i < noOfHashes; i++) {
-            MURMURHASH_3(key, keylen, i, &result);
-            if (bitArray[result % filterSize] == 0) {
-                // The key does NOT exist.
-                return false;
-            }
+        uint64_t mask[blockWords];
+        const uint64_t *block = getBlock(key, keylen, mask);
+        // Fixed-width, branch-free compare of the whole block so the
+        // compiler can vectorize it.
+        uint64_t missing = 0;
+        for (size_t i = 0; i < blockWords; i++) {
+            missing |= mask[i] & ~block[i];
+        }
+        if (missing) {
+            // The key does NOT exist.
+            return false;
         }
     }
     // The key may exist.
@@ -33,6 +33,11 @@ typedef enum {
  * We are to maintain the vbucket-number of these instances.
  *
  * Each vbucket will hold one such object.
+ *
+ * The filter is cache blocked: the bit array is split into 64-byte
+ * blocks, and all the bits for a key are set in a single block chosen
+ * from the key's hash. A lookup therefore touches one cache line and
+ * compares the whole block against the key's mask in one pass.
  */
 class BloomFilter {
 public:
@@ -51,16 +56,31 @@ public:
     size_t getFilterSize();
 
 private:
+    // Bits per block; one block fills one 64-byte cache line.
+    static const size_t blockBits = 512;
+    static const size_t blockWords = blockBits / 64;
+
     size_t estimateFilterSize(size_t key_count, double false_positive_prob);
     size_t estimateNoOfHashes(size_t key_count);
 
+    /**
+     * Compute the block a key maps to and the bits it sets in there.
+     */
+    uint64_t *getBlock(const char *key, size_t keylen, uint64_t *mask);
+
+    void freeBitArray();
+
     size_t filterSize;
     size_t noOfHashes;
+    size_t numBlocks;
 
     size_t keyCounter;
 
     bfilter_status_t status;
-    std::vector<bool> bitArray;
+    uint8_t *bitArrayAlloc;
+    uint64_t *bitArray;
+
+    DISALLOW_COPY_AND_ASSIGN(BloomFilter);
 };
 
 #endif // SRC_BLOOMFILTER_H_
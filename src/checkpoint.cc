@@ -17,6 +17,7 @@
 
 #include "config.h"
 
+#include <algorithm>
 #include <string>
 #include <utility>
 #include <vector>
@@ -30,6 +31,27 @@
 
 const std::string CheckpointManager::pCursorName("persistence");
 
+// A cursor handle is a serial number combined with the cursor's slot, so that
+// a stale handle never matches the cursor registered in the same slot later.
+static const size_t cursorSlotBits = 16;
+static const cursor_handle_t cursorSlotMask = (1 << cursorSlotBits) - 1;
+
+const cursor_handle_t CheckpointManager::pCursor = 1 << cursorSlotBits;
+
+// Serial 1 is reserved for the persistence cursor.
+static AtomicValue<uint64_t> nextCursorSerial(2);
+
+// Below this many items getAllItemsForCursor() copies them right away
+// instead of dropping and retaking the queue lock.
+static const size_t unlockedCopyThreshold = 256;
+
+static size_t countBits(uint64_t v) {
+    v = v - ((v >> 1) & 0x5555555555555555ULL);
+    v = (v & 0x3333333333333333ULL) + ((v >> 2) & 0x3333333333333333ULL);
+    v = (v + (v >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+    return static_cast<size_t>((v * 0x0101010101010101ULL) >> 56);
+}
+
 /**
  * A listener class to update checkpoint related configs at runtime.
  */
@@ -73,9 +95,25 @@ void CheckpointCursor::decrOffset(size_t decr) {
 }
 
 void CheckpointCursor::decrPos() {
-    if (currentPos != (*currentCheckpoint)->begin()) {
-        --currentPos;
-    }
+    currentPos = (*currentCheckpoint)->prev(currentPos);
+}
+
+const queued_item &CheckpointCursor::currentItem() const {
+    return (*currentCheckpoint)->getItem(currentPos);
+}
+
+Checkpoint::Checkpoint(EPStats &st, uint64_t id, uint64_t snapStart,
+                       uint64_t snapEnd, uint16_t vbid) :
+    stats(st), checkpointId(id), snapStartSeqno(snapStart),
+    snapEndSeqno(snapEnd), vbucketId(vbid), creationTime(ep_real_time()),
+    checkpointState(CHECKPOINT_OPEN), numItems(0), numCursors(0), numSlots(0),
+    numEmptySlots(0), numPins(0), numIndexEntries(0), memOverhead(0) {
+    // Room for the meta items plus a few mutations before the first resize.
+    index_entry empty = {0, emptyPosition, 0};
+    keyIndex.assign(8, empty);
+    stats.memOverhead.fetch_add(memorySize());
+    cb_assert(stats.memOverhead.load() < GIGANTOR);
+    updateMemOverhead();
 }
 
 Checkpoint::~Checkpoint() {
@@ -84,6 +122,12 @@ Checkpoint::~Checkpoint() {
         checkpointId, vbucketId);
     stats.memOverhead.fetch_sub(memorySize());
     cb_assert(stats.memOverhead.load() < GIGANTOR);
+    cb_assert(numPins == 0);
+    std::vector<queued_item*>::iterator it = segments.begin();
+    for (; it != segments.end(); ++it) {
+        delete []*it;
+    }
+    releaseRetiredSegments();
 }
 
 void Checkpoint::setState(checkpoint_state state) {
@@ -91,15 +135,249 @@ void Checkpoint::setState(checkpoint_state state) {
 }
 
 void Checkpoint::popBackCheckpointEndItem() {
-    if (!toWrite.empty() &&
-        toWrite.back()->getOperation() == queue_op_checkpoint_end) {
-        keyIndex.erase(toWrite.back()->getKey());
-        toWrite.pop_back();
+    if (numSlots == 0) {
+        return;
+    }
+    size_t pos = last();
+    const queued_item &qi = getItem(pos);
+    if (qi->getOperation() == queue_op_checkpoint_end) {
+        index_entry *entry = findEntry(qi->getKey(), hashKey(qi->getKey()));
+        if (entry) {
+            eraseEntry(entry);
+        }
+        emptySlot(pos);
+        ++numEmptySlots;
+        // Trailing empty slots are reused, unless a reader may still copy
+        // from them.
+        while (numPins == 0 && numSlots > 0 && !isLive(numSlots - 1)) {
+            --numSlots;
+            --numEmptySlots;
+        }
     }
 }
 
 bool Checkpoint::keyExists(const std::string &key) {
-    return keyIndex.find(key) != keyIndex.end();
+    return findEntry(key, hashKey(key)) != NULL;
+}
+
+uint32_t Checkpoint::hashKey(const std::string &key) {
+    uint32_t h = 5381;
+    for (size_t i = 0; i < key.length(); ++i) {
+        h = ((h << 5) + h) ^ static_cast<uint8_t>(key[i]);
+    }
+    return h;
+}
+
+index_entry *Checkpoint::findEntry(const std::string &key, uint32_t hash) {
+    size_t mask = keyIndex.size() - 1;
+    for (size_t i = hash & mask; ; i = (i + 1) & mask) {
+        index_entry &entry = keyIndex[i];
+        if (entry.position == emptyPosition) {
+            return NULL;
+        }
+        if (entry.hash == hash && getItem(entry.position)->getKey() == key) {
+            return &entry;
+        }
+    }
+}
+
+void Checkpoint::insertEntry(uint32_t hash, size_t pos, int64_t mutationId) {
+    // Keep the load factor at or below 1/2 so that probe chains stay short.
+    if ((numIndexEntries + 1) * 2 > keyIndex.size()) {
+        growIndex();
+    }
+    size_t mask = keyIndex.size() - 1;
+    size_t i = hash & mask;
+    while (keyIndex[i].position != emptyPosition) {
+        i = (i + 1) & mask;
+    }
+    keyIndex[i].hash = hash;
+    keyIndex[i].position = static_cast<uint32_t>(pos);
+    keyIndex[i].mutation_id = mutationId;
+    ++numIndexEntries;
+}
+
+void Checkpoint::eraseEntry(index_entry *entry) {
+    // Backward shift deletion: pull later entries of the probe chain into
+    // the hole, so that lookups never need tombstones.
+    size_t mask = keyIndex.size() - 1;
+    size_t hole = entry - &keyIndex[0];
+    size_t i = hole;
+    while (true) {
+        i = (i + 1) & mask;
+        if (keyIndex[i].position == emptyPosition) {
+            break;
+        }
+        size_t home = keyIndex[i].hash & mask;
+        bool inRange = hole <= i ? (hole < home && home <= i)
+                                 : (hole < home || home <= i);
+        if (!inRange) {
+            keyIndex[hole] = keyIndex[i];
+            hole = i;
+        }
+    }
+    keyIndex[hole].position = emptyPosition;
+    --numIndexEntries;
+}
+
+void Checkpoint::growIndex() {
+    index_entry empty = {0, emptyPosition, 0};
+    std::vector<index_entry> old(keyIndex.size() * 2, empty);
+    old.swap(keyIndex);
+    size_t mask = keyIndex.size() - 1;
+    std::vector<index_entry>::iterator it = old.begin();
+    for (; it != old.end(); ++it) {
+        if (it->position != emptyPosition) {
+            size_t i = it->hash & mask;
+            while (keyIndex[i].position != emptyPosition) {
+                i = (i + 1) & mask;
+            }
+            keyIndex[i] = *it;
+        }
+    }
+}
+
+void Checkpoint::append(const queued_item &qi) {
+    // Only slots past the published end are written, so readers copying
+    // published items never race with an append.
+    if (numSlots == segments.size() * segmentSize) {
+        segments.push_back(new queued_item[segmentSize]);
+        liveSlots.push_back(0);
+    }
+    segments[numSlots / segmentSize][numSlots % segmentSize] = qi;
+    liveSlots[numSlots / segmentSize] |=
+        static_cast<uint64_t>(1) << (numSlots % segmentSize);
+    ++numSlots;
+}
+
+void Checkpoint::emptySlot(size_t pos) {
+    liveSlots[pos / segmentSize] &=
+        ~(static_cast<uint64_t>(1) << (pos % segmentSize));
+    if (numPins == 0) {
+        segments[pos / segmentSize][pos % segmentSize].reset();
+    }
+}
+
+void Checkpoint::releaseRetiredSegments() {
+    std::vector<queued_item*>::iterator it = retiredSegments.begin();
+    for (; it != retiredSegments.end(); ++it) {
+        delete []*it;
+    }
+    retiredSegments.clear();
+}
+
+size_t Checkpoint::publish(size_t from, published_items &published) {
+    published.checkpoint = this;
+    size_t count = 0;
+    size_t first = from / segmentSize;
+    for (size_t seg = first; seg * segmentSize < numSlots; ++seg) {
+        uint64_t live = liveSlots[seg];
+        if (seg == first) {
+            live &= ~static_cast<uint64_t>(0) << (from % segmentSize);
+        }
+        published.segments.push_back(segments[seg]);
+        published.live.push_back(live);
+        count += countBits(live);
+    }
+    ++numPins;
+    return count;
+}
+
+void Checkpoint::copyPublished(const published_items &published,
+                               std::vector<queued_item> &items) {
+    for (size_t seg = 0; seg < published.segments.size(); ++seg) {
+        const queued_item *slots = published.segments[seg];
+        uint64_t live = published.live[seg];
+        for (size_t i = 0; live != 0; ++i, live >>= 1) {
+            if (live & 1) {
+                items.push_back(slots[i]);
+            }
+        }
+    }
+}
+
+bool Checkpoint::unpin() {
+    cb_assert(numPins > 0);
+    if (--numPins > 0) {
+        return false;
+    }
+    releaseRetiredSegments();
+    return true;
+}
+
+void Checkpoint::rebuild(const std::vector<queued_item> &inserted,
+                         CheckpointManager *checkpointManager) {
+    std::vector<queued_item*> old;
+    old.swap(segments);
+    std::vector<uint64_t> oldLive;
+    oldLive.swap(liveSlots);
+    size_t oldSlots = numSlots;
+    std::vector<uint32_t> remap(oldSlots, emptyPosition);
+
+    numSlots = 0;
+    numEmptySlots = 0;
+    bool placed = false;
+    for (size_t pos = 0; pos < oldSlots; ++pos) {
+        if (!((oldLive[pos / segmentSize] >> (pos % segmentSize)) & 1)) {
+            continue;
+        }
+        const queued_item &qi = old[pos / segmentSize][pos % segmentSize];
+        if (!placed && pos >= 2) {
+            std::vector<queued_item>::const_iterator it = inserted.begin();
+            for (; it != inserted.end(); ++it) {
+                append(*it);
+            }
+            placed = true;
+        }
+        remap[pos] = static_cast<uint32_t>(numSlots);
+        append(qi);
+    }
+    if (!placed) {
+        std::vector<queued_item>::const_iterator it = inserted.begin();
+        for (; it != inserted.end(); ++it) {
+            append(*it);
+        }
+    }
+
+    std::vector<index_entry>::iterator eit = keyIndex.begin();
+    for (; eit != keyIndex.end(); ++eit) {
+        if (eit->position != emptyPosition) {
+            eit->position = remap[eit->position];
+        }
+    }
+
+    std::vector<CheckpointCursor>::iterator cit =
+        checkpointManager->cursors.begin();
+    for (; cit != checkpointManager->cursors.end(); ++cit) {
+        if (checkpointManager->isCursorInCheckpoint(*cit, this)) {
+            cit->currentPos = remap[cit->currentPos];
+        }
+    }
+
+    // Pinned segments may still be copied from; free them on the last unpin.
+    std::vector<queued_item*>::iterator sit = old.begin();
+    for (; sit != old.end(); ++sit) {
+        if (numPins > 0) {
+            retiredSegments.push_back(*sit);
+        } else {
+            delete []*sit;
+        }
+    }
+    updateMemOverhead();
+}
+
+void Checkpoint::updateMemOverhead() {
+    size_t overhead = segments.size() * segmentSize * sizeof(queued_item) +
+                      segments.capacity() * sizeof(queued_item*) +
+                      liveSlots.capacity() * sizeof(uint64_t) +
+                      keyIndex.size() * sizeof(index_entry);
+    if (overhead > memOverhead) {
+        stats.memOverhead.fetch_add(overhead - memOverhead);
+    } else if (overhead < memOverhead) {
+        stats.memOverhead.fetch_sub(memOverhead - overhead);
+    }
+    memOverhead = overhead;
+    cb_assert(stats.memOverhead.load() < GIGANTOR);
 }
 
 queue_dirty_t Checkpoint::queueDirty(const queued_item &qi,
@@ -107,41 +385,51 @@ queue_dirty_t Checkpoint::queueDirty(const queued_item &qi,
     assert (checkpointState == CHECKPOINT_OPEN);
     queue_dirty_t rv;
 
-    checkpoint_index::iterator it = keyIndex.find(qi->getKey());
+    uint32_t hash = hashKey(qi->getKey());
+    index_entry *entry = findEntry(qi->getKey(), hash);
     // Check if this checkpoint already had an item for the same key.
-    if (it != keyIndex.end()) {
+    if (entry) {
         rv = EXISTING_ITEM;
-        std::list<queued_item>::iterator currPos = it->second.position;
-        uint64_t currMutationId = it->second.mutation_id;
+        size_t currPos = entry->position;
+        uint64_t currMutationId = entry->mutation_id;
 
-        cursor_index::iterator map_it = checkpointManager->tapCursors.begin();
-        for (; map_it != checkpointManager->tapCursors.end(); ++map_it) {
+        std::vector<CheckpointCursor>::iterator cit =
+            checkpointManager->cursors.begin();
+        for (; cit != checkpointManager->cursors.end(); ++cit) {
 
-            if (*(map_it->second.currentCheckpoint) == this) {
-                queued_item &tqi = *(map_it->second.currentPos);
+            if (checkpointManager->isCursorInCheckpoint(*cit, this)) {
+                const queued_item &tqi = getItem(cit->currentPos);
                 const std::string &key = tqi->getKey();
-                checkpoint_index::iterator ita = keyIndex.find(key);
-                if (ita != keyIndex.end()) {
-                    uint64_t mutationId = ita->second.mutation_id;
+                index_entry *ita = findEntry(key, hashKey(key));
+                if (ita) {
+                    uint64_t mutationId = ita->mutation_id;
                     if (currMutationId <= mutationId &&
                         tqi->getOperation() != queue_op_checkpoint_start) {
-                        map_it->second.decrOffset(1);
-                        if (map_it->second.name.compare(CheckpointManager::pCursorName) == 0) {
+                        cit->decrOffset(1);
+                        if (cit->handle == CheckpointManager::pCursor) {
                             rv = PERSIST_AGAIN;
                         }
                     }
                 }
                 // If an TAP cursor points to the existing item for the same
                 // key, shift it left by 1
-                if (map_it->second.currentPos == currPos) {
-                    map_it->second.decrPos();
+                if (cit->currentPos == currPos) {
+                    cit->decrPos();
                 }
             }
         }
 
-        toWrite.push_back(qi);
-        // Remove the existing item for the same key from the list.
-        toWrite.erase(currPos);
+        // Empty the slot of the existing item and append the new one.
+        emptySlot(currPos);
+        ++numEmptySlots;
+        append(qi);
+        entry->position = static_cast<uint32_t>(numSlots - 1);
+        entry->mutation_id = qi->getBySeqno();
+
+        // Compact once most of the slots are empty, e.g. under a hot key.
+        if (numEmptySlots >= segmentSize && numEmptySlots * 2 > numSlots) {
+            rebuild(std::vector<queued_item>(), checkpointManager);
+        }
     } else {
         if (qi->getOperation() == queue_op_set ||
             qi->getOperation() == queue_op_del) {
@@ -149,24 +437,12 @@ queue_dirty_t Checkpoint::queueDirty(const queued_item &qi,
         }
         rv = NEW_ITEM;
         // Push the new item into the list
-        toWrite.push_back(qi);
-    }
-
-    if (qi->getNKey() > 0) {
-        std::list<queued_item>::iterator last = toWrite.end();
-        // --last is okay as the list is not empty now.
-        index_entry entry = {--last, qi->getBySeqno()};
-        // Set the index of the key to the new item that is pushed back into
-        // the list.
-        keyIndex[qi->getKey()] = entry;
-        if (rv == NEW_ITEM) {
-            size_t newEntrySize = qi->getNKey() + sizeof(index_entry) +
-                                  sizeof(queued_item);
-            memOverhead += newEntrySize;
-            stats.memOverhead.fetch_add(newEntrySize);
-            cb_assert(stats.memOverhead.load() < GIGANTOR);
+        append(qi);
+        if (qi->getNKey() > 0) {
+            insertEntry(hash, numSlots - 1, qi->getBySeqno());
         }
     }
+    updateMemOverhead();
 
     // Notify flusher if in case queued item is a checkpoint meta item
     if (qi->getOperation() == queue_op_checkpoint_start ||
@@ -177,56 +453,57 @@ queue_dirty_t Checkpoint::queueDirty(const queued_item &qi,
     return rv;
 }
 
-size_t Checkpoint::mergePrevCheckpoint(Checkpoint *pPrevCheckpoint) {
-    size_t numNewItems = 0;
-    size_t newEntryMemOverhead = 0;
-    std::list<queued_item>::reverse_iterator rit = pPrevCheckpoint->rbegin();
-
+size_t Checkpoint::mergePrevCheckpoint(Checkpoint *pPrevCheckpoint,
+                                       CheckpointManager *checkpointManager) {
     LOG(EXTENSION_LOG_INFO,
         "Collapse the checkpoint %llu into the checkpoint %llu for vbucket %d",
         pPrevCheckpoint->getId(), checkpointId, vbucketId);
 
-    std::list<queued_item>::iterator itr = toWrite.begin();
-    uint64_t seqno = pPrevCheckpoint->getMutationIdForKey("dummy_key");
-    keyIndex["dummy_key"].mutation_id = seqno;
-    (*itr)->setBySeqno(seqno);
-
-    seqno = pPrevCheckpoint->getMutationIdForKey("checkpoint_start");
-    keyIndex["checkpoint_start"].mutation_id = seqno;
-    ++itr;
-    (*itr)->setBySeqno(seqno);
-
-    for (; rit != pPrevCheckpoint->rend(); ++rit) {
-        const std::string &key = (*rit)->getKey();
-        if ((*rit)->getOperation() != queue_op_del &&
-            (*rit)->getOperation() != queue_op_set) {
+    const std::string dummyKey("dummy_key");
+    uint64_t seqno = pPrevCheckpoint->getMutationIdForKey(dummyKey);
+    findEntry(dummyKey, hashKey(dummyKey))->mutation_id = seqno;
+    size_t pos = begin();
+    getItem(pos)->setBySeqno(seqno);
+
+    const std::string startKey("checkpoint_start");
+    seqno = pPrevCheckpoint->getMutationIdForKey(startKey);
+    findEntry(startKey, hashKey(startKey))->mutation_id = seqno;
+    pos = next(pos);
+    getItem(pos)->setBySeqno(seqno);
+
+    // Items of the previous checkpoint that don't exist in this one go right
+    // after the first two meta items, keeping their order.
+    std::vector<queued_item> missing;
+    pos = pPrevCheckpoint->begin();
+    for (; pos != pPrevCheckpoint->end(); pos = pPrevCheckpoint->next(pos)) {
+        const queued_item &qi = pPrevCheckpoint->getItem(pos);
+        if (qi->getOperation() != queue_op_del &&
+            qi->getOperation() != queue_op_set) {
             continue;
         }
-        checkpoint_index::iterator it = keyIndex.find(key);
-        if (it == keyIndex.end()) {
-            std::list<queued_item>::iterator pos = toWrite.begin();
-            // Skip the first two meta items
-            ++pos; ++pos;
-            toWrite.insert(pos, *rit);
-            index_entry entry = {--pos, static_cast<int64_t>(pPrevCheckpoint->
-                                                    getMutationIdForKey(key))};
-            keyIndex[key] = entry;
-            newEntryMemOverhead += key.size() + sizeof(index_entry);
-            ++numItems;
-            ++numNewItems;
+        if (!keyExists(qi->getKey())) {
+            missing.push_back(qi);
         }
     }
-    memOverhead += newEntryMemOverhead;
-    stats.memOverhead.fetch_add(newEntryMemOverhead);
-    cb_assert(stats.memOverhead.load() < GIGANTOR);
-    return numNewItems;
+
+    if (!missing.empty()) {
+        rebuild(missing, checkpointManager);
+        for (size_t i = 0; i < missing.size(); ++i) {
+            const std::string &key = missing[i]->getKey();
+            insertEntry(hashKey(key), 2 + i,
+                        pPrevCheckpoint->getMutationIdForKey(key));
+        }
+        numItems += missing.size();
+        updateMemOverhead();
+    }
+    return missing.size();
 }
 
 uint64_t Checkpoint::getMutationIdForKey(const std::string &key) {
     uint64_t mid = 0;
-    checkpoint_index::iterator it = keyIndex.find(key);
-    if (it != keyIndex.end()) {
-        mid = it->second.mutation_id;
+    index_entry *entry = findEntry(key, hashKey(key));
+    if (entry) {
+        mid = entry->mutation_id;
     }
     return mid;
 }
@@ -238,6 +515,10 @@ CheckpointManager::~CheckpointManager() {
         delete *it;
         ++it;
     }
+    for (it = retiredCheckpoints.begin(); it != retiredCheckpoints.end();
+         ++it) {
+        delete *it;
+    }
 }
 
 uint64_t CheckpointManager::getOpenCheckpointId_UNLOCKED() {
@@ -270,11 +551,11 @@ uint64_t CheckpointManager::getLastClosedCheckpointId() {
 void CheckpointManager::setOpenCheckpointId_UNLOCKED(uint64_t id) {
     if (!checkpointList.empty()) {
         // Update the checkpoint_start item with the new Id.
-        std::list<queued_item>::iterator it =
-            ++(checkpointList.back()->begin());
-        (*it)->setRevSeqno(id);
+        Checkpoint *chk = checkpointList.back();
+        const queued_item &qi = chk->getItem(chk->next(chk->begin()));
+        qi->setRevSeqno(id);
         if (checkpointList.back()->getId() == 0) {
-            (*it)->setBySeqno(lastBySeqno + 1);
+            qi->setBySeqno(lastBySeqno + 1);
             checkpointList.back()->setSnapshotStartSeqno(lastBySeqno);
             checkpointList.back()->setSnapshotEndSeqno(lastBySeqno);
         }
@@ -282,7 +563,7 @@ void CheckpointManager::setOpenCheckpointId_UNLOCKED(uint64_t id) {
         checkpointList.back()->setId(id);
         LOG(EXTENSION_LOG_INFO, "Set the current open checkpoint id to %llu "
             "for vbucket %d, bySeqno is %llu, max is %llu", id, vbucketId,
-            (*it)->getBySeqno(), lastBySeqno);
+            qi->getBySeqno(), lastBySeqno);
     }
 }
 
@@ -327,30 +608,28 @@ bool CheckpointManager::addNewCheckpoint_UNLOCKED(uint64_t id,
     // If any of replication cursors reached to the end of its current
     // checkpoint, move it to the next checkpoint. Note that the replication
     // cursors cannot skip a checkpoint_end meta item.
-    std::map<const std::string, CheckpointCursor>::iterator tap_it = tapCursors.begin();
-    for (; tap_it != tapCursors.end(); ++tap_it) {
-        CheckpointCursor &cursor = tap_it->second;
-        ++(cursor.currentPos);
-        if (cursor.name.compare(pCursorName) == 0 &&
-            cursor.currentPos != (*(cursor.currentCheckpoint))->end() &&
-            (*(cursor.currentPos))->getOperation() == queue_op_checkpoint_end) {
+    std::vector<CheckpointCursor>::iterator cit = cursors.begin();
+    for (; cit != cursors.end(); ++cit) {
+        CheckpointCursor &cursor = *cit;
+        if (cursor.handle == 0 ||
+            cursor.currentCheckpoint == checkpointList.end()) {
+            continue;
+        }
+        Checkpoint *chk = *(cursor.currentCheckpoint);
+        size_t pos = chk->next(cursor.currentPos);
+        if (cursor.handle == pCursor &&
+            pos != chk->end() &&
+            chk->getItem(pos)->getOperation() == queue_op_checkpoint_end) {
             // checkpoint_end meta item is only used by replication cursors
             ++(cursor.offset);
-            ++(cursor.currentPos); // cursor now reaches to the checkpoint end
-        }
-
-        if (cursor.currentPos == (*(cursor.currentCheckpoint))->end()) {
-           if ((*(cursor.currentCheckpoint))->getState() == CHECKPOINT_CLOSED) {
-               if (!moveCursorToNextCheckpoint(cursor)) {
-                   --(cursor.currentPos);
-               }
-           } else {
-               // The replication cursor is already reached to the end of
-               // the open checkpoint.
-               --(cursor.currentPos);
-           }
-        } else {
-            --(cursor.currentPos);
+            cursor.currentPos = pos;
+            pos = chk->next(pos); // cursor now reaches to the checkpoint end
+        }
+
+        // A cursor at the end of the open checkpoint stays where it is, as
+        // the replication cursor is already reached to its end.
+        if (pos == chk->end() && chk->getState() == CHECKPOINT_CLOSED) {
+            moveCursorToNextCheckpoint(cursor);
         }
     }
 
@@ -384,22 +663,97 @@ bool CheckpointManager::closeOpenCheckpoint() {
     return closeOpenCheckpoint_UNLOCKED();
 }
 
+CheckpointCursor *CheckpointManager::getCursor(cursor_handle_t handle) {
+    size_t slot = static_cast<size_t>(handle & cursorSlotMask);
+    if (handle == 0 || slot >= cursors.size() ||
+        cursors[slot].handle != handle) {
+        return NULL;
+    }
+    return &cursors[slot];
+}
+
+CheckpointCursor *CheckpointManager::findCursor(const std::string &name) {
+    std::vector<CheckpointCursor>::iterator it = cursors.begin();
+    for (; it != cursors.end(); ++it) {
+        if (it->handle != 0 && it->name.compare(name) == 0) {
+            return &(*it);
+        }
+    }
+    return NULL;
+}
+
+CheckpointCursor &CheckpointManager::allocCursor(const std::string &name,
+                                                 cursor_handle_t handle) {
+    size_t slot = static_cast<size_t>(handle & cursorSlotMask);
+    if (handle == 0 || (slot < cursors.size() && cursors[slot].handle != 0)) {
+        for (slot = 0; slot < cursors.size() && cursors[slot].handle != 0;
+             ++slot) { }
+        handle = (nextCursorSerial++ << cursorSlotBits) | slot;
+    }
+    cb_assert(slot <= cursorSlotMask);
+    if (slot >= cursors.size()) {
+        cursors.resize(slot + 1);
+    }
+
+    CheckpointCursor &cursor = cursors[slot];
+    cursor.handle = handle;
+    cursor.name.assign(name);
+    cursor.currentCheckpoint = checkpointList.end();
+    cursor.currentPos = 0;
+    cursor.offset = 0;
+    cursor.fromBeginningOnChkCollapse = false;
+    return cursor;
+}
+
+void CheckpointManager::setCursorCheckpoint(CheckpointCursor &cursor,
+                                    std::list<Checkpoint*>::iterator chkItr) {
+    if (cursor.currentCheckpoint != checkpointList.end()) {
+        (*(cursor.currentCheckpoint))->decrNumCursors();
+    }
+    cursor.currentCheckpoint = chkItr;
+    (*chkItr)->incrNumCursors();
+}
+
+void CheckpointManager::detachCursors(std::list<Checkpoint*>::iterator first,
+                                      std::list<Checkpoint*>::iterator last) {
+    std::vector<CheckpointCursor>::iterator cit = cursors.begin();
+    for (; cit != cursors.end(); ++cit) {
+        if (cit->handle == 0) {
+            continue;
+        }
+        std::list<Checkpoint*>::iterator it = first;
+        for (; it != last; ++it) {
+            if (cit->currentCheckpoint == it) {
+                (*it)->decrNumCursors();
+                cit->currentCheckpoint = checkpointList.end();
+                break;
+            }
+        }
+    }
+}
+
 bool CheckpointManager::registerCursor(const std::string &name,
-                                          uint64_t checkpointId,
-                                          bool alwaysFromBeginning) {
+                                       cursor_handle_t &handle,
+                                       uint64_t checkpointId,
+                                       bool alwaysFromBeginning) {
     LockHolder lh(queueLock);
-    return registerCursor_UNLOCKED(name, checkpointId, alwaysFromBeginning);
+    handle = 0;
+    return registerCursor_UNLOCKED(name, handle, checkpointId,
+                                   alwaysFromBeginning);
 }
 
 CursorRegResult CheckpointManager::registerCursorBySeqno(const std::string &name,
-                                                         uint64_t startBySeqno) {
+                                                         uint64_t startBySeqno,
+                                                         cursor_handle_t &handle) {
     LockHolder lh(queueLock);
     cb_assert(!checkpointList.empty());
     cb_assert(checkpointList.back()->getHighSeqno() >= startBySeqno);
 
-    removeCursor_UNLOCKED(name);
+    removeCursor_UNLOCKED(findCursor(name));
+    handle = 0;
 
     size_t skipped = 0;
+    size_t pos = 0;
     CursorRegResult result;
     result.first = std::numeric_limits<uint64_t>::max();
     result.second = false;
@@ -410,35 +764,38 @@ CursorRegResult CheckpointManager::registerCursorBySeqno(const std::string &name
         uint64_t st = (*itr)->getLowSeqno();
 
         if (startBySeqno < st) {
-            tapCursors[name] = CheckpointCursor(name, itr, (*itr)->begin(),
-                                                skipped, false);
-            (*itr)->registerCursorName(name);
+            pos = (*itr)->begin();
             result.first = (*itr)->getLowSeqno();
             break;
         } else if (startBySeqno <= en) {
-            std::list<queued_item>::iterator iitr = (*itr)->begin();
-            while (++iitr != (*itr)->end() &&
-                    startBySeqno >= static_cast<uint64_t>((*iitr)->getBySeqno())) {
+            Checkpoint *chk = *itr;
+            pos = chk->begin();
+            size_t npos;
+            while ((npos = chk->next(pos)) != chk->end() &&
+                    startBySeqno >= static_cast<uint64_t>(chk->getItem(npos)->getBySeqno())) {
+                pos = npos;
                 skipped++;
             }
 
-            if (iitr == (*itr)->end()) {
-                --iitr;
-                result.first = static_cast<uint64_t>((*iitr)->getBySeqno()) + 1;
+            if (npos == chk->end()) {
+                result.first = static_cast<uint64_t>(chk->getItem(pos)->getBySeqno()) + 1;
             } else {
-                result.first = static_cast<uint64_t>((*iitr)->getBySeqno());
-                --iitr;
+                result.first = static_cast<uint64_t>(chk->getItem(npos)->getBySeqno());
             }
-
-            tapCursors[name] = CheckpointCursor(name, itr, iitr, skipped,
-                                                false);
-            (*itr)->registerCursorName(name);
             break;
         } else {
             skipped += (*itr)->getNumItems() + 2;
         }
     }
 
+    if (itr != checkpointList.end()) {
+        CheckpointCursor &cursor = allocCursor(name, 0);
+        setCursorCheckpoint(cursor, itr);
+        cursor.currentPos = pos;
+        cursor.offset = skipped;
+        handle = cursor.handle;
+    }
+
     result.second = (result.first == checkpointList.front()->getLowSeqno()) ? true : false;
 
     if (result.first == std::numeric_limits<uint64_t>::max()) {
@@ -455,6 +812,7 @@ CursorRegResult CheckpointManager::registerCursorBySeqno(const std::string &name
 }
 
 bool CheckpointManager::registerCursor_UNLOCKED(const std::string &name,
+                                                cursor_handle_t &handle,
                                                 uint64_t checkpointId,
                                                 bool alwaysFromBeginning) {
     cb_assert(!checkpointList.empty());
@@ -477,12 +835,14 @@ bool CheckpointManager::registerCursor_UNLOCKED(const std::string &name,
         "Register the tap cursor with the name \"%s\" for vbucket %d",
         name.c_str(), vbucketId);
 
-    // If the tap cursor exists, remove its name from the checkpoint that is
-    // currently referenced by the tap cursor.
-    cursor_index::iterator map_it = tapCursors.find(name);
-    if (map_it != tapCursors.end()) {
-        (*(map_it->second.currentCheckpoint))->removeCursorName(name);
+    // An existing cursor is repositioned and keeps its handle. A new one is
+    // not in any checkpoint yet.
+    CheckpointCursor *cursor = findCursor(name);
+    if (!cursor) {
+        cursor = &allocCursor(name, handle);
     }
+    handle = cursor->handle;
+    cursor->fromBeginningOnChkCollapse = resetOnCollapse;
 
     if (!found) {
         for (it = checkpointList.begin(); it != checkpointList.end(); ++it) {
@@ -505,12 +865,12 @@ bool CheckpointManager::registerCursor_UNLOCKED(const std::string &name,
             offset += (*pos)->getNumItems() + 2;
         }
 
-        tapCursors[name] = CheckpointCursor(name, it, (*it)->begin(), offset,
-                                            resetOnCollapse);
-        (*it)->registerCursorName(name);
+        setCursorCheckpoint(*cursor, it);
+        cursor->currentPos = (*it)->begin();
+        cursor->offset = offset;
     } else {
         size_t offset = 0;
-        std::list<queued_item>::iterator curr;
+        size_t curr;
 
         LOG(EXTENSION_LOG_DEBUG,
             "Checkpoint %llu for vbucket %d exists in memory. "
@@ -518,13 +878,13 @@ bool CheckpointManager::registerCursor_UNLOCKED(const std::string &name,
             checkpointId, vbucketId, name.c_str(), checkpointId);
 
         if (!alwaysFromBeginning &&
-            map_it != tapCursors.end() &&
-            (*(map_it->second.currentCheckpoint))->getId() == (*it)->getId()) {
+            cursor->currentCheckpoint != checkpointList.end() &&
+            (*(cursor->currentCheckpoint))->getId() == (*it)->getId()) {
             // If the cursor is currently in the checkpoint to start with,
             // simply start from
             // its current position.
-            curr = map_it->second.currentPos;
-            offset = map_it->second.offset;
+            curr = cursor->currentPos;
+            offset = cursor->offset;
         } else {
             // Set the cursor's position to the begining of the checkpoint to
             // start with
@@ -536,60 +896,65 @@ bool CheckpointManager::registerCursor_UNLOCKED(const std::string &name,
             }
         }
 
-        tapCursors[name] = CheckpointCursor(name, it, curr, offset,
-                                            resetOnCollapse);
-        // Register the tap cursor's name to the checkpoint.
-        (*it)->registerCursorName(name);
+        setCursorCheckpoint(*cursor, it);
+        cursor->currentPos = curr;
+        cursor->offset = offset;
     }
 
     return found;
 }
 
+bool CheckpointManager::removeCursor(cursor_handle_t handle) {
+    LockHolder lh(queueLock);
+    return removeCursor_UNLOCKED(getCursor(handle));
+}
+
 bool CheckpointManager::removeCursor(const std::string &name) {
     LockHolder lh(queueLock);
-    return removeCursor_UNLOCKED(name);
+    return removeCursor_UNLOCKED(findCursor(name));
 }
 
-bool CheckpointManager::removeCursor_UNLOCKED(const std::string &name) {
-    cursor_index::iterator it = tapCursors.find(name);
-    if (it == tapCursors.end()) {
+bool CheckpointManager::removeCursor_UNLOCKED(CheckpointCursor *cursor) {
+    if (!cursor) {
         return false;
     }
 
     LOG(EXTENSION_LOG_INFO,
         "Remove the checkpoint cursor with the name \"%s\" from vbucket %d",
-        name.c_str(), vbucketId);
+        cursor->name.c_str(), vbucketId);
 
-    // We can simply remove the cursor's name from the checkpoint to which it
-    // currently belongs,
-    // by calling
-    // (*(it->second.currentCheckpoint))->removeCursorName(name);
-    // However, we just want to do more sanity checks by looking at each
-    // checkpoint. This won't
-    // cause much overhead because the max number of checkpoints allowed per
-    // vbucket is small.
-    std::list<Checkpoint*>::iterator cit = checkpointList.begin();
-    for (; cit != checkpointList.end(); ++cit) {
-        (*cit)->removeCursorName(name);
+    if (cursor->currentCheckpoint != checkpointList.end()) {
+        (*(cursor->currentCheckpoint))->decrNumCursors();
     }
-
-    tapCursors.erase(it);
+    // Free the slot; the handle is never handed out again.
+    *cursor = CheckpointCursor();
     return true;
 }
 
 uint64_t CheckpointManager::getCheckpointIdForCursor(const std::string &name) {
     LockHolder lh(queueLock);
-    cursor_index::iterator it = tapCursors.find(name);
-    if (it == tapCursors.end()) {
+    CheckpointCursor *cursor = findCursor(name);
+    if (!cursor) {
         return 0;
     }
 
-    return (*(it->second.currentCheckpoint))->getId();
+    return (*(cursor->currentCheckpoint))->getId();
 }
 
 size_t CheckpointManager::getNumOfCursors() {
     LockHolder lh(queueLock);
-    return tapCursors.size();
+    return getNumOfCursors_UNLOCKED();
+}
+
+size_t CheckpointManager::getNumOfCursors_UNLOCKED() {
+    size_t count = 0;
+    std::vector<CheckpointCursor>::iterator it = cursors.begin();
+    for (; it != cursors.end(); ++it) {
+        if (it->handle != 0) {
+            ++count;
+        }
+    }
+    return count;
 }
 
 size_t CheckpointManager::getNumCheckpoints() {
@@ -597,14 +962,16 @@ size_t CheckpointManager::getNumCheckpoints() {
     return checkpointList.size();
 }
 
-std::list<std::string> CheckpointManager::getCursorNames() {
+cursor_list CheckpointManager::getCursors() {
     LockHolder lh(queueLock);
-    std::list<std::string> cursor_names;
-    cursor_index::iterator tap_it = tapCursors.begin();
-        for (; tap_it != tapCursors.end(); ++tap_it) {
-        cursor_names.push_back((tap_it->first));
+    cursor_list cursorList;
+    std::vector<CheckpointCursor>::iterator it = cursors.begin();
+    for (; it != cursors.end(); ++it) {
+        if (it->handle != 0) {
+            cursorList.push_back(std::make_pair(it->handle, it->name));
+        }
     }
-    return cursor_names;
+    return cursorList;
 }
 
 bool CheckpointManager::isCheckpointCreationForHighMemUsage(
@@ -613,7 +980,8 @@ bool CheckpointManager::isCheckpointCreationForHighMemUsage(
     double memoryUsed = static_cast<double>(stats.getTotalMemoryUsed());
     // pesistence and tap cursors are all currently in the open checkpoint?
     bool allCursorsInOpenCheckpoint =
-        (tapCursors.size() + 1) == checkpointList.back()->getNumberOfCursors();
+        (getNumOfCursors_UNLOCKED() + 1) ==
+        checkpointList.back()->getNumberOfCursors();
 
     if (memoryUsed > stats.mem_high_wat &&
         allCursorsInOpenCheckpoint &&
@@ -662,8 +1030,8 @@ size_t CheckpointManager::removeClosedUnrefCheckpoints(
     std::list<Checkpoint*> unrefCheckpointList;
     std::list<Checkpoint*>::iterator it = checkpointList.begin();
     for (; it != checkpointList.end(); ++it) {
-        removeInvalidCursorsOnCheckpoint(*it);
-        if ((*it)->getNumberOfCursors() > 0 ||
+        // A pinned checkpoint is still being copied from by a cursor.
+        if ((*it)->getNumberOfCursors() > 0 || (*it)->isPinned() ||
             (*it)->getId() > pCursorPreCheckpointId) {
             break;
         } else {
@@ -684,9 +1052,11 @@ size_t CheckpointManager::removeClosedUnrefCheckpoints(
     size_t total_items = numUnrefItems + numMetaItems;
     numItems.fetch_sub(total_items);
     if (total_items > 0) {
-        cursor_index::iterator map_it = tapCursors.begin();
-        for (; map_it != tapCursors.end(); ++map_it) {
-            map_it->second.decrOffset(total_items);
+        std::vector<CheckpointCursor>::iterator cit = cursors.begin();
+        for (; cit != cursors.end(); ++cit) {
+            if (cit->handle != 0) {
+                cit->decrOffset(total_items);
+            }
         }
     }
     unrefCheckpointList.splice(unrefCheckpointList.begin(), checkpointList,
@@ -701,9 +1071,9 @@ size_t CheckpointManager::removeClosedUnrefCheckpoints(
         !checkpointConfig.canKeepClosedCheckpoints() &&
         vbucket->getState() == vbucket_state_replica)
     {
-        size_t curr_remains = getNumItemsForCursor_UNLOCKED(pCursorName);
+        size_t curr_remains = getNumItemsForCursor_UNLOCKED(getCursor(pCursor));
         collapseClosedCheckpoints(unrefCheckpointList);
-        size_t new_remains = getNumItemsForCursor_UNLOCKED(pCursorName);
+        size_t new_remains = getNumItemsForCursor_UNLOCKED(getCursor(pCursor));
         if (curr_remains > new_remains) {
             size_t diff = curr_remains - new_remains;
             stats.decrDiskQueueSize(diff);
@@ -724,93 +1094,80 @@ size_t CheckpointManager::removeClosedUnrefCheckpoints(
     return numUnrefItems;
 }
 
-void CheckpointManager::removeInvalidCursorsOnCheckpoint(
-                                                     Checkpoint *pCheckpoint) {
-    std::list<std::string> invalidCursorNames;
-    const std::set<std::string> &cursors = pCheckpoint->getCursorNameList();
-    std::set<std::string>::const_iterator cit = cursors.begin();
-    for (; cit != cursors.end(); ++cit) {
-        cursor_index::iterator mit = tapCursors.find(*cit);
-        if (mit == tapCursors.end() ||
-            pCheckpoint != *(mit->second.currentCheckpoint)) {
-            invalidCursorNames.push_back(*cit);
-        }
-    }
-
-    std::list<std::string>::iterator it = invalidCursorNames.begin();
-    for (; it != invalidCursorNames.end(); ++it) {
-        pCheckpoint->removeCursorName(*it);
-    }
-}
-
 void CheckpointManager::collapseClosedCheckpoints(
                                       std::list<Checkpoint*> &collapsedChks) {
     // If there are one open checkpoint and more than one closed checkpoint,
     // collapse those
     // closed checkpoints into one checkpoint to reduce the memory overhead.
     if (checkpointList.size() > 2) {
-        std::map<std::string, std::pair<uint64_t, bool> > slowCursors;
-        std::set<std::string> fastCursors;
+        std::map<cursor_handle_t, std::pair<uint64_t, bool> > slowCursors;
+        std::vector<cursor_handle_t> fastCursors;
         std::list<Checkpoint*>::iterator lastClosedChk = checkpointList.end();
         --lastClosedChk; --lastClosedChk; // Move to the last closed chkpt.
-        std::set<std::string>::iterator nitr =
-                (*lastClosedChk)->getCursorNameList().begin();
         // Check if there are any cursors in the last closed checkpoint, which
         // haven't yet visited any regular items belonging to the last closed
         // checkpoint. If so, then we should skip collapsing checkpoints until
         // those cursors move to the first regular item. Otherwise, those cursors will
         // visit old items from collapsed checkpoints again.
-        for (; nitr != (*lastClosedChk)->getCursorNameList().end(); ++nitr) {
-            cursor_index::iterator cc = tapCursors.find(*nitr);
-            if (cc == tapCursors.end()) {
+        std::vector<CheckpointCursor>::iterator cc = cursors.begin();
+        for (; cc != cursors.end(); ++cc) {
+            if (!isCursorInCheckpoint(*cc, *lastClosedChk)) {
                 continue;
             }
-            enum queue_operation qop = (*(cc->second.currentPos))->getOperation();
+            enum queue_operation qop = cc->currentItem()->getOperation();
             if (qop ==  queue_op_empty || qop == queue_op_checkpoint_start) {
                 return;
             }
+            fastCursors.push_back(cc->handle);
+        }
+        // The collapsed checkpoints are deleted without the queue lock, so
+        // none of them may still be copied from.
+        std::list<Checkpoint*>::iterator it = checkpointList.begin();
+        for (; it != lastClosedChk; ++it) {
+            if ((*it)->isPinned()) {
+                return;
+            }
         }
 
-        fastCursors.insert((*lastClosedChk)->getCursorNameList().begin(),
-                           (*lastClosedChk)->getCursorNameList().end());
         std::list<Checkpoint*>::reverse_iterator rit = checkpointList.rbegin();
         ++rit; ++rit; //Move to the second last closed checkpoint.
         size_t numDuplicatedItems = 0, numMetaItems = 0;
         for (; rit != checkpointList.rend(); ++rit) {
-            size_t numAddedItems = (*lastClosedChk)->mergePrevCheckpoint(*rit);
+            size_t numAddedItems = (*lastClosedChk)->mergePrevCheckpoint(*rit,
+                                                                         this);
             numDuplicatedItems += ((*rit)->getNumItems() - numAddedItems);
             numMetaItems += 2; // checkpoint start and end meta items
 
-            std::set<std::string>::iterator nameItr =
-                (*rit)->getCursorNameList().begin();
-            for (; nameItr != (*rit)->getCursorNameList().end(); ++nameItr) {
-                cursor_index::iterator cc = tapCursors.find(*nameItr);
-                const std::string& key = (*(cc->second.currentPos))->getKey();
+            for (cc = cursors.begin(); cc != cursors.end(); ++cc) {
+                if (!isCursorInCheckpoint(*cc, *rit)) {
+                    continue;
+                }
+                const std::string& key = cc->currentItem()->getKey();
                 bool cursor_on_chk_start = false;
-                if ((*(cc->second.currentPos))->getOperation() ==
+                if (cc->currentItem()->getOperation() ==
                     queue_op_checkpoint_start) {
                     cursor_on_chk_start = true;
                 }
-                slowCursors[*nameItr] =
+                slowCursors[cc->handle] =
                     std::make_pair((*rit)->getMutationIdForKey(key), cursor_on_chk_start);
             }
         }
+        // The slow cursors leave the checkpoints that are collapsed.
+        detachCursors(checkpointList.begin(), lastClosedChk);
         putCursorsInCollapsedChk(slowCursors, lastClosedChk);
 
         size_t total_items = numDuplicatedItems + numMetaItems;
         numItems.fetch_sub(total_items);
         Checkpoint *pOpenCheckpoint = checkpointList.back();
-        const std::set<std::string> &openCheckpointCursors =
-                                    pOpenCheckpoint->getCursorNameList();
-        fastCursors.insert(openCheckpointCursors.begin(),
-                           openCheckpointCursors.end());
-        std::set<std::string>::const_iterator cit = fastCursors.begin();
+        for (cc = cursors.begin(); cc != cursors.end(); ++cc) {
+            if (isCursorInCheckpoint(*cc, pOpenCheckpoint)) {
+                fastCursors.push_back(cc->handle);
+            }
+        }
+        std::vector<cursor_handle_t>::iterator cit = fastCursors.begin();
         // Update the offset of each fast cursor.
         for (; cit != fastCursors.end(); ++cit) {
-            cursor_index::iterator mit = tapCursors.find(*cit);
-            if (mit != tapCursors.end()) {
-                mit->second.decrOffset(total_items);
-            }
+            getCursor(*cit)->decrOffset(total_items);
         }
         collapsedChks.splice(collapsedChks.end(), checkpointList,
                              checkpointList.begin(),  lastClosedChk);
@@ -865,48 +1222,83 @@ bool CheckpointManager::queueDirty(const RCPtr<VBucket> &vb, queued_item& qi,
 }
 
 snapshot_range_t CheckpointManager::getAllItemsForCursor(
-                                             const std::string& name,
+                                             cursor_handle_t handle,
                                              std::vector<queued_item> &items) {
     LockHolder lh(queueLock);
     snapshot_range_t range;
-    cursor_index::iterator it = tapCursors.find(name);
-    if (it == tapCursors.end()) {
+    CheckpointCursor *cursor = getCursor(handle);
+    if (!cursor) {
         range.start = 0;
         range.end = 0;
         return range;
     }
 
-    bool moreItems;
-    range.start = (*it->second.currentCheckpoint)->getSnapshotStartSeqno();
-    range.end = (*it->second.currentCheckpoint)->getSnapshotEndSeqno();
-    while ((moreItems = incrCursor(it->second))) {
-        queued_item& qi = *(it->second.currentPos);
-        items.push_back(qi);
+    // Move the cursor past everything queued so far a checkpoint at a time,
+    // capturing the items it passes. Only the capture happens under the
+    // lock; queueDirty() keeps appending behind the published end meanwhile.
+    std::list<published_items> published;
+    size_t numPublished = 0;
+    bool moreItems = true;
+    range.start = (*cursor->currentCheckpoint)->getSnapshotStartSeqno();
+    range.end = (*cursor->currentCheckpoint)->getSnapshotEndSeqno();
+    while (true) {
+        Checkpoint *chk = *(cursor->currentCheckpoint);
+        size_t from = chk->next(cursor->currentPos);
+        if (from == chk->end()) {
+            if (!moveCursorToNextCheckpoint(*cursor)) {
+                moreItems = false;
+                break;
+            }
+            continue;
+        }
 
-        if (qi->getOperation() == queue_op_checkpoint_end) {
-            range.end = (*it->second.currentCheckpoint)->getSnapshotEndSeqno();
-            moveCursorToNextCheckpoint(it->second);
-            if (name.compare(pCursorName) != 0) {
+        published.push_back(published_items());
+        size_t count = chk->publish(from, published.back());
+        numPublished += count;
+        cursor->currentPos = chk->last();
+        cursor->offset += count;
+
+        if (cursor->currentItem()->getOperation() ==
+            queue_op_checkpoint_end) {
+            range.end = chk->getSnapshotEndSeqno();
+            moveCursorToNextCheckpoint(*cursor);
+            if (handle != pCursor) {
                 break;
             }
         }
     }
 
     if (!moreItems) {
-        range.end = (*it->second.currentCheckpoint)->getSnapshotEndSeqno();
+        range.end = (*cursor->currentCheckpoint)->getSnapshotEndSeqno();
+    }
+
+    bool unlocked = numPublished >= unlockedCopyThreshold;
+    if (unlocked) {
+        lh.unlock();
+    }
+    items.reserve(items.size() + numPublished);
+    std::list<published_items>::iterator it = published.begin();
+    for (; it != published.end(); ++it) {
+        Checkpoint::copyPublished(*it, items);
+    }
+    if (unlocked) {
+        lh.lock();
+    }
+    for (it = published.begin(); it != published.end(); ++it) {
+        unpinCheckpoint_UNLOCKED(it->checkpoint);
     }
 
     return range;
 }
 
-queued_item CheckpointManager::nextItem(const std::string &name,
+queued_item CheckpointManager::nextItem(cursor_handle_t handle,
                                         bool &isLastMutationItem) {
     LockHolder lh(queueLock);
-    cursor_index::iterator it = tapCursors.find(name);
-    if (it == tapCursors.end()) {
+    CheckpointCursor *cursor = getCursor(handle);
+    if (!cursor) {
         LOG(EXTENSION_LOG_WARNING,
-        "The cursor with name \"%s\" is not found in the checkpoint of vbucket"
-        "%d.\n", name.c_str(), vbucketId);
+        "The cursor with handle %llu is not found in the checkpoint of vbucket"
+        "%d.\n", (unsigned long long)handle, vbucketId);
         queued_item qi(new Item(std::string(""), 0xffff,
                                 queue_op_empty, 0, 0));
         return qi;
@@ -921,10 +1313,9 @@ queued_item CheckpointManager::nextItem(const std::string &name,
         return qi;
     }
 
-    CheckpointCursor &cursor = it->second;
-    if (incrCursor(cursor)) {
-        isLastMutationItem = isLastMutationItemInCheckpoint(cursor);
-        return *(cursor.currentPos);
+    if (incrCursor(*cursor)) {
+        isLastMutationItem = isLastMutationItemInCheckpoint(*cursor);
+        return cursor->currentItem();
     } else {
         isLastMutationItem = false;
         queued_item qi(new Item(std::string(""), 0xffff,
@@ -934,11 +1325,13 @@ queued_item CheckpointManager::nextItem(const std::string &name,
 }
 
 bool CheckpointManager::incrCursor(CheckpointCursor &cursor) {
-    if (++(cursor.currentPos) != (*(cursor.currentCheckpoint))->end()) {
+    Checkpoint *chk = *(cursor.currentCheckpoint);
+    size_t pos = chk->next(cursor.currentPos);
+    if (pos != chk->end()) {
+        cursor.currentPos = pos;
         ++(cursor.offset);
         return true;
     } else if (!moveCursorToNextCheckpoint(cursor)) {
-        --(cursor.currentPos);
         return false;
     }
     return incrCursor(cursor);
@@ -955,10 +1348,11 @@ void CheckpointManager::clear(RCPtr<VBucket> &vb, uint64_t seqno) {
 }
 
 void CheckpointManager::clear_UNLOCKED(vbucket_state_t vbState, uint64_t seqno) {
+    detachCursors(checkpointList.begin(), checkpointList.end());
     std::list<Checkpoint*>::iterator it = checkpointList.begin();
     // Remove all the checkpoints.
     while(it != checkpointList.end()) {
-        delete *it;
+        deleteCheckpoint_UNLOCKED(*it);
         ++it;
     }
     checkpointList.clear();
@@ -972,10 +1366,33 @@ void CheckpointManager::clear_UNLOCKED(vbucket_state_t vbState, uint64_t seqno)
     resetCursors();
 }
 
+void CheckpointManager::deleteCheckpoint_UNLOCKED(Checkpoint *chk) {
+    if (chk->isPinned()) {
+        retiredCheckpoints.push_back(chk);
+    } else {
+        delete chk;
+    }
+}
+
+void CheckpointManager::unpinCheckpoint_UNLOCKED(Checkpoint *chk) {
+    if (chk->unpin() && !retiredCheckpoints.empty()) {
+        std::list<Checkpoint*>::iterator it =
+            std::find(retiredCheckpoints.begin(), retiredCheckpoints.end(),
+                      chk);
+        if (it != retiredCheckpoints.end()) {
+            retiredCheckpoints.erase(it);
+            delete chk;
+        }
+    }
+}
+
 void CheckpointManager::resetCursors(bool resetPersistenceCursor) {
-    cursor_index::iterator cit = tapCursors.begin();
-    for (; cit != tapCursors.end(); ++cit) {
-        if (cit->second.name.compare(pCursorName) == 0) {
+    std::vector<CheckpointCursor>::iterator cit = cursors.begin();
+    for (; cit != cursors.end(); ++cit) {
+        if (cit->handle == 0) {
+            continue;
+        }
+        if (cit->handle == pCursor) {
             if (!resetPersistenceCursor) {
                 continue;
             } else {
@@ -983,18 +1400,19 @@ void CheckpointManager::resetCursors(bool resetPersistenceCursor) {
                 pCursorPreCheckpointId = chkid ? chkid - 1 : 0;
             }
         }
-        cit->second.currentCheckpoint = checkpointList.begin();
-        cit->second.currentPos = checkpointList.front()->begin();
-        cit->second.offset = 0;
-        checkpointList.front()->registerCursorName(cit->second.name);
+        setCursorCheckpoint(*cit, checkpointList.begin());
+        cit->currentPos = checkpointList.front()->begin();
+        cit->offset = 0;
     }
 }
 
-void CheckpointManager::resetCursors(const std::list<std::string> &cursors) {
+void CheckpointManager::resetCursors(const cursor_list &cursorList) {
     LockHolder lh(queueLock);
-    std::list<std::string>::const_iterator it = cursors.begin();
-    for (; it != cursors.end(); ++it) {
-        registerCursor_UNLOCKED(*it, getOpenCheckpointId_UNLOCKED(), true);
+    cursor_list::const_iterator it = cursorList.begin();
+    for (; it != cursorList.end(); ++it) {
+        cursor_handle_t handle = it->first;
+        registerCursor_UNLOCKED(it->second, handle,
+                                getOpenCheckpointId_UNLOCKED(), true);
     }
 }
 
@@ -1010,13 +1428,10 @@ bool CheckpointManager::moveCursorToNextCheckpoint(CheckpointCursor &cursor) {
         }
     }
 
-    // Remove the cursor's name from its current checkpoint.
-    (*(cursor.currentCheckpoint))->removeCursorName(cursor.name);
     // Move the cursor to the next checkpoint.
-    ++(cursor.currentCheckpoint);
+    std::list<Checkpoint*>::iterator nextCheckpoint = cursor.currentCheckpoint;
+    setCursorCheckpoint(cursor, ++nextCheckpoint);
     cursor.currentPos = (*(cursor.currentCheckpoint))->begin();
-    // Register the cursor's name to its new current checkpoint.
-    (*(cursor.currentCheckpoint))->registerCursorName(cursor.name);
     return true;
 }
 
@@ -1053,16 +1468,21 @@ uint64_t CheckpointManager::checkOpenCheckpoint_UNLOCKED(bool forceCreation,
     return checkpoint_id;
 }
 
+size_t CheckpointManager::getNumItemsForCursor(cursor_handle_t handle) {
+    LockHolder lh(queueLock);
+    return getNumItemsForCursor_UNLOCKED(getCursor(handle));
+}
+
 size_t CheckpointManager::getNumItemsForCursor(const std::string &name) {
     LockHolder lh(queueLock);
-    return getNumItemsForCursor_UNLOCKED(name);
+    return getNumItemsForCursor_UNLOCKED(findCursor(name));
 }
 
-size_t CheckpointManager::getNumItemsForCursor_UNLOCKED(const std::string &name) {
+size_t CheckpointManager::getNumItemsForCursor_UNLOCKED(
+                                                   CheckpointCursor *cursor) {
     size_t remains = 0;
-    cursor_index::iterator it = tapCursors.find(name);
-    if (it != tapCursors.end()) {
-        size_t offset = it->second.offset + getNumOfMetaItemsFromCursor(it->second);
+    if (cursor) {
+        size_t offset = cursor->offset + getNumOfMetaItemsFromCursor(*cursor);
         remains = (numItems > offset) ? numItems - offset : 0;
     }
     return remains;
@@ -1074,12 +1494,12 @@ size_t CheckpointManager::getNumOfMetaItemsFromCursor(CheckpointCursor &cursor)
     std::list<Checkpoint*>::iterator curr_chk = cursor.currentCheckpoint;
     for (; curr_chk != checkpointList.end(); ++curr_chk) {
         if (curr_chk == cursor.currentCheckpoint) {
-            std::list<queued_item>::iterator curr_pos = cursor.currentPos;
-            ++curr_pos;
+            size_t curr_pos = (*curr_chk)->next(cursor.currentPos);
             if (curr_pos == (*curr_chk)->end()) {
                 continue;
             }
-            if ((*curr_pos)->getOperation() == queue_op_checkpoint_start) {
+            if ((*curr_chk)->getItem(curr_pos)->getOperation() ==
+                queue_op_checkpoint_start) {
                 if ((*curr_chk)->getState() == CHECKPOINT_CLOSED) {
                     meta_items += 2;
                 } else {
@@ -1101,22 +1521,21 @@ size_t CheckpointManager::getNumOfMetaItemsFromCursor(CheckpointCursor &cursor)
     return meta_items;
 }
 
-void CheckpointManager::decrCursorFromCheckpointEnd(const std::string &name) {
+void CheckpointManager::decrCursorFromCheckpointEnd(cursor_handle_t handle) {
     LockHolder lh(queueLock);
-    cursor_index::iterator it = tapCursors.find(name);
-    if (it != tapCursors.end() &&
-        (*(it->second.currentPos))->getOperation() ==
-        queue_op_checkpoint_end) {
-        it->second.decrPos();
+    CheckpointCursor *cursor = getCursor(handle);
+    if (cursor &&
+        cursor->currentItem()->getOperation() == queue_op_checkpoint_end) {
+        cursor->decrPos();
     }
 }
 
 bool CheckpointManager::isLastMutationItemInCheckpoint(
                                                    CheckpointCursor &cursor) {
-    std::list<queued_item>::iterator it = cursor.currentPos;
-    ++it;
-    if (it == (*(cursor.currentCheckpoint))->end() ||
-        (*it)->getOperation() == queue_op_checkpoint_end) {
+    Checkpoint *chk = *(cursor.currentCheckpoint);
+    size_t pos = chk->next(cursor.currentPos);
+    if (pos == chk->end() ||
+        chk->getItem(pos)->getOperation() == queue_op_checkpoint_end) {
         return true;
     }
     return false;
@@ -1240,25 +1659,23 @@ void CheckpointManager::checkAndAddNewCheckpoint(uint64_t id,
             // Reposition all the cursors in the open checkpoint to the
             // begining position so that a checkpoint_start message can be
             // sent again with the correct id.
-            const std::set<std::string> &cursors = checkpointList.back()->
-                                                   getCursorNameList();
-            std::set<std::string>::const_iterator cit = cursors.begin();
+            std::vector<CheckpointCursor>::iterator cit = cursors.begin();
             for (; cit != cursors.end(); ++cit) {
-                if ((*cit).compare(pCursorName) == 0) {
+                if (!isCursorInCheckpoint(*cit, checkpointList.back()) ||
+                    cit->handle == pCursor) {
                     // Persistence cursor
                     continue;
                 } else { // TAP cursors
-                    cursor_index::iterator mit = tapCursors.find(*cit);
-                    mit->second.currentPos = checkpointList.back()->begin();
+                    cit->currentPos = checkpointList.back()->begin();
                 }
             }
         } else {
             addNewCheckpoint_UNLOCKED(id);
         }
     } else {
-        size_t curr_remains = getNumItemsForCursor_UNLOCKED(pCursorName);
+        size_t curr_remains = getNumItemsForCursor_UNLOCKED(getCursor(pCursor));
         collapseCheckpoints(id);
-        size_t new_remains = getNumItemsForCursor_UNLOCKED(pCursorName);
+        size_t new_remains = getNumItemsForCursor_UNLOCKED(getCursor(pCursor));
         if (curr_remains > new_remains) {
             size_t diff = curr_remains - new_remains;
             stats.decrDiskQueueSize(diff);
@@ -1274,20 +1691,26 @@ void CheckpointManager::checkAndAddNewCheckpoint(uint64_t id,
 void CheckpointManager::collapseCheckpoints(uint64_t id) {
     cb_assert(!checkpointList.empty());
 
-    std::map<std::string, std::pair<uint64_t, bool> > cursorMap;
-    cursor_index::iterator itr;
-    for (itr = tapCursors.begin(); itr != tapCursors.end(); itr++) {
-        Checkpoint* chk = *(itr->second.currentCheckpoint);
-        const std::string& key = (*(itr->second.currentPos))->getKey();
+    std::map<cursor_handle_t, std::pair<uint64_t, bool> > cursorMap;
+    std::vector<CheckpointCursor>::iterator itr;
+    for (itr = cursors.begin(); itr != cursors.end(); itr++) {
+        if (itr->handle == 0) {
+            continue;
+        }
+        Checkpoint* chk = *(itr->currentCheckpoint);
+        const std::string& key = itr->currentItem()->getKey();
         bool cursor_on_chk_start = false;
-        if ((*(itr->second.currentPos))->getOperation() == queue_op_checkpoint_start) {
+        if (itr->currentItem()->getOperation() == queue_op_checkpoint_start) {
             cursor_on_chk_start = true;
         }
-        cursorMap[itr->first.c_str()] =
+        cursorMap[itr->handle] =
             std::make_pair(chk->getMutationIdForKey(key), cursor_on_chk_start);
     }
 
     setOpenCheckpointId_UNLOCKED(id);
+    // All the cursors get placed in the open checkpoint once the others are
+    // merged into it.
+    detachCursors(checkpointList.begin(), --checkpointList.end());
 
     std::list<Checkpoint*>::reverse_iterator rit = checkpointList.rbegin();
     ++rit; // Move to the last closed checkpoint.
@@ -1295,10 +1718,10 @@ void CheckpointManager::collapseCheckpoints(uint64_t id) {
     // Collapse all checkpoints.
     for (; rit != checkpointList.rend(); ++rit) {
         size_t numAddedItems = checkpointList.back()->
-                               mergePrevCheckpoint(*rit);
+                               mergePrevCheckpoint(*rit, this);
         numDuplicatedItems += ((*rit)->getNumItems() - numAddedItems);
         numMetaItems += 2; // checkpoint start and end meta items
-        delete *rit;
+        deleteCheckpoint_UNLOCKED(*rit);
     }
     numItems.fetch_sub(numDuplicatedItems + numMetaItems);
 
@@ -1316,72 +1739,70 @@ void CheckpointManager::collapseCheckpoints(uint64_t id) {
 }
 
 void CheckpointManager::
-putCursorsInCollapsedChk(std::map<std::string, std::pair<uint64_t, bool> > &cursors,
+putCursorsInCollapsedChk(std::map<cursor_handle_t, std::pair<uint64_t, bool> > &cursorMap,
                          std::list<Checkpoint*>::iterator chkItr) {
     size_t i;
     Checkpoint *chk = *chkItr;
-    std::list<queued_item>::iterator cit = chk->begin();
-    std::list<queued_item>::iterator last = chk->begin();
-    for (i = 0; cit != chk->end(); ++i, ++cit) {
-        uint64_t id = chk->getMutationIdForKey((*cit)->getKey());
-        std::map<std::string, std::pair<uint64_t, bool> >::iterator mit = cursors.begin();
-        while (mit != cursors.end()) {
+    size_t cit = chk->begin();
+    size_t last = chk->begin();
+    for (i = 0; cit != chk->end(); ++i, cit = chk->next(cit)) {
+        uint64_t id = chk->getMutationIdForKey(chk->getItem(cit)->getKey());
+        std::map<cursor_handle_t, std::pair<uint64_t, bool> >::iterator mit =
+            cursorMap.begin();
+        while (mit != cursorMap.end()) {
             std::pair<uint64_t, bool> val = mit->second;
             if (val.first < id || (val.first == id && val.second &&
-                (*last)->getOperation() == queue_op_checkpoint_start)) {
+                chk->getItem(last)->getOperation() == queue_op_checkpoint_start)) {
 
-                cursor_index::iterator cc = tapCursors.find(mit->first);
-                if (cc == tapCursors.end() ||
-                    cc->second.fromBeginningOnChkCollapse) {
+                CheckpointCursor *cc = getCursor(mit->first);
+                if (!cc || cc->fromBeginningOnChkCollapse) {
                     ++mit;
                     continue;
                 }
-                cc->second.currentCheckpoint = chkItr;
-                cc->second.currentPos = last;
-                cc->second.offset = (i > 0) ? i - 1 : 0;
-                chk->registerCursorName(cc->second.name);
-                cursors.erase(mit++);
+                setCursorCheckpoint(*cc, chkItr);
+                cc->currentPos = last;
+                cc->offset = (i > 0) ? i - 1 : 0;
+                cursorMap.erase(mit++);
             } else {
                 ++mit;
             }
         }
 
         last = cit;
-        if (cursors.empty()) {
+        if (cursorMap.empty()) {
             break;
         }
     }
 
-    std::map<std::string, std::pair<uint64_t, bool> >::iterator mit = cursors.begin();
-    for (; mit != cursors.end(); ++mit) {
-        cursor_index::iterator cc = tapCursors.find(mit->first);
-        if (cc == tapCursors.end()) {
+    std::map<cursor_handle_t, std::pair<uint64_t, bool> >::iterator mit =
+        cursorMap.begin();
+    for (; mit != cursorMap.end(); ++mit) {
+        CheckpointCursor *cc = getCursor(mit->first);
+        if (!cc) {
             continue;
         }
-        cc->second.currentCheckpoint = chkItr;
-        if (cc->second.fromBeginningOnChkCollapse) {
-            cc->second.currentPos = chk->begin();
-            cc->second.offset = 0;
+        setCursorCheckpoint(*cc, chkItr);
+        if (cc->fromBeginningOnChkCollapse) {
+            cc->currentPos = chk->begin();
+            cc->offset = 0;
         } else {
-            cc->second.currentPos = last;
-            cc->second.offset = (i > 0) ? i - 1 : 0;
+            cc->currentPos = last;
+            cc->offset = (i > 0) ? i - 1 : 0;
         }
-        chk->registerCursorName(cc->second.name);
     }
 }
 
-bool CheckpointManager::hasNext(const std::string &name) {
+bool CheckpointManager::hasNext(cursor_handle_t handle) {
     LockHolder lh(queueLock);
-    cursor_index::iterator it = tapCursors.find(name);
-    if (it == tapCursors.end() || getOpenCheckpointId_UNLOCKED() == 0) {
+    CheckpointCursor *cursor = getCursor(handle);
+    if (!cursor || getOpenCheckpointId_UNLOCKED() == 0) {
         return false;
     }
 
     bool hasMore = true;
-    std::list<queued_item>::iterator curr = it->second.currentPos;
-    ++curr;
-    if (curr == (*(it->second.currentCheckpoint))->end() &&
-        (*(it->second.currentCheckpoint)) == checkpointList.back()) {
+    Checkpoint *chk = *(cursor->currentCheckpoint);
+    if (chk->next(cursor->currentPos) == chk->end() &&
+        chk == checkpointList.back()) {
         hasMore = false;
     }
     return hasMore;
@@ -1425,7 +1846,7 @@ uint64_t CheckpointManager::getPersistenceCursorPreChkId() {
 
 void CheckpointManager::itemsPersisted() {
     LockHolder lh(queueLock);
-    CheckpointCursor& persistenceCursor = tapCursors[pCursorName];
+    CheckpointCursor& persistenceCursor = *getCursor(pCursor);
     std::list<Checkpoint*>::iterator itr = persistenceCursor.currentCheckpoint;
     pCursorPreCheckpointId = ((*itr)->getId() > 0) ? (*itr)->getId() - 1 : 0;
 }
@@ -1532,7 +1953,7 @@ void CheckpointManager::addStats(ADD_STAT add_stat, const void *cookie) {
     add_casted_stat(buf, getLastClosedCheckpointId_UNLOCKED(),
     add_stat, cookie);
     snprintf(buf, sizeof(buf), "vb_%d:num_tap_cursors", vbucketId);
-    add_casted_stat(buf, tapCursors.size(), add_stat, cookie);
+    add_casted_stat(buf, getNumOfCursors_UNLOCKED(), add_stat, cookie);
     snprintf(buf, sizeof(buf), "vb_%d:num_checkpoint_items", vbucketId);
     add_casted_stat(buf, numItems, add_stat, cookie);
     snprintf(buf, sizeof(buf), "vb_%d:num_open_checkpoint_items", vbucketId);
@@ -1542,19 +1963,33 @@ void CheckpointManager::addStats(ADD_STAT add_stat, const void *cookie) {
     snprintf(buf, sizeof(buf), "vb_%d:num_checkpoints", vbucketId);
     add_casted_stat(buf, checkpointList.size(), add_stat, cookie);
     snprintf(buf, sizeof(buf), "vb_%d:num_items_for_persistence", vbucketId);
-    add_casted_stat(buf, getNumItemsForCursor_UNLOCKED(pCursorName),
+    add_casted_stat(buf, getNumItemsForCursor_UNLOCKED(getCursor(pCursor)),
                     add_stat, cookie);
 
-    cursor_index::iterator tap_it = tapCursors.begin();
-    for (; tap_it != tapCursors.end(); ++tap_it) {
+    size_t memOverhead = 0;
+    std::list<Checkpoint*>::iterator chk_it = checkpointList.begin();
+    for (; chk_it != checkpointList.end(); ++chk_it) {
+        memOverhead += (*chk_it)->memorySize();
+    }
+    snprintf(buf, sizeof(buf), "vb_%d:mem_overhead", vbucketId);
+    add_casted_stat(buf, memOverhead, add_stat, cookie);
+    snprintf(buf, sizeof(buf), "vb_%d:mem_overhead_per_item", vbucketId);
+    add_casted_stat(buf, numItems > 0 ? memOverhead / numItems : 0,
+                    add_stat, cookie);
+
+    std::vector<CheckpointCursor>::iterator cit = cursors.begin();
+    for (; cit != cursors.end(); ++cit) {
+        if (cit->handle == 0) {
+            continue;
+        }
         snprintf(buf, sizeof(buf),
                  "vb_%d:%s:cursor_checkpoint_id", vbucketId,
-                 tap_it->first.c_str());
-        add_casted_stat(buf, (*(tap_it->second.currentCheckpoint))->getId(),
+                 cit->name.c_str());
+        add_casted_stat(buf, (*(cit->currentCheckpoint))->getId(),
                         add_stat, cookie);
         snprintf(buf, sizeof(buf), "vb_%d:%s:cursor_seqno", vbucketId,
-                 tap_it->first.c_str());
-        add_casted_stat(buf, (*(tap_it->second.currentPos))->getBySeqno(),
+                 cit->name.c_str());
+        add_casted_stat(buf, cit->currentItem()->getBySeqno(),
                         add_stat, cookie);
     }
 }
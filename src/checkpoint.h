@@ -52,10 +52,12 @@ typedef enum {
 } checkpoint_state;
 
 /**
- * A checkpoint index entry.
+ * A checkpoint index entry. The key itself is not copied into the index;
+ * lookups compare against the key of the item stored at the entry's position.
  */
 struct index_entry {
-    std::list<queued_item>::iterator position;
+    uint32_t hash;
+    uint32_t position;
     int64_t mutation_id;
 };
 
@@ -69,16 +71,30 @@ typedef struct {
     snapshot_range_t range;
 } snapshot_info_t;
 
-/**
- * The checkpoint index maps a key to a checkpoint index_entry.
- */
-typedef unordered_map<std::string, index_entry> checkpoint_index;
-
 class Checkpoint;
 class CheckpointManager;
 class CheckpointConfig;
 class VBucket;
 
+/**
+ * Opaque handle of a checkpoint cursor. It is returned when the cursor is
+ * registered and identifies the cursor in all later calls, so that walking
+ * the checkpoints never requires a lookup by name. 0 is never a valid handle.
+ */
+typedef uint64_t cursor_handle_t;
+
+/**
+ * Items of a checkpoint published to a cursor. They are captured under the
+ * queue lock and copied out after it is released; the checkpoint is pinned
+ * in the meantime, so none of the captured slots is released or reused.
+ */
+struct published_items {
+    Checkpoint *checkpoint;
+    std::vector<const queued_item*> segments;
+    // Live slot bits of each captured segment.
+    std::vector<uint64_t> live;
+};
+
 /**
  * A checkpoint cursor
  */
@@ -87,31 +103,22 @@ class CheckpointCursor {
     friend class Checkpoint;
 public:
 
-    CheckpointCursor() { }
-
-    CheckpointCursor(const std::string &n)
-        : name(n),
-          currentCheckpoint(),
-          currentPos(),
+    CheckpointCursor()
+        : handle(0),
+          currentPos(0),
           offset(0),
           fromBeginningOnChkCollapse(false) { }
 
-    CheckpointCursor(const std::string &n,
-                     std::list<Checkpoint*>::iterator checkpoint,
-                     std::list<queued_item>::iterator pos,
-                     size_t os,
-                     bool beginningOnChkCollapse) :
-        name(n), currentCheckpoint(checkpoint), currentPos(pos),
-        offset(os), fromBeginningOnChkCollapse(beginningOnChkCollapse) { }
-
     // We need to define the copy construct explicitly due to the fact
     // that std::atomic implicitly deleted the assignment operator
     CheckpointCursor(const CheckpointCursor &other) :
-        name(other.name), currentCheckpoint(other.currentCheckpoint),
+        handle(other.handle), name(other.name),
+        currentCheckpoint(other.currentCheckpoint),
         currentPos(other.currentPos), offset(other.offset.load()),
         fromBeginningOnChkCollapse(other.fromBeginningOnChkCollapse) { }
 
     CheckpointCursor &operator=(const CheckpointCursor &other) {
+        handle = other.handle;
         name.assign(other.name);
         currentCheckpoint = other.currentCheckpoint;
         currentPos = other.currentPos;
@@ -124,18 +131,24 @@ public:
 
     void decrPos();
 
+    /**
+     * Return the item at the cursor's current position.
+     */
+    const queued_item &currentItem() const;
+
 private:
+    cursor_handle_t                  handle; // 0 if the slot is free
     std::string                      name;
     std::list<Checkpoint*>::iterator currentCheckpoint;
-    std::list<queued_item>::iterator currentPos;
+    size_t                           currentPos;
     AtomicValue<size_t>              offset;
     bool                             fromBeginningOnChkCollapse;
 };
 
 /**
- * The cursor index maps checkpoint cursor names to checkpoint cursors
+ * The handles and names of the cursors registered with a checkpoint manager.
  */
-typedef std::map<const std::string, CheckpointCursor> cursor_index;
+typedef std::list<std::pair<cursor_handle_t, std::string> > cursor_list;
 
 /**
  * Result from invoking queueDirty in the current open checkpoint.
@@ -168,13 +181,7 @@ typedef enum {
 class Checkpoint {
 public:
     Checkpoint(EPStats &st, uint64_t id, uint64_t snapStart, uint64_t snapEnd,
-               uint16_t vbid) :
-        stats(st), checkpointId(id), snapStartSeqno(snapStart),
-        snapEndSeqno(snapEnd), vbucketId(vbid), creationTime(ep_real_time()),
-        checkpointState(CHECKPOINT_OPEN), numItems(0), memOverhead(0) {
-        stats.memOverhead.fetch_add(memorySize());
-        cb_assert(stats.memOverhead.load() < GIGANTOR);
-    }
+               uint16_t vbid);
 
     ~Checkpoint();
 
@@ -226,35 +233,22 @@ public:
      * Return the number of cursors that are currently walking through this checkpoint.
      */
     size_t getNumberOfCursors() const {
-        return cursors.size();
-    }
-
-    /**
-     * Register a cursor's name to this checkpoint
-     */
-    void registerCursorName(const std::string &name) {
-        cursors.insert(name);
+        return numCursors;
     }
 
     /**
-     * Remove a cursor's name from this checkpoint
+     * Account for a cursor that has moved into this checkpoint
      */
-    void removeCursorName(const std::string &name) {
-        cursors.erase(name);
+    void incrNumCursors() {
+        ++numCursors;
     }
 
     /**
-     * Return true if the cursor with a given name exists in this checkpoint
+     * Account for a cursor that has left this checkpoint
      */
-    bool hasCursorName(const std::string &name) const {
-        return cursors.find(name) != cursors.end();
-    }
-
-    /**
-     * Return the list of all cursor names in this checkpoint
-     */
-    const std::set<std::string> &getCursorNameList() const {
-        return cursors;
+    void decrNumCursors() {
+        cb_assert(numCursors > 0);
+        --numCursors;
     }
 
     /**
@@ -268,14 +262,11 @@ public:
                              CheckpointManager *checkpointManager);
 
     uint64_t getLowSeqno() {
-        std::list<queued_item>::iterator pos = toWrite.begin();
-        pos++;
-        return (*pos)->getBySeqno();
+        return getItem(next(begin()))->getBySeqno();
     }
 
     uint64_t getHighSeqno() {
-        std::list<queued_item>::reverse_iterator pos = toWrite.rbegin();
-        return (*pos)->getBySeqno();
+        return getItem(last())->getBySeqno();
     }
 
     uint64_t getSnapshotStartSeqno() {
@@ -294,24 +285,77 @@ public:
         snapEndSeqno = seqno;
     }
 
-    std::list<queued_item>::iterator begin() {
-        return toWrite.begin();
+    /**
+     * Items are addressed by their position in the checkpoint. A position
+     * left behind by a deduplicated item is empty and skipped by next() and
+     * prev(); the first (dummy) item is never removed.
+     */
+    size_t begin() const {
+        return 0;
     }
 
-    std::list<queued_item>::iterator end() {
-        return toWrite.end();
+    size_t end() const {
+        return numSlots;
     }
 
-    std::list<queued_item>::reverse_iterator rbegin() {
-        return toWrite.rbegin();
+    /**
+     * Return the position of the item following pos, or end().
+     */
+    size_t next(size_t pos) const {
+        while (++pos < numSlots && !isLive(pos)) { }
+        return pos;
     }
 
-    std::list<queued_item>::reverse_iterator rend() {
-        return toWrite.rend();
+    /**
+     * Return the position of the item preceding pos, or begin() if there is
+     * none.
+     */
+    size_t prev(size_t pos) const {
+        while (pos > 0) {
+            if (isLive(--pos)) {
+                return pos;
+            }
+        }
+        return 0;
+    }
+
+    /**
+     * Return the position of the last item in this checkpoint.
+     */
+    size_t last() const {
+        return prev(numSlots);
+    }
+
+    const queued_item &getItem(size_t pos) const {
+        return segments[pos / segmentSize][pos % segmentSize];
     }
 
     bool keyExists(const std::string &key);
 
+    /**
+     * Capture the items from position from up to end(), and pin this
+     * checkpoint until they are released with unpin(). The queue lock must
+     * be held.
+     * @return the number of items captured
+     */
+    size_t publish(size_t from, published_items &published);
+
+    /**
+     * Copy published items; doesn't need the queue lock.
+     */
+    static void copyPublished(const published_items &published,
+                              std::vector<queued_item> &items);
+
+    /**
+     * Release a pin taken by publish(). The queue lock must be held.
+     * @return true if this checkpoint is no longer pinned
+     */
+    bool unpin();
+
+    bool isPinned() const {
+        return numPins > 0;
+    }
+
     /**
      * Return the memory overhead of this checkpoint instance, except for the memory used by
      * all the items belonging to this checkpoint. The memory overhead of those items is
@@ -326,9 +370,11 @@ public:
      * Merge the previous checkpoint into the this checkpoint by adding the items from
      * the previous checkpoint, which don't exist in this checkpoint.
      * @param pPrevCheckpoint pointer to the previous checkpoint.
+     * @param checkpointManager the checkpoint manager to which this checkpoint belongs
      * @return the number of items added from the previous checkpoint.
      */
-    size_t mergePrevCheckpoint(Checkpoint *pPrevCheckpoint);
+    size_t mergePrevCheckpoint(Checkpoint *pPrevCheckpoint,
+                               CheckpointManager *checkpointManager);
 
     /**
      * Get the mutation id for a given key in this checkpoint
@@ -338,6 +384,44 @@ public:
     uint64_t getMutationIdForKey(const std::string &key);
 
 private:
+    static uint32_t hashKey(const std::string &key);
+
+    index_entry *findEntry(const std::string &key, uint32_t hash);
+
+    void insertEntry(uint32_t hash, size_t pos, int64_t mutationId);
+
+    void eraseEntry(index_entry *entry);
+
+    void growIndex();
+
+    void append(const queued_item &qi);
+
+    bool isLive(size_t pos) const {
+        return (liveSlots[pos / segmentSize] >> (pos % segmentSize)) & 1;
+    }
+
+    /**
+     * Empty the slot at the given position. The item is released right away
+     * unless the slot may still be copied by a reader of this checkpoint.
+     */
+    void emptySlot(size_t pos);
+
+    void releaseRetiredSegments();
+
+    /**
+     * Rewrite the item slots without the empty positions, placing the given
+     * items right after the dummy and checkpoint_start items. Index entries
+     * and the cursors walking this checkpoint are moved along.
+     */
+    void rebuild(const std::vector<queued_item> &inserted,
+                 CheckpointManager *checkpointManager);
+
+    void updateMemOverhead();
+
+    // Number of item slots per storage segment.
+    static const size_t segmentSize = 64;
+    static const uint32_t emptyPosition = 0xffffffff;
+
     EPStats                       &stats;
     uint64_t                       checkpointId;
     uint64_t                       snapStartSeqno;
@@ -346,11 +430,25 @@ private:
     rel_time_t                     creationTime;
     checkpoint_state               checkpointState;
     size_t                         numItems;
-    std::set<std::string>          cursors; // List of cursors with their unique names.
-    // List is used for queueing mutations as vector incurs shift operations for deduplication.
-    std::list<queued_item>         toWrite;
-    checkpoint_index               keyIndex;
+    size_t                         numCursors;
+    // Items are appended to fixed size segments, so queueing never moves
+    // existing items. Deduplication empties the old slot instead of shifting
+    // the items behind it; the slots are compacted once mostly empty.
+    std::vector<queued_item*>      segments;
+    // One bit per slot, set while the slot holds a live item.
+    std::vector<uint64_t>          liveSlots;
+    size_t                         numSlots;
+    size_t                         numEmptySlots;
+    // Readers copying published items without the queue lock. Segments
+    // replaced by a compaction meanwhile are freed once the last one is done.
+    size_t                         numPins;
+    std::vector<queued_item*>      retiredSegments;
+    // Open addressed (linear probing) key index, sized to a power of two.
+    std::vector<index_entry>       keyIndex;
+    size_t                         numIndexEntries;
     size_t                         memOverhead;
+
+    DISALLOW_COPY_AND_ASSIGN(Checkpoint);
 };
 
 typedef std::pair<uint64_t, bool> CursorRegResult;
@@ -378,7 +476,8 @@ public:
         flusherCB(cb) {
         LockHolder lh(queueLock);
         addNewCheckpoint_UNLOCKED(checkpointId, lastSnapStart, lastSnapEnd);
-        registerCursor_UNLOCKED("persistence", checkpointId);
+        cursor_handle_t handle = pCursor;
+        registerCursor_UNLOCKED(pCursorName, handle, checkpointId);
     }
 
     ~CheckpointManager();
@@ -410,27 +509,41 @@ public:
      * Register the cursor for getting items whose bySeqno values are between
      * startBySeqno and endBySeqno, and close the open checkpoint if endBySeqno
      * belongs to the open checkpoint.
+     * @param name the name of a given connection. Any existing cursor with
+     * this name is replaced.
      * @param startBySeqno start bySeqno.
+     * @param handle set to the handle of the new cursor.
      * @return Cursor registration result which consists of (1) the bySeqno with
      * which the cursor can start and (2) flag indicating if the cursor starts
      * with the first item on a checkpoint.
      */
     CursorRegResult registerCursorBySeqno(const std::string &name,
-                                          uint64_t startBySeqno);
+                                          uint64_t startBySeqno,
+                                          cursor_handle_t &handle);
 
     /**
      * Register the new cursor for a given connection
      * @param name the name of a given connection
+     * @param handle set to the handle of the cursor. If a cursor with this
+     * name already exists, it is repositioned and keeps its handle.
      * @param checkpointId the checkpoint Id to start with.
      * @param alwaysFromBeginning the flag indicating if a cursor should be set to the beginning of
      * checkpoint to start with, even if the cursor is currently in that checkpoint.
      * @return true if the checkpoint to start with exists in the queue.
      */
-    bool registerCursor(const std::string &name, uint64_t checkpointId = 1,
+    bool registerCursor(const std::string &name, cursor_handle_t &handle,
+                        uint64_t checkpointId = 1,
                         bool alwaysFromBeginning = false);
 
     /**
      * Remove the cursor for a given connection.
+     * @param handle the handle of the cursor
+     * @return true if the cursor is removed successfully.
+     */
+    bool removeCursor(cursor_handle_t handle);
+
+    /**
+     * Remove the cursor for a given connection by its name.
      * @param name the name of a given connection
      * @return true if the cursor is removed successfully.
      */
@@ -446,7 +559,7 @@ public:
 
     size_t getNumOfCursors();
 
-    std::list<std::string> getCursorNames();
+    cursor_list getCursors();
 
     /**
      * Queue an item to be written to persistent layer.
@@ -459,14 +572,20 @@ public:
 
     /**
      * Return the next item to be sent to a given connection
-     * @param name the name of a given connection
+     * @param handle the handle of the connection's cursor
      * @param isLastMutationItem flag indicating if the item to be returned is
      * the last mutation one in the closed checkpoint.
      * @return the next item to be sent to a given connection.
      */
-    queued_item nextItem(const std::string &name, bool &isLastMutationItem);
+    queued_item nextItem(cursor_handle_t handle, bool &isLastMutationItem);
 
-    snapshot_range_t getAllItemsForCursor(const std::string& name,
+    /**
+     * Get the items the cursor hasn't visited yet, up to the end of its
+     * checkpoint unless it is the persistence cursor. The cursor is moved
+     * under the queue lock, but the items are copied without holding it, so
+     * that front-end threads keep queueing while a large backlog is drained.
+     */
+    snapshot_range_t getAllItemsForCursor(cursor_handle_t handle,
                                           std::vector<queued_item> &items);
 
     /**
@@ -480,6 +599,11 @@ public:
 
     size_t getNumCheckpoints();
 
+    size_t getNumItemsForCursor(cursor_handle_t handle);
+
+    /**
+     * Same as above, looking the cursor up by its name. Only meant for stats.
+     */
     size_t getNumItemsForCursor(const std::string &name);
 
     void clear(vbucket_state_t vbState) {
@@ -496,11 +620,11 @@ public:
      * If a given cursor currently points to the checkpoint_end dummy item,
      * decrease its current position by 1. This function is mainly used for
      * checkpoint synchronization between the master and slave nodes.
-     * @param name the name of a given connection
+     * @param handle the handle of the connection's cursor
      */
-    void decrCursorFromCheckpointEnd(const std::string &name);
+    void decrCursorFromCheckpointEnd(cursor_handle_t handle);
 
-    bool hasNext(const std::string &name);
+    bool hasNext(cursor_handle_t handle);
 
     const CheckpointConfig &getCheckpointConfig() const {
         return checkpointConfig;
@@ -514,7 +638,12 @@ public:
      */
     uint64_t createNewCheckpoint();
 
-    void resetCursors(const std::list<std::string> &cursors);
+    /**
+     * Register the given cursors at the beginning of the open checkpoint.
+     * Each cursor keeps its handle unless it is already taken, so that the
+     * cursors copied from another checkpoint manager stay usable.
+     */
+    void resetCursors(const cursor_list &cursors);
 
     /**
      * Get id of the previous checkpoint that is followed by the checkpoint
@@ -583,18 +712,70 @@ public:
 
     static const std::string pCursorName;
 
+    // Handle of the persistence cursor, which is the same in every vbucket.
+    static const cursor_handle_t pCursor;
+
 private:
 
-    bool removeCursor_UNLOCKED(const std::string &name);
+    CheckpointCursor *getCursor(cursor_handle_t handle);
 
+    CheckpointCursor *findCursor(const std::string &name);
+
+    /**
+     * Take a free cursor slot for a new cursor, preferably the one of the
+     * given handle. Invalidates pointers to other cursors.
+     */
+    CheckpointCursor &allocCursor(const std::string &name,
+                                  cursor_handle_t handle);
+
+    bool removeCursor_UNLOCKED(CheckpointCursor *cursor);
+
+    size_t getNumOfCursors_UNLOCKED();
+
+    /**
+     * Register a cursor by name.
+     * @param handle the handle for the cursor if it doesn't exist yet, or 0
+     * to allocate a new one. Set to the handle of the registered cursor.
+     */
     bool registerCursor_UNLOCKED(const std::string &name,
-                                    uint64_t checkpointId = 1,
-                                    bool alwaysFromBeginning = false);
+                                 cursor_handle_t &handle,
+                                 uint64_t checkpointId = 1,
+                                 bool alwaysFromBeginning = false);
 
-    size_t getNumItemsForCursor_UNLOCKED(const std::string &name);
+    size_t getNumItemsForCursor_UNLOCKED(CheckpointCursor *cursor);
+
+    /**
+     * Move a cursor into the given checkpoint, keeping the per checkpoint
+     * cursor counts up to date.
+     */
+    void setCursorCheckpoint(CheckpointCursor &cursor,
+                             std::list<Checkpoint*>::iterator chkItr);
+
+    /**
+     * Detach every cursor in the given checkpoints, which are about to be
+     * deleted. A detached cursor must be placed with setCursorCheckpoint()
+     * before it is used again.
+     */
+    void detachCursors(std::list<Checkpoint*>::iterator first,
+                       std::list<Checkpoint*>::iterator last);
+
+    bool isCursorInCheckpoint(const CheckpointCursor &cursor,
+                              const Checkpoint *chk) const {
+        return cursor.handle != 0 &&
+               cursor.currentCheckpoint != checkpointList.end() &&
+               *(cursor.currentCheckpoint) == chk;
+    }
 
     void clear_UNLOCKED(vbucket_state_t vbState, uint64_t seqno);
 
+    /**
+     * Delete a checkpoint that was taken off the checkpoint list, or defer
+     * it until the readers copying its items are done.
+     */
+    void deleteCheckpoint_UNLOCKED(Checkpoint *chk);
+
+    void unpinCheckpoint_UNLOCKED(Checkpoint *chk);
+
     /**
      * Create a new open checkpoint and add it to the checkpoint list.
      * The lock should be acquired before calling this function.
@@ -606,8 +787,6 @@ private:
                                    uint64_t snapStartSeqno,
                                    uint64_t snapEndSeqno);
 
-    void removeInvalidCursorsOnCheckpoint(Checkpoint *pCheckpoint);
-
     bool moveCursorToNextCheckpoint(CheckpointCursor &cursor);
 
     /**
@@ -638,7 +817,7 @@ private:
 
     void resetCursors(bool resetPersistenceCursor = true);
 
-    void putCursorsInCollapsedChk(std::map<std::string, std::pair<uint64_t, bool> > &cursors,
+    void putCursorsInCollapsedChk(std::map<cursor_handle_t, std::pair<uint64_t, bool> > &cursorMap,
                                   std::list<Checkpoint*>::iterator chkItr);
 
     queued_item createCheckpointItem(uint64_t id, uint16_t vbid,
@@ -654,10 +833,13 @@ private:
     int64_t                  lastBySeqno;
     int64_t                  lastClosedChkBySeqno;
     std::list<Checkpoint*>   checkpointList;
+    // Checkpoints removed from the list while still pinned by a reader.
+    std::list<Checkpoint*>   retiredCheckpoints;
     bool                     isCollapsedCheckpoint;
     uint64_t                 lastClosedCheckpointId;
     uint64_t                 pCursorPreCheckpointId;
-    cursor_index             tapCursors;
+    // Cursors are stored by the slot number encoded in their handle.
+    std::vector<CheckpointCursor> cursors;
 
     shared_ptr<Callback<uint16_t> > flusherCB;
 };
@@ -935,6 +935,11 @@ DcpConnMap::DcpConnMap(EventuallyPersistentEngine &e)
     : ConnMap(e) {
     numActiveSnoozingBackfills = 0;
     updateMaxActiveSnoozingBackfills(engine.getEpStats().getMaxDataSize());
+    numBackfillScans = 0;
+    maxBackfillScans = std::max(static_cast<size_t>(1),
+                    engine.getConfiguration().getDcpBackfillMaxScans());
+    peakBackfillScans = 0;
+    numBackfillingConns = 0;
 }
 
 
@@ -1189,6 +1194,57 @@ void DcpConnMap::decrNumActiveSnoozingBackfills()
     }
 }
 
+bool DcpConnMap::acquireBackfillScan(size_t connScans, const ExTask &waiter)
+{
+    SpinLockHolder lh(&numBackfillsLock);
+    size_t conns = std::max(numBackfillingConns, static_cast<size_t>(1));
+    size_t share = std::max(maxBackfillScans / conns, static_cast<size_t>(1));
+    if (numBackfillScans < maxBackfillScans && connScans < share) {
+        ++numBackfillScans;
+        peakBackfillScans = std::max(peakBackfillScans, numBackfillScans);
+        return true;
+    }
+    if (waiter.get()) {
+        backfillScanWaiters.push_back(waiter);
+    }
+    return false;
+}
+
+void DcpConnMap::releaseBackfillScan()
+{
+    std::list<ExTask> waiters;
+    SpinLockHolder lh(&numBackfillsLock);
+    cb_assert(numBackfillScans > 0);
+    --numBackfillScans;
+    waiters.swap(backfillScanWaiters);
+    lh.unlock();
+
+    std::list<ExTask>::iterator it = waiters.begin();
+    for (; it != waiters.end(); ++it) {
+        ExecutorPool::get()->wake((*it)->getId());
+    }
+}
+
+size_t DcpConnMap::getBackfillScanShare()
+{
+    SpinLockHolder lh(&numBackfillsLock);
+    size_t conns = std::max(numBackfillingConns, static_cast<size_t>(1));
+    return std::max(maxBackfillScans / conns, static_cast<size_t>(1));
+}
+
+void DcpConnMap::incrNumBackfillingConns()
+{
+    SpinLockHolder lh(&numBackfillsLock);
+    ++numBackfillingConns;
+}
+
+void DcpConnMap::decrNumBackfillingConns()
+{
+    SpinLockHolder lh(&numBackfillsLock);
+    cb_assert(numBackfillingConns > 0);
+    --numBackfillingConns;
+}
+
 void DcpConnMap::updateMaxActiveSnoozingBackfills(size_t maxDataSize)
 {
     double numBackfillsMemThresholdPercent =
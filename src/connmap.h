@@ -472,6 +472,43 @@ public:
         return maxActiveSnoozingBackfills;
     }
 
+    /**
+     * Take one of the slots for a backfill scan, unless they are all in use
+     * or the connection already runs its share of them. In that case the
+     * waiter is woken up as soon as a slot is released.
+     *
+     * @param connScans the number of scans the connection runs right now
+     * @param waiter the backfill task to wake up once it may retry
+     */
+    bool acquireBackfillScan(size_t connScans, const ExTask &waiter);
+
+    /**
+     * Give back a backfill scan slot and wake up the tasks waiting for one.
+     */
+    void releaseBackfillScan();
+
+    /**
+     * The number of scans a connection may run at the same time: the
+     * budget split evenly between the connections that are backfilling.
+     */
+    size_t getBackfillScanShare();
+
+    void incrNumBackfillingConns();
+
+    void decrNumBackfillingConns();
+
+    size_t getNumBackfillScans() const {
+        return numBackfillScans;
+    }
+
+    size_t getMaxBackfillScans() const {
+        return maxBackfillScans;
+    }
+
+    size_t getPeakBackfillScans() const {
+        return peakBackfillScans;
+    }
+
 private:
 
     void disconnect_UNLOCKED(const void *cookie);
@@ -485,6 +522,11 @@ private:
     static const uint32_t dbFileMem;
     uint16_t numActiveSnoozingBackfills;
     uint16_t maxActiveSnoozingBackfills;
+    size_t numBackfillScans;
+    size_t maxBackfillScans;
+    size_t peakBackfillScans;
+    size_t numBackfillingConns;
+    std::list<ExTask> backfillScanWaiters;
     /* Max num of backfills we want to have irrespective of memory */
     static const uint16_t numBackfillsThreshold;
     /* Max percentage of memory we want backfills to occupy */
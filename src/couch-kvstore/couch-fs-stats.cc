@@ -17,12 +17,18 @@
 
 #include "config.h"
 
+#include <algorithm>
+#include <string>
+#include <utility>
+
 #include "common.h"
 #include "couch-kvstore/couch-fs-stats.h"
 #include "histo.h"
 
 extern "C" {
 static couch_file_handle cfs_construct(couchstore_error_info_t*, void* cookie);
+static couch_file_handle cfs_construct_grouped(couchstore_error_info_t*,
+                                               void* cookie);
 static couchstore_error_t cfs_open(couchstore_error_info_t*,
                                    couch_file_handle*, const char*, int);
 static void cfs_close(couchstore_error_info_t*, couch_file_handle);
@@ -56,13 +62,127 @@ couch_file_ops getCouchstoreStatsOps(CouchstoreStats* stats) {
     return ops;
 }
 
+CouchstoreSyncGroup::CouchstoreSyncGroup(CouchstoreStats* st) : stats(st) {
+    couch_file_ops groupOps = {
+        5,
+        cfs_construct_grouped,
+        cfs_open,
+        cfs_close,
+        cfs_pread,
+        cfs_pwrite,
+        cfs_goto_eof,
+        cfs_sync,
+        cfs_advise,
+        cfs_destroy,
+        this
+    };
+    ops = groupOps;
+}
+
 struct StatFile {
     const couch_file_ops* orig_ops;
     couch_file_handle orig_handle;
     CouchstoreStats* stats;
     cs_off_t last_offs;
+    // Set for files written by a group commit.
+    CouchstoreSyncGroup* group;
+    bool sync_pending;
+    // Writes made after the deferred sync (the header), held back until
+    // the data before them is synced.
+    std::vector<std::pair<cs_off_t, std::string> > held;
 };
 
+static couchstore_error_t syncFile(couchstore_error_info_t *errinfo,
+                                   StatFile* sf) {
+    BlockTimer bt(&sf->stats->syncTimeHisto);
+    return sf->orig_ops->sync(errinfo, sf->orig_handle);
+}
+
+static couchstore_error_t writeHeld(couchstore_error_info_t *errinfo,
+                                    StatFile* sf) {
+    couchstore_error_t rv = COUCHSTORE_SUCCESS;
+    std::vector<std::pair<cs_off_t, std::string> >::iterator it;
+    for (it = sf->held.begin(); it != sf->held.end(); ++it) {
+        const std::string &buf = it->second;
+        BlockTimer bt(&sf->stats->writeTimeHisto);
+        ssize_t written = sf->orig_ops->pwrite(errinfo, sf->orig_handle,
+                                               buf.data(), buf.size(),
+                                               it->first);
+        if (written != static_cast<ssize_t>(buf.size())) {
+            rv = COUCHSTORE_ERROR_WRITE;
+            break;
+        }
+    }
+    sf->held.clear();
+    return rv;
+}
+
+/**
+ * Complete a file whose sync was deferred on its own: sync its data, write
+ * its header and sync again.
+ */
+static couchstore_error_t completeFile(couchstore_error_info_t *errinfo,
+                                       StatFile* sf) {
+    sf->sync_pending = false;
+    couchstore_error_t rv = syncFile(errinfo, sf);
+    if (rv == COUCHSTORE_SUCCESS && !sf->held.empty()) {
+        rv = writeHeld(errinfo, sf);
+        if (rv == COUCHSTORE_SUCCESS) {
+            rv = syncFile(errinfo, sf);
+        }
+    }
+    sf->held.clear();
+    return rv;
+}
+
+couchstore_error_t CouchstoreSyncGroup::syncAll() {
+    couchstore_error_t rv = COUCHSTORE_SUCCESS;
+    couchstore_error_info_t errinfo;
+    std::vector<StatFile*>::iterator it;
+
+    // The data of every file must be durable before any header points at
+    // it, so sync all the data, then write all the headers and sync again.
+    for (it = pending.begin(); it != pending.end(); ++it) {
+        couchstore_error_t err = syncFile(&errinfo, *it);
+        if (rv == COUCHSTORE_SUCCESS) {
+            rv = err;
+        }
+    }
+    if (rv == COUCHSTORE_SUCCESS) {
+        for (it = pending.begin(); it != pending.end(); ++it) {
+            couchstore_error_t err = writeHeld(&errinfo, *it);
+            if (rv == COUCHSTORE_SUCCESS) {
+                rv = err;
+            }
+        }
+    }
+    if (rv == COUCHSTORE_SUCCESS) {
+        for (it = pending.begin(); it != pending.end(); ++it) {
+            couchstore_error_t err = syncFile(&errinfo, *it);
+            if (rv == COUCHSTORE_SUCCESS) {
+                rv = err;
+            }
+        }
+    }
+    for (it = pending.begin(); it != pending.end(); ++it) {
+        // On failure the headers are dropped, leaving the files at their
+        // previous commit.
+        (*it)->held.clear();
+        (*it)->sync_pending = false;
+    }
+    pending.clear();
+    return rv;
+}
+
+void CouchstoreSyncGroup::defer(StatFile *sf) {
+    pending.push_back(sf);
+}
+
+void CouchstoreSyncGroup::forget(StatFile *sf) {
+    pending.erase(std::remove(pending.begin(), pending.end(), sf),
+                  pending.end());
+}
+
 extern "C" {
     static couch_file_handle cfs_construct(couchstore_error_info_t *errinfo,
                                            void* cookie) {
@@ -72,9 +192,20 @@ extern "C" {
         sf->orig_handle = sf->orig_ops->constructor(errinfo,
                                                     sf->orig_ops->cookie);
         sf->last_offs = 0;
+        sf->group = NULL;
+        sf->sync_pending = false;
         return reinterpret_cast<couch_file_handle>(sf);
     }
 
+    static couch_file_handle cfs_construct_grouped(
+                                           couchstore_error_info_t *errinfo,
+                                           void* cookie) {
+        CouchstoreSyncGroup* group = static_cast<CouchstoreSyncGroup*>(cookie);
+        couch_file_handle h = cfs_construct(errinfo, group->getStats());
+        reinterpret_cast<StatFile*>(h)->group = group;
+        return h;
+    }
+
     static couchstore_error_t cfs_open(couchstore_error_info_t *errinfo,
                                        couch_file_handle* h,
                                        const char* path,
@@ -86,6 +217,11 @@ extern "C" {
     static void cfs_close(couchstore_error_info_t *errinfo,
                           couch_file_handle h) {
         StatFile* sf = reinterpret_cast<StatFile*>(h);
+        if (sf->sync_pending) {
+            // Closed before the group sync, e.g. on an error path.
+            sf->group->forget(sf);
+            completeFile(errinfo, sf);
+        }
         sf->orig_ops->close(errinfo, sf->orig_handle);
     }
 
@@ -95,6 +231,19 @@ extern "C" {
                              size_t sz,
                              cs_off_t off) {
         StatFile* sf = reinterpret_cast<StatFile*>(h);
+        if (!sf->held.empty()) {
+            // Reads of a held write must see it.
+            std::vector<std::pair<cs_off_t, std::string> >::iterator it;
+            for (it = sf->held.begin(); it != sf->held.end(); ++it) {
+                const std::string &held = it->second;
+                if (off >= it->first &&
+                    off + static_cast<cs_off_t>(sz) <=
+                    it->first + static_cast<cs_off_t>(held.size())) {
+                    memcpy(buf, held.data() + (off - it->first), sz);
+                    return sz;
+                }
+            }
+        }
         sf->stats->readSizeHisto.add(sz);
         if(sf->last_offs) {
             sf->stats->readSeekHisto.add(abs(off - sf->last_offs));
@@ -110,6 +259,13 @@ extern "C" {
                               size_t sz,
                               cs_off_t off) {
         StatFile* sf = reinterpret_cast<StatFile*>(h);
+        if (sf->sync_pending) {
+            // Anything written after the deferred sync is the header; it
+            // may only reach the file once the data before it is synced.
+            sf->held.push_back(std::make_pair(off,
+                    std::string(static_cast<const char*>(buf), sz)));
+            return sz;
+        }
         sf->stats->writeSizeHisto.add(sz);
         BlockTimer bt(&sf->stats->writeTimeHisto);
         return sf->orig_ops->pwrite(errinfo, sf->orig_handle, buf, sz, off);
@@ -118,14 +274,26 @@ extern "C" {
     static cs_off_t cfs_goto_eof(couchstore_error_info_t *errinfo,
                                  couch_file_handle h) {
         StatFile* sf = reinterpret_cast<StatFile*>(h);
-        return sf->orig_ops->goto_eof(errinfo, sf->orig_handle);
+        cs_off_t eof = sf->orig_ops->goto_eof(errinfo, sf->orig_handle);
+        std::vector<std::pair<cs_off_t, std::string> >::iterator it;
+        for (it = sf->held.begin(); it != sf->held.end(); ++it) {
+            eof = std::max(eof, it->first +
+                                static_cast<cs_off_t>(it->second.size()));
+        }
+        return eof;
     }
 
     static couchstore_error_t cfs_sync(couchstore_error_info_t *errinfo,
                                        couch_file_handle h) {
         StatFile* sf = reinterpret_cast<StatFile*>(h);
-        BlockTimer bt(&sf->stats->syncTimeHisto);
-        return sf->orig_ops->sync(errinfo, sf->orig_handle);
+        if (sf->group) {
+            if (!sf->sync_pending) {
+                sf->sync_pending = true;
+                sf->group->defer(sf);
+            }
+            return COUCHSTORE_SUCCESS;
+        }
+        return syncFile(errinfo, sf);
     }
 
     static couchstore_error_t cfs_advise(couchstore_error_info_t *errinfo,
@@ -140,6 +308,9 @@ extern "C" {
     static void cfs_destroy(couchstore_error_info_t *errinfo,
                             couch_file_handle h) {
         StatFile* sf = reinterpret_cast<StatFile*>(h);
+        if (sf->sync_pending) {
+            sf->group->forget(sf);
+        }
         sf->orig_ops->destructor(errinfo, sf->orig_handle);
         delete sf;
     }
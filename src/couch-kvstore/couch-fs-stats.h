@@ -22,6 +22,8 @@
 
 #include <libcouchstore/couch_db.h>
 
+#include <vector>
+
 #include "histo.h"
 
 struct CouchstoreStats {
@@ -32,17 +34,17 @@ public:
         writeSizeHisto(ExponentialGenerator<size_t>(1, 2), 25) { }
 
     //Read time length
-    Histogram<hrtime_t> readTimeHisto;
+    ShardedHistogram<hrtime_t> readTimeHisto;
     //Distance from last read
     Histogram<size_t> readSeekHisto;
     //Size of read
     Histogram<size_t> readSizeHisto;
     //Write time length
-    Histogram<hrtime_t> writeTimeHisto;
+    ShardedHistogram<hrtime_t> writeTimeHisto;
     //Write size
     Histogram<size_t> writeSizeHisto;
     //Time spent in sync
-    Histogram<hrtime_t> syncTimeHisto;
+    ShardedHistogram<hrtime_t> syncTimeHisto;
 
     void reset() {
         readTimeHisto.reset();
@@ -56,4 +58,47 @@ public:
 
 couch_file_ops getCouchstoreStatsOps(CouchstoreStats* stats);
 
+struct StatFile;
+
+/**
+ * Syncs of the couchstore files written by one group commit.
+ *
+ * Files opened with the group's file ops don't sync when couchstore commits
+ * to them; the syncs are only recorded, and the header couchstore writes
+ * after the first of them is held in memory. Once every file of the group
+ * has been written, syncAll() syncs the data of all of them, writes all the
+ * headers and syncs them all again, so no header is durable before the
+ * data it points at. A file should stay open until then, closing it
+ * earlier completes it on its own.
+ */
+class CouchstoreSyncGroup {
+public:
+    CouchstoreSyncGroup(CouchstoreStats* stats);
+
+    const couch_file_ops *getOps() const {
+        return &ops;
+    }
+
+    CouchstoreStats *getStats() const {
+        return stats;
+    }
+
+    /**
+     * Complete every file whose sync was deferred: sync the data, write
+     * the held headers, sync again. No header is written if a data sync
+     * fails.
+     * @return the first error, or COUCHSTORE_SUCCESS
+     */
+    couchstore_error_t syncAll();
+
+    void defer(StatFile *sf);
+
+    void forget(StatFile *sf);
+
+private:
+    CouchstoreStats *stats;
+    couch_file_ops ops;
+    std::vector<StatFile*> pending;
+};
+
 #endif  // SRC_COUCH_KVSTORE_COUCH_FS_STATS_H_
@@ -59,6 +59,12 @@ static const int MAX_OPEN_DB_RETRY = 10;
 
 static const uint32_t DEFAULT_META_LEN = 16;
 
+// Compaction copies what was flushed during it without holding the vbucket
+// lock until at most COMPACT_CATCH_UP_LOCKED changes are left, or it has
+// made COMPACT_CATCH_UP_MAX_PASSES passes; the rest is copied under the lock.
+static const uint64_t COMPACT_CATCH_UP_LOCKED = 1000;
+static const int COMPACT_CATCH_UP_MAX_PASSES = 10;
+
 class NoLookupCallback : public Callback<CacheLookup> {
 public:
     NoLookupCallback() {}
@@ -223,9 +229,10 @@ struct AllKeysCtx {
 };
 
 CouchRequest::CouchRequest(const Item &it, uint64_t rev,
-                           CouchRequestCallback &cb, bool del) :
+                           CouchRequestCallback &cb, bool del,
+                           key_existence_t exists) :
     value(it.getValue()), vbucketId(it.getVBucketId()), fileRevNum(rev),
-    key(it.getKey()), deleteItem(del)
+    key(it.getKey()), deleteItem(del), existence(exists)
 {
     uint64_t cas = htonll(it.getCas());
     uint32_t flags = it.getFlags();
@@ -300,9 +307,72 @@ CouchRequest::CouchRequest(const Item &it, uint64_t rev,
     start = gethrtime();
 }
 
+DbHandleCache::DbHandleCache(uint16_t numVBuckets, size_t max) :
+    hits(0), misses(0), evictions(0), maxHandles(max),
+    generations(numVBuckets, 0) { }
+
+Db *DbHandleCache::take(uint16_t vbid, uint64_t rev, uint64_t &gen) {
+    LockHolder lh(lock);
+    gen = generations[vbid];
+    std::list<CachedHandle>::iterator it = idle.begin();
+    for (; it != idle.end(); ++it) {
+        if (it->vbid == vbid && it->rev == rev) {
+            Db *db = it->db;
+            idle.erase(it);
+            ++hits;
+            return db;
+        }
+    }
+    ++misses;
+    return NULL;
+}
+
+void DbHandleCache::put(uint16_t vbid, uint64_t rev, uint64_t gen, Db *db,
+                        std::list<Db*> &closing) {
+    LockHolder lh(lock);
+    if (gen != generations[vbid]) {
+        // The file changed while the handle was out.
+        closing.push_back(db);
+        return;
+    }
+
+    CachedHandle handle = { vbid, rev, db };
+    idle.push_front(handle);
+    if (idle.size() > maxHandles) {
+        closing.push_back(idle.back().db);
+        idle.pop_back();
+        ++evictions;
+    }
+}
+
+void DbHandleCache::invalidate(uint16_t vbid, std::list<Db*> &closing) {
+    LockHolder lh(lock);
+    ++generations[vbid];
+    std::list<CachedHandle>::iterator it = idle.begin();
+    while (it != idle.end()) {
+        if (it->vbid == vbid) {
+            closing.push_back(it->db);
+            it = idle.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void DbHandleCache::clear(std::list<Db*> &closing) {
+    LockHolder lh(lock);
+    std::list<CachedHandle>::iterator it = idle.begin();
+    for (; it != idle.end(); ++it) {
+        closing.push_back(it->db);
+    }
+    idle.clear();
+}
+
 CouchKVStore::CouchKVStore(KVStoreConfig &config, bool read_only) :
     KVStore(read_only), configuration(config), dbname(configuration.getDBName()),
-    intransaction(false), backfillCounter(0)
+    intransaction(false), syncGroup(&st.fsStats), backfillCounter(0),
+    dbHandles(NULL),
+    readOnlyPeer(NULL)
 {
     createDataDir(dbname);
     statCollectingFileOps = getCouchstoreStatsOps(&st.fsStats);
@@ -313,21 +383,32 @@ CouchKVStore::CouchKVStore(KVStoreConfig &config, bool read_only) :
     for (uint16_t i = 0; i < numDbFiles; i++) {
         // pre-allocate to avoid rehashing for safe read-only operations
         dbFileRevMap.push_back(1);
+        fileRewinds.push_back(0);
         cachedDocCount[i] = (size_t)-1;
         cachedDeleteCount[i] = (size_t)-1;
         cachedVBStates.push_back((vbucket_state *)NULL);
     }
 
+    if (read_only && configuration.getDbHandleCacheSize() > 0) {
+        dbHandles = new DbHandleCache(numDbFiles,
+                                      configuration.getDbHandleCacheSize());
+    }
+
     initialize();
 }
 
 CouchKVStore::CouchKVStore(const CouchKVStore &copyFrom) :
     KVStore(copyFrom), configuration(copyFrom.configuration),
     dbname(copyFrom.dbname), dbFileRevMap(copyFrom.dbFileRevMap),
-    numDbFiles(copyFrom.numDbFiles), intransaction(false)
+    fileRewinds(copyFrom.fileRewinds), numDbFiles(copyFrom.numDbFiles), intransaction(false),
+    syncGroup(&st.fsStats), dbHandles(NULL), readOnlyPeer(NULL)
 {
     createDataDir(dbname);
     statCollectingFileOps = getCouchstoreStatsOps(&st.fsStats);
+    if (isReadOnly() && configuration.getDbHandleCacheSize() > 0) {
+        dbHandles = new DbHandleCache(numDbFiles,
+                                      configuration.getDbHandleCacheSize());
+    }
 }
 
 void CouchKVStore::initialize() {
@@ -365,6 +446,13 @@ void CouchKVStore::initialize() {
 CouchKVStore::~CouchKVStore() {
     close();
 
+    if (dbHandles) {
+        std::list<Db*> idle;
+        dbHandles->clear(idle);
+        closeHandles(idle);
+        delete dbHandles;
+    }
+
     for (std::vector<vbucket_state *>::iterator it = cachedVBStates.begin();
          it != cachedVBStates.end(); it++) {
         vbucket_state *vbstate = *it;
@@ -387,6 +475,7 @@ void CouchKVStore::reset(uint16_t vbucketId) {
 
         // Unlink the couchstore file upon reset
         unlinkCouchFile(vbucketId, dbFileRevMap[vbucketId]);
+        ++fileRewinds[vbucketId];
 
         resetVBucket(vbucketId, *state);
         updateDbFileMap(vbucketId, 1);
@@ -397,7 +486,8 @@ void CouchKVStore::reset(uint16_t vbucketId) {
     }
 }
 
-void CouchKVStore::set(const Item &itm, Callback<mutation_result> &cb) {
+void CouchKVStore::set(const Item &itm, Callback<mutation_result> &cb,
+                       key_existence_t existence) {
     cb_assert(!isReadOnly());
     cb_assert(intransaction);
     bool deleteItem = false;
@@ -406,7 +496,8 @@ void CouchKVStore::set(const Item &itm, Callback<mutation_result> &cb) {
 
     // each req will be de-allocated after commit
     requestcb.setCb = &cb;
-    CouchRequest *req = new CouchRequest(itm, fileRev, requestcb, deleteItem);
+    CouchRequest *req = new CouchRequest(itm, fileRev, requestcb, deleteItem,
+                                         existence);
     pendingReqsQ.push_back(req);
 }
 
@@ -414,10 +505,9 @@ void CouchKVStore::get(const std::string &key, uint16_t vb,
                        Callback<GetValue> &cb, bool fetchDelete) {
     Db *db = NULL;
     GetValue rv;
-    uint64_t fileRev = dbFileRevMap[vb];
+    uint64_t fileRev, gen;
 
-    couchstore_error_t errCode = openDB(vb, fileRev, &db,
-                                        COUCHSTORE_OPEN_FLAG_RDONLY);
+    couchstore_error_t errCode = acquireReadHandle(vb, &db, fileRev, gen);
     if (errCode != COUCHSTORE_SUCCESS) {
         ++st.numGetFailure;
         LOG(EXTENSION_LOG_WARNING,
@@ -430,7 +520,7 @@ void CouchKVStore::get(const std::string &key, uint16_t vb,
     }
 
     getWithHeader(db, key, vb, cb, fetchDelete);
-    closeDatabaseHandle(db);
+    releaseReadHandle(vb, fileRev, gen, db);
 }
 
 void CouchKVStore::getWithHeader(void *dbHandle, const std::string &key,
@@ -490,11 +580,10 @@ void CouchKVStore::getWithHeader(void *dbHandle, const std::string &key,
 
 void CouchKVStore::getMulti(uint16_t vb, vb_bgfetch_queue_t &itms) {
     int numItems = itms.size();
-    uint64_t fileRev = dbFileRevMap[vb];
+    uint64_t fileRev, gen;
 
     Db *db = NULL;
-    couchstore_error_t errCode = openDB(vb, fileRev, &db,
-                                        COUCHSTORE_OPEN_FLAG_RDONLY);
+    couchstore_error_t errCode = acquireReadHandle(vb, &db, fileRev, gen);
     if (errCode != COUCHSTORE_SUCCESS) {
         LOG(EXTENSION_LOG_WARNING,
             "Warning: failed to open database for data fetch, "
@@ -539,19 +628,23 @@ void CouchKVStore::getMulti(uint16_t vb, vb_bgfetch_queue_t &itms) {
                 (*fitr)->value.setStatus(couchErr2EngineErr(errCode));
             }
         }
+        // Don't hand a handle that just failed to the next reader.
+        closeDatabaseHandle(db);
+    } else {
+        releaseReadHandle(vb, fileRev, gen, db);
     }
-    closeDatabaseHandle(db);
     delete []ids;
 }
 
-void CouchKVStore::del(const Item &itm,
-                       Callback<int> &cb) {
+void CouchKVStore::del(const Item &itm, Callback<int> &cb,
+                       key_existence_t existence) {
     cb_assert(!isReadOnly());
     cb_assert(intransaction);
     uint16_t fileRev = dbFileRevMap[itm.getVBucketId()];
     CouchRequestCallback requestcb;
     requestcb.delCb = &cb;
-    CouchRequest *req = new CouchRequest(itm, fileRev, requestcb, true);
+    CouchRequest *req = new CouchRequest(itm, fileRev, requestcb, true,
+                                         existence);
     pendingReqsQ.push_back(req);
 }
 
@@ -559,6 +652,7 @@ void CouchKVStore::delVBucket(uint16_t vbucket) {
     cb_assert(!isReadOnly());
 
     unlinkCouchFile(vbucket, dbFileRevMap[vbucket]);
+    ++fileRewinds[vbucket];
 
     if (cachedVBStates[vbucket]) {
         delete cachedVBStates[vbucket];
@@ -571,6 +665,12 @@ void CouchKVStore::delVBucket(uint16_t vbucket) {
     updateDbFileMap(vbucket, 1);
 }
 
+void CouchKVStore::setReadOnlyPeer(KVStore *ro) {
+    cb_assert(!isReadOnly());
+    cb_assert(ro->isReadOnly());
+    readOnlyPeer = static_cast<CouchKVStore*>(ro);
+}
+
 std::vector<vbucket_state *> CouchKVStore::listPersistedVbuckets() {
     return cachedVBStates;
 }
@@ -796,16 +896,114 @@ static int time_purge_hook(Db* d, DocInfo* info, void* ctx_p) {
     return COUCHSTORE_COMPACT_KEEP_ITEM;
 }
 
+/**
+ * Changes copied into a compacted file, a batch at a time.
+ */
+struct CatchUpCtx {
+    CatchUpCtx(Db *t) : target(t), numCopied(0), lastSeqno(0),
+                        errCode(COUCHSTORE_SUCCESS) { }
+
+    Db *target;
+    std::vector<DocInfo *> infos;
+    std::vector<Doc *> docs;
+    size_t numCopied;
+    uint64_t lastSeqno;
+    couchstore_error_t errCode;
+};
+
+static const size_t CATCH_UP_BATCH_SIZE = 256;
+
+static couchstore_error_t saveCatchUpBatch(CatchUpCtx *ctx) {
+    couchstore_error_t errCode = COUCHSTORE_SUCCESS;
+    if (ctx->errCode == COUCHSTORE_SUCCESS && !ctx->infos.empty()) {
+        errCode = couchstore_save_documents(ctx->target, &ctx->docs[0],
+                                            &ctx->infos[0],
+                                            (unsigned)ctx->infos.size(),
+                                            COUCHSTORE_SEQUENCE_AS_IS);
+        if (errCode == COUCHSTORE_SUCCESS) {
+            ctx->numCopied += ctx->infos.size();
+            ctx->lastSeqno = ctx->infos.back()->db_seq;
+        }
+    }
+    for (size_t i = 0; i < ctx->infos.size(); ++i) {
+        if (ctx->docs[i]) {
+            couchstore_free_document(ctx->docs[i]);
+        }
+        couchstore_free_docinfo(ctx->infos[i]);
+    }
+    ctx->infos.clear();
+    ctx->docs.clear();
+    return errCode;
+}
+
+static int copyChange(Db *db, DocInfo *docinfo, void *ctx_p) {
+    CatchUpCtx *ctx = static_cast<CatchUpCtx *>(ctx_p);
+
+    // Copy the body as it is stored: still compressed, if it was.
+    Doc *doc = NULL;
+    couchstore_error_t errCode;
+    errCode = couchstore_open_doc_with_docinfo(db, docinfo, &doc, 0);
+    if (errCode == COUCHSTORE_ERROR_DOC_NOT_FOUND && docinfo->deleted) {
+        errCode = COUCHSTORE_SUCCESS;
+    }
+
+    // Keep the docinfo either way, it's freed with the batch.
+    ctx->infos.push_back(docinfo);
+    ctx->docs.push_back(doc);
+    if (errCode != COUCHSTORE_SUCCESS) {
+        ctx->errCode = errCode;
+        saveCatchUpBatch(ctx);
+        return COUCHSTORE_ERROR_CANCEL;
+    }
+
+    if (ctx->infos.size() >= CATCH_UP_BATCH_SIZE) {
+        ctx->errCode = saveCatchUpBatch(ctx);
+        if (ctx->errCode != COUCHSTORE_SUCCESS) {
+            return COUCHSTORE_ERROR_CANCEL;
+        }
+    }
+    return 1;
+}
+
+couchstore_error_t CouchKVStore::catchUpCompactedDb(Db *source, Db *target,
+                                                    uint64_t sinceSeqno,
+                                                    uint64_t &lastSeqno,
+                                                    size_t &numCopied) {
+    CatchUpCtx ctx(target);
+    ctx.lastSeqno = sinceSeqno;
+    couchstore_error_t errCode;
+    errCode = couchstore_changes_since(source, sinceSeqno + 1,
+                                       COUCHSTORE_NO_OPTIONS, copyChange,
+                                       static_cast<void *>(&ctx));
+    if (ctx.errCode != COUCHSTORE_SUCCESS) {
+        errCode = ctx.errCode;
+    }
+    if (errCode == COUCHSTORE_SUCCESS) {
+        errCode = saveCatchUpBatch(&ctx);
+    } else {
+        ctx.errCode = errCode;
+        saveCatchUpBatch(&ctx);
+    }
+
+    lastSeqno = ctx.lastSeqno;
+    numCopied += ctx.numCopied;
+    return errCode;
+}
+
 bool CouchKVStore::compactVBucket(const uint16_t vbid,
                                   compaction_ctx *hook_ctx,
-                                  Callback<kvstats_ctx> &kvcb) {
+                                  Callback<kvstats_ctx> &kvcb,
+                                  Mutex &vbLock) {
     couchstore_compact_hook       hook = time_purge_hook;
     couchstore_docinfo_hook      dhook = edit_docinfo_hook;
     const couch_file_ops     *def_iops = couchstore_get_default_file_ops();
     Db                      *compactdb = NULL;
     Db                       *targetDb = NULL;
-    uint64_t                   fileRev = dbFileRevMap[vbid];
-    uint64_t                   new_rev = fileRev + 1;
+    uint64_t                   fileRev = 0;
+    uint64_t                   new_rev = 0;
+    uint64_t                   rewinds = 0;
+    uint64_t             snapshotSeqno = 0;
+    size_t                   numCopied = 0;
     couchstore_error_t         errCode = COUCHSTORE_SUCCESS;
     hrtime_t                     start = gethrtime();
     std::string                 dbfile;
@@ -814,15 +1012,23 @@ bool CouchKVStore::compactVBucket(const uint16_t vbid,
     kvstats_ctx                  kvctx;
     DbInfo                        info;
 
-    // Open the source VBucket database file ...
+    // Open the source VBucket database file at its current header. Flushes
+    // carry on appending to it while the snapshot is compacted.
+    LockHolder lh(vbLock);
+    fileRev = dbFileRevMap[vbid];
+    new_rev = fileRev + 1;
+    rewinds = fileRewinds[vbid];
     errCode = openDB(vbid, fileRev, &compactdb,
                      (uint64_t)COUCHSTORE_OPEN_FLAG_RDONLY, NULL);
+    lh.unlock();
     if (errCode != COUCHSTORE_SUCCESS) {
         LOG(EXTENSION_LOG_WARNING,
                 "Warning: failed to open database, vbucketId = %d "
                 "fileRev = %llu", vbid, fileRev);
         return false;
     }
+    couchstore_db_info(compactdb, &info);
+    snapshotSeqno = info.last_sequence;
 
     // Build the temporary vbucket.compact file name
     dbfile       = getDBFileName(dbname, vbid, fileRev);
@@ -839,11 +1045,96 @@ bool CouchKVStore::compactVBucket(const uint16_t vbid,
             couchstore_strerror(errCode),
             couchkvstore_strerrno(compactdb, errCode).c_str());
         closeDatabaseHandle(compactdb);
+        removeCompactFile(compact_file);
         return false;
     }
 
     // Close the source Database File once compaction is done
     closeDatabaseHandle(compactdb);
+    compactdb = NULL;
+
+    errCode = couchstore_open_db_ex(compact_file.c_str(), 0, def_iops,
+                                    &targetDb);
+    if (errCode != COUCHSTORE_SUCCESS) {
+        LOG(EXTENSION_LOG_WARNING,
+            "Warning: failed to open compacted file '%s', error=%s",
+            compact_file.c_str(), couchstore_strerror(errCode));
+        removeCompactFile(compact_file);
+        return false;
+    }
+
+    // Copy over what was flushed to the source since the snapshot while
+    // flushes carry on, until little enough is left for the final pass
+    // under the lock.
+    uint64_t caughtUpSeqno = snapshotSeqno;
+    for (int pass = 0; pass < COMPACT_CATCH_UP_MAX_PASSES; ++pass) {
+        lh.lock();
+        bool reset = dbFileRevMap[vbid] != fileRev ||
+                     fileRewinds[vbid] != rewinds;
+        if (!reset) {
+            errCode = openDB(vbid, fileRev, &compactdb,
+                             (uint64_t)COUCHSTORE_OPEN_FLAG_RDONLY, NULL);
+        }
+        lh.unlock();
+        if (reset || errCode != COUCHSTORE_SUCCESS) {
+            break;
+        }
+
+        couchstore_db_info(compactdb, &info);
+        if (info.last_sequence - caughtUpSeqno <= COMPACT_CATCH_UP_LOCKED) {
+            closeDatabaseHandle(compactdb);
+            compactdb = NULL;
+            break;
+        }
+        errCode = catchUpCompactedDb(compactdb, targetDb, caughtUpSeqno,
+                                     caughtUpSeqno, numCopied);
+        closeDatabaseHandle(compactdb);
+        compactdb = NULL;
+        if (errCode != COUCHSTORE_SUCCESS) {
+            break;
+        }
+    }
+
+    // From here on no flush may touch the vbucket until the compacted file
+    // has replaced the source.
+    lh.lock();
+    hrtime_t switchStart = gethrtime();
+    if (dbFileRevMap[vbid] != fileRev || fileRewinds[vbid] != rewinds) {
+        LOG(EXTENSION_LOG_WARNING,
+            "Warning: vbucket %d was reset or rolled back while it was "
+            "compacted, dropping '%s'", vbid, compact_file.c_str());
+        closeDatabaseHandle(targetDb);
+        removeCompactFile(compact_file);
+        return false;
+    }
+
+    // Copy the rest along with the current vbucket state, and commit
+    if (errCode == COUCHSTORE_SUCCESS) {
+        errCode = openDB(vbid, fileRev, &compactdb,
+                         (uint64_t)COUCHSTORE_OPEN_FLAG_RDONLY, NULL);
+    }
+    if (errCode == COUCHSTORE_SUCCESS) {
+        errCode = catchUpCompactedDb(compactdb, targetDb, caughtUpSeqno,
+                                     caughtUpSeqno, numCopied);
+        closeDatabaseHandle(compactdb);
+    }
+    vbucket_state *vbstate = cachedVBStates[vbid];
+    if (errCode == COUCHSTORE_SUCCESS && vbstate) {
+        errCode = saveVBState(targetDb, *vbstate);
+    }
+    if (errCode == COUCHSTORE_SUCCESS) {
+        errCode = couchstore_commit(targetDb);
+    }
+    closeDatabaseHandle(targetDb);
+    targetDb = NULL;
+    if (errCode != COUCHSTORE_SUCCESS) {
+        LOG(EXTENSION_LOG_WARNING,
+            "Warning: failed to catch up compacted file '%s' with its "
+            "source, error=%s", compact_file.c_str(),
+            couchstore_strerror(errCode));
+        removeCompactFile(compact_file);
+        return false;
+    }
 
     // Rename the .compact file to one with the next revision number
     new_file = getDBFileName(dbname, vbid, new_rev);
@@ -876,8 +1167,9 @@ bool CouchKVStore::compactVBucket(const uint16_t vbid,
     updateDbFileMap(vbid, new_rev);
 
     LOG(EXTENSION_LOG_INFO,
-            "INFO: created new couch db file, name=%s rev=%llu",
-            new_file.c_str(), new_rev);
+            "INFO: created new couch db file, name=%s rev=%llu, "
+            "caught up %llu changes",
+            new_file.c_str(), new_rev, (unsigned long long)numCopied);
 
     // Update stats to caller
     kvctx.vbucket = vbid;
@@ -900,7 +1192,10 @@ bool CouchKVStore::compactVBucket(const uint16_t vbid,
 
     // Removing the stale couch file
     unlinkCouchFile(vbid, fileRev);
+    lh.unlock();
 
+    st.compactSwitchHisto.add((gethrtime() - switchStart) / 1000);
+    st.compactCaughtUp.fetch_add(numCopied);
     st.compactHisto.add((gethrtime() - start) / 1000);
 
     return true;
@@ -1059,6 +1354,7 @@ bool CouchKVStore::setVBucketState(uint16_t vbucketId, vbucket_state &vbstate,
         closeDatabaseHandle(db);
         return false;
     }
+    invalidateReadHandles(vbucketId);
     if (kvcb) {
         DbInfo info;
         couchstore_db_info(db, &info);
@@ -1090,6 +1386,18 @@ bool CouchKVStore::commit(Callback<kvstats_ctx> *cb, uint64_t snapStartSeqno,
     return !intransaction;
 }
 
+bool CouchKVStore::groupCommit(Callback<kvstats_ctx> *cb,
+                               const std::vector<VBucketCommit> &vbCommits) {
+    cb_assert(!isReadOnly());
+    if (intransaction) {
+        if (groupCommit2couchstore(cb, vbCommits)) {
+            intransaction = false;
+        }
+    }
+
+    return !intransaction;
+}
+
 uint64_t CouchKVStore::getLastPersistedSeqno(uint16_t vbid) {
     vbucket_state *state = cachedVBStates[vbid];
     if (state) {
@@ -1120,6 +1428,12 @@ void CouchKVStore::addStats(const std::string &prefix,
         addStat(prefix_str, "failure_del",   st.numDelFailure,   add_stat, c);
         addStat(prefix_str, "failure_vbset", st.numVbSetFailure, add_stat, c);
         addStat(prefix_str, "lastCommDocs",  st.docsCommitted,   add_stat, c);
+        addStat(prefix_str, "docinfo_lookups", st.docInfoLookups,
+                add_stat, c);
+        addStat(prefix_str, "docinfo_lookups_avoided",
+                st.docInfoLookupsAvoided, add_stat, c);
+        addStat(prefix_str, "compact_caught_up", st.compactCaughtUp,
+                add_stat, c);
     }
 
     addStat(prefix_str, "io_num_read", st.io_num_read, add_stat, c);
@@ -1127,6 +1441,15 @@ void CouchKVStore::addStats(const std::string &prefix,
     addStat(prefix_str, "io_read_bytes", st.io_read_bytes, add_stat, c);
     addStat(prefix_str, "io_write_bytes", st.io_write_bytes, add_stat, c);
 
+    if (dbHandles) {
+        addStat(prefix_str, "db_handle_cache_hits", dbHandles->hits,
+                add_stat, c);
+        addStat(prefix_str, "db_handle_cache_misses", dbHandles->misses,
+                add_stat, c);
+        addStat(prefix_str, "db_handle_cache_evictions",
+                dbHandles->evictions, add_stat, c);
+    }
+
 }
 
 void CouchKVStore::addTimingStats(const std::string &prefix,
@@ -1137,11 +1460,14 @@ void CouchKVStore::addTimingStats(const std::string &prefix,
     const char *prefix_str = prefix.c_str();
     addStat(prefix_str, "commit",      st.commitHisto,      add_stat, c);
     addStat(prefix_str, "compact",     st.compactHisto,     add_stat, c);
+    addStat(prefix_str, "compactSwitch", st.compactSwitchHisto, add_stat, c);
     addStat(prefix_str, "delete",      st.delTimeHisto,     add_stat, c);
     addStat(prefix_str, "save_documents", st.saveDocsHisto, add_stat, c);
     addStat(prefix_str, "writeTime",   st.writeTimeHisto,   add_stat, c);
     addStat(prefix_str, "writeSize",   st.writeSizeHisto,   add_stat, c);
     addStat(prefix_str, "bulkSize",    st.batchSize,        add_stat, c);
+    addStat(prefix_str, "groupSyncTime", st.groupSyncHisto, add_stat, c);
+    addStat(prefix_str, "groupFiles",  st.groupCommitFiles, add_stat, c);
 
     // Couchstore file ops stats
     addStat(prefix_str, "fsReadTime",  st.fsStats.readTimeHisto,  add_stat, c);
@@ -1339,6 +1665,53 @@ void CouchKVStore::updateDbFileMap(uint16_t vbucketId, uint64_t newFileRev) {
     }
 
     dbFileRevMap[vbucketId] = newFileRev;
+    invalidateReadHandles(vbucketId);
+}
+
+void CouchKVStore::invalidateReadHandles(uint16_t vbid) {
+    CouchKVStore *ro = isReadOnly() ? this : readOnlyPeer;
+    if (ro && ro->dbHandles) {
+        std::list<Db*> stale;
+        ro->dbHandles->invalidate(vbid, stale);
+        ro->closeHandles(stale);
+    }
+}
+
+couchstore_error_t CouchKVStore::acquireReadHandle(uint16_t vbid, Db **db,
+                                                   uint64_t &rev,
+                                                   uint64_t &gen) {
+    rev = dbFileRevMap[vbid];
+    gen = 0;
+    if (dbHandles) {
+        *db = dbHandles->take(vbid, rev, gen);
+        if (*db) {
+            return COUCHSTORE_SUCCESS;
+        }
+    }
+
+    uint64_t newRev = rev;
+    couchstore_error_t errCode = openDB(vbid, rev, db,
+                                        COUCHSTORE_OPEN_FLAG_RDONLY, &newRev);
+    rev = newRev;
+    return errCode;
+}
+
+void CouchKVStore::releaseReadHandle(uint16_t vbid, uint64_t rev,
+                                     uint64_t gen, Db *db) {
+    if (!dbHandles) {
+        closeDatabaseHandle(db);
+        return;
+    }
+    std::list<Db*> closing;
+    dbHandles->put(vbid, rev, gen, db, closing);
+    closeHandles(closing);
+}
+
+void CouchKVStore::closeHandles(std::list<Db*> &handles) {
+    std::list<Db*>::iterator it = handles.begin();
+    for (; it != handles.end(); ++it) {
+        closeDatabaseHandle(*it);
+    }
 }
 
 couchstore_error_t CouchKVStore::openDB(uint16_t vbucketId,
@@ -1346,9 +1719,12 @@ couchstore_error_t CouchKVStore::openDB(uint16_t vbucketId,
                                         Db **db,
                                         uint64_t options,
                                         uint64_t *newFileRev,
-                                        bool reset) {
+                                        bool reset,
+                                        const couch_file_ops *ops) {
     std::string dbFileName = getDBFileName(dbname, vbucketId, fileRev);
-    couch_file_ops* ops = &statCollectingFileOps;
+    if (!ops) {
+        ops = &statCollectingFileOps;
+    }
 
     uint64_t newRevNum = fileRev;
     couchstore_error_t errorCode = COUCHSTORE_SUCCESS;
@@ -1722,6 +2098,7 @@ bool CouchKVStore::commit2couchstore(Callback<kvstats_ctx> *cb,
 
     Doc **docs = new Doc *[pendingCommitCnt];
     DocInfo **docinfos = new DocInfo *[pendingCommitCnt];
+    key_existence_t *existence = new key_existence_t[pendingCommitCnt];
 
     cb_assert(pendingReqsQ[0]);
     uint16_t vbucket2flush = pendingReqsQ[0]->getVBucketId();
@@ -1731,6 +2108,7 @@ bool CouchKVStore::commit2couchstore(Callback<kvstats_ctx> *cb,
         cb_assert(req);
         docs[i] = req->getDbDoc();
         docinfos[i] = req->getDbDocInfo();
+        existence[i] = req->getExistence();
         cb_assert(vbucket2flush == req->getVBucketId());
     }
 
@@ -1738,7 +2116,8 @@ bool CouchKVStore::commit2couchstore(Callback<kvstats_ctx> *cb,
     kvctx.vbucket = vbucket2flush;
     // flush all
     couchstore_error_t errCode = saveDocs(vbucket2flush, fileRev, docs,
-                                          docinfos, pendingCommitCnt, kvctx,
+                                          docinfos, existence,
+                                          pendingCommitCnt, kvctx,
                                           snapStartSeqno, snapEndSeqno, maxCas,
                                           driftCounter);
     if (errCode) {
@@ -1758,6 +2137,106 @@ bool CouchKVStore::commit2couchstore(Callback<kvstats_ctx> *cb,
     pendingReqsQ.clear();
     delete [] docs;
     delete [] docinfos;
+    delete [] existence;
+    return success;
+}
+
+bool CouchKVStore::groupCommit2couchstore(Callback<kvstats_ctx> *cb,
+                                    const std::vector<VBucketCommit> &vbCommits) {
+    bool success = true;
+
+    size_t pendingCommitCnt = pendingReqsQ.size();
+    if (pendingCommitCnt == 0) {
+        return success;
+    }
+
+    // Split the requests by vbucket, keeping their order.
+    std::map<uint16_t, std::vector<CouchRequest *> > reqsByVb;
+    for (size_t i = 0; i < pendingCommitCnt; ++i) {
+        CouchRequest *req = pendingReqsQ[i];
+        cb_assert(req);
+        reqsByVb[req->getVBucketId()].push_back(req);
+    }
+
+    // Write all the files first, deferring their syncs and headers.
+    std::vector<const VBucketCommit*> committed;
+    std::vector<PendingSync> pending;
+    std::vector<couchstore_error_t> errCodes;
+    std::vector<kvstats_ctx> kvctxs;
+    std::vector<VBucketCommit>::const_iterator vit = vbCommits.begin();
+    for (; vit != vbCommits.end(); ++vit) {
+        std::map<uint16_t, std::vector<CouchRequest *> >::iterator rit =
+            reqsByVb.find(vit->vbucket);
+        if (rit == reqsByVb.end()) {
+            continue;
+        }
+        std::vector<CouchRequest *> &reqs = rit->second;
+        std::vector<Doc *> docs(reqs.size());
+        std::vector<DocInfo *> docinfos(reqs.size());
+        std::vector<key_existence_t> existence(reqs.size());
+        for (size_t i = 0; i < reqs.size(); ++i) {
+            docs[i] = reqs[i]->getDbDoc();
+            docinfos[i] = reqs[i]->getDbDocInfo();
+            existence[i] = reqs[i]->getExistence();
+        }
+
+        committed.push_back(&*vit);
+        kvctxs.push_back(kvstats_ctx());
+        kvctxs.back().vbucket = vit->vbucket;
+        PendingSync ps = { NULL, 0 };
+        uint64_t fileRev = reqs[0]->getRevNum();
+        couchstore_error_t errCode = saveDocs(vit->vbucket, fileRev, &docs[0],
+                                              &docinfos[0], &existence[0],
+                                              reqs.size(), kvctxs.back(),
+                                              vit->snapStartSeqno,
+                                              vit->snapEndSeqno, vit->maxCas,
+                                              vit->driftCounter, &ps);
+        if (errCode) {
+            LOG(EXTENSION_LOG_WARNING,
+                "Warning: commit failed, cannot save CouchDB docs "
+                "for vbucket = %d rev = %llu\n", vit->vbucket, fileRev);
+        }
+        pending.push_back(ps);
+        errCodes.push_back(errCode);
+    }
+    // Every request must belong to one of the committed vbuckets.
+    cb_assert(committed.size() == reqsByVb.size());
+
+    hrtime_t start = gethrtime();
+    couchstore_error_t syncErr = syncGroup.syncAll();
+    st.groupSyncHisto.add((gethrtime() - start) / 1000);
+    st.groupCommitFiles.add(committed.size());
+    if (syncErr) {
+        LOG(EXTENSION_LOG_WARNING,
+            "Warning: failed to sync the files of a group commit of %d "
+            "vbuckets, error=%s", committed.size(),
+            couchstore_strerror(syncErr));
+    }
+
+    for (size_t i = 0; i < committed.size(); ++i) {
+        uint16_t vbid = committed[i]->vbucket;
+        if (errCodes[i] == COUCHSTORE_SUCCESS) {
+            if (syncErr == COUCHSTORE_SUCCESS) {
+                errCodes[i] = finishSaveDocs(vbid, pending[i].db,
+                                             reqsByVb[vbid].size(),
+                                             pending[i].maxDBSeqno,
+                                             kvctxs[i]);
+            } else {
+                closeDatabaseHandle(pending[i].db);
+                errCodes[i] = syncErr;
+            }
+        }
+        if (cb) {
+            cb->callback(kvctxs[i]);
+        }
+        commitCallback(reqsByVb[vbid], kvctxs[i], errCodes[i]);
+    }
+
+    // clean up
+    for (size_t i = 0; i < pendingCommitCnt; ++i) {
+        delete pendingReqsQ[i];
+    }
+    pendingReqsQ.clear();
     return success;
 }
 
@@ -1780,18 +2259,20 @@ static int readDocInfos(Db *db, DocInfo *docinfo, void *ctx) {
 
 couchstore_error_t CouchKVStore::saveDocs(uint16_t vbid, uint64_t rev,
                                           Doc **docs, DocInfo **docinfos,
+                                          const key_existence_t *existence,
                                           size_t docCount, kvstats_ctx &kvctx,
                                           uint64_t snapStartSeqno,
                                           uint64_t snapEndSeqno,
-                                          uint64_t maxCas, uint64_t driftCounter) {
+                                          uint64_t maxCas, uint64_t driftCounter,
+                                          PendingSync *pending) {
     couchstore_error_t errCode;
     uint64_t fileRev = rev;
-    DbInfo info;
     cb_assert(fileRev);
 
     Db *db = NULL;
     uint64_t newFileRev;
-    errCode = openDB(vbid, fileRev, &db, 0, &newFileRev);
+    errCode = openDB(vbid, fileRev, &db, 0, &newFileRev, false,
+                     pending ? syncGroup.getOps() : NULL);
     if (errCode != COUCHSTORE_SUCCESS) {
         LOG(EXTENSION_LOG_WARNING,
                 "Warning: failed to open database, vbucketId = %d "
@@ -1809,18 +2290,27 @@ couchstore_error_t CouchKVStore::saveDocs(uint16_t vbid, uint64_t rev,
             state->maxDeletedSeqno = max;
         }
 
+        // Only look up the keys the engine couldn't tell us about.
         uint64_t maxDBSeqno = 0;
+        size_t numIds = 0;
         sized_buf *ids = new sized_buf[docCount];
         for (size_t idx = 0; idx < docCount; idx++) {
-            ids[idx] = docinfos[idx]->id;
             maxDBSeqno = std::max(maxDBSeqno, docinfos[idx]->db_seq);
-            std::string key(ids[idx].buf, ids[idx].size);
-            kvctx.keyStats[key] = std::make_pair(false,
+            std::string key(docinfos[idx]->id.buf, docinfos[idx]->id.size);
+            bool exists = existence[idx] == KEY_KNOWN_EXISTING;
+            kvctx.keyStats[key] = std::make_pair(exists,
                     !docinfos[idx]->deleted);
+            if (existence[idx] == KEY_EXISTENCE_UNKNOWN) {
+                ids[numIds++] = docinfos[idx]->id;
+            }
+        }
+        if (numIds > 0) {
+            couchstore_docinfos_by_id(db, ids, (unsigned) numIds, 0,
+                    readDocInfos, &kvctx);
         }
-        couchstore_docinfos_by_id(db, ids, (unsigned) docCount, 0,
-                readDocInfos, &kvctx);
         delete[] ids;
+        st.docInfoLookups.fetch_add(numIds);
+        st.docInfoLookupsAvoided.fetch_add(docCount - numIds);
 
         hrtime_t cs_begin = gethrtime();
         uint64_t flags = COMPRESS_DOC_BODIES | COUCHSTORE_SEQUENCE_AS_IS;
@@ -1864,31 +2354,46 @@ couchstore_error_t CouchKVStore::saveDocs(uint16_t vbid, uint64_t rev,
             return errCode;
         }
 
-        st.batchSize.add(docCount);
+        if (pending) {
+            // The file is completed once the group commit synced it.
+            pending->db = db;
+            pending->maxDBSeqno = maxDBSeqno;
+            return errCode;
+        }
+        errCode = finishSaveDocs(vbid, db, docCount, maxDBSeqno, kvctx);
+    }
 
-        // retrieve storage system stats for file fragmentation computation
-        couchstore_db_info(db, &info);
-        kvctx.fileSpaceUsed = info.space_used;
-        kvctx.fileSize = info.file_size;
-        cachedDeleteCount[vbid] = info.deleted_count;
-        cachedDocCount[vbid] = info.doc_count;
+    return errCode;
+}
 
-        if (maxDBSeqno != info.last_sequence) {
-            LOG(EXTENSION_LOG_WARNING, "Seqno in db header (%llu) is not matched with "
-                "what was persisted (%llu) for vbucket %d", info.last_sequence,
-                maxDBSeqno, vbid);
-        }
-        state->highSeqno = info.last_sequence;
+couchstore_error_t CouchKVStore::finishSaveDocs(uint16_t vbid, Db *db,
+                                                size_t docCount,
+                                                uint64_t maxDBSeqno,
+                                                kvstats_ctx &kvctx) {
+    DbInfo info;
+    st.batchSize.add(docCount);
+    invalidateReadHandles(vbid);
 
-        closeDatabaseHandle(db);
+    // retrieve storage system stats for file fragmentation computation
+    couchstore_db_info(db, &info);
+    kvctx.fileSpaceUsed = info.space_used;
+    kvctx.fileSize = info.file_size;
+    cachedDeleteCount[vbid] = info.deleted_count;
+    cachedDocCount[vbid] = info.doc_count;
+
+    if (maxDBSeqno != info.last_sequence) {
+        LOG(EXTENSION_LOG_WARNING, "Seqno in db header (%llu) is not matched with "
+            "what was persisted (%llu) for vbucket %d", info.last_sequence,
+            maxDBSeqno, vbid);
     }
+    cachedVBStates[vbid]->highSeqno = info.last_sequence;
+
+    closeDatabaseHandle(db);
 
     /* update stat */
-    if(errCode == COUCHSTORE_SUCCESS) {
-        st.docsCommitted = docCount;
-    }
+    st.docsCommitted = docCount;
 
-    return errCode;
+    return COUCHSTORE_SUCCESS;
 }
 
 void CouchKVStore::remVBucketFromDbFileMap(uint16_t vbucketId) {
@@ -2370,8 +2875,10 @@ RollbackResult CouchKVStore::rollback(uint16_t vbid, uint64_t rollbackSeqno,
 
     closeDatabaseHandle(db);
     //Append the rewinded header to the database file, before closing handle
+    ++fileRewinds[vbid];
     errCode = couchstore_commit(newdb);
     closeDatabaseHandle(newdb);
+    invalidateReadHandles(vbid);
 
     if (errCode != COUCHSTORE_SUCCESS) {
         return RollbackResult(false, 0, 0, 0);
@@ -21,6 +21,7 @@
 #include "config.h"
 #include "libcouchstore/couch_db.h"
 
+#include <list>
 #include <map>
 #include <string>
 #include <vector>
@@ -49,6 +50,7 @@ public:
       numLoadedVb(0), numGetFailure(0), numSetFailure(0),
       numDelFailure(0), numOpenFailure(0), numVbSetFailure(0),
       io_num_read(0), io_num_write(0), io_read_bytes(0), io_write_bytes(0),
+      docInfoLookups(0), docInfoLookupsAvoided(0),
       readSizeHisto(ExponentialGenerator<size_t>(1, 2), 25),
       writeSizeHisto(ExponentialGenerator<size_t>(1, 2), 25) {
     }
@@ -63,6 +65,9 @@ public:
         numDelFailure.store(0);
         numOpenFailure.store(0);
         numVbSetFailure.store(0);
+        docInfoLookups.store(0);
+        docInfoLookupsAvoided.store(0);
+        compactCaughtUp.store(0);
 
         readTimeHisto.reset();
         readSizeHisto.reset();
@@ -70,9 +75,12 @@ public:
         writeSizeHisto.reset();
         delTimeHisto.reset();
         compactHisto.reset();
+        compactSwitchHisto.reset();
         commitHisto.reset();
         saveDocsHisto.reset();
         batchSize.reset();
+        groupSyncHisto.reset();
+        groupCommitFiles.reset();
         fsStats.reset();
     }
 
@@ -100,6 +108,12 @@ public:
     AtomicValue<size_t> io_read_bytes;
     //! Number of bytes written
     AtomicValue<size_t> io_write_bytes;
+    //! Number of keys looked up before a write to count inserts
+    AtomicValue<size_t> docInfoLookups;
+    //! Number of keys written without a lookup as the engine knew the answer
+    AtomicValue<size_t> docInfoLookupsAvoided;
+    //! Number of changes copied into compacted files after their snapshot
+    AtomicValue<size_t> compactCaughtUp;
 
     /* for flush and vb delete, no error handling in CouchKVStore, such
      * failure should be tracked in MC-engine  */
@@ -118,10 +132,16 @@ public:
     Histogram<hrtime_t> commitHisto;
     // Time spent in couchstore compaction
     Histogram<hrtime_t> compactHisto;
+    // Time flushes are held off while a compacted file replaces its source
+    Histogram<hrtime_t> compactSwitchHisto;
     // Time spent in couchstore save documents
     Histogram<hrtime_t> saveDocsHisto;
     // Batch size of saveDocs calls
     Histogram<size_t> batchSize;
+    // Time spent syncing the files of a group commit
+    Histogram<hrtime_t> groupSyncHisto;
+    // Number of vbucket files written by a group commit
+    Histogram<size_t> groupCommitFiles;
 
     // Stats from the underlying OS file operations done by couchstore.
     CouchstoreStats fsStats;
@@ -154,8 +174,10 @@ public:
      * @param rev vbucket database revision number
      * @param cb persistence callback
      * @param del flag indicating if it is an item deletion or not
+     * @param existence whether the key is known to exist in the file
      */
-    CouchRequest(const Item &it, uint64_t rev, CouchRequestCallback &cb, bool del);
+    CouchRequest(const Item &it, uint64_t rev, CouchRequestCallback &cb,
+                 bool del, key_existence_t existence = KEY_EXISTENCE_UNKNOWN);
 
     /**
      * Get the vbucket id of a document to be persisted
@@ -243,6 +265,13 @@ public:
         return deleteItem;
     };
 
+    /**
+     * What the writer knew about the key already existing in the file
+     */
+    key_existence_t getExistence() const {
+        return existence;
+    }
+
     /**
      * Get the key of a document to be persisted
      *
@@ -261,11 +290,76 @@ private :
     Doc dbDoc;
     DocInfo dbDocInfo;
     bool deleteItem;
+    key_existence_t existence;
     CouchRequestCallback callback;
 
     hrtime_t start;
 };
 
+/**
+ * Bounded LRU cache of idle read-only database handles, keyed by vbucket
+ * and file revision.
+ *
+ * A handle is checked out exclusively while a reader uses it. A couchstore
+ * handle only sees the header it was opened with, so each vbucket has a
+ * generation that is bumped whenever its file is committed to, compacted
+ * or deleted; handles taken under an older generation are not cached again.
+ */
+class DbHandleCache {
+public:
+    DbHandleCache(uint16_t numVBuckets, size_t maxHandles);
+
+    /**
+     * Check out an idle handle for the given vbucket file revision.
+     *
+     * @param vbid the vbucket
+     * @param rev the file revision the caller would open
+     * @param gen receives the vbucket's generation, to pass back to put()
+     * @return the handle, or NULL on a miss
+     */
+    Db *take(uint16_t vbid, uint64_t rev, uint64_t &gen);
+
+    /**
+     * Hand a handle back after use.
+     *
+     * @param closing receives the handles the caller must now close; the
+     *        given one if it is stale, or the least recently used one if
+     *        the cache is full
+     */
+    void put(uint16_t vbid, uint64_t rev, uint64_t gen, Db *db,
+             std::list<Db*> &closing);
+
+    /**
+     * Drop all idle handles for the vbucket and make any checked out
+     * ones stale.
+     */
+    void invalidate(uint16_t vbid, std::list<Db*> &closing);
+
+    /**
+     * Drop all idle handles.
+     */
+    void clear(std::list<Db*> &closing);
+
+    AtomicValue<size_t> hits;
+    AtomicValue<size_t> misses;
+    AtomicValue<size_t> evictions;
+
+private:
+    struct CachedHandle {
+        uint16_t vbid;
+        uint64_t rev;
+        Db *db;
+    };
+
+    Mutex lock;
+    const size_t maxHandles;
+    // most recently used first
+    std::list<CachedHandle> idle;
+    std::vector<uint64_t> generations;
+
+    DISALLOW_COPY_AND_ASSIGN(DbHandleCache);
+};
+
 /**
  * KVStore with couchstore as the underlying storage system
  */
@@ -320,6 +414,18 @@ public:
                 uint64_t snapEndSeqno, uint64_t maxCas,
                 uint64_t driftCounter);
 
+    /**
+     * Commit a transaction holding mutations of several vbuckets. The data
+     * of all the vbucket files is written and synced first, then all their
+     * headers are written and synced, so that a trickle of writes to many
+     * vbuckets costs two rounds of back to back syncs rather than a pair of
+     * syncs between the opens and closes of every file.
+     *
+     * @return true if the commit is completed successfully.
+     */
+    bool groupCommit(Callback<kvstats_ctx> *cb,
+                     const std::vector<VBucketCommit> &vbCommits);
+
     /**
      * Rollback a transaction (unless not currently in one).
      */
@@ -342,8 +448,10 @@ public:
      *
      * @param itm instance representing the document to be inserted or updated
      * @param cb callback instance for SET
+     * @param existence whether the key is known to exist in the file
      */
-    void set(const Item &itm, Callback<mutation_result> &cb);
+    void set(const Item &itm, Callback<mutation_result> &cb,
+             key_existence_t existence = KEY_EXISTENCE_UNKNOWN);
 
     /**
      * Retrieve the document with a given key from the underlying storage system.
@@ -374,8 +482,10 @@ public:
      *
      * @param itm instance representing the document to be deleted
      * @param cb callback instance for DELETE
+     * @param existence whether the key is known to exist in the file
      */
-    void del(const Item &itm, Callback<int> &cb);
+    void del(const Item &itm, Callback<int> &cb,
+             key_existence_t existence = KEY_EXISTENCE_UNKNOWN);
 
     /**
      * Delete a given vbucket database instance from the underlying storage system
@@ -385,6 +495,8 @@ public:
      */
     void delVBucket(uint16_t vbucket);
 
+    void setReadOnlyPeer(KVStore *ro);
+
     /**
      * Retrieve the list of persisted vbucket states
      *
@@ -426,10 +538,11 @@ public:
      * @param hook_ctx - details of vbucket which needs to be compacted
      * @param cb - callback to help process newly expired items
      * @param kvcb - callback to update kvstore stats
+     * @param vbLock - lock held by flushes of the vbucket
      * @return true if successful
      */
     bool compactVBucket(const uint16_t vbid, compaction_ctx *cookie,
-                        Callback<kvstats_ctx> &kvcb);
+                        Callback<kvstats_ctx> &kvcb, Mutex &vbLock);
 
     /**
      * Does the underlying storage system support key-only retrieval operations?
@@ -562,6 +675,8 @@ private:
     bool commit2couchstore(Callback<kvstats_ctx> *cb, uint64_t snapStartSeqno,
                            uint64_t snapEndSeqno, uint64_t maxCas,
                            uint64_t driftCounter);
+    bool groupCommit2couchstore(Callback<kvstats_ctx> *cb,
+                                const std::vector<VBucketCommit> &vbCommits);
 
     uint64_t checkNewRevNum(std::string &dbname, bool newFile = false);
     void populateFileNameMap(std::vector<std::string> &filenames,
@@ -570,17 +685,38 @@ private:
     void updateDbFileMap(uint16_t vbucketId, uint64_t newFileRev);
     couchstore_error_t openDB(uint16_t vbucketId, uint64_t fileRev, Db **db,
                               uint64_t options, uint64_t *newFileRev = NULL,
-                              bool reset=false);
+                              bool reset=false,
+                              const couch_file_ops *ops = NULL);
     couchstore_error_t openDB_retry(std::string &dbfile, uint64_t options,
                                     const couch_file_ops *ops,
                                     Db **db, uint64_t *newFileRev);
+    /**
+     * A vbucket file written by a group commit, still open until the
+     * group's files are synced.
+     */
+    struct PendingSync {
+        Db *db;
+        uint64_t maxDBSeqno;
+    };
+
+    /**
+     * Save the docs of a vbucket and commit its file.
+     * @param pending if given, the file is written as part of a group
+     * commit: its syncs are deferred and it is left open, to be completed
+     * with finishSaveDocs() after the group sync.
+     */
     couchstore_error_t saveDocs(uint16_t vbid, uint64_t rev, Doc **docs,
-                                DocInfo **docinfos, size_t docCount,
-                                kvstats_ctx &kvctx,
+                                DocInfo **docinfos,
+                                const key_existence_t *existence,
+                                size_t docCount, kvstats_ctx &kvctx,
                                 uint64_t snapStartSeqno,
                                 uint64_t snapEndSeqno,
                                 uint64_t maxCas,
-                                uint64_t driftCounter);
+                                uint64_t driftCounter,
+                                PendingSync *pending = NULL);
+    couchstore_error_t finishSaveDocs(uint16_t vbid, Db *db, size_t docCount,
+                                      uint64_t maxDBSeqno,
+                                      kvstats_ctx &kvctx);
     void commitCallback(std::vector<CouchRequest *> &committedReqs,
                         kvstats_ctx &kvctx,
                         couchstore_error_t errCode);
@@ -588,6 +724,21 @@ private:
     void setDocsCommitted(uint16_t docs);
     void closeDatabaseHandle(Db *db);
 
+    /**
+     * Open a read-only handle for the vbucket, reusing a cached one when
+     * possible. Give it back with releaseReadHandle().
+     */
+    couchstore_error_t acquireReadHandle(uint16_t vbid, Db **db,
+                                         uint64_t &rev, uint64_t &gen);
+    void releaseReadHandle(uint16_t vbid, uint64_t rev, uint64_t gen, Db *db);
+
+    /**
+     * Drop the cached read handles for a vbucket whose file changed,
+     * whether they live in this store or its read-only peer.
+     */
+    void invalidateReadHandles(uint16_t vbid);
+    void closeHandles(std::list<Db*> &handles);
+
     /**
      * Unlink selected couch file, which will be removed by the OS,
      * once all its references close.
@@ -606,9 +757,27 @@ private:
 
     void removeCompactFile(const std::string &filename);
 
+    /**
+     * Copy the changes made to a vbucket file after the given seqno into
+     * its compacted copy, a batch at a time. The copy is not committed.
+     *
+     * @param source the vbucket file, open at a recent header
+     * @param target the compacted file, open for writing
+     * @param sinceSeqno last seqno the compacted file already has
+     * @param lastSeqno set to the last seqno the compacted file now has
+     * @param numCopied incremented by the number of changes copied
+     */
+    couchstore_error_t catchUpCompactedDb(Db *source, Db *target,
+                                          uint64_t sinceSeqno,
+                                          uint64_t &lastSeqno,
+                                          size_t &numCopied);
+
     KVStoreConfig &configuration;
     const std::string dbname;
     std::vector<uint64_t>dbFileRevMap;
+    /* bumped whenever a file is rewound or reset in place; only changed
+     * under the vbucket lock */
+    std::vector<uint64_t> fileRewinds;
     uint16_t numDbFiles;
     std::vector<CouchRequest *> pendingReqsQ;
     bool intransaction;
@@ -616,6 +785,7 @@ private:
     /* all stats */
     CouchKVStoreStats   st;
     couch_file_ops statCollectingFileOps;
+    CouchstoreSyncGroup syncGroup;
     /* vbucket state cache*/
     std::vector<vbucket_state *> cachedVBStates;
     /* deleted docs in each file*/
@@ -628,6 +798,11 @@ private:
     AtomicValue<size_t> backfillCounter;
     std::map<size_t, Db*> backfills;
     Mutex backfillLock;
+
+    /* idle read handles (read-only store only) */
+    DbHandleCache *dbHandles;
+    /* read-only store reading the same files (read-write store only) */
+    CouchKVStore *readOnlyPeer;
 };
 
 #endif  // SRC_COUCH_KVSTORE_COUCH_KVSTORE_H_
@@ -16,6 +16,9 @@
  */
 
 #include "config.h"
+
+#include <algorithm>
+
 #include "ep_engine.h"
 #include "connmap.h"
 #include "dcp/backfill-manager.h"
@@ -40,7 +43,7 @@ private:
 };
 
 bool BackfillManagerTask::run() {
-    backfill_status_t status = manager->backfill();
+    backfill_status_t status = manager->backfill(this);
     if (status == backfill_finished) {
         return false;
     } else if (status == backfill_snooze) {
@@ -61,19 +64,25 @@ std::string BackfillManagerTask::getDescription() {
 }
 
 BackfillManager::BackfillManager(EventuallyPersistentEngine* e, connection_t c)
-    : engine(e), conn(c), managerTask(NULL) {
+    : engine(e), conn(c), backfilling(false) {
 
     Configuration& config = e->getConfiguration();
 
-    scanBuffer.bytesRead = 0;
-    scanBuffer.itemsRead = 0;
-    scanBuffer.maxBytes = config.getDcpScanByteLimit();
-    scanBuffer.maxItems = config.getDcpScanItemLimit();
+    maxScanBytes = config.getDcpScanByteLimit();
+    maxScanItems = config.getDcpScanItemLimit();
 
     buffer.bytesRead = 0;
     buffer.maxBytes = config.getDcpBackfillByteLimit();
     buffer.nextReadSize = 0;
     buffer.full = false;
+
+    scanStats.scans = 0;
+    scanStats.itemsRead = 0;
+    scanStats.bytesRead = 0;
+    scanStats.scanTime = 0;
+    scanStats.maxScanTime = 0;
+    scanStats.firstStart = 0;
+    scanStats.lastEnd = 0;
 }
 
 void BackfillManager::addStats(connection_t conn, ADD_STAT add_stat,
@@ -85,12 +94,42 @@ void BackfillManager::addStats(connection_t conn, ADD_STAT add_stat,
     conn->addStat("backfill_num_active", activeBackfills.size(), add_stat, c);
     conn->addStat("backfill_num_snoozing", snoozingBackfills.size(), add_stat, c);
     conn->addStat("backfill_num_pending", pendingBackfills.size(), add_stat, c);
+    conn->addStat("backfill_num_scanning", scans.size(), add_stat, c);
+    conn->addStat("backfill_num_tasks", tasks.size(), add_stat, c);
+    conn->addStat("backfill_scans", scanStats.scans, add_stat, c);
+    conn->addStat("backfill_items_read", scanStats.itemsRead, add_stat, c);
+    conn->addStat("backfill_bytes_read", scanStats.bytesRead, add_stat, c);
+
+    uint64_t avgScanTime = 0;
+    if (scanStats.scans > 0) {
+        avgScanTime = scanStats.scanTime / scanStats.scans / 1000;
+    }
+    conn->addStat("backfill_scan_time_avg_us", avgScanTime, add_stat, c);
+    conn->addStat("backfill_scan_time_max_us", scanStats.maxScanTime / 1000,
+                  add_stat, c);
+
+    // Throughput over the wall clock time the scans took, so that scans
+    // running in parallel count once.
+    uint64_t itemsPerSec = 0;
+    uint64_t bytesPerSec = 0;
+    if (scanStats.lastEnd > scanStats.firstStart) {
+        double secs = (scanStats.lastEnd - scanStats.firstStart) / 1e9;
+        itemsPerSec = static_cast<uint64_t>(scanStats.itemsRead / secs);
+        bytesPerSec = static_cast<uint64_t>(scanStats.bytesRead / secs);
+    }
+    conn->addStat("backfill_items_per_sec", itemsPerSec, add_stat, c);
+    conn->addStat("backfill_bytes_per_sec", bytesPerSec, add_stat, c);
 }
 
 BackfillManager::~BackfillManager() {
     LockHolder lh(lock);
-    if (managerTask) {
-        managerTask->cancel();
+    std::list<ExTask>::iterator it = tasks.begin();
+    for (; it != tasks.end(); ++it) {
+        (*it)->cancel();
+    }
+    tasks.clear();
+    if (backfilling) {
+        engine->getDcpConnMap().decrNumBackfillingConns();
     }
 
     while (!activeBackfills.empty()) {
@@ -125,25 +164,26 @@ void BackfillManager::schedule(stream_t stream, uint64_t start, uint64_t end) {
         pendingBackfills.push_back(new DCPBackfill(engine, stream, start, end));
     }
 
-    if (managerTask && !managerTask->isdead()) {
-        managerTask->snooze(0);
-        return;
-    }
-
-    managerTask.reset(new BackfillManagerTask(engine, this,
-                                              Priority::BackfillTaskPriority));
-    ExecutorPool::get()->schedule(managerTask, NONIO_TASK_IDX);
+    wakeUpTasks_UNLOCKED();
+    scheduleTasks_UNLOCKED();
 }
 
-bool BackfillManager::bytesRead(uint32_t bytes) {
+bool BackfillManager::bytesRead(const Stream* stream, uint32_t bytes) {
     LockHolder lh(lock);
-    if (scanBuffer.itemsRead >= scanBuffer.maxItems) {
+    std::map<const Stream*, ScanBuffer>::iterator it = scans.find(stream);
+    if (it == scans.end()) {
+        // Only streams that are being scanned read from disk
+        return false;
+    }
+    ScanBuffer &scanBuffer = it->second;
+
+    if (scanBuffer.itemsRead >= maxScanItems) {
         return false;
     }
 
     // Always allow an item to be backfilled if the scan buffer is empty,
     // otherwise check to see if there is room for the item.
-    if (scanBuffer.bytesRead + bytes <= scanBuffer.maxBytes ||
+    if (scanBuffer.bytesRead + bytes <= maxScanBytes ||
         scanBuffer.bytesRead == 0) {
         scanBuffer.bytesRead += bytes;
     }
@@ -174,19 +214,17 @@ void BackfillManager::bytesSent(uint32_t bytes) {
         if (canFitNext && enoughCleared) {
             buffer.nextReadSize = 0;
             buffer.full = false;
-            if (managerTask) {
-                managerTask->snooze(0);
-            }
+            wakeUpTasks_UNLOCKED();
         }
     }
 }
 
-backfill_status_t BackfillManager::backfill() {
+backfill_status_t BackfillManager::backfill(GlobalTask* task) {
     LockHolder lh(lock);
 
     if (activeBackfills.empty() && snoozingBackfills.empty()
-        && pendingBackfills.empty()) {
-        managerTask.reset();
+        && pendingBackfills.empty() && scans.empty()) {
+        removeTask_UNLOCKED(task);
         return backfill_finished;
     }
 
@@ -199,6 +237,11 @@ backfill_status_t BackfillManager::backfill() {
     moveToActiveQueue();
 
     if (activeBackfills.empty()) {
+        // One task is enough to wait for the snoozing backfills
+        if (tasks.size() > 1) {
+            removeTask_UNLOCKED(task);
+            return backfill_finished;
+        }
         return backfill_snooze;
     }
 
@@ -229,15 +272,52 @@ backfill_status_t BackfillManager::backfill() {
         return reschedule ? backfill_success : backfill_snooze;
     }
 
+    // Without a free scan slot, sleep until one is released. The task
+    // snoozes before it asks for a slot, so that a release in between wakes
+    // it up instead of being overwritten by the snooze.
+    ExTask self;
+    std::list<ExTask>::iterator t_itr = tasks.begin();
+    for (; t_itr != tasks.end(); ++t_itr) {
+        if (t_itr->get() == task) {
+            self = *t_itr;
+        }
+    }
+    task->snooze(sleepTime);
+    if (!engine->getDcpConnMap().acquireBackfillScan(scans.size(), self)) {
+        return backfill_success;
+    }
+    task->snooze(0);
+
     DCPBackfill* backfill = activeBackfills.front();
     activeBackfills.pop_front();
+    const Stream* stream = backfill->getStream();
+    scans[stream] = ScanBuffer();
+
+    // Let other reader threads pick up the remaining backfills
+    if (!activeBackfills.empty()) {
+        scheduleTasks_UNLOCKED();
+    }
 
     lh.unlock();
+    hrtime_t start = gethrtime();
     backfill_status_t status = backfill->run();
+    hrtime_t end = gethrtime();
     lh.lock();
 
-    scanBuffer.bytesRead = 0;
-    scanBuffer.itemsRead = 0;
+    engine->getDcpConnMap().releaseBackfillScan();
+
+    ScanBuffer &scanBuffer = scans[stream];
+    hrtime_t elapsed = end - start;
+    scanStats.scans++;
+    scanStats.itemsRead += scanBuffer.itemsRead;
+    scanStats.bytesRead += scanBuffer.bytesRead;
+    scanStats.scanTime += elapsed;
+    scanStats.maxScanTime = std::max(scanStats.maxScanTime, elapsed);
+    if (scanStats.firstStart == 0) {
+        scanStats.firstStart = start;
+    }
+    scanStats.lastEnd = std::max(scanStats.lastEnd, end);
+    scans.erase(stream);
 
     if (status == backfill_success) {
         activeBackfills.push_back(backfill);
@@ -288,11 +368,61 @@ void BackfillManager::moveToActiveQueue() {
     }
 }
 
+void BackfillManager::scheduleTasks_UNLOCKED() {
+    std::list<ExTask>::iterator it = tasks.begin();
+    while (it != tasks.end()) {
+        if ((*it)->isdead()) {
+            it = tasks.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
+    size_t wanted = std::min(activeBackfills.size() + scans.size(),
+                             engine->getDcpConnMap().getBackfillScanShare());
+    if (tasks.empty()) {
+        // Someone has to look after the pending and snoozing backfills
+        wanted = std::max(wanted, static_cast<size_t>(1));
+    }
+
+    while (tasks.size() < wanted) {
+        ExTask task = new BackfillManagerTask(engine, this,
+                                              Priority::BackfillTaskPriority);
+        tasks.push_back(task);
+        ExecutorPool::get()->schedule(task, READER_TASK_IDX);
+    }
+
+    if (!backfilling) {
+        backfilling = true;
+        engine->getDcpConnMap().incrNumBackfillingConns();
+    }
+}
+
+void BackfillManager::wakeUpTasks_UNLOCKED() {
+    std::list<ExTask>::iterator it = tasks.begin();
+    for (; it != tasks.end(); ++it) {
+        (*it)->snooze(0);
+    }
+}
+
+void BackfillManager::removeTask_UNLOCKED(GlobalTask* task) {
+    std::list<ExTask>::iterator it = tasks.begin();
+    for (; it != tasks.end(); ++it) {
+        if (it->get() == task) {
+            tasks.erase(it);
+            break;
+        }
+    }
+
+    if (tasks.empty() && backfilling) {
+        backfilling = false;
+        engine->getDcpConnMap().decrNumBackfillingConns();
+    }
+}
+
 void BackfillManager::wakeUpTask() {
     LockHolder lh(lock);
-    if (managerTask) {
-        managerTask->snooze(0);
-    }
+    wakeUpTasks_UNLOCKED();
 }
 
 void BackfillManager::wakeUpSnoozingBackfills(uint16_t vbid) {
@@ -303,7 +433,7 @@ void BackfillManager::wakeUpSnoozingBackfills(uint16_t vbid) {
         if (vbid == bfill->getVBucketId()) {
             activeBackfills.push_back(bfill);
             snoozingBackfills.erase(it);
-            managerTask->snooze(0);
+            wakeUpTasks_UNLOCKED();
             return;
         }
     }
@@ -19,6 +19,10 @@
 #define SRC_DCP_BACKFILL_MANAGER_H_ 1
 
 #include "config.h"
+
+#include <list>
+#include <map>
+
 #include "connmap.h"
 #include "dcp/backfill.h"
 #include "dcp/producer.h"
@@ -27,6 +31,14 @@
 
 class EventuallyPersistentEngine;
 
+/**
+ * Runs the backfills of one DCP producer.
+ *
+ * Each scan runs as a task on the shared READER pool, so the backfills of
+ * a connection that streams many vbuckets proceed in parallel. The number
+ * of scans running at once is bounded across all connections by the
+ * DcpConnMap, and each connection only gets its fair share of that budget.
+ */
 class BackfillManager {
 public:
     BackfillManager(EventuallyPersistentEngine* e, connection_t c);
@@ -37,11 +49,11 @@ public:
 
     void schedule(stream_t stream, uint64_t start, uint64_t end);
 
-    bool bytesRead(uint32_t bytes);
+    bool bytesRead(const Stream* stream, uint32_t bytes);
 
     void bytesSent(uint32_t bytes);
 
-    backfill_status_t backfill();
+    backfill_status_t backfill(GlobalTask* task);
 
     void wakeUpTask();
 
@@ -54,6 +66,13 @@ private:
 
     void moveToActiveQueue();
 
+    //! Start tasks up to the connection's share of concurrent scans
+    void scheduleTasks_UNLOCKED();
+
+    void wakeUpTasks_UNLOCKED();
+
+    void removeTask_UNLOCKED(GlobalTask* task);
+
     Mutex lock;
     std::list<DCPBackfill*> activeBackfills;
     std::list<std::pair<rel_time_t, DCPBackfill*> > snoozingBackfills;
@@ -62,15 +81,20 @@ private:
     std::list<DCPBackfill*> pendingBackfills;
     EventuallyPersistentEngine* engine;
     connection_t conn;
-    ExTask managerTask;
+    std::list<ExTask> tasks;
+    //! Whether this connection counts towards the backfilling connections
+    bool backfilling;
 
-    //! The scan buffer is for the current stream being backfilled
-    struct {
+    uint32_t maxScanBytes;
+    uint32_t maxScanItems;
+
+    //! The scan buffer is for a stream that is being backfilled
+    struct ScanBuffer {
+        ScanBuffer() : bytesRead(0), itemsRead(0) {}
         uint32_t bytesRead;
         uint32_t itemsRead;
-        uint32_t maxBytes;
-        uint32_t maxItems;
-    } scanBuffer;
+    };
+    std::map<const Stream*, ScanBuffer> scans;
 
     //! The buffer is the total bytes used by all backfills for this connection
     struct {
@@ -79,6 +103,17 @@ private:
         uint32_t nextReadSize;
         bool full;
     } buffer;
+
+    //! Totals of the finished scans, for throughput and latency stats
+    struct {
+        uint64_t scans;
+        uint64_t itemsRead;
+        uint64_t bytesRead;
+        hrtime_t scanTime;
+        hrtime_t maxScanTime;
+        hrtime_t firstStart;
+        hrtime_t lastEnd;
+    } scanStats;
 };
 
 #endif  // SRC_DCP_BACKFILL_MANAGER_H_
@@ -52,7 +52,7 @@ void CacheCallback::callback(CacheLookup &lookup) {
     LockHolder lh = vb->ht.getLockedBucket(lookup.getKey(), &bucket_num);
     StoredValue *v = vb->ht.unlocked_find(lookup.getKey(), bucket_num, false, false);
     if (v && v->isResident() && v->getBySeqno() == lookup.getBySeqno()) {
-        Item* it = v->toItem(false, lookup.getVBucketId());
+        Item* it = v->toItem(false, lookup.getVBucketId(), vb->ht);
         lh.unlock();
         ActiveStream* as = static_cast<ActiveStream*>(stream_.get());
         if (!as->backfillReceived(it, BACKFILL_FROM_MEMORY)) {
@@ -69,6 +69,10 @@ public:
 
     uint16_t getVBucketId();
 
+    const Stream* getStream() {
+        return stream.get();
+    }
+
     uint64_t getEndSeqno();
 
     bool isDead() {
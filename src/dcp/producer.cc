@@ -17,6 +17,8 @@
 
 #include "config.h"
 
+#include <algorithm>
+
 #include "backfill.h"
 #include "ep_engine.h"
 #include "failover-table.h"
@@ -27,9 +29,8 @@
 
 const uint32_t DcpProducer::defaultNoopInerval = 20;
 
-void BufferLog::insert(DcpResponse* response) {
-    cb_assert(!isFull());
-    bytes_sent += response->getMessageSize();
+void BufferLog::insert(uint32_t bytes) {
+    bytes_sent += bytes;
 }
 
 void BufferLog::free(uint32_t bytes_to_free) {
@@ -42,8 +43,10 @@ void BufferLog::free(uint32_t bytes_to_free) {
 
 DcpProducer::DcpProducer(EventuallyPersistentEngine &e, const void *cookie,
                          const std::string &name, bool isNotifier)
-    : Producer(e, cookie, name), rejectResp(NULL),
+    : Producer(e, cookie, name),
       notifyOnly(isNotifier), lastSendTime(ep_current_time()), log(NULL),
+      ready(e.getConfiguration().getMaxVbuckets()),
+      streams(e.getConfiguration().getMaxVbuckets()),
       itemsSent(0), totalBytesSent(0), ackedBytes(0) {
     setSupportAck(true);
     setReserved(true);
@@ -77,6 +80,10 @@ DcpProducer::DcpProducer(EventuallyPersistentEngine &e, const void *cookie,
 
     enableExtMetaData = false;
 
+    Configuration &config = e.getConfiguration();
+    batchMaxItems = std::max(config.getDcpStepBatchItems(), (size_t)1);
+    batchMaxBytes = config.getDcpStepBatchBytes();
+
     backfillMgr = new BackfillManager(&engine_, this);
 }
 
@@ -85,7 +92,10 @@ DcpProducer::~DcpProducer() {
         delete log;
     }
 
-    delete rejectResp;
+    while (!rejectResps.empty()) {
+        delete rejectResps.front();
+        rejectResps.pop_front();
+    }
     delete backfillMgr;
 }
 
@@ -142,16 +152,15 @@ ENGINE_ERROR_CODE DcpProducer::streamRequest(uint32_t flags,
     }
 
     bool add_vb_conn_map = true;
-    std::map<uint16_t, stream_t>::iterator itr;
-    if ((itr = streams.find(vbucket)) != streams.end()) {
-        if (itr->second->getState() != STREAM_DEAD) {
+    if (streams[vbucket]) {
+        if (streams[vbucket]->getState() != STREAM_DEAD) {
             LOG(EXTENSION_LOG_WARNING, "%s (vb %d) Stream request failed"
                 " because a stream already exists for this vbucket",
                 logHeader(), vbucket);
             return ENGINE_KEY_EEXISTS;
         } else {
-            streams.erase(vbucket);
-            ready.remove(vbucket);
+            // A ready entry left for the dead stream serves the new one.
+            streams[vbucket].reset();
             // Don't need to add an entry to vbucket-to-conns map
             add_vb_conn_map = false;
         }
@@ -198,7 +207,7 @@ ENGINE_ERROR_CODE DcpProducer::streamRequest(uint32_t flags,
         static_cast<ActiveStream*>(streams[vbucket].get())->setActive();
     }
 
-    ready.push_back(vbucket);
+    ready.push(vbucket);
     lh.unlock();
     if (add_vb_conn_map) {
         connection_t conn(this);
@@ -237,26 +246,69 @@ ENGINE_ERROR_CODE DcpProducer::step(struct dcp_message_producers* producers) {
         return ret;
     }
 
-    DcpResponse *resp;
-    if (rejectResp) {
-        resp = rejectResp;
-        rejectResp = NULL;
+    std::list<DcpResponse*> batch;
+    if (!rejectResps.empty()) {
+        batch.swap(rejectResps);
     } else {
-        resp = getNextItem();
-        if (!resp) {
+        getNextItems(batch);
+        if (batch.empty()) {
             return ENGINE_SUCCESS;
         }
     }
 
-    ret = ENGINE_SUCCESS;
-
-    Item* itmCpy = NULL;
-    if (resp->getEvent() == DCP_MUTATION) {
-        itmCpy = static_cast<MutationResponse*>(resp)->getItemCopy();
+    // The send path keeps its own reference to each item until the bytes
+    // are written, so the item and its value are never copied.
+    std::vector<Item*> items;
+    std::list<DcpResponse*>::iterator it = batch.begin();
+    for (; it != batch.end(); ++it) {
+        if ((*it)->getEvent() == DCP_MUTATION) {
+            items.push_back(static_cast<MutationResponse*>(*it)->getSharedItem());
+        } else {
+            items.push_back(NULL);
+        }
     }
 
+    ret = ENGINE_SUCCESS;
+    size_t sent = 0;
     EventuallyPersistentEngine *epe = ObjectRegistry::onSwitchThread(NULL,
                                                                      true);
+    for (it = batch.begin(); it != batch.end(); ++it) {
+        ret = sendResponse(producers, *it, items[sent]);
+        if (ret != ENGINE_SUCCESS) {
+            break;
+        }
+        ++sent;
+    }
+    ObjectRegistry::onSwitchThread(epe);
+
+    // Items of messages that weren't sent are still ours.
+    for (size_t i = sent; i < items.size(); ++i) {
+        if (items[i]) {
+            queued_item::release(items[i]);
+        }
+    }
+
+    for (size_t i = 0; i < sent; ++i) {
+        delete batch.front();
+        batch.pop_front();
+    }
+    if (ret != ENGINE_SUCCESS) {
+        if (ret != ENGINE_E2BIG) {
+            delete batch.front();
+            batch.pop_front();
+        }
+        // Stash the rest for retry
+        rejectResps.swap(batch);
+    }
+
+    lastSendTime = ep_current_time();
+    return (ret == ENGINE_SUCCESS) ? ENGINE_WANT_MORE : ret;
+}
+
+ENGINE_ERROR_CODE DcpProducer::sendResponse(
+                                    struct dcp_message_producers* producers,
+                                    DcpResponse *resp, Item *itm) {
+    ENGINE_ERROR_CODE ret = ENGINE_SUCCESS;
     switch (resp->getEvent()) {
         case DCP_STREAM_END:
         {
@@ -267,16 +319,16 @@ ENGINE_ERROR_CODE DcpProducer::step(struct dcp_message_producers* producers) {
         }
         case DCP_MUTATION:
         {
-            MutationResponse *m = dynamic_cast<MutationResponse*> (resp);
+            MutationResponse *m = static_cast<MutationResponse*>(resp);
             if (m->getExtMetaData()) {
                 std::pair<const char*, uint16_t> meta = m->getExtMetaData()->getExtMeta();
-                ret = producers->mutation(getCookie(), m->getOpaque(), itmCpy,
+                ret = producers->mutation(getCookie(), m->getOpaque(), itm,
                                           m->getVBucket(), m->getBySeqno(),
                                           m->getRevSeqno(), 0,
                                           meta.first, meta.second,
                                           m->getItem()->getNRUValue());
             } else {
-                ret = producers->mutation(getCookie(), m->getOpaque(), itmCpy,
+                ret = producers->mutation(getCookie(), m->getOpaque(), itm,
                                           m->getVBucket(), m->getBySeqno(),
                                           m->getRevSeqno(), 0,
                                           NULL, 0,
@@ -332,20 +384,7 @@ ENGINE_ERROR_CODE DcpProducer::step(struct dcp_message_producers* producers) {
             break;
         }
     }
-
-    ObjectRegistry::onSwitchThread(epe);
-    if (resp->getEvent() == DCP_MUTATION && ret != ENGINE_SUCCESS) {
-        delete itmCpy;
-    }
-
-    if (ret == ENGINE_E2BIG) {
-        rejectResp = resp;
-    } else {
-        delete resp;
-    }
-
-    lastSendTime = ep_current_time();
-    return (ret == ENGINE_SUCCESS) ? ENGINE_WANT_MORE : ret;
+    return ret;
 }
 
 ENGINE_ERROR_CODE DcpProducer::bufferAcknowledgement(uint32_t opaque,
@@ -444,13 +483,13 @@ ENGINE_ERROR_CODE DcpProducer::handleResponse(
 
         LockHolder lh(queueLock);
         stream_t active_stream;
-        std::map<uint16_t, stream_t>::iterator itr;
+        std::vector<stream_t>::iterator itr;
         for (itr = streams.begin() ; itr != streams.end(); ++itr) {
-            active_stream = itr->second;
+            active_stream = *itr;
             Stream *str = active_stream.get();
             if (str && str->getType() == STREAM_ACTIVE) {
                 ActiveStream* as = static_cast<ActiveStream*>(str);
-                if (as && opaque == itr->second->getOpaque()) {
+                if (as && opaque == str->getOpaque()) {
                     break;
                 }
             }
@@ -492,25 +531,22 @@ ENGINE_ERROR_CODE DcpProducer::closeStream(uint32_t opaque, uint16_t vbucket) {
     }
 
     LockHolder lh(queueLock);
-    std::map<uint16_t, stream_t>::iterator itr;
-    if ((itr = streams.find(vbucket)) == streams.end()) {
+    stream_t stream = findStream_UNLOCKED(vbucket);
+    if (!stream) {
         LOG(EXTENSION_LOG_WARNING, "%s (vb %d) Cannot close stream because no "
             "stream exists for this vbucket", logHeader(), vbucket);
         return ENGINE_KEY_ENOENT;
-    } else if (!itr->second->isActive()) {
+    } else if (!stream->isActive()) {
         LOG(EXTENSION_LOG_WARNING, "%s (vb %d) Cannot close stream because "
             "stream is already marked as dead", logHeader(), vbucket);
-        streams.erase(vbucket);
-        ready.remove(vbucket);
+        streams[vbucket].reset();
         lh.unlock();
         connection_t conn(this);
         engine_.getDcpConnMap().removeVBConnByVBId(conn, vbucket);
         return ENGINE_KEY_ENOENT;
     }
 
-    stream_t stream = itr->second;
-    streams.erase(vbucket);
-    ready.remove(vbucket);
+    streams[vbucket].reset();
     lh.unlock();
 
     stream->setDead(END_STREAM_CLOSED);
@@ -547,19 +583,21 @@ void DcpProducer::addStats(ADD_STAT add_stat, const void *c) {
         addStat("flow_control", "disabled", add_stat, c);
     }
 
-    std::map<uint16_t, stream_t>::iterator itr;
+    std::vector<stream_t>::iterator itr;
     for (itr = streams.begin(); itr != streams.end(); ++itr) {
-        itr->second->addStats(add_stat, c);
+        if (*itr) {
+            (*itr)->addStats(add_stat, c);
+        }
     }
 }
 
 void DcpProducer::addTakeoverStats(ADD_STAT add_stat, const void* c,
                                    uint16_t vbid) {
     LockHolder lh(queueLock);
-    std::map<uint16_t, stream_t>::iterator itr = streams.find(vbid);
-    if (itr != streams.end()) {
-        Stream *s = itr->second.get();
-        if (s && s->getType() == STREAM_ACTIVE) {
+    stream_t stream = findStream_UNLOCKED(vbid);
+    if (stream) {
+        Stream *s = stream.get();
+        if (s->getType() == STREAM_ACTIVE) {
             ActiveStream* as = static_cast<ActiveStream*>(s);
             if (as) {
                 as->addTakeoverStats(add_stat, c);
@@ -583,9 +621,8 @@ void DcpProducer::aggregateQueueStats(ConnCounter* aggregator) {
 
 void DcpProducer::notifySeqnoAvailable(uint16_t vbucket, uint64_t seqno) {
     LockHolder lh(queueLock);
-    std::map<uint16_t, stream_t>::iterator itr = streams.find(vbucket);
-    if (itr != streams.end() && itr->second->isActive()) {
-        stream_t stream = itr->second;
+    stream_t stream = findStream_UNLOCKED(vbucket);
+    if (stream && stream->isActive()) {
         lh.unlock();
         stream->notifySeqnoAvailable(seqno);
     }
@@ -593,9 +630,8 @@ void DcpProducer::notifySeqnoAvailable(uint16_t vbucket, uint64_t seqno) {
 
 void DcpProducer::vbucketStateChanged(uint16_t vbucket, vbucket_state_t state) {
     LockHolder lh(queueLock);
-    std::map<uint16_t, stream_t>::iterator itr = streams.find(vbucket);
-    if (itr != streams.end()) {
-        stream_t stream = itr->second;
+    stream_t stream = findStream_UNLOCKED(vbucket);
+    if (stream) {
         lh.unlock();
         stream->setDead(END_STREAM_STATE);
     }
@@ -604,13 +640,12 @@ void DcpProducer::vbucketStateChanged(uint16_t vbucket, vbucket_state_t state) {
 void DcpProducer::closeAllStreams() {
     LockHolder lh(queueLock);
     std::list<uint16_t> vblist;
-    while (!streams.empty()) {
-        std::map<uint16_t, stream_t>::iterator itr = streams.begin();
-        uint16_t vbid = itr->first;
-        itr->second->setDead(END_STREAM_DISCONNECTED);
-        streams.erase(vbid);
-        ready.remove(vbid);
-        vblist.push_back(vbid);
+    for (size_t vbid = 0; vbid < streams.size(); ++vbid) {
+        if (streams[vbid]) {
+            streams[vbid]->setDead(END_STREAM_DISCONNECTED);
+            streams[vbid].reset();
+            vblist.push_back(vbid);
+        }
     }
     lh.unlock();
 
@@ -629,20 +664,24 @@ const char* DcpProducer::getType() const {
     }
 }
 
-DcpResponse* DcpProducer::getNextItem() {
+void DcpProducer::getNextItems(std::list<DcpResponse*> &batch) {
     LockHolder lh(queueLock);
 
     setPaused(false);
-    while (!ready.empty()) {
-        if (log && log->isFull()) {
-            setPaused(true);
-            return NULL;
+    uint16_t vbucket;
+    size_t items = 0;
+    uint32_t bytes = 0;
+    while (batch.size() < batchMaxItems &&
+           (batch.empty() || bytes < batchMaxBytes)) {
+        if (log && log->isFull(bytes)) {
+            break;
         }
 
-        uint16_t vbucket = ready.front();
-        ready.pop_front();
+        if (!ready.pop(vbucket)) {
+            break;
+        }
 
-        if (streams.find(vbucket) == streams.end()) {
+        if (!streams[vbucket]) {
             continue;
         }
         DcpResponse* op = streams[vbucket]->next();
@@ -664,23 +703,33 @@ DcpResponse* DcpProducer::getNextItem() {
                 abort();
         }
 
-        if (log) {
-            log->insert(op);
-        }
-        ready.push_back(vbucket);
+        ready.push(vbucket);
 
         if (op->getEvent() == DCP_MUTATION || op->getEvent() == DCP_DELETION ||
             op->getEvent() == DCP_EXPIRATION) {
-            itemsSent++;
+            items++;
         }
 
-        totalBytesSent = totalBytesSent + op->getMessageSize();
+        bytes += op->getMessageSize();
+        batch.push_back(op);
+    }
 
-        return op;
+    if (batch.empty()) {
+        setPaused(true);
+        // A stream made ready between the last pop and the pause saw the
+        // connection unpaused and didn't notify it, so check again.
+        if (!ready.empty() && (!log || !log->isFull())) {
+            lh.unlock();
+            engine_.getDcpConnMap().notifyPausedConnection(this, true);
+        }
+        return;
     }
 
-    setPaused(true);
-    return NULL;
+    if (log) {
+        log->insert(bytes);
+    }
+    itemsSent.fetch_add(items);
+    totalBytesSent.fetch_add(bytes);
 }
 
 void DcpProducer::setDisconnect(bool disconnect) {
@@ -688,25 +737,20 @@ void DcpProducer::setDisconnect(bool disconnect) {
 
     if (disconnect) {
         LockHolder lh(queueLock);
-        std::map<uint16_t, stream_t>::iterator itr = streams.begin();
+        std::vector<stream_t>::iterator itr = streams.begin();
         for (; itr != streams.end(); ++itr) {
-            itr->second->setDead(END_STREAM_DISCONNECTED);
+            if (*itr) {
+                (*itr)->setDead(END_STREAM_DISCONNECTED);
+            }
         }
     }
 }
 
 void DcpProducer::notifyStreamReady(uint16_t vbucket, bool schedule) {
-    LockHolder lh(queueLock);
-
-    std::list<uint16_t>::iterator iter =
-        std::find(ready.begin(), ready.end(), vbucket);
-    if (iter != ready.end()) {
+    if (!ready.push(vbucket)) {
         return;
     }
 
-    ready.push_back(vbucket);
-    lh.unlock();
-
     if (!log || (log && !log->isFull())) {
         engine_.getDcpConnMap().notifyPausedConnection(this, schedule);
     }
@@ -748,9 +792,11 @@ void DcpProducer::setTimeForNoop() {
 
 void DcpProducer::clearQueues() {
     LockHolder lh(queueLock);
-    std::map<uint16_t, stream_t>::iterator itr = streams.begin();
+    std::vector<stream_t>::iterator itr = streams.begin();
     for (; itr != streams.end(); ++itr) {
-        itr->second->clear();
+        if (*itr) {
+            (*itr)->clear();
+        }
     }
 }
 
@@ -770,11 +816,11 @@ size_t DcpProducer::getItemsSent() {
 size_t DcpProducer::getItemsRemaining_UNLOCKED() {
     size_t remainingSize = 0;
 
-    std::map<uint16_t, stream_t>::iterator itr = streams.begin();
+    std::vector<stream_t>::iterator itr = streams.begin();
     for (; itr != streams.end(); ++itr) {
-        Stream *s = (itr->second).get();
+        Stream *s = itr->get();
 
-        if (s->getType() == STREAM_ACTIVE) {
+        if (s && s->getType() == STREAM_ACTIVE) {
             ActiveStream *as = static_cast<ActiveStream *>(s);
             remainingSize += as->getItemsRemaining();
         }
@@ -790,13 +836,21 @@ size_t DcpProducer::getTotalBytes() {
 std::list<uint16_t> DcpProducer::getVBList() {
     LockHolder lh(queueLock);
     std::list<uint16_t> vblist;
-    std::map<uint16_t, stream_t>::iterator itr = streams.begin();
-    for (; itr != streams.end(); ++itr) {
-        vblist.push_back(itr->first);
+    for (size_t vbid = 0; vbid < streams.size(); ++vbid) {
+        if (streams[vbid]) {
+            vblist.push_back(vbid);
+        }
     }
     return vblist;
 }
 
+stream_t DcpProducer::findStream_UNLOCKED(uint16_t vbucket) {
+    if (vbucket >= streams.size()) {
+        return stream_t();
+    }
+    return streams[vbucket];
+}
+
 bool DcpProducer::windowIsFull() {
     abort(); // Not Implemented
 }
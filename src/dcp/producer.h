@@ -20,6 +20,10 @@
 
 #include "config.h"
 
+#include <list>
+#include <vector>
+
+#include "dcp/ready-queue.h"
 #include "dcp/stream.h"
 #include "tapconnection.h"
 
@@ -45,11 +49,15 @@ public:
         return bytes_sent;
     }
 
-    bool isFull() {
-        return max_bytes <= bytes_sent;
+    /**
+     * Whether the buffer is full, counting the given bytes that are about
+     * to be sent as well.
+     */
+    bool isFull(uint32_t pending = 0) {
+        return max_bytes <= bytes_sent + pending;
     }
 
-    void insert(DcpResponse* response);
+    void insert(uint32_t bytes);
 
     void free(uint32_t bytes_to_free);
 
@@ -143,7 +151,16 @@ public:
 
 private:
 
-    DcpResponse* getNextItem();
+    /**
+     * Take the next messages to send, up to the step batch limits, and
+     * account for them in the buffer log.
+     */
+    void getNextItems(std::list<DcpResponse*> &batch);
+
+    ENGINE_ERROR_CODE sendResponse(struct dcp_message_producers* producers,
+                                   DcpResponse *resp, Item *itm);
+
+    stream_t findStream_UNLOCKED(uint16_t vbucket);
 
     size_t getItemsRemaining_UNLOCKED();
 
@@ -159,15 +176,20 @@ private:
 
     std::string priority;
 
-    DcpResponse *rejectResp; // stash response for retry if E2BIG was hit
+    // stash responses for retry if E2BIG was hit
+    std::list<DcpResponse*> rejectResps;
 
     bool notifyOnly;
     bool enableExtMetaData;
+    size_t batchMaxItems;
+    uint32_t batchMaxBytes;
     rel_time_t lastSendTime;
     BufferLog* log;
     BackfillManager* backfillMgr;
-    std::list<uint16_t> ready;
-    std::map<uint16_t, stream_t> streams;
+    // Vbuckets whose stream may have something to send
+    VBReadyQueue ready;
+    // Indexed by vbucket, guarded by queueLock
+    std::vector<stream_t> streams;
     AtomicValue<size_t> itemsSent;
     AtomicValue<size_t> totalBytesSent;
     AtomicValue<size_t> ackedBytes;
@@ -0,0 +1,106 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2015 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef SRC_DCP_READY_QUEUE_H_
+#define SRC_DCP_READY_QUEUE_H_ 1
+
+#include "config.h"
+
+#include "atomic.h"
+#include "common.h"
+
+/**
+ * The set of vbuckets of a DCP connection that have something to send,
+ * in the order they became ready.
+ *
+ * A bitmap indexed by vbucket makes a vbucket appear at most once, so the
+ * ring behind it never holds more than one slot per vbucket and can't
+ * overflow. Any number of threads may push() concurrently without a lock;
+ * pop() must only be called by one thread at a time. Both are O(1).
+ */
+class VBReadyQueue {
+public:
+    VBReadyQueue(size_t maxVBuckets)
+        : capacity(maxVBuckets), bitmap(new AtomicValue<uint64_t>[
+                                            (maxVBuckets + 63) / 64]),
+          ring(new AtomicValue<uint32_t>[maxVBuckets]), head(0), tail(0) {
+        for (size_t i = 0; i < (capacity + 63) / 64; ++i) {
+            bitmap[i].store(0);
+        }
+        for (size_t i = 0; i < capacity; ++i) {
+            ring[i].store(0);
+        }
+    }
+
+    ~VBReadyQueue() {
+        delete[] bitmap;
+        delete[] ring;
+    }
+
+    /**
+     * Mark the vbucket as ready.
+     *
+     * @return false if it was already queued
+     */
+    bool push(uint16_t vbid) {
+        uint64_t bit = 1ULL << (vbid & 63);
+        if (bitmap[vbid >> 6].fetch_or(bit) & bit) {
+            return false;
+        }
+        // Slots hold vbid + 1 so that 0 means not (yet) written.
+        size_t slot = tail.fetch_add(1) % capacity;
+        ring[slot].store(vbid + 1);
+        return true;
+    }
+
+    /**
+     * Take the vbucket that has been ready the longest.
+     *
+     * @return false if no vbucket is ready. A push() that hasn't finished
+     *         writing its slot yet may be seen only on the next call.
+     */
+    bool pop(uint16_t &vbid) {
+        size_t slot = head % capacity;
+        uint32_t v = ring[slot].load();
+        if (v == 0) {
+            return false;
+        }
+        ring[slot].store(0);
+        ++head;
+        vbid = static_cast<uint16_t>(v - 1);
+        // Only clear the bit once the slot is free, so that a concurrent
+        // push() for this vbucket can't find the ring full.
+        bitmap[vbid >> 6].fetch_and(~(1ULL << (vbid & 63)));
+        return true;
+    }
+
+    bool empty() const {
+        return ring[head % capacity].load() == 0;
+    }
+
+private:
+    const size_t capacity;
+    AtomicValue<uint64_t> *bitmap;
+    AtomicValue<uint32_t> *ring;
+    // Only touched by the consumer.
+    size_t head;
+    AtomicValue<size_t> tail;
+
+    DISALLOW_COPY_AND_ASSIGN(VBReadyQueue);
+};
+
+#endif  // SRC_DCP_READY_QUEUE_H_
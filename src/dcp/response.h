@@ -289,8 +289,12 @@ public:
         return item_;
     }
 
-    Item* getItemCopy() {
-        return new Item(*item_);
+    /**
+     * The item to hand to the send path, holding a reference of its own
+     * until it is released through the engine's item release.
+     */
+    Item* getSharedItem() {
+        return item_.retain();
     }
 
     uint16_t getVBucket() {
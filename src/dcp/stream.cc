@@ -95,7 +95,7 @@ ActiveStream::ActiveStream(EventuallyPersistentEngine* e, DcpProducer* p,
     :  Stream(n, flags, opaque, vb, st_seqno, en_seqno, vb_uuid,
               snap_start_seqno, snap_end_seqno),
        lastReadSeqno(st_seqno), lastSentSeqno(st_seqno), curChkSeqno(st_seqno),
-       takeoverState(vbucket_state_pending), backfillRemaining(0),
+       cursor(0), takeoverState(vbucket_state_pending), backfillRemaining(0),
        itemsFromMemoryPhase(0), firstMarkerSent(false), waitForSnapshot(0),
        engine(e), producer(p), isBackfillTaskRunning(false) {
 
@@ -195,7 +195,8 @@ void ActiveStream::markDiskSnapshot(uint64_t startSeqno, uint64_t endSeqno) {
         }
         // Only re-register the cursor if we still need to get memory snapshots
         CursorRegResult result =
-            vb->checkpointManager.registerCursorBySeqno(name_, endSeqno);
+            vb->checkpointManager.registerCursorBySeqno(name_, endSeqno,
+                                                        cursor);
         curChkSeqno = result.first;
     }
 
@@ -209,7 +210,7 @@ void ActiveStream::markDiskSnapshot(uint64_t startSeqno, uint64_t endSeqno) {
 bool ActiveStream::backfillReceived(Item* itm, backfill_source_t backfill_source) {
     LockHolder lh(streamMutex);
     if (state_ == STREAM_BACKFILLING) {
-        if (!producer->getBackfillManager()->bytesRead(itm->size())) {
+        if (!producer->getBackfillManager()->bytesRead(this, itm->size())) {
             delete itm;
             return false;
         }
@@ -446,7 +447,7 @@ DcpResponse* ActiveStream::nextQueuedItem() {
         if (response->getEvent() == DCP_MUTATION ||
             response->getEvent() == DCP_DELETION ||
             response->getEvent() == DCP_EXPIRATION) {
-            lastSentSeqno = dynamic_cast<MutationResponse*>(response)->getBySeqno();
+            lastSentSeqno = static_cast<MutationResponse*>(response)->getBySeqno();
 
             if (state_ == STREAM_BACKFILLING) {
                 backfillItems.sent++;
@@ -467,7 +468,7 @@ void ActiveStream::nextCheckpointItem() {
     bool mark = false;
     std::vector<queued_item> items;
     std::list<MutationResponse*> mutations;
-    vbucket->checkpointManager.getAllItemsForCursor(name_, items);
+    vbucket->checkpointManager.getAllItemsForCursor(cursor, items);
     if (vbucket->checkpointManager.getNumCheckpoints() > 1) {
         engine->getEpStore()->wakeUpCheckpointRemover();
     }
@@ -582,7 +583,8 @@ void ActiveStream::scheduleBackfill() {
 
         CursorRegResult result =
             vbucket->checkpointManager.registerCursorBySeqno(name_,
-                                                             lastReadSeqno);
+                                                             lastReadSeqno,
+                                                             cursor);
         curChkSeqno = result.first;
         bool isFirstItem = result.second;
 
@@ -668,7 +670,7 @@ void ActiveStream::transitionState(stream_state_t newState) {
     } else if (newState == STREAM_DEAD) {
         RCPtr<VBucket> vb = engine->getVBucket(vb_);
         if (vb) {
-            vb->checkpointManager.removeCursor(name_);
+            vb->checkpointManager.removeCursor(cursor);
         }
     }
 }
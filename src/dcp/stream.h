@@ -225,6 +225,8 @@ private:
     uint64_t lastSentSeqno;
     //! The last known seqno pointed to by the checkpoint cursor
     uint64_t curChkSeqno;
+    //! The handle of this stream's checkpoint cursor
+    cursor_handle_t cursor;
     //! The current vbucket state to send in the takeover stream
     vbucket_state_t takeoverState;
     //! The amount of items remaining to be read from disk
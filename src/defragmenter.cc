@@ -39,7 +39,8 @@ bool DefragmenterTask::run(void) {
         // then resume from where we last were, otherwise create a new visitor and
         // reset the position.
         if (visitor == NULL) {
-            visitor = new DefragmentVisitor(getAgeThreshold());
+            visitor = new DefragmentVisitor(getAgeThreshold(),
+                                            shouldCompressValues());
             epstore_position = engine->getEpStore()->startPosition();
         }
 
@@ -98,7 +99,8 @@ bool DefragmenterTask::run(void) {
         }
         ss << " Took " << (end - start) / 1024 << " us."
            << " moved " << visitor->getDefragCount() << "/"
-           << visitor->getVisitedCount() << " visited documents."
+           << visitor->getVisitedCount() << " visited documents,"
+           << " compressed " << visitor->getCompressCount() << "."
            << " mem_used=" << stats.getTotalMemoryUsed()
            << ", mapped_bytes=" << getMappedBytes()
            << ". Sleeping for " << getSleepTime() << " seconds.";
@@ -136,6 +138,10 @@ size_t DefragmenterTask::getAgeThreshold() const {
     return engine->getConfiguration().getDefragmenterAgeThreshold();
 }
 
+bool DefragmenterTask::shouldCompressValues() const {
+    return engine->getConfiguration().isDefragmenterCompressValues();
+}
+
 size_t DefragmenterTask::getChunkDurationMS() const {
     return engine->getConfiguration().getDefragmenterChunkDuration();
 }
@@ -119,6 +119,9 @@ private:
     // must be to be considered for defragmentation.
     size_t getAgeThreshold() const;
 
+    // Should values not accessed recently be compressed in memory?
+    bool shouldCompressValues() const;
+
     // Upper limit on how long (in milliseconds) each defragmention chunk
     // can run for, before being paused.
     size_t getChunkDurationMS() const;
@@ -46,14 +46,18 @@ private:
 
 // DegragmentVisitor implementation ///////////////////////////////////////////
 
-DefragmentVisitor::DefragmentVisitor(uint8_t age_threshold_)
+DefragmentVisitor::DefragmentVisitor(uint8_t age_threshold_,
+                                     bool compress_values_)
   : max_size_class(3584),  // TODO: Derive from allocator hooks.
     age_threshold(age_threshold_),
+    compress_values(compress_values_),
     progressTracker(NULL),
     resume_vbucket_id(0),
     hashtable_position(),
+    current_hashtable(NULL),
     defrag_count(0),
-    visited_count(0) {
+    visited_count(0),
+    compress_count(0) {
     progressTracker = new ProgressTracker(*this);
 }
 
@@ -74,7 +78,9 @@ bool DefragmentVisitor::visit(uint16_t vbucket_id, HashTable& ht) {
         ht_start = hashtable_position;
     }
 
+    current_hashtable = &ht;
     hashtable_position = ht.pauseResumeVisit(*this, ht_start);
+    current_hashtable = NULL;
 
     if (hashtable_position != ht.endPosition()) {
         // We didn't get to the end of this hashtable. Record the vbucket_id
@@ -89,6 +95,26 @@ bool DefragmentVisitor::visit(uint16_t vbucket_id, HashTable& ht) {
 bool DefragmentVisitor::visit(StoredValue& v) {
     const size_t value_len = v.valuelen();
 
+    // Compress clean values that have not been read for a whole pass.
+    // Dirty values are still shared with the checkpoints, so leave them be,
+    // as well as values that the client already stored compressed.
+    if (compress_values && current_hashtable != NULL &&
+        value_len >= MIN_COMPRESS_LENGTH && v.isClean()) {
+        const value_t &value = v.getValue();
+        uint8_t datatype = value->getDataType();
+        if (!value->isCompressedInMemory() && !value->isIncompressible() &&
+            datatype != PROTOCOL_BINARY_DATATYPE_COMPRESSED &&
+            datatype != PROTOCOL_BINARY_DATATYPE_COMPRESSED_JSON) {
+            if (!value->isCold()) {
+                value->markCold();
+            } else if (v.compressValue(*current_hashtable)) {
+                compress_count++;
+                visited_count++;
+                return progressTracker->shouldContinueVisiting();
+            }
+        }
+    }
+
     // value must be at least non-zero (also covers Items with null Blobs)
     // and no larger than the biggest size class the allocator
     // supports, so it can be successfully reallocated to a run with other
@@ -116,6 +142,7 @@ HashTable::Position DefragmentVisitor::getHashtablePosition() const {
 void DefragmentVisitor::clearStats() {
     defrag_count = 0;
     visited_count = 0;
+    compress_count = 0;
 }
 
 size_t DefragmentVisitor::getDefragCount() const {
@@ -126,6 +153,10 @@ size_t DefragmentVisitor::getVisitedCount() const {
     return visited_count;
 }
 
+size_t DefragmentVisitor::getCompressCount() const {
+    return compress_count;
+}
+
 /* ProgressTracker implementation ********************************************/
 
 ProgressTracker::ProgressTracker(DefragmentVisitor& visitor_)
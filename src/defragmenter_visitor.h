@@ -28,7 +28,7 @@ class ProgressTracker;
 class DefragmentVisitor : public PauseResumeEPStoreVisitor,
                           public PauseResumeHashTableVisitor {
 public:
-    DefragmentVisitor(uint8_t age_threshold_);
+    DefragmentVisitor(uint8_t age_threshold_, bool compress_values_ = false);
 
     ~DefragmentVisitor();
 
@@ -53,6 +53,9 @@ public:
     // Returns the number of documents that have been visited.
     size_t getVisitedCount() const;
 
+    // Returns the number of documents whose values have been compressed.
+    size_t getCompressCount() const;
+
 private:
     /* Configuration parameters */
 
@@ -62,6 +65,12 @@ private:
     // How old a blob must be to consider it for defragmentation.
     const uint8_t age_threshold;
 
+    // Should values not accessed recently be compressed in memory?
+    const bool compress_values;
+
+    // Values shorter than this rarely compress enough to be worth it.
+    static const size_t MIN_COMPRESS_LENGTH = 64;
+
     /* Runtime state */
 
     // Estimates how far we have got, and when we should pause.
@@ -73,11 +82,16 @@ private:
     // When pausing / resuming, hashtable position to use.
     HashTable::Position hashtable_position;
 
+    // The hashtable being visited, if visited through a vbucket.
+    HashTable* current_hashtable;
+
     /* Statistics */
     // Count of how many documents have been defrag'd.
     size_t defrag_count;
     // How many documents have been visited.
     size_t visited_count;
+    // Count of how many documents have had their values compressed.
+    size_t compress_count;
 };
 
 #endif /* DEFRAGMENTER_VISITOR_H_ */
@@ -120,6 +120,10 @@ public:
             store.getEPEngine().getReplicationThrottle().setQueueCap(value);
         } else if (key.compare("replication_throttle_cap_pcnt") == 0) {
             store.getEPEngine().getReplicationThrottle().setCapPercent(value);
+        } else if (key.compare("flusher_group_commit_max_items") == 0) {
+            store.setGroupCommitMaxItems(value);
+        } else if (key.compare("flusher_group_commit_max_bytes") == 0) {
+            store.setGroupCommitMaxBytes(value);
         } else {
             LOG(EXTENSION_LOG_WARNING,
                 "Failed to change value for unknown variable, %s\n",
@@ -136,6 +140,8 @@ public:
             }
         } else if (key.compare("bfilter_enabled") == 0) {
             store.setAllBloomFilters(value);
+        } else if (key.compare("flusher_group_commit") == 0) {
+            store.setGroupCommit(value);
         }
     }
 
@@ -275,8 +281,8 @@ EventuallyPersistentStore::EventuallyPersistentStore(
 
     storageProperties = new StorageProperties(true, true, true, true);
 
-    stats.schedulingHisto = new Histogram<hrtime_t>[MAX_TYPE_ID];
-    stats.taskRuntimeHisto = new Histogram<hrtime_t>[MAX_TYPE_ID];
+    stats.schedulingHisto = new ShardedHistogram<hrtime_t>[MAX_TYPE_ID];
+    stats.taskRuntimeHisto = new ShardedHistogram<hrtime_t>[MAX_TYPE_ID];
 
     for (size_t i = 0; i < MAX_TYPE_ID; i++) {
         stats.schedulingHisto[i].reset();
@@ -363,6 +369,16 @@ EventuallyPersistentStore::EventuallyPersistentStore(
     config.addValueChangedListener("compaction_write_queue_cap",
                                    new EPStoreValueChangeListener(*this));
 
+    groupCommit = config.isFlusherGroupCommit();
+    config.addValueChangedListener("flusher_group_commit",
+                                   new EPStoreValueChangeListener(*this));
+    groupCommitMaxItems = config.getFlusherGroupCommitMaxItems();
+    config.addValueChangedListener("flusher_group_commit_max_items",
+                                   new EPStoreValueChangeListener(*this));
+    groupCommitMaxBytes = config.getFlusherGroupCommitMaxBytes();
+    config.addValueChangedListener("flusher_group_commit_max_bytes",
+                                   new EPStoreValueChangeListener(*this));
+
     const std::string &policy = config.getItemEvictionPolicy();
     if (policy.compare("value_only") == 0) {
         eviction_policy = VALUE_ONLY;
@@ -569,8 +585,10 @@ EventuallyPersistentStore::deleteExpiredItem(uint16_t vbid, std::string &key,
     if (vb) {
         int bucket_num(0);
         incExpirationStat(vb);
-        LockHolder lh = vb->ht.getLockedBucket(key, &bucket_num);
-        StoredValue *v = vb->ht.unlocked_find(key, bucket_num, true, false);
+        const KeyView hashedKey(key);
+        LockHolder lh = vb->ht.getLockedBucket(hashedKey, &bucket_num);
+        StoredValue *v = vb->ht.unlocked_find(hashedKey, bucket_num, true,
+                                              false);
         if (v) {
             if (v->isTempNonExistentItem() || v->isTempDeletedItem()) {
                 // This is a temporary item whose background fetch for metadata
@@ -614,7 +632,7 @@ EventuallyPersistentStore::deleteExpiredItems(std::list<std::pair<uint16_t,
 }
 
 StoredValue *EventuallyPersistentStore::fetchValidValue(RCPtr<VBucket> &vb,
-                                                        const std::string &key,
+                                                        const KeyView &key,
                                                         int bucket_num,
                                                         bool wantDeleted,
                                                         bool trackReference,
@@ -643,8 +661,9 @@ bool EventuallyPersistentStore::isMetaDataResident(RCPtr<VBucket> &vb,
 
     cb_assert(vb);
     int bucket_num(0);
-    LockHolder lh = vb->ht.getLockedBucket(key, &bucket_num);
-    StoredValue *v = vb->ht.unlocked_find(key, bucket_num, false, false);
+    const KeyView hashedKey(key);
+    LockHolder lh = vb->ht.getLockedBucket(hashedKey, &bucket_num);
+    StoredValue *v = vb->ht.unlocked_find(hashedKey, bucket_num, false, false);
 
     if (v && !v->isTempItem()) {
         return true;
@@ -665,8 +684,9 @@ protocol_binary_response_status EventuallyPersistentStore::evictKey(
     }
 
     int bucket_num(0);
-    LockHolder lh = vb->ht.getLockedBucket(key, &bucket_num);
-    StoredValue *v = fetchValidValue(vb, key, bucket_num, force, false);
+    const KeyView hashedKey(key);
+    LockHolder lh = vb->ht.getLockedBucket(hashedKey, &bucket_num);
+    StoredValue *v = fetchValidValue(vb, hashedKey, bucket_num, force, false);
 
     protocol_binary_response_status rv(PROTOCOL_BINARY_RESPONSE_SUCCESS);
 
@@ -750,9 +770,9 @@ ENGINE_ERROR_CODE EventuallyPersistentStore::set(const Item &itm,
 
     bool cas_op = (itm.getCas() != 0);
     int bucket_num(0);
-    LockHolder lh = vb->ht.getLockedBucket(itm.getKey(), &bucket_num);
-    StoredValue *v = vb->ht.unlocked_find(itm.getKey(), bucket_num, true,
-                                          false);
+    const KeyView key(itm.getKey());
+    LockHolder lh = vb->ht.getLockedBucket(key, &bucket_num);
+    StoredValue *v = vb->ht.unlocked_find(key, bucket_num, true, false);
     if (v && v->isLocked(ep_current_time()) &&
         (vb->getState() == vbucket_state_replica ||
          vb->getState() == vbucket_state_pending)) {
@@ -839,9 +859,9 @@ ENGINE_ERROR_CODE EventuallyPersistentStore::add(const Item &itm,
     }
 
     int bucket_num(0);
-    LockHolder lh = vb->ht.getLockedBucket(itm.getKey(), &bucket_num);
-    StoredValue *v = vb->ht.unlocked_find(itm.getKey(), bucket_num, true,
-                                          false);
+    const KeyView key(itm.getKey());
+    LockHolder lh = vb->ht.getLockedBucket(key, &bucket_num);
+    StoredValue *v = vb->ht.unlocked_find(key, bucket_num, true, false);
 
     bool maybeKeyExists = true;
     if (eviction_policy == FULL_EVICTION) {
@@ -896,9 +916,9 @@ ENGINE_ERROR_CODE EventuallyPersistentStore::replace(const Item &itm,
     }
 
     int bucket_num(0);
-    LockHolder lh = vb->ht.getLockedBucket(itm.getKey(), &bucket_num);
-    StoredValue *v = vb->ht.unlocked_find(itm.getKey(), bucket_num, true,
-                                          false);
+    const KeyView key(itm.getKey());
+    LockHolder lh = vb->ht.getLockedBucket(key, &bucket_num);
+    StoredValue *v = vb->ht.unlocked_find(key, bucket_num, true, false);
     if (v) {
         if (v->isDeleted() || v->isTempDeletedItem() ||
             v->isTempNonExistentItem()) {
@@ -967,6 +987,111 @@ ENGINE_ERROR_CODE EventuallyPersistentStore::replace(const Item &itm,
     }
 }
 
+ENGINE_ERROR_CODE EventuallyPersistentStore::appendOrPrepend(
+                                                        const Item &itm,
+                                                        const void *cookie,
+                                                        bool append,
+                                                        size_t maxItemSize) {
+    RCPtr<VBucket> vb = getVBucket(itm.getVBucketId());
+    if (!vb || vb->getState() == vbucket_state_dead ||
+        vb->getState() == vbucket_state_replica) {
+        ++stats.numNotMyVBuckets;
+        return ENGINE_NOT_MY_VBUCKET;
+    } else if (vb->getState() == vbucket_state_pending) {
+        if (vb->addPendingOp(cookie)) {
+            return ENGINE_EWOULDBLOCK;
+        }
+    }
+
+    int bucket_num(0);
+    const KeyView key(itm.getKey());
+    LockHolder lh = vb->ht.getLockedBucket(key, &bucket_num);
+    StoredValue *v = fetchValidValue(vb, key, bucket_num, true);
+    if (!v) {
+        if (eviction_policy == VALUE_ONLY) {
+            return ENGINE_KEY_ENOENT;
+        }
+
+        if (vb->maybeKeyExistsInFilter(itm.getKey())) {
+            return addTempItemForBgFetch(lh, bucket_num, itm.getKey(), vb,
+                                         cookie, false);
+        } else {
+            // As bloomfilter predicted that item surely doesn't exist
+            // on disk, return ENOENT.
+            return ENGINE_KEY_ENOENT;
+        }
+    }
+
+    if (v->isDeleted() || v->isTempDeletedItem() ||
+        v->isTempNonExistentItem()) {
+        return ENGINE_KEY_ENOENT;
+    }
+
+    // The value to add to has to be in memory.
+    if (!v->isResident()) {
+        lh.unlock();
+        bgFetch(itm.getKey(), vb->getId(), cookie);
+        return ENGINE_EWOULDBLOCK;
+    }
+
+    if (v->isLocked(ep_current_time())) {
+        return ENGINE_TMPFAIL;
+    }
+    if (itm.getCas() != 0 && v->getCas() != itm.getCas()) {
+        return ENGINE_KEY_EEXISTS;
+    }
+
+    // The copy shares the stored Blob, so only the combined value is built.
+    Item *merged = v->toItem(false, vb->getId(), vb->ht);
+    ENGINE_ERROR_CODE ret = append ? merged->append(itm, maxItemSize) :
+                                     merged->prepend(itm, maxItemSize);
+    if (ret != ENGINE_SUCCESS) {
+        delete merged;
+        return ret == ENGINE_E2BIG ? ret : ENGINE_ENOMEM;
+    }
+
+    // Adding anything to JSON breaks the json data structure.
+    if (merged->getDataType() == PROTOCOL_BINARY_DATATYPE_JSON) {
+        merged->setDataType(PROTOCOL_BINARY_RAW_BYTES);
+    } else if (merged->getDataType() ==
+               PROTOCOL_BINARY_DATATYPE_COMPRESSED_JSON) {
+        merged->setDataType(PROTOCOL_BINARY_DATATYPE_COMPRESSED);
+    }
+
+    mutation_type_t mtype = vb->ht.unlocked_set(v, *merged, 0, true, false,
+                                                eviction_policy, 0xff);
+    delete merged;
+
+    Item& it = const_cast<Item&>(itm);
+    uint64_t seqno = 0;
+    switch (mtype) {
+    case NOMEM:
+        ret = ENGINE_ENOMEM;
+        break;
+    case IS_LOCKED:
+        ret = ENGINE_TMPFAIL;
+        break;
+    case WAS_DIRTY:
+        // Even if the item was dirty, push it into the vbucket's open
+        // checkpoint.
+    case WAS_CLEAN:
+        it.setCas(vb->nextHLCCas());
+        v->setCas(it.getCas());
+        queueDirty(vb, v, &lh, &seqno);
+        it.setBySeqno(seqno);
+        break;
+    case INVALID_CAS:
+    case NOT_FOUND:
+    case NEED_BG_FETCH:
+    case INVALID_VBUCKET:
+        // Ruled out under the same lock above.
+        ret = ENGINE_NOT_STORED;
+        break;
+    }
+
+    return ret;
+}
+
 ENGINE_ERROR_CODE EventuallyPersistentStore::addTAPBackfillItem(
                                                         const Item &itm,
                                                         uint8_t nru,
@@ -982,9 +1107,9 @@ ENGINE_ERROR_CODE EventuallyPersistentStore::addTAPBackfillItem(
     }
 
     int bucket_num(0);
-    LockHolder lh = vb->ht.getLockedBucket(itm.getKey(), &bucket_num);
-    StoredValue *v = vb->ht.unlocked_find(itm.getKey(), bucket_num, true,
-                                          false);
+    const KeyView key(itm.getKey());
+    LockHolder lh = vb->ht.getLockedBucket(key, &bucket_num);
+    StoredValue *v = vb->ht.unlocked_find(key, bucket_num, true, false);
 
     // Note that this function is only called on replica or pending vbuckets.
     if (v && v->isLocked(ep_current_time())) {
@@ -1419,11 +1544,6 @@ bool EventuallyPersistentStore::compactVBucket(const uint16_t vbid,
     ENGINE_ERROR_CODE err = ENGINE_SUCCESS;
     RCPtr<VBucket> vb = vbMap.getBucket(vbid);
     if (vb) {
-        LockHolder lh(vb_mutexes[vbid], true /*tryLock*/);
-        if (!lh.islocked()) {
-            return true; // Schedule a compaction task again.
-        }
-
         Configuration &config = getEPEngine().getConfiguration();
         if (config.isBfilterEnabled()) {
             size_t initial_estimation = config.getBfilterKeyCount();
@@ -1495,7 +1615,10 @@ bool EventuallyPersistentStore::compactVBucket(const uint16_t vbid,
         ctx->expiryCallback = expiry;
 
         KVStatsCallback kvcb(this);
-        if (getRWUnderlying(vbid)->compactVBucket(vbid, ctx, kvcb)) {
+        // Flushes carry on while the vbucket is compacted; the store only
+        // takes the vbucket lock to switch over to the compacted file.
+        if (getRWUnderlying(vbid)->compactVBucket(vbid, ctx, kvcb,
+                                                  vb_mutexes[vbid])) {
             if (config.isBfilterEnabled()) {
                 vb->swapFilter();
             } else {
@@ -1555,8 +1678,7 @@ bool EventuallyPersistentStore::resetVBucket(uint16_t vbid) {
         vbMap.removeBucket(vbid);
         lh.unlock();
 
-        std::list<std::string> tap_cursors = vb->checkpointManager.
-                                             getCursorNames();
+        cursor_list tap_cursors = vb->checkpointManager.getCursors();
         // Delete and recreate the vbucket database file
         scheduleVBDeletion(vb, NULL, 0);
         setVBucketState(vbid, vbstate, false);
@@ -1656,8 +1778,9 @@ void EventuallyPersistentStore::completeBGFetch(const std::string &key,
     RCPtr<VBucket> vb = getVBucket(vbucket);
     if (vb) {
         int bucket_num(0);
-        LockHolder hlh = vb->ht.getLockedBucket(key, &bucket_num);
-        StoredValue *v = fetchValidValue(vb, key, bucket_num, true);
+        const KeyView hashedKey(key);
+        LockHolder hlh = vb->ht.getLockedBucket(hashedKey, &bucket_num);
+        StoredValue *v = fetchValidValue(vb, hashedKey, bucket_num, true);
         if (isMeta) {
             if (v && v->unlocked_restoreMeta(gcb.val.getValue(),
                                              gcb.val.getStatus(), vb->ht)) {
@@ -1754,8 +1877,9 @@ void EventuallyPersistentStore::completeBGFetchMulti(uint16_t vbId,
         const std::string &key = (*itemItr).first;
 
         int bucket = 0;
-        LockHolder blh = vb->ht.getLockedBucket(key, &bucket);
-        StoredValue *v = fetchValidValue(vb, key, bucket, true);
+        const KeyView hashedKey(key);
+        LockHolder blh = vb->ht.getLockedBucket(hashedKey, &bucket);
+        StoredValue *v = fetchValidValue(vb, hashedKey, bucket, true);
         if (bgitem->metaDataOnly) {
             if (v && v->unlocked_restoreMeta(fetchedValue, status, vb->ht)) {
                 status = ENGINE_SUCCESS;
@@ -1865,7 +1989,7 @@ void EventuallyPersistentStore::bgFetch(const std::string &key,
     }
 }
 
-GetValue EventuallyPersistentStore::getInternal(const std::string &key,
+GetValue EventuallyPersistentStore::getInternal(const KeyView &key,
                                                 uint16_t vbucket,
                                                 const void *cookie,
                                                 bool queueBG,
@@ -1904,13 +2028,19 @@ GetValue EventuallyPersistentStore::getInternal(const std::string &key,
         // If the value is not resident, wait for it...
         if (!v->isResident()) {
             if (queueBG) {
-                bgFetch(key, vbucket, cookie);
+                bgFetch(key.toString(), vbucket, cookie);
             }
             return GetValue(NULL, ENGINE_EWOULDBLOCK, v->getBySeqno(),
                             true, v->getNRUValue());
         }
 
-        GetValue rv(v->toItem(v->isLocked(ep_current_time()), vbucket),
+        // A value compressed while it was cold is held uncompressed again
+        // once a client reads it; other reads get an inflated copy.
+        if (trackReference) {
+            v->inflateValue(vb->ht);
+        }
+        GetValue rv(v->toItem(v->isLocked(ep_current_time()), vbucket,
+                              vb->ht),
                     ENGINE_SUCCESS, v->getBySeqno(), false, v->getNRUValue());
         return rv;
     } else {
@@ -1919,10 +2049,11 @@ GetValue EventuallyPersistentStore::getInternal(const std::string &key,
             return rv;
         }
 
-        if (vb->maybeKeyExistsInFilter(key)) {
+        std::string k(key.toString());
+        if (vb->maybeKeyExistsInFilter(k)) {
             ENGINE_ERROR_CODE ec = ENGINE_EWOULDBLOCK;
             if (queueBG) { // Full eviction and need a bg fetch.
-                ec = addTempItemForBgFetch(lh, bucket_num, key, vb,
+                ec = addTempItemForBgFetch(lh, bucket_num, k, vb,
                                            cookie, false);
             }
             return GetValue(NULL, ec, -1, true);
@@ -1993,8 +2124,9 @@ ENGINE_ERROR_CODE EventuallyPersistentStore::getMetaData(
 
     int bucket_num(0);
     deleted = 0;
-    LockHolder lh = vb->ht.getLockedBucket(key, &bucket_num);
-    StoredValue *v = vb->ht.unlocked_find(key, bucket_num, true,
+    const KeyView hashedKey(key);
+    LockHolder lh = vb->ht.getLockedBucket(hashedKey, &bucket_num);
+    StoredValue *v = vb->ht.unlocked_find(hashedKey, bucket_num, true,
                                           trackReferenced);
 
     if (v) {
@@ -2067,9 +2199,9 @@ ENGINE_ERROR_CODE EventuallyPersistentStore::setWithMeta(
     }
 
     int bucket_num(0);
-    LockHolder lh = vb->ht.getLockedBucket(itm.getKey(), &bucket_num);
-    StoredValue *v = vb->ht.unlocked_find(itm.getKey(), bucket_num, true,
-                                          false);
+    const KeyView key(itm.getKey());
+    LockHolder lh = vb->ht.getLockedBucket(key, &bucket_num);
+    StoredValue *v = vb->ht.unlocked_find(key, bucket_num, true, false);
 
     bool maybeKeyExists = true;
     if (!force) {
@@ -2188,8 +2320,9 @@ GetValue EventuallyPersistentStore::getAndUpdateTtl(const std::string &key,
     }
 
     int bucket_num(0);
-    LockHolder lh = vb->ht.getLockedBucket(key, &bucket_num);
-    StoredValue *v = fetchValidValue(vb, key, bucket_num, true);
+    const KeyView hashedKey(key);
+    LockHolder lh = vb->ht.getLockedBucket(hashedKey, &bucket_num);
+    StoredValue *v = fetchValidValue(vb, hashedKey, bucket_num, true);
 
     if (v) {
         if (v->isDeleted() || v->isTempDeletedItem() ||
@@ -2213,7 +2346,8 @@ GetValue EventuallyPersistentStore::getAndUpdateTtl(const std::string &key,
            v->setExptime(exptime);
         }
 
-        GetValue rv(v->toItem(v->isLocked(ep_current_time()), vbucket),
+        GetValue rv(v->toItem(v->isLocked(ep_current_time()), vbucket,
+                              vb->ht),
                     ENGINE_SUCCESS, v->getBySeqno());
 
         if (exptime_mutated) {
@@ -2252,8 +2386,9 @@ EventuallyPersistentStore::statsVKey(const std::string &key,
     }
 
     int bucket_num(0);
-    LockHolder lh = vb->ht.getLockedBucket(key, &bucket_num);
-    StoredValue *v = fetchValidValue(vb, key, bucket_num, true);
+    const KeyView hashedKey(key);
+    LockHolder lh = vb->ht.getLockedBucket(hashedKey, &bucket_num);
+    StoredValue *v = fetchValidValue(vb, hashedKey, bucket_num, true);
 
     if (v) {
         if (v->isDeleted() || v->isTempDeletedItem() ||
@@ -2315,8 +2450,9 @@ void EventuallyPersistentStore::completeStatsVKey(const void* cookie,
         RCPtr<VBucket> vb = getVBucket(vbid);
         if (vb) {
             int bucket_num(0);
-            LockHolder hlh = vb->ht.getLockedBucket(key, &bucket_num);
-            StoredValue *v = fetchValidValue(vb, key, bucket_num, true);
+            const KeyView hashedKey(key);
+            LockHolder hlh = vb->ht.getLockedBucket(hashedKey, &bucket_num);
+            StoredValue *v = fetchValidValue(vb, hashedKey, bucket_num, true);
             if (v && v->isTempInitialItem()) {
                 if (gcb.val.getStatus() == ENGINE_SUCCESS) {
                     v->unlocked_restoreValue(gcb.val.getValue(), vb->ht);
@@ -2360,8 +2496,9 @@ bool EventuallyPersistentStore::getLocked(const std::string &key,
     }
 
     int bucket_num(0);
-    LockHolder lh = vb->ht.getLockedBucket(key, &bucket_num);
-    StoredValue *v = fetchValidValue(vb, key, bucket_num, true);
+    const KeyView hashedKey(key);
+    LockHolder lh = vb->ht.getLockedBucket(hashedKey, &bucket_num);
+    StoredValue *v = fetchValidValue(vb, hashedKey, bucket_num, true);
 
     if (v) {
         if (v->isDeleted() || v->isTempNonExistentItem() ||
@@ -2391,7 +2528,7 @@ bool EventuallyPersistentStore::getLocked(const std::string &key,
         // acquire lock and increment cas value
         v->lock(currentTime + lockTimeout);
 
-        Item *it = v->toItem(false, vbucket);
+        Item *it = v->toItem(false, vbucket, vb->ht);
         it->setCas(vb->nextHLCCas());
         v->setCas(it->getCas());
 
@@ -2436,8 +2573,9 @@ EventuallyPersistentStore::unlockKey(const std::string &key,
     }
 
     int bucket_num(0);
-    LockHolder lh = vb->ht.getLockedBucket(key, &bucket_num);
-    StoredValue *v = fetchValidValue(vb, key, bucket_num, true);
+    const KeyView hashedKey(key);
+    LockHolder lh = vb->ht.getLockedBucket(hashedKey, &bucket_num);
+    StoredValue *v = fetchValidValue(vb, hashedKey, bucket_num, true);
 
     if (v) {
         if (v->isDeleted() || v->isTempNonExistentItem() ||
@@ -2481,8 +2619,9 @@ ENGINE_ERROR_CODE EventuallyPersistentStore::getKeyStats(
     }
 
     int bucket_num(0);
-    LockHolder lh = vb->ht.getLockedBucket(key, &bucket_num);
-    StoredValue *v = fetchValidValue(vb, key, bucket_num, true);
+    const KeyView hashedKey(key);
+    LockHolder lh = vb->ht.getLockedBucket(hashedKey, &bucket_num);
+    StoredValue *v = fetchValidValue(vb, hashedKey, bucket_num, true);
 
     if (v) {
         if ((v->isDeleted() && !wantsDeleted) ||
@@ -2524,8 +2663,9 @@ std::string EventuallyPersistentStore::validateKey(const std::string &key,
                                                    Item &diskItem) {
     int bucket_num(0);
     RCPtr<VBucket> vb = getVBucket(vbucket);
-    LockHolder lh = vb->ht.getLockedBucket(key, &bucket_num);
-    StoredValue *v = fetchValidValue(vb, key, bucket_num, true,
+    const KeyView hashedKey(key);
+    LockHolder lh = vb->ht.getLockedBucket(hashedKey, &bucket_num);
+    StoredValue *v = fetchValidValue(vb, hashedKey, bucket_num, true,
                                      false, true);
 
     if (v) {
@@ -2536,13 +2676,15 @@ std::string EventuallyPersistentStore::validateKey(const std::string &key,
 
         if (diskItem.getFlags() != v->getFlags()) {
             return "flags_mismatch";
-        } else if (v->isResident() && memcmp(diskItem.getData(),
-                                             v->getValue()->getData(),
-                                             diskItem.getNBytes())) {
-            return "data_mismatch";
-        } else {
-            return "valid";
+        } else if (v->isResident()) {
+            // Compare with the value as stored, leaving it as it is held.
+            value_t val(v->getInflatedValue(vb->ht));
+            if (memcmp(diskItem.getData(), val->getData(),
+                       diskItem.getNBytes())) {
+                return "data_mismatch";
+            }
         }
+        return "valid";
     } else {
         return "item_deleted";
     }
@@ -2572,8 +2714,9 @@ ENGINE_ERROR_CODE EventuallyPersistentStore::deleteItem(const std::string &key,
     }
 
     int bucket_num(0);
-    LockHolder lh = vb->ht.getLockedBucket(key, &bucket_num);
-    StoredValue *v = vb->ht.unlocked_find(key, bucket_num, true, false);
+    const KeyView hashedKey(key);
+    LockHolder lh = vb->ht.getLockedBucket(hashedKey, &bucket_num);
+    StoredValue *v = vb->ht.unlocked_find(hashedKey, bucket_num, true, false);
     if (!v || v->isDeleted() || v->isTempItem()) {
         if (eviction_policy == VALUE_ONLY) {
             return ENGINE_KEY_ENOENT;
@@ -2701,8 +2844,9 @@ ENGINE_ERROR_CODE EventuallyPersistentStore::deleteWithMeta(
     }
 
     int bucket_num(0);
-    LockHolder lh = vb->ht.getLockedBucket(key, &bucket_num);
-    StoredValue *v = vb->ht.unlocked_find(key, bucket_num, true, false);
+    const KeyView hashedKey(key);
+    LockHolder lh = vb->ht.getLockedBucket(hashedKey, &bucket_num);
+    StoredValue *v = vb->ht.unlocked_find(hashedKey, bucket_num, true, false);
     if (!force) { // Need conflict resolution.
         if (v)  {
             if (v->isTempInitialItem()) {
@@ -2854,11 +2998,10 @@ public:
     void callback(mutation_result &value) {
         if (value.first == 1) {
             int bucket_num(0);
-            LockHolder lh = vbucket->ht.getLockedBucket(queuedItem->getKey(),
-                                                        &bucket_num);
-            StoredValue *v = store->fetchValidValue(vbucket,
-                                                    queuedItem->getKey(),
-                                                    bucket_num, true, false);
+            const KeyView key(queuedItem->getKey());
+            LockHolder lh = vbucket->ht.getLockedBucket(key, &bucket_num);
+            StoredValue *v = store->fetchValidValue(vbucket, key, bucket_num,
+                                                    true, false);
             if (v) {
                 if (v->getCas() == cas) {
                     // mark this item clean only if current and stored cas
@@ -2888,10 +3031,9 @@ public:
             // we do not know the rowid of this object.
             if (value.first == 0) {
                 int bucket_num(0);
-                LockHolder lh = vbucket->ht.getLockedBucket(
-                                           queuedItem->getKey(), &bucket_num);
-                StoredValue *v = store->fetchValidValue(vbucket,
-                                                        queuedItem->getKey(),
+                const KeyView key(queuedItem->getKey());
+                LockHolder lh = vbucket->ht.getLockedBucket(key, &bucket_num);
+                StoredValue *v = store->fetchValidValue(vbucket, key,
                                                         bucket_num, true,
                                                         false);
                 if (v) {
@@ -2935,11 +3077,10 @@ public:
             // We have succesfully removed an item from the disk, we
             // may now remove it from the hash table.
             int bucket_num(0);
-            LockHolder lh = vbucket->ht.getLockedBucket(queuedItem->getKey(),
-                                                        &bucket_num);
-            StoredValue *v = store->fetchValidValue(vbucket,
-                                                    queuedItem->getKey(),
-                                                    bucket_num, true, false);
+            const KeyView key(queuedItem->getKey());
+            LockHolder lh = vbucket->ht.getLockedBucket(key, &bucket_num);
+            StoredValue *v = store->fetchValidValue(vbucket, key, bucket_num,
+                                                    true, false);
             if (v && v->isDeleted()) {
                 bool newCacheItem = v->isNewCacheItem();
                 bool deleted = vbucket->ht.unlocked_del(queuedItem->getKey(),
@@ -3039,15 +3180,122 @@ void EventuallyPersistentStore::flushOneDeleteAll() {
     setFlushAllComplete();
 }
 
-int EventuallyPersistentStore::flushVBucket(uint16_t vbid) {
+bool EventuallyPersistentStore::flushAllPending(uint16_t vbid) {
     KVShard *shard = vbMap.getShard(vbid);
     if (diskFlushAll && !flushAllTaskCtx.delayFlushAll) {
         if (shard->getId() == EP_PRIMARY_SHARD) {
             flushOneDeleteAll();
         } else {
             // disk flush is pending just return
-            return 0;
+            return true;
+        }
+    }
+    return false;
+}
+
+snapshot_range_t EventuallyPersistentStore::getItemsToFlush(
+                                            RCPtr<VBucket> &vb,
+                                            std::vector<queued_item> &items) {
+    while (!vb->rejectQueue.empty()) {
+        items.push_back(vb->rejectQueue.front());
+        vb->rejectQueue.pop();
+    }
+
+    vb->getBackfillItems(items);
+
+    return vb->checkpointManager.getAllItemsForCursor(
+                                        CheckpointManager::pCursor, items);
+}
+
+int EventuallyPersistentStore::flushItems(RCPtr<VBucket> &vb,
+                                          std::vector<queued_item> &items,
+                                          std::list<PersistenceCallback*> &pcbs,
+                                          uint64_t &maxSeqno,
+                                          uint64_t &maxCas) {
+    int items_flushed = 0;
+    getRWUnderlying(vb->getId())->optimizeWrites(items);
+
+    Item *prev = NULL;
+    std::vector<queued_item>::iterator it = items.begin();
+    for(; it != items.end(); ++it) {
+        if ((*it)->getOperation() != queue_op_set &&
+            (*it)->getOperation() != queue_op_del) {
+            continue;
+        } else if (!prev || prev->getKey() != (*it)->getKey()) {
+            prev = (*it).get();
+            ++items_flushed;
+            PersistenceCallback *cb = flushOneDelOrSet(*it, vb);
+            if (cb) {
+                pcbs.push_back(cb);
+            }
+
+            maxSeqno = std::max(maxSeqno, (uint64_t)(*it)->getBySeqno());
+            maxCas = std::max(maxCas, (uint64_t)(*it)->getCas());
+            ++stats.flusher_todo;
+        } else {
+            stats.decrDiskQueueSize(1);
+            vb->doStatsForFlushing(*(*it), (*it)->size());
+        }
+    }
+    return items_flushed;
+}
+
+void EventuallyPersistentStore::persistedSnapshot(RCPtr<VBucket> &vb,
+                                              const snapshot_range_t &range) {
+    uint16_t vbid = vb->getId();
+    if (vb->rejectQueue.empty()) {
+        vb->setPersistedSnapshot(range.start, range.end);
+        uint64_t highSeqno = getRWUnderlying(vbid)->getLastPersistedSeqno(vbid);
+        if (highSeqno > 0 &&
+            highSeqno != vbMap.getPersistenceSeqno(vbid)) {
+            vbMap.setPersistenceSeqno(vbid, highSeqno);
+            vb->notifySeqnoPersisted(highSeqno);
+        }
+    }
+}
+
+bool EventuallyPersistentStore::completeFlush(RCPtr<VBucket> &vb) {
+    uint16_t vbid = vb->getId();
+    if (vb->checkpointManager.getNumCheckpoints() > 1) {
+        wakeUpCheckpointRemover();
+    }
+
+    if (vb->rejectQueue.empty()) {
+        vb->checkpointManager.itemsPersisted();
+        uint64_t seqno = vbMap.getPersistenceSeqno(vbid);
+        uint64_t chkid = vb->checkpointManager.getPersistenceCursorPreChkId();
+        vb->notifyCheckpointPersisted(engine, seqno, true);
+        vb->notifyCheckpointPersisted(engine, chkid, false);
+        if (chkid > 0 && chkid != vbMap.getPersistenceCheckpointId(vbid)) {
+            vbMap.setPersistenceCheckpointId(vbid, chkid);
         }
+        return true;
+    }
+    return false;
+}
+
+void EventuallyPersistentStore::updateCommitStats(int items_flushed,
+                                                  hrtime_t start,
+                                                  rel_time_t flush_start) {
+    ++stats.flusherCommits;
+    stats.flusherCommitItems.fetch_add(items_flushed);
+    hrtime_t end = gethrtime();
+    uint64_t commit_time = (end - start) / 1000000;
+    uint64_t trans_time = (end - flush_start) / 1000000;
+
+    lastTransTimePerItem = (items_flushed == 0) ? 0 :
+        static_cast<double>(trans_time) /
+        static_cast<double>(items_flushed);
+    stats.commit_time.store(commit_time);
+    stats.cumulativeCommitTime.fetch_add(commit_time);
+    stats.cumulativeFlushTime.fetch_add(ep_current_time()
+                                        - flush_start);
+    stats.flusher_todo.store(0);
+}
+
+int EventuallyPersistentStore::flushVBucket(uint16_t vbid) {
+    if (flushAllPending(vbid)) {
+        return 0;
     }
 
     if (vbMap.isBucketCreation(vbid)) {
@@ -3068,16 +3316,7 @@ int EventuallyPersistentStore::flushVBucket(uint16_t vbid) {
         std::vector<queued_item> items;
         KVStore *rwUnderlying = getRWUnderlying(vbid);
 
-        while (!vb->rejectQueue.empty()) {
-            items.push_back(vb->rejectQueue.front());
-            vb->rejectQueue.pop();
-        }
-
-        const std::string cursor(CheckpointManager::pCursorName);
-        vb->getBackfillItems(items);
-
-        snapshot_range_t range;
-        range = vb->checkpointManager.getAllItemsForCursor(cursor, items);
+        snapshot_range_t range = getItemsToFlush(vb, items);
 
         if (!items.empty()) {
             while (!rwUnderlying->begin()) {
@@ -3086,33 +3325,11 @@ int EventuallyPersistentStore::flushVBucket(uint16_t vbid) {
                     "Retry in 1 sec ...");
                 sleep(1);
             }
-            rwUnderlying->optimizeWrites(items);
 
-            Item *prev = NULL;
             uint64_t maxSeqno = 0;
             uint64_t maxCas = 0;
             std::list<PersistenceCallback*> pcbs;
-            std::vector<queued_item>::iterator it = items.begin();
-            for(; it != items.end(); ++it) {
-                if ((*it)->getOperation() != queue_op_set &&
-                    (*it)->getOperation() != queue_op_del) {
-                    continue;
-                } else if (!prev || prev->getKey() != (*it)->getKey()) {
-                    prev = (*it).get();
-                    ++items_flushed;
-                    PersistenceCallback *cb = flushOneDelOrSet(*it, vb);
-                    if (cb) {
-                        pcbs.push_back(cb);
-                    }
-
-                    maxSeqno = std::max(maxSeqno, (uint64_t)(*it)->getBySeqno());
-                    maxCas = std::max(maxCas, (uint64_t)(*it)->getCas());
-                    ++stats.flusher_todo;
-                } else {
-                    stats.decrDiskQueueSize(1);
-                    vb->doStatsForFlushing(*(*it), (*it)->size());
-                }
-            }
+            items_flushed = flushItems(vb, items, pcbs, maxSeqno, maxCas);
 
             BlockTimer timer(&stats.diskCommitHisto, "disk_commit",
                              stats.timingLog);
@@ -3132,53 +3349,147 @@ int EventuallyPersistentStore::flushVBucket(uint16_t vbid) {
 
             }
 
-            if (vb->rejectQueue.empty()) {
-                vb->setPersistedSnapshot(range.start, range.end);
-                uint64_t highSeqno = rwUnderlying->getLastPersistedSeqno(vbid);
-                if (highSeqno > 0 &&
-                    highSeqno != vbMap.getPersistenceSeqno(vbid)) {
-                    vbMap.setPersistenceSeqno(vbid, highSeqno);
-                    vb->notifySeqnoPersisted(highSeqno);
-                }
-            }
+            persistedSnapshot(vb, range);
 
             while (!pcbs.empty()) {
                 delete pcbs.front();
                 pcbs.pop_front();
             }
 
-            ++stats.flusherCommits;
-            hrtime_t end = gethrtime();
-            uint64_t commit_time = (end - start) / 1000000;
-            uint64_t trans_time = (end - flush_start) / 1000000;
-
-            lastTransTimePerItem = (items_flushed == 0) ? 0 :
-                static_cast<double>(trans_time) /
-                static_cast<double>(items_flushed);
-            stats.commit_time.store(commit_time);
-            stats.cumulativeCommitTime.fetch_add(commit_time);
-            stats.cumulativeFlushTime.fetch_add(ep_current_time()
-                                                - flush_start);
-            stats.flusher_todo.store(0);
+            updateCommitStats(items_flushed, start, flush_start);
         }
 
         rwUnderlying->pendingTasks();
 
-        if (vb->checkpointManager.getNumCheckpoints() > 1) {
-            wakeUpCheckpointRemover();
+        if (!completeFlush(vb)) {
+            return RETRY_FLUSH_VBUCKET;
         }
+    }
 
-        if (vb->rejectQueue.empty()) {
-            vb->checkpointManager.itemsPersisted();
-            uint64_t seqno = vbMap.getPersistenceSeqno(vbid);
-            uint64_t chkid = vb->checkpointManager.getPersistenceCursorPreChkId();
-            vb->notifyCheckpointPersisted(engine, seqno, true);
-            vb->notifyCheckpointPersisted(engine, chkid, false);
-            if (chkid > 0 && chkid != vbMap.getPersistenceCheckpointId(vbid)) {
-                vbMap.setPersistenceCheckpointId(vbid, chkid);
+    return items_flushed;
+}
+
+int EventuallyPersistentStore::flushVBuckets(std::queue<uint16_t> &vbs,
+                                             std::vector<uint16_t> &retry) {
+    if (vbs.empty() || flushAllPending(vbs.front())) {
+        return 0;
+    }
+
+    int items_flushed = 0;
+    rel_time_t flush_start = ep_current_time();
+    size_t maxItems = groupCommitMaxItems.load();
+    size_t maxBytes = groupCommitMaxBytes.load();
+
+    // The vbuckets in this batch, their items and the locks that keep
+    // them from being deleted or reset until the commit completes.
+    std::list<LockHolder> locks;
+    std::vector<RCPtr<VBucket> > batch;
+    std::vector<std::vector<queued_item> > batchItems;
+    std::vector<snapshot_range_t> ranges;
+    size_t numItems = 0;
+    size_t numBytes = 0;
+    KVStore *rwUnderlying = NULL;
+
+    while (!vbs.empty() && numItems < maxItems && numBytes < maxBytes) {
+        uint16_t vbid = vbs.front();
+        vbs.pop();
+
+        if (vbMap.isBucketCreation(vbid)) {
+            retry.push_back(vbid);
+            continue;
+        }
+
+        RCPtr<VBucket> vb = vbMap.getBucket(vbid);
+        if (!vb) {
+            continue;
+        }
+
+        LockHolder lh(vb_mutexes[vbid], true /*tryLock*/);
+        if (!lh.islocked()) { // Try another bucket if this one is locked
+            retry.push_back(vbid); // to avoid blocking flusher
+            continue;
+        }
+        locks.push_back(lh);
+
+        cb_assert(!rwUnderlying || rwUnderlying == getRWUnderlying(vbid));
+        rwUnderlying = getRWUnderlying(vbid);
+
+        batch.push_back(vb);
+        batchItems.push_back(std::vector<queued_item>());
+        std::vector<queued_item> &items = batchItems.back();
+        ranges.push_back(getItemsToFlush(vb, items));
+        numItems += items.size();
+        std::vector<queued_item>::iterator it = items.begin();
+        for (; it != items.end(); ++it) {
+            numBytes += (*it)->size();
+        }
+    }
+
+    if (numItems > 0) {
+        while (!rwUnderlying->begin()) {
+            ++stats.beginFailed;
+            LOG(EXTENSION_LOG_WARNING, "Failed to start a transaction!!! "
+                "Retry in 1 sec ...");
+            sleep(1);
+        }
+
+        KVStatsCallback cb(this);
+        std::list<PersistenceCallback*> pcbs;
+        std::vector<VBucketCommit> commits;
+        for (size_t i = 0; i < batch.size(); ++i) {
+            if (batchItems[i].empty()) {
+                continue;
             }
-        } else {
-            return RETRY_FLUSH_VBUCKET;
+            uint64_t maxSeqno = 0;
+            uint64_t maxCas = 0;
+            items_flushed += flushItems(batch[i], batchItems[i], pcbs,
+                                        maxSeqno, maxCas);
+            if (batch[i]->getState() == vbucket_state_active) {
+                ranges[i].start = maxSeqno;
+                ranges[i].end = maxSeqno;
+            }
+            VBucketCommit commit;
+            commit.vbucket = static_cast<uint16_t>(batch[i]->getId());
+            commit.snapStartSeqno = ranges[i].start;
+            commit.snapEndSeqno = ranges[i].end;
+            commit.maxCas = maxCas;
+            commit.driftCounter =
+                static_cast<uint64_t>(batch[i]->getDriftCounter());
+            commits.push_back(commit);
+        }
+
+        BlockTimer timer(&stats.diskCommitHisto, "disk_commit",
+                         stats.timingLog);
+        hrtime_t start = gethrtime();
+
+        while (!rwUnderlying->groupCommit(&cb, commits)) {
+            ++stats.commitFailed;
+            LOG(EXTENSION_LOG_WARNING, "Flusher commit failed!!! Retry in "
+                "1 sec...\n");
+            sleep(1);
+        }
+
+        for (size_t i = 0; i < batch.size(); ++i) {
+            if (!batchItems[i].empty()) {
+                persistedSnapshot(batch[i], ranges[i]);
+            }
+        }
+
+        while (!pcbs.empty()) {
+            delete pcbs.front();
+            pcbs.pop_front();
+        }
+
+        updateCommitStats(items_flushed, start, flush_start);
+    }
+
+    if (rwUnderlying) {
+        rwUnderlying->pendingTasks();
+    }
+
+    for (size_t i = 0; i < batch.size(); ++i) {
+        if (!completeFlush(batch[i])) {
+            retry.push_back(batch[i]->getId());
         }
     }
 
@@ -3214,6 +3525,7 @@ EventuallyPersistentStore::flushOneDelOrSet(const queued_item &qi,
     }
 
     KVStore *rwUnderlying = getRWUnderlying(qi->getVBucketId());
+    key_existence_t existence = getKeyExistence(qi, vb);
     if (!deleted) {
         // TODO: Need to separate disk_insert from disk_update because
         // bySeqno doesn't give us that information.
@@ -3223,18 +3535,44 @@ EventuallyPersistentStore::flushOneDelOrSet(const queued_item &qi,
                          stats.timingLog);
         PersistenceCallback *cb =
             new PersistenceCallback(qi, vb, this, &stats, qi->getCas());
-        rwUnderlying->set(*qi, *cb);
+        rwUnderlying->set(*qi, *cb, existence);
         return cb;
     } else {
         BlockTimer timer(&stats.diskDelHisto, "disk_delete",
                          stats.timingLog);
         PersistenceCallback *cb =
             new PersistenceCallback(qi, vb, this, &stats, 0);
-        rwUnderlying->del(*qi, *cb);
+        rwUnderlying->del(*qi, *cb, existence);
         return cb;
     }
 }
 
+key_existence_t EventuallyPersistentStore::getKeyExistence(
+                                                    const queued_item &qi,
+                                                    RCPtr<VBucket> &vb) {
+    int bucket_num(0);
+    const KeyView key(qi->getKey());
+    LockHolder lh = vb->ht.getLockedBucket(key, &bucket_num);
+    StoredValue *v = vb->ht.unlocked_find(key, bucket_num, true, false);
+    if (!v || v->isTempItem()) {
+        return KEY_EXISTENCE_UNKNOWN;
+    }
+
+    if (!v->isNewCacheItem()) {
+        // A set of this value has been persisted, so the key is on disk.
+        // A deletion may have been persisted since, which the value
+        // doesn't tell.
+        return qi->isDeleted() ? KEY_EXISTENCE_UNKNOWN : KEY_KNOWN_EXISTING;
+    }
+
+    // Every key on disk is resident with value only eviction, and this
+    // one hasn't been persisted yet.
+    if (eviction_policy == VALUE_ONLY) {
+        return KEY_KNOWN_NEW;
+    }
+    return KEY_EXISTENCE_UNKNOWN;
+}
+
 void EventuallyPersistentStore::queueDirty(RCPtr<VBucket> &vb,
                                            StoredValue* v,
                                            LockHolder *plh,
@@ -3249,7 +3587,7 @@ void EventuallyPersistentStore::queueDirty(RCPtr<VBucket> &vb,
             v->setConflictResMode(last_write_wins);
         }
 
-        queued_item qi(v->toItem(false, vb->getId()));
+        queued_item qi(v->toItem(false, vb->getId(), vb->ht));
 
         bool rv = tapBackfill ? vb->queueBackfillItem(qi, genBySeqno) :
                                 vb->checkpointManager.queueDirty(vb, qi,
@@ -238,6 +238,20 @@ public:
      */
     ENGINE_ERROR_CODE replace(const Item &item, const void *cookie);
 
+    /**
+     * Append or prepend the value of an item to the one in the store,
+     * without the stored value leaving the hash bucket lock.
+     *
+     * @param item the item whose value to add; on success it gets the
+     *             cas and seqno of the new value
+     * @param cookie the cookie representing the client to store the item
+     * @param append true to append the value, false to prepend it
+     * @param maxItemSize the largest the combined value may be
+     * @return the result of the operation
+     */
+    ENGINE_ERROR_CODE appendOrPrepend(const Item &item, const void *cookie,
+                                      bool append, size_t maxItemSize);
+
     /**
      * Add an TAP backfill item into its corresponding vbucket
      * @param item the item to be added
@@ -261,7 +275,7 @@ public:
      *
      * @return a GetValue representing the result of the request
      */
-    GetValue get(const std::string &key, uint16_t vbucket,
+    GetValue get(const KeyView &key, uint16_t vbucket,
                  const void *cookie, bool queueBG=true,
                  bool honorStates=true, bool trackReference=true) {
         return getInternal(key, vbucket, cookie, queueBG, honorStates,
@@ -280,7 +294,7 @@ public:
      *
      * @return a GetValue representing the result of the request
      */
-    GetValue getReplica(const std::string &key, uint16_t vbucket,
+    GetValue getReplica(const KeyView &key, uint16_t vbucket,
                         const void *cookie, bool queueBG=true) {
         return getInternal(key, vbucket, cookie, queueBG, true,
                            vbucket_state_replica);
@@ -778,6 +792,16 @@ public:
      */
     int flushVBucket(uint16_t vbid);
 
+    /**
+     * Flushes the vbuckets at the front of the given queue with a single
+     * commit, taking vbuckets until the group commit item or byte budget
+     * is reached. All of them must belong to the same shard.
+     * @param vbs The vbuckets waiting to be flushed; flushed ones are popped
+     * @param retry Receives the vbuckets that have to be flushed again
+     * @return The amount of items flushed
+     */
+    int flushVBuckets(std::queue<uint16_t> &vbs, std::vector<uint16_t> &retry);
+
     void addKVStoreStats(ADD_STAT add_stat, const void* cookie);
 
     void addKVStoreTimingStats(ADD_STAT add_stat, const void* cookie);
@@ -808,6 +832,22 @@ public:
         compactionWriteQueueCap = to;
     }
 
+    void setGroupCommit(bool to) {
+        groupCommit.store(to);
+    }
+
+    bool isGroupCommit() {
+        return groupCommit.load();
+    }
+
+    void setGroupCommitMaxItems(size_t to) {
+        groupCommitMaxItems.store(to);
+    }
+
+    void setGroupCommitMaxBytes(size_t to) {
+        groupCommitMaxBytes.store(to);
+    }
+
     void setCompactionExpMemThreshold(size_t to) {
         compactionExpMemThreshold = static_cast<double>(to) / 100.0;
     }
@@ -885,7 +925,7 @@ private:
      *
      * @return true if the object was found and method was invoked
      */
-    bool invokeOnLockedStoredValue(const std::string &key, uint16_t vbid,
+    bool invokeOnLockedStoredValue(const KeyView &key, uint16_t vbid,
                                    void (StoredValue::* f)()) {
         RCPtr<VBucket> vb = getVBucket(vbid);
         if (!vb) {
@@ -903,14 +943,33 @@ private:
     }
 
     void flushOneDeleteAll(void);
+    /**
+     * What the hash table tells about the key of an item to flush already
+     * being on disk.
+     */
+    key_existence_t getKeyExistence(const queued_item &qi,
+                                    RCPtr<VBucket> &vb);
+
     PersistenceCallback* flushOneDelOrSet(const queued_item &qi,
                                           RCPtr<VBucket> &vb);
 
-    StoredValue *fetchValidValue(RCPtr<VBucket> &vb, const std::string &key,
+    /* Steps of a vbucket flush shared by flushVBucket and flushVBuckets */
+    bool flushAllPending(uint16_t vbid);
+    snapshot_range_t getItemsToFlush(RCPtr<VBucket> &vb,
+                                     std::vector<queued_item> &items);
+    int flushItems(RCPtr<VBucket> &vb, std::vector<queued_item> &items,
+                   std::list<PersistenceCallback*> &pcbs,
+                   uint64_t &maxSeqno, uint64_t &maxCas);
+    void persistedSnapshot(RCPtr<VBucket> &vb, const snapshot_range_t &range);
+    bool completeFlush(RCPtr<VBucket> &vb);
+    void updateCommitStats(int items_flushed, hrtime_t start,
+                           rel_time_t flush_start);
+
+    StoredValue *fetchValidValue(RCPtr<VBucket> &vb, const KeyView &key,
                                  int bucket_num, bool wantsDeleted=false,
                                  bool trackReference=true, bool queueExpired=true);
 
-    GetValue getInternal(const std::string &key, uint16_t vbucket,
+    GetValue getInternal(const KeyView &key, uint16_t vbucket,
                          const void *cookie, bool queueBG,
                          bool honorStates,
                          vbucket_state_t allowedState,
@@ -946,6 +1005,12 @@ private:
     size_t                          compactionWriteQueueCap;
     float                           compactionExpMemThreshold;
 
+    /* Flush several vbuckets of a shard with one commit, up to the
+     * given number of items or bytes per commit. */
+    AtomicValue<bool>               groupCommit;
+    AtomicValue<size_t>             groupCommitMaxItems;
+    AtomicValue<size_t>             groupCommitMaxBytes;
+
     /* Array of mutexes for each vbucket
      * Used by flush operations: flushVB, deleteVB, compactVB, snapshotVB */
     Mutex                          *vb_mutexes;
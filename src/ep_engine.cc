@@ -548,12 +548,34 @@ extern "C" {
                 checkNumeric(valz);
                 validate(v, 1, std::numeric_limits<int>::max());
                 e->getConfiguration().setDefragmenterChunkDuration(v);
+            } else if (strcmp(keyz, "defragmenter_compress_values") == 0) {
+                if (strcmp(valz, "true") == 0) {
+                    e->getConfiguration().setDefragmenterCompressValues(true);
+                } else {
+                    e->getConfiguration().setDefragmenterCompressValues(false);
+                }
             } else if (strcmp(keyz, "defragmenter_run") == 0) {
                 e->runDefragmenterTask();
             } else if (strcmp(keyz, "compaction_write_queue_cap") == 0) {
                 checkNumeric(valz);
                 validate(v, 1, std::numeric_limits<int>::max());
                 e->getConfiguration().setCompactionWriteQueueCap(v);
+            } else if (strcmp(keyz, "flusher_group_commit") == 0) {
+                if (strcmp(valz, "true") == 0) {
+                    e->getConfiguration().setFlusherGroupCommit(true);
+                } else if (strcmp(valz, "false") == 0) {
+                    e->getConfiguration().setFlusherGroupCommit(false);
+                } else {
+                    throw std::runtime_error("Value expected: true/false.");
+                }
+            } else if (strcmp(keyz, "flusher_group_commit_max_items") == 0) {
+                checkNumeric(valz);
+                validate(v, 1, std::numeric_limits<int>::max());
+                e->getConfiguration().setFlusherGroupCommitMaxItems(v);
+            } else if (strcmp(keyz, "flusher_group_commit_max_bytes") == 0) {
+                checkNumeric(valz);
+                validate(v, 1, std::numeric_limits<int>::max());
+                e->getConfiguration().setFlusherGroupCommitMaxBytes(v);
             } else {
                 *msg = "Unknown config param";
                 rv = PROTOCOL_BINARY_RESPONSE_KEY_ENOENT;
@@ -2031,6 +2053,9 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::initialize(const char* config) {
     // Start updating the variables from the config!
     HashTable::setDefaultNumBuckets(configuration.getHtSize());
     HashTable::setDefaultNumLocks(configuration.getHtLocks());
+    HashTable::setDefaultLayout(configuration.getHtLayout());
+    HashTable::setDefaultIncrementalResize(
+                                    configuration.isHtIncrementalResize());
     StoredValue::setMutationMemoryThreshold(
                                       configuration.getMutationMemThreshold());
 
@@ -2170,7 +2195,6 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::store(const void *cookie,
     BlockTimer timer(&stats.storeCmdHisto);
     ENGINE_ERROR_CODE ret;
     Item *it = static_cast<Item*>(itm);
-    item *i = NULL;
 
     it->setVBucketId(vbucket);
 
@@ -2218,56 +2242,15 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::store(const void *cookie,
 
     case OPERATION_APPEND:
     case OPERATION_PREPEND:
-        do {
-            if ((ret = get(cookie, &i, it->getKey().c_str(),
-                           it->getNKey(), vbucket)) == ENGINE_SUCCESS) {
-                Item *old = reinterpret_cast<Item*>(i);
-
-                if (old->getCas() == (uint64_t) -1) {
-                    // item is locked against updates
-                    itemRelease(cookie, i);
-                    return ENGINE_TMPFAIL;
-                }
-
-                if (it->getCas() != 0 && old->getCas() != it->getCas()) {
-                    itemRelease(cookie, i);
-                    return ENGINE_KEY_EEXISTS;
-                }
-
-                if (operation == OPERATION_APPEND) {
-                    ret = old->append(*it, maxItemSize);
-                } else {
-                    ret = old->prepend(*it, maxItemSize);
-                }
-
-                if (ret != ENGINE_SUCCESS) {
-                    itemRelease(cookie, i);
-                    if (ret == ENGINE_E2BIG) {
-                        return ret;
-                    } else {
-                        return memoryCondition();
-                    }
-                } else {
-                    if (old->getDataType() == PROTOCOL_BINARY_DATATYPE_JSON) {
-                        // Set the datatype of the new document to BINARY (0),
-                        // as appending/prepending anything to JSON breaks the
-                        // json data structure.
-                        old->setDataType(PROTOCOL_BINARY_RAW_BYTES);
-                    } else if (old->getDataType() ==
-                                    PROTOCOL_BINARY_DATATYPE_COMPRESSED_JSON) {
-                        // Set the datatype of the new document to
-                        // COMPRESSED_BINARY, as appending/prepending anything
-                        // to JSON breaks the json data structure.
-                        old->setDataType(PROTOCOL_BINARY_DATATYPE_COMPRESSED);
-                    }
-                }
-
-                ret = store(cookie, old, cas, OPERATION_CAS, vbucket);
-
-                it->setBySeqno(old->getBySeqno());
-                itemRelease(cookie, i);
-            }
-        } while (ret == ENGINE_KEY_EEXISTS);
+        if (isDegradedMode()) {
+            return ENGINE_TMPFAIL;
+        }
+        ret = epstore->appendOrPrepend(*it, cookie,
+                                       operation == OPERATION_APPEND,
+                                       maxItemSize);
+        if (ret == ENGINE_SUCCESS) {
+            *cas = it->getCas();
+        }
 
         // Map the error code back to what memcapable expects
         if (ret == ENGINE_KEY_ENOENT) {
@@ -3065,6 +3048,15 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doEngineStats(const void *cookie,
                     add_stat, cookie);
     add_casted_stat("ep_commit_num", epstats.flusherCommits,
                     add_stat, cookie);
+    size_t commits = epstats.flusherCommits.load();
+    size_t commitItems = epstats.flusherCommitItems.load();
+    add_casted_stat("ep_commit_items", commitItems, add_stat, cookie);
+    add_casted_stat("ep_commit_items_avg",
+                    commits == 0 ? 0 : commitItems / commits,
+                    add_stat, cookie);
+    time_t uptime = ep_real_time() - startupTime;
+    add_casted_stat("ep_commits_per_sec",
+                    uptime <= 0 ? 0 : commits / uptime, add_stat, cookie);
     add_casted_stat("ep_commit_time",
                     epstats.commit_time, add_stat, cookie);
     add_casted_stat("ep_commit_time_total",
@@ -3292,6 +3284,7 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doEngineStats(const void *cookie,
                     pendingCountVisitor.getMetaDataDisk(),
                     add_stat, cookie);
 
+    stats.flushPendingMemory();
     size_t memUsed =  stats.getTotalMemoryUsed();
     add_casted_stat("mem_used", memUsed, add_stat, cookie);
     add_casted_stat("bytes", memUsed, add_stat, cookie);
@@ -3332,6 +3325,8 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doEngineStats(const void *cookie,
                     add_stat, cookie);
     add_casted_stat("ep_max_bg_remaining_jobs", epstats.maxRemainingBgJobs,
                     add_stat, cookie);
+    add_casted_stat("ep_bg_fetch_inflight", epstats.numBgFetchInflight,
+                    add_stat, cookie);
     add_casted_stat("ep_tap_bg_fetched", stats.numTapBGFetched,
                     add_stat, cookie);
     add_casted_stat("ep_tap_bg_fetch_requeued", stats.numTapBGFetchRequeued,
@@ -3489,12 +3484,23 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doEngineStats(const void *cookie,
                     add_stat, cookie);
     add_casted_stat("ep_defragmenter_num_moved", epstats.defragNumMoved,
                     add_stat, cookie);
+    add_casted_stat("ep_compressor_num_compressed",
+                    epstats.compressorNumCompressed, add_stat, cookie);
+    add_casted_stat("ep_compressor_bytes_saved",
+                    epstats.compressorBytesSaved, add_stat, cookie);
+    add_casted_stat("ep_compressor_compress_time",
+                    epstats.compressorCompressTime, add_stat, cookie);
+    add_casted_stat("ep_compressor_num_inflated",
+                    epstats.compressorNumInflated, add_stat, cookie);
+    add_casted_stat("ep_compressor_inflate_time",
+                    epstats.compressorInflateTime, add_stat, cookie);
 
     return ENGINE_SUCCESS;
 }
 
 ENGINE_ERROR_CODE EventuallyPersistentEngine::doMemoryStats(const void *cookie,
                                                            ADD_STAT add_stat) {
+    stats.flushPendingMemory();
     add_casted_stat("bytes", stats.getTotalMemoryUsed(), add_stat, cookie);
     add_casted_stat("mem_used", stats.getTotalMemoryUsed(), add_stat, cookie);
     add_casted_stat("ep_kv_size", stats.currentSize, add_stat, cookie);
@@ -3632,6 +3638,10 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doHashStats(const void *cookie,
             add_casted_stat(buf, vb->ht.getSize(), add_stat, cookie);
             snprintf(buf, sizeof(buf), "vb_%d:locks", vbid);
             add_casted_stat(buf, vb->ht.getNumLocks(), add_stat, cookie);
+            snprintf(buf, sizeof(buf), "vb_%d:layout", vbid);
+            add_casted_stat(buf,
+                            vb->ht.getLayout() == HT_LAYOUT_TAGGED ?
+                            "tagged" : "chained", add_stat, cookie);
             snprintf(buf, sizeof(buf), "vb_%d:min_depth", vbid);
             add_casted_stat(buf, depthVisitor.min == -1 ? 0 : depthVisitor.min,
                             add_stat, cookie);
@@ -3645,6 +3655,12 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doHashStats(const void *cookie,
             add_casted_stat(buf, depthVisitor.size, add_stat, cookie);
             snprintf(buf, sizeof(buf), "vb_%d:resized", vbid);
             add_casted_stat(buf, vb->ht.getNumResizes(), add_stat, cookie);
+            snprintf(buf, sizeof(buf), "vb_%d:resize_remaining", vbid);
+            add_casted_stat(buf, vb->ht.getResizeRemaining(), add_stat,
+                            cookie);
+            snprintf(buf, sizeof(buf), "vb_%d:resize_migrated", vbid);
+            add_casted_stat(buf, vb->ht.getNumMigratedItems(), add_stat,
+                            cookie);
             snprintf(buf, sizeof(buf), "vb_%d:mem_size", vbid);
             add_casted_stat(buf, vb->ht.memSize, add_stat, cookie);
             snprintf(buf, sizeof(buf), "vb_%d:mem_size_counted", vbid);
@@ -4033,6 +4049,12 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doDcpStats(const void *cookie,
                     dcpConnMap_->getNumActiveSnoozingBackfills(), add_stat, cookie);
     add_casted_stat("ep_dcp_max_running_backfills",
                     dcpConnMap_->getMaxActiveSnoozingBackfills(), add_stat, cookie);
+    add_casted_stat("ep_dcp_num_backfill_scans",
+                    dcpConnMap_->getNumBackfillScans(), add_stat, cookie);
+    add_casted_stat("ep_dcp_max_backfill_scans",
+                    dcpConnMap_->getMaxBackfillScans(), add_stat, cookie);
+    add_casted_stat("ep_dcp_peak_backfill_scans",
+                    dcpConnMap_->getPeakBackfillScans(), add_stat, cookie);
 
     return ENGINE_SUCCESS;
 }
@@ -4162,6 +4184,12 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doTimingStats(const void *cookie,
     // Misc
     add_casted_stat("notify_io", stats.notifyIOHisto, add_stat, cookie);
     add_casted_stat("batch_read", stats.getMultiHisto, add_stat, cookie);
+    add_casted_stat("bg_fetch_batch_size", stats.bgFetchBatchSizeHisto,
+                    add_stat, cookie);
+    add_casted_stat("bg_fetch_queue_depth", stats.bgFetchQueueDepthHisto,
+                    add_stat, cookie);
+    add_casted_stat("bg_fetch_concurrency", stats.bgFetchConcurrencyHisto,
+                    add_stat, cookie);
 
     // Disk stats
     add_casted_stat("disk_insert", stats.diskInsertHisto, add_stat, cookie);
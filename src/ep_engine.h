@@ -248,7 +248,8 @@ public:
     void itemRelease(const void* cookie, item *itm)
     {
         (void)cookie;
-        delete (Item*)itm;
+        // DCP mutations hand out items still shared with the checkpoints.
+        queued_item::release((Item*)itm);
     }
 
     ENGINE_ERROR_CODE get(const void* cookie,
@@ -259,7 +260,7 @@ public:
                           bool track_stat = false)
     {
         BlockTimer timer(&stats.getCmdHisto);
-        std::string k(static_cast<const char*>(key), nkey);
+        KeyView k(static_cast<const char*>(key), nkey);
 
         GetValue gv(epstore->get(k, vbucket, cookie, serverApi->core));
         ENGINE_ERROR_CODE ret = gv.getStatus();
@@ -158,9 +158,11 @@ ExecutorPool::ExecutorPool(size_t maxThreads, size_t nTaskSets,
     curWorkers  = new AtomicValue<uint16_t>[nTaskSets];
     maxWorkers  = new AtomicValue<uint16_t>[nTaskSets];
     numReadyTasks  = new AtomicValue<size_t>[nTaskSets];
+    numLocalTasks  = new AtomicValue<size_t>[nTaskSets];
     for (size_t i = 0; i < nTaskSets; i++) {
         curWorkers[i] = 0;
         numReadyTasks[i] = 0;
+        numLocalTasks[i] = 0;
     }
     maxWorkers[WRITER_TASK_IDX] = maxWriters;
     maxWorkers[READER_TASK_IDX] = maxReaders;
@@ -186,12 +188,81 @@ ExecutorPool::~ExecutorPool(void) {
 // To prevent starvation of low priority queues, we define their
 // polling frequencies as follows ...
 #define LOW_PRIORITY_FREQ 5 // 1 out of 5 times threads check low priority Q
+// Likewise threads with tasks of their own still poll the shared queues,
+// which only they may be left to sweep, 1 out of 4 times.
+#define LOCAL_YIELD_FREQ 4
+
+TaskQueue *ExecutorPool::_startLocalTask(ExecutorThread &t, ExTask &task,
+                                         TaskQueue *q) {
+    lessLocalWork(q->getQueueType());
+    if (!task->isdead()) {
+        struct timeval now;
+        gettimeofday(&now, NULL);
+        if (less_tv(now, task->waketime)) {
+            // Snoozed since it was queued locally.
+            q->schedule(task);
+            return NULL;
+        }
+        t.curTaskType = tryNewWork(q->getQueueType());
+        if (t.curTaskType == NO_TASK_TYPE) {
+            // Leave it to the shared queue's pendingQueue.
+            q->schedule(task);
+            return NULL;
+        }
+    }
+    t.currentTask = task;
+    return q;
+}
+
+TaskQueue *ExecutorPool::_nextLocalTask(ExecutorThread &t) {
+    ExTask task;
+    TaskQueue *q;
+    while (t.popLocal(task, q)) {
+        if (TaskQueue *rq = _startLocalTask(t, task, q)) {
+            return rq;
+        }
+    }
+    return NULL;
+}
+
+TaskQueue *ExecutorPool::_stealTask(ExecutorThread &t) {
+    // Never wait for tMutex: it is held while threads are joined.
+    LockHolder lh(tMutex, true);
+    if (!lh.islocked()) {
+        return NULL;
+    }
+    ExTask task;
+    TaskQueue *q;
+    for (size_t tidx = 0; tidx < threadQ.size(); ++tidx) {
+        ExecutorThread *victim = threadQ[tidx];
+        if (victim != &t && victim->startIndex == t.startIndex &&
+            victim->stealLocal(task, q)) {
+            lh.unlock();
+            return _startLocalTask(t, task, q);
+        }
+    }
+    return NULL;
+}
+
+bool ExecutorPool::hasIncomingTasks(task_type_t qType) {
+    return (isHiPrioQset && hpTaskQ[qType]->futureQueue.hasIncoming()) ||
+           (isLowPrioQset && lpTaskQ[qType]->futureQueue.hasIncoming());
+}
 
 TaskQueue *ExecutorPool::_nextTask(ExecutorThread &t, uint8_t tick) {
     if (!tick) {
         return NULL;
     }
 
+    // Tasks this thread queued for itself go first, unless the shared
+    // queues have ready tasks that may outrank them.
+    if (numReadyTasks[t.startIndex] <= numLocalTasks[t.startIndex] &&
+        (tick % LOCAL_YIELD_FREQ)) {
+        if (TaskQueue *q = _nextLocalTask(t)) {
+            return q;
+        }
+    }
+
     unsigned int myq = t.startIndex;
     TaskQueue *checkQ; // which TaskQueue set should be polled first
     TaskQueue *checkNextQ; // which set of TaskQueue should be polled next
@@ -211,6 +282,14 @@ TaskQueue *ExecutorPool::_nextTask(ExecutorThread &t, uint8_t tick) {
             return checkQ;
         }
         if (toggle || checkQ == checkNextQ) {
+            // Out of shared work: run our own tasks, or take another
+            // thread's, before going to sleep.
+            if (TaskQueue *q = _nextLocalTask(t)) {
+                return q;
+            }
+            if (TaskQueue *q = _stealTask(t)) {
+                return q;
+            }
             TaskQueue *sleepQ = getSleepQ(myq);
             if (sleepQ->fetchNextTask(t, true)) {
                 return sleepQ;
@@ -333,6 +412,8 @@ bool ExecutorPool::_snooze(size_t taskId, double tosleep) {
     std::map<size_t, TaskQpair>::iterator itr = taskLocator.find(taskId);
     if (itr != taskLocator.end()) {
         itr->second.first->snooze(tosleep);
+        // Move it in the futureQueue if it is waiting there.
+        itr->second.second->futureQueue.refile(itr->second.first);
         return true;
     }
     return false;
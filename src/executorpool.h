@@ -39,12 +39,27 @@ typedef std::pair<RingBuffer<TaskLogEntry>*, RingBuffer<TaskLogEntry> *>
 typedef std::vector<TaskQueue *> TaskQ;
 
 class ExecutorPool {
+    friend class ExecutorPoolTest;
 public:
 
     void addWork(size_t newWork, task_type_t qType);
 
     void lessWork(task_type_t qType);
 
+    /**
+     * A ready task was queued on a thread's own queue. It stays counted as
+     * ready until a thread takes it from there, so that no thread sleeps
+     * while it waits behind its owner's current task.
+     */
+    void addLocalWork(task_type_t qType) {
+        numLocalTasks[qType]++;
+    }
+
+    void lessLocalWork(task_type_t qType) {
+        numLocalTasks[qType]--;
+        lessWork(qType);
+    }
+
     void doneWork(task_type_t &doneTaskType);
 
     task_type_t tryNewWork(task_type_t newTaskType);
@@ -63,6 +78,8 @@ public:
 
     TaskQueue *nextTask(ExecutorThread &t, uint8_t tick);
 
+    bool hasIncomingTasks(task_type_t qType);
+
     TaskQueue *getSleepQ(unsigned int curTaskType) {
         return isHiPrioQset ? hpTaskQ[curTaskType] : lpTaskQ[curTaskType];
     }
@@ -130,6 +147,9 @@ private:
     ~ExecutorPool(void);
 
     TaskQueue* _nextTask(ExecutorThread &t, uint8_t tick);
+    TaskQueue* _nextLocalTask(ExecutorThread &t);
+    TaskQueue* _stealTask(ExecutorThread &t);
+    TaskQueue* _startLocalTask(ExecutorThread &t, ExTask &task, TaskQueue *q);
     bool _cancel(size_t taskId, bool eraseTask=false);
     bool _wake(size_t taskId);
     bool _startWorkers(void);
@@ -167,6 +187,7 @@ private:
     AtomicValue<uint16_t> *curWorkers; // track # of active workers per TaskSet
     AtomicValue<uint16_t> *maxWorkers; // and limit it to the value set here
     AtomicValue<size_t> *numReadyTasks; // number of ready tasks per task set
+    AtomicValue<size_t> *numLocalTasks; // of which on threads' own queues
 
     // Set of all known buckets
     std::set<void *> buckets;
@@ -133,7 +133,16 @@ void ExecutorThread::run() {
                     }
                     // release capacity back to TaskQueue ..
                     manager->doneWork(curTaskType);
-                    timetowake = q->reschedule(currentTask, curTaskType);
+                    if (less_eq_tv(currentTask->waketime, now)) {
+                        // Due again already: run it from this thread's own
+                        // queue rather than through the shared one.
+                        timetowake = now;
+                        manager->addWork(1, q->getQueueType());
+                        manager->addLocalWork(q->getQueueType());
+                        pushLocal(currentTask, q);
+                    } else {
+                        timetowake = q->reschedule(currentTask, curTaskType);
+                    }
                     // record min waketime ...
                     if (less_tv(timetowake, waketime)) {
                         waketime = timetowake;
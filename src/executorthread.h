@@ -120,6 +120,43 @@ public:
 
 private:
 
+    /**
+     * Queue a ready task for this thread to run next.
+     */
+    void pushLocal(ExTask task, TaskQueue *q) {
+        LockHolder lh(localMutex);
+        localQueue.push_back(std::make_pair(task, q));
+    }
+
+    /**
+     * Take the oldest task this thread queued for itself.
+     */
+    bool popLocal(ExTask &task, TaskQueue *&q) {
+        LockHolder lh(localMutex);
+        if (localQueue.empty()) {
+            return false;
+        }
+        task = localQueue.front().first;
+        q = localQueue.front().second;
+        localQueue.pop_front();
+        return true;
+    }
+
+    /**
+     * Take the newest task this thread queued for itself, on behalf of
+     * another thread.
+     */
+    bool stealLocal(ExTask &task, TaskQueue *&q) {
+        LockHolder lh(localMutex);
+        if (localQueue.empty()) {
+            return false;
+        }
+        task = localQueue.back().first;
+        q = localQueue.back().second;
+        localQueue.pop_back();
+        return true;
+    }
+
     cb_thread_t thread;
     ExecutorPool *manager;
     int startIndex;
@@ -136,6 +173,11 @@ private:
     Mutex logMutex;
     RingBuffer<TaskLogEntry> tasklog;
     RingBuffer<TaskLogEntry> slowjobs;
+
+    // Ready tasks this thread claimed, or is running again; only other
+    // threads out of work take localMutex, to steal from the back.
+    Mutex localMutex;
+    std::deque<std::pair<ExTask, TaskQueue *> > localQueue;
 };
 
 #endif  // SRC_SCHEDULER_H_
@@ -279,6 +279,24 @@ void Flusher::flushVB(void) {
         if (doHighPriority && --numHighPriority == 0) {
             doHighPriority = false;
         }
+        if (store->isGroupCommit()) {
+            std::vector<uint16_t> retry;
+            size_t pending = lpVbs.size();
+            store->flushVBuckets(lpVbs, retry);
+            size_t flushed = pending - lpVbs.size();
+            if (doHighPriority && flushed > 1) {
+                // The first vbucket was accounted for above.
+                numHighPriority -= std::min(numHighPriority, flushed - 1);
+                if (numHighPriority == 0) {
+                    doHighPriority = false;
+                }
+            }
+            std::vector<uint16_t>::iterator it = retry.begin();
+            for (; it != retry.end(); ++it) {
+                lpVbs.push(*it);
+            }
+            return;
+        }
         uint16_t vbid = lpVbs.front();
         lpVbs.pop();
         if (store->flushVBucket(vbid) == RETRY_FLUSH_VBUCKET) {
@@ -15,90 +15,1940 @@
  *   limitations under the License.
  */
 
-#include "forest-kvstore/forest-kvstore.h"
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
 #include <sys/stat.h>
+#include <sys/types.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <string>
+#include <vector>
+#include <platform/dirutils.h>
+#include <cJSON.h>
+
+#include "common.h"
+#include "forest-kvstore/forest-kvstore.h"
+#define STATWRITER_NAMESPACE forestdb_engine
+#include "statwriter.h"
+#undef STATWRITER_NAMESPACE
+
+using namespace CouchbaseDirectoryUtilities;
+
+static const int MUTATION_FAILED = -1;
+static const int DOC_NOT_FOUND = 0;
+static const int MUTATION_SUCCESS = 1;
+
+/*
+ * Document metadata, in network byte order:
+ * cas (8) | exptime (4) | flags (4) | revSeqno (8) | FLEX_META_CODE (1) |
+ * datatype (1) | conflict resolution mode (1)
+ */
+static const size_t FOREST_DEFAULT_META_LEN = 24;
+static const size_t FOREST_META_LEN = FOREST_DEFAULT_META_LEN +
+                                      FLEX_DATA_OFFSET + EXT_META_LEN + 1;
+
+static const char *LOCAL_KVS_NAME = "local";
+static const char *VBSTATE_KEY = "vbstate";
+
+class NoLookupCallback : public Callback<CacheLookup> {
+public:
+    NoLookupCallback() {}
+    ~NoLookupCallback() {}
+    void callback(CacheLookup&) {}
+};
+
+static const std::string getJSONObjString(const cJSON *i) {
+    if (i == NULL) {
+        return "";
+    }
+    if (i->type != cJSON_String) {
+        abort();
+    }
+    return i->valuestring;
+}
+
+static bool allDigit(const std::string &input) {
+    if (input.empty()) {
+        return false;
+    }
+    for (size_t i = 0; i < input.length(); ++i) {
+        if (!isdigit(input[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Split a file name of the form <dir>/<vbid>.fdb.<rev>.
+ *
+ * @return false if the name doesn't belong to a vbucket file
+ */
+static bool parseDBFileName(const std::string &filename, uint16_t &vbid,
+                            uint64_t &rev) {
+    size_t pos = filename.rfind(".fdb.");
+    if (pos == std::string::npos) {
+        return false;
+    }
+#ifdef _MSC_VER
+    size_t slash = filename.find_last_of("\\/", pos);
+#else
+    size_t slash = filename.rfind("/", pos);
+#endif
+    size_t begin = (slash == std::string::npos) ? 0 : slash + 1;
+    std::string vbStr = filename.substr(begin, pos - begin);
+    std::string revStr = filename.substr(pos + sizeof(".fdb.") - 1);
+    if (!allDigit(vbStr) || !allDigit(revStr)) {
+        return false;
+    }
+    vbid = static_cast<uint16_t>(atoi(vbStr.c_str()));
+    rev = strtoull(revStr.c_str(), NULL, 10);
+    return true;
+}
+
+static int getMutationStatus(fdb_status errCode) {
+    switch (errCode) {
+    case FDB_RESULT_SUCCESS:
+        return MUTATION_SUCCESS;
+    case FDB_RESULT_NO_SUCH_FILE:
+    case FDB_RESULT_KEY_NOT_FOUND:
+        // this return causes ep engine to drop the failed flush
+        // of an item since it does not know about the itme any longer
+        return DOC_NOT_FOUND;
+    default:
+        // this return causes ep engine to keep requeuing the failed
+        // flush of an item
+        return MUTATION_FAILED;
+    }
+}
 
-ForestKVStore::ForestKVStore(KVStoreConfig &config) :
-    dbname(config.getDBName()) {
+/**
+ * The seqno of the document key-value store recorded by a commit marker.
+ */
+static fdb_seqnum_t getMarkerSeqno(const fdb_snapshot_info_t &marker) {
+    for (int64_t i = 0; i < marker.num_kvs_markers; ++i) {
+        const char *name = marker.kvs_markers[i].kv_store_name;
+        if (name == NULL || strcmp(name, "default") == 0) {
+            return marker.kvs_markers[i].seqnum;
+        }
+    }
+    return 0;
+}
+
+ForestRequest::ForestRequest(const Item &it, Callback<mutation_result> *scb,
+                             Callback<int> *dcb, key_existence_t exists) :
+    value(it.getValue()), vbucketId(it.getVBucketId()),
+    revSeqno(it.getRevSeqno()), key(it.getKey()), existence(exists),
+    setCb(scb), delCb(dcb), start(gethrtime())
+{
+    uint64_t cas = htonll(it.getCas());
+    uint32_t flags = it.getFlags();
+    uint32_t exptime = it.getExptime();
+    uint64_t revSeq = htonll(revSeqno);
+    uint8_t confresmode = static_cast<uint8_t>(it.getConflictResMode());
+    bool del = isDelete();
+
+    // Save time of deletion in expiry time field of deleted item's metadata.
+    if (del) {
+        exptime = ep_real_time();
+    }
+    exptime = htonl(exptime);
 
-    /* create the data directory */
+    memset(meta, 0, sizeof(meta));
+    memcpy(meta, &cas, 8);
+    memcpy(meta + 8, &exptime, 4);
+    memcpy(meta + 12, &flags, 4);
+    memcpy(meta + 16, &revSeq, 8);
+    *(meta + FOREST_DEFAULT_META_LEN) = FLEX_META_CODE;
+    if (del) {
+        uint8_t del_datatype = PROTOCOL_BINARY_RAW_BYTES;
+        memcpy(meta + FOREST_DEFAULT_META_LEN + FLEX_DATA_OFFSET,
+               &del_datatype, sizeof(uint8_t));
+    } else {
+        memcpy(meta + FOREST_DEFAULT_META_LEN + FLEX_DATA_OFFSET,
+               it.getExtMeta(), it.getExtMetaLen());
+    }
+    memcpy(meta + FOREST_DEFAULT_META_LEN + FLEX_DATA_OFFSET + EXT_META_LEN,
+           &confresmode, 1);
+
+    memset(&doc, 0, sizeof(doc));
+    doc.key = const_cast<char *>(key.c_str());
+    doc.keylen = it.getNKey();
+    doc.meta = meta;
+    doc.metalen = FOREST_META_LEN;
+    if (!del && it.getNBytes()) {
+        doc.body = const_cast<char *>(value->getData());
+        doc.bodylen = it.getNBytes();
+    }
+    doc.deleted = del;
+    // Keep the seqno the engine assigned, so DCP and rollbacks can rely on
+    // the sequence index.
+    doc.seqnum = it.getBySeqno();
+    doc.flags = FDB_CUSTOM_SEQNUM;
+}
+
+ForestKVStore::ForestKVStore(KVStoreConfig &config, bool read_only) :
+    KVStore(read_only), configuration(config),
+    dbname(configuration.getDBName()), intransaction(false),
+    scanCounter(0), readOnlyPeer(NULL)
+{
     createDataDir(dbname);
+
+    numDbFiles = configuration.getMaxVBuckets();
+    cachedVBStates.reserve(numDbFiles);
+    vbFiles.reserve(numDbFiles);
+    for (uint16_t i = 0; i < numDbFiles; i++) {
+        // pre-allocate to avoid rehashing for safe read-only operations
+        dbFileRevMap.push_back(1);
+        fileRewinds.push_back(0);
+        cachedVBStates.push_back((vbucket_state *)NULL);
+        vbFiles.push_back(new ForestVBFile());
+    }
+
+    initialize();
 }
 
 ForestKVStore::ForestKVStore(const ForestKVStore &copyFrom) :
-    dbname(copyFrom.dbname) {
-
-    /* create the data directory */
+    KVStore(copyFrom), configuration(copyFrom.configuration),
+    dbname(copyFrom.dbname), numDbFiles(copyFrom.numDbFiles),
+    intransaction(false), fileConfig(copyFrom.fileConfig),
+    kvsConfig(copyFrom.kvsConfig), dbFileRevMap(copyFrom.dbFileRevMap),
+    fileRewinds(copyFrom.fileRewinds), scanCounter(0), readOnlyPeer(NULL)
+{
     createDataDir(dbname);
+
+    for (uint16_t i = 0; i < numDbFiles; i++) {
+        cachedVBStates.push_back((vbucket_state *)NULL);
+        vbFiles.push_back(new ForestVBFile());
+    }
+}
+
+void ForestKVStore::initialize() {
+    fileConfig = fdb_get_default_config();
+    fileConfig.seqtree_opt = FDB_SEQTREE_USE;
+    // Compaction is driven by the engine's compaction tasks.
+    fileConfig.compaction_mode = FDB_COMPACTION_MANUAL;
+    fileConfig.multi_kv_instances = true;
+    fileConfig.compress_document_body = true;
+    if (isReadOnly()) {
+        fileConfig.flags = FDB_OPEN_FLAG_RDONLY;
+    }
+
+    kvsConfig = fdb_get_default_kvs_config();
+    kvsConfig.create_if_missing = !isReadOnly();
+
+    // Only keep the latest revision of every vbucket file.
+    std::map<uint16_t, uint64_t> revs;
+    std::vector<std::string> files = findFilesContaining(dbname, ".fdb.");
+    std::vector<std::string>::iterator fit = files.begin();
+    for (; fit != files.end(); ++fit) {
+        uint16_t vbid;
+        uint64_t rev;
+        if (!parseDBFileName(*fit, vbid, rev) || vbid >= numDbFiles) {
+            LOG(EXTENSION_LOG_DEBUG,
+                "Non-vbucket database file, %s, skip adding "
+                "to ForestKVStore dbFileMap\n", fit->c_str());
+            continue;
+        }
+        std::map<uint16_t, uint64_t>::iterator rit = revs.find(vbid);
+        if (rit == revs.end()) {
+            revs[vbid] = rev;
+            continue;
+        }
+        uint64_t stale = std::min(rit->second, rev);
+        rit->second = std::max(rit->second, rev);
+        if (!isReadOnly()) {
+            std::string stale_file = getDBFileName(vbid, stale);
+            if (remove(stale_file.c_str()) != 0) {
+                LOG(EXTENSION_LOG_WARNING,
+                    "Warning: Failed to remove the stale file '%s': %s",
+                    stale_file.c_str(), strerror(errno));
+            } else {
+                LOG(EXTENSION_LOG_WARNING,
+                    "Warning: Removed stale file '%s'", stale_file.c_str());
+            }
+        }
+    }
+
+    std::map<uint16_t, uint64_t>::iterator it = revs.begin();
+    for (; it != revs.end(); ++it) {
+        uint16_t id = it->first;
+        dbFileRevMap[id] = it->second;
+
+        ForestVBFile &vbf = *vbFiles[id];
+        LockHolder lh(vbf.lock);
+        if (openVBFile(id, vbf, false) == FDB_RESULT_SUCCESS) {
+            readVBState(vbf, id);
+            /* update stat */
+            ++st.numLoadedVb;
+            // Don't hold on to the handles of every vbucket from warmup.
+            closeHandles(vbf);
+        } else {
+            LOG(EXTENSION_LOG_WARNING, "Failed to open database file "
+                "%s/%d.fdb.%llu", dbname.c_str(), id, it->second);
+            dbFileRevMap[id] = 1;
+        }
+    }
 }
 
 ForestKVStore::~ForestKVStore() {
+    close();
+
+    std::map<size_t, ForestScan *>::iterator sit = scans.begin();
+    for (; sit != scans.end(); ++sit) {
+        closeScan(sit->second);
+    }
 
+    for (size_t i = 0; i < vbFiles.size(); ++i) {
+        closeHandles(*vbFiles[i]);
+        delete vbFiles[i];
+    }
+
+    for (std::vector<vbucket_state *>::iterator it = cachedVBStates.begin();
+         it != cachedVBStates.end(); it++) {
+        vbucket_state *vbstate = *it;
+        if (vbstate) {
+            delete vbstate;
+            *it = NULL;
+        }
+    }
 }
 
 void ForestKVStore::close() {
     intransaction = false;
 }
 
-void ForestKVStore::delVBucket(uint16_t vbucket) {
+std::string ForestKVStore::getDBFileName(uint16_t vbid, uint64_t rev) {
+    std::stringstream ss;
+    ss << dbname << "/" << vbid << ".fdb." << rev;
+    return ss.str();
+}
+
+fdb_status ForestKVStore::openVBFile(uint16_t vbid, ForestVBFile &vbf,
+                                     bool create) {
+    if (vbf.isOpen()) {
+        return FDB_RESULT_SUCCESS;
+    }
+
+    fdb_status status = FDB_RESULT_NO_SUCH_FILE;
+    for (int attempt = 0; attempt < 2; ++attempt) {
+        std::string filename = getDBFileName(vbid, dbFileRevMap[vbid]);
+        if (create || access(filename.c_str(), F_OK) == 0) {
+            fdb_config config = fileConfig;
+            status = fdb_open(&vbf.file, filename.c_str(), &config);
+            if (status == FDB_RESULT_SUCCESS) {
+                break;
+            }
+            vbf.file = NULL;
+        }
+        // The read-write store may have compacted the file to a new
+        // revision since we last looked.
+        if (create || !discoverRev(vbid)) {
+            break;
+        }
+    }
+    if (status != FDB_RESULT_SUCCESS) {
+        ++st.numOpenFailure;
+        return status;
+    }
+
+    status = fdb_kvs_open_default(vbf.file, &vbf.docs, &kvsConfig);
+    if (status == FDB_RESULT_SUCCESS) {
+        fdb_status lstatus = fdb_kvs_open(vbf.file, &vbf.local,
+                                          LOCAL_KVS_NAME, &kvsConfig);
+        if (lstatus != FDB_RESULT_SUCCESS) {
+            vbf.local = NULL;
+            // A read-only store may open a file the vbucket state hasn't
+            // been written to yet; it only needs the documents.
+            if (!isReadOnly()) {
+                status = lstatus;
+            }
+        }
+    } else {
+        vbf.docs = NULL;
+    }
 
+    ++st.numOpen;
+    if (status != FDB_RESULT_SUCCESS) {
+        LOG(EXTENSION_LOG_WARNING,
+            "Warning: failed to open the key-value stores of vbucket %d "
+            "rev %llu, error=%s", vbid, dbFileRevMap[vbid],
+            fdb_error_msg(status));
+        ++st.numOpenFailure;
+        closeHandles(vbf);
+    }
+    return status;
 }
 
-void ForestKVStore::getWithHeader(void *dbHandle, const std::string &key,
-                                  uint16_t vb, Callback<GetValue> &cb,
-                                  bool fetchDelete) {
+void ForestKVStore::closeHandles(ForestVBFile &vbf) {
+    if (!vbf.isOpen()) {
+        return;
+    }
+    if (vbf.local) {
+        fdb_kvs_close(vbf.local);
+        vbf.local = NULL;
+    }
+    if (vbf.docs) {
+        fdb_kvs_close(vbf.docs);
+        vbf.docs = NULL;
+    }
+    fdb_status status = fdb_close(vbf.file);
+    if (status != FDB_RESULT_SUCCESS) {
+        LOG(EXTENSION_LOG_WARNING,
+            "Warning: fdb_close failed, error=%s", fdb_error_msg(status));
+    }
+    vbf.file = NULL;
+    ++st.numClose;
+}
 
+void ForestKVStore::closeScan(ForestScan *scan) {
+    if (scan->snapshot) {
+        fdb_kvs_close(scan->snapshot);
+    }
+    closeHandles(scan->handles);
+    delete scan;
 }
 
-bool ForestKVStore::commit(Callback<kvstats_ctx> *cb, uint64_t snapStartSeqno,
-                           uint64_t snapEndSeqno, uint64_t maxCas,
-                           uint64_t driftCounter) {
+void ForestKVStore::closeVBFile(uint16_t vbid, uint64_t rev) {
+    ForestVBFile &vbf = *vbFiles[vbid];
+    LockHolder lh(vbf.lock);
+    closeHandles(vbf);
+    dbFileRevMap[vbid] = rev;
+}
+
+bool ForestKVStore::discoverRev(uint16_t vbid) {
+    std::stringstream prefix;
+    prefix << vbid << ".fdb.";
+    std::vector<std::string> files = findFilesWithPrefix(dbname,
+                                                         prefix.str());
+    uint64_t latest = 0;
+    std::vector<std::string>::iterator it = files.begin();
+    for (; it != files.end(); ++it) {
+        uint16_t id;
+        uint64_t rev;
+        if (parseDBFileName(*it, id, rev) && id == vbid) {
+            latest = std::max(latest, rev);
+        }
+    }
+    if (latest == 0 || latest == dbFileRevMap[vbid]) {
+        return false;
+    }
+    dbFileRevMap[vbid] = latest;
     return true;
 }
 
-StorageProperties ForestKVStore::getStorageProperties(void) {
-    StorageProperties rv(true, true, true, true);
-    return rv;
+void ForestKVStore::notifyReadOnlyPeer(uint16_t vbid) {
+    if (readOnlyPeer) {
+        readOnlyPeer->closeVBFile(vbid, dbFileRevMap[vbid]);
+    }
+}
+
+void ForestKVStore::unlinkVBFile(uint16_t vbid, uint64_t rev) {
+    std::string fname = getDBFileName(vbid, rev);
+    int errCode;
+#ifdef _MSC_VER
+    errCode = _unlink(fname.c_str());
+#else
+    errCode = unlink(fname.c_str());
+#endif
+    if (errCode == -1) {
+        LOG(EXTENSION_LOG_WARNING, "Failed to unlink database file for "
+            "vbucket = %d rev = %llu, errCode = %u\n", vbid, rev, errno);
+
+        if (errno != ENOENT) {
+            pendingFileDeletions.push(fname);
+        }
+    }
+}
+
+void ForestKVStore::reset(uint16_t vbucketId) {
+    cb_assert(!isReadOnly());
+
+    vbucket_state *state = cachedVBStates[vbucketId];
+    if (state) {
+        state->checkpointId = 0;
+        state->maxDeletedSeqno = 0;
+        state->highSeqno = 0;
+        state->purgeSeqno = 0;
+        state->lastSnapStart = 0;
+        state->lastSnapEnd = 0;
+
+        ForestVBFile &vbf = *vbFiles[vbucketId];
+        LockHolder lh(vbf.lock);
+        closeHandles(vbf);
+        unlinkVBFile(vbucketId, dbFileRevMap[vbucketId]);
+        ++fileRewinds[vbucketId];
+        dbFileRevMap[vbucketId] = 1;
+        lh.unlock();
+        notifyReadOnlyPeer(vbucketId);
+
+        setVBucketState(vbucketId, *state, NULL);
+    } else {
+        LOG(EXTENSION_LOG_WARNING, "No entry in cached states "
+                "for vbucket %u", vbucketId);
+        cb_assert(false);
+    }
+}
+
+void ForestKVStore::set(const Item &itm, Callback<mutation_result> &cb,
+                        key_existence_t existence) {
+    cb_assert(!isReadOnly());
+    cb_assert(intransaction);
+    // each req will be de-allocated after commit
+    ForestRequest *req = new ForestRequest(itm, &cb, NULL, existence);
+    pendingReqsQ.push_back(req);
+}
+
+void ForestKVStore::del(const Item &itm, Callback<int> &cb,
+                        key_existence_t existence) {
+    cb_assert(!isReadOnly());
+    cb_assert(intransaction);
+    ForestRequest *req = new ForestRequest(itm, NULL, &cb, existence);
+    pendingReqsQ.push_back(req);
 }
 
-void ForestKVStore::set(const Item &itm, Callback<mutation_result> &cb) {
+Item *ForestKVStore::makeItem(fdb_doc *doc, uint16_t vbId, bool keyOnly) {
+    uint64_t cas = 0;
+    uint32_t exptime = 0;
+    uint32_t itemFlags = 0;
+    uint64_t revSeqno = 0;
+    uint8_t ext_meta[EXT_META_LEN];
+    uint8_t conf_res_mode = revision_seqno;
+    const uint8_t *meta = static_cast<const uint8_t *>(doc->meta);
 
+    cb_assert(doc->metalen >= FOREST_META_LEN);
+    memcpy(&cas, meta, 8);
+    memcpy(&exptime, meta + 8, 4);
+    memcpy(&itemFlags, meta + 12, 4);
+    memcpy(&revSeqno, meta + 16, 8);
+    memcpy(ext_meta, meta + FOREST_DEFAULT_META_LEN + FLEX_DATA_OFFSET,
+           EXT_META_LEN);
+    memcpy(&conf_res_mode,
+           meta + FOREST_DEFAULT_META_LEN + FLEX_DATA_OFFSET + EXT_META_LEN,
+           1);
+    cas = ntohll(cas);
+    exptime = ntohl(exptime);
+    revSeqno = ntohll(revSeqno);
+
+    const void *body = NULL;
+    size_t bodylen = 0;
+    if (!keyOnly && !doc->deleted) {
+        body = doc->body;
+        bodylen = doc->bodylen;
+    }
+
+    cb_assert(doc->keylen <= UINT16_MAX);
+    Item *it = new Item(doc->key, static_cast<uint16_t>(doc->keylen),
+                        itemFlags, (time_t)exptime, body, bodylen,
+                        ext_meta, EXT_META_LEN, cas, doc->seqnum, vbId,
+                        revSeqno);
+    if (doc->deleted) {
+        it->setDeleted();
+    }
+    it->setConflictResMode(
+            static_cast<enum conflict_resolution_mode>(conf_res_mode));
+    return it;
+}
+
+fdb_status ForestKVStore::fetchDoc(fdb_kvs_handle *kvs,
+                                   const std::string &key,
+                                   GetValue &docValue, uint16_t vbId,
+                                   bool metaOnly, bool fetchDelete) {
+    fdb_doc *doc = NULL;
+    fdb_status status = fdb_doc_create(&doc, key.c_str(), key.size(),
+                                       NULL, 0, NULL, 0);
+    if (status != FDB_RESULT_SUCCESS) {
+        return status;
+    }
+
+    // Deleted documents are only found by a metadata lookup.
+    bool metaFetched = false;
+    if (metaOnly || fetchDelete) {
+        status = fdb_get_metaonly(kvs, doc);
+        metaFetched = status == FDB_RESULT_SUCCESS &&
+                      (metaOnly || doc->deleted);
+    }
+    if (!metaOnly && !metaFetched && status == FDB_RESULT_SUCCESS) {
+        status = fdb_get(kvs, doc);
+    }
+
+    if (status == FDB_RESULT_SUCCESS) {
+        Item *it = makeItem(doc, vbId, metaFetched);
+        docValue = GetValue(it);
+        // update ep-engine IO stats
+        ++st.io_num_read;
+        st.io_read_bytes.fetch_add(doc->keylen +
+                                   (metaFetched ? 0 : doc->bodylen));
+    }
+    fdb_doc_free(doc);
+    return status;
 }
 
 void ForestKVStore::get(const std::string &key, uint16_t vb,
                         Callback<GetValue> &cb, bool fetchDelete) {
+    ForestVBFile &vbf = *vbFiles[vb];
+    LockHolder lh(vbf.lock);
+    fdb_status status = openVBFile(vb, vbf, false);
+    if (status != FDB_RESULT_SUCCESS) {
+        ++st.numGetFailure;
+        LOG(EXTENSION_LOG_WARNING,
+            "Warning: failed to open database to retrieve data "
+            "from vBucketId = %d, key = %s\n",
+            vb, key.c_str());
+        GetValue rv;
+        rv.setStatus(forestErr2EngineErr(status));
+        cb.callback(rv);
+        return;
+    }
+
+    getWithHeader(vbf.docs, key, vb, cb, fetchDelete);
+}
 
+void ForestKVStore::getWithHeader(void *dbHandle, const std::string &key,
+                                  uint16_t vb, Callback<GetValue> &cb,
+                                  bool fetchDelete) {
+    fdb_kvs_handle *kvs = static_cast<fdb_kvs_handle *>(dbHandle);
+    hrtime_t start = gethrtime();
+    RememberingCallback<GetValue> *rc =
+        dynamic_cast<RememberingCallback<GetValue> *>(&cb);
+    bool getMetaOnly = rc && rc->val.isPartial();
+    GetValue rv;
+
+    fdb_status status = fetchDoc(kvs, key, rv, vb, getMetaOnly, fetchDelete);
+    if (status == FDB_RESULT_SUCCESS) {
+        st.readTimeHisto.add((gethrtime() - start) / 1000);
+        st.readSizeHisto.add(key.length() + rv.getValue()->getNBytes());
+    } else {
+        if (status != FDB_RESULT_KEY_NOT_FOUND) {
+            LOG(EXTENSION_LOG_WARNING,
+                "Warning: failed to retrieve key value from "
+                "database, vbucketId=%d key=%s error=%s",
+                vb, key.c_str(), fdb_error_msg(status));
+        }
+        ++st.numGetFailure;
+    }
+
+    rv.setStatus(forestErr2EngineErr(status));
+    cb.callback(rv);
 }
 
+struct BGFetchKeyLess {
+    bool operator()(const vb_bgfetch_queue_t::iterator &a,
+                    const vb_bgfetch_queue_t::iterator &b) const {
+        return a->first < b->first;
+    }
+};
+
 void ForestKVStore::getMulti(uint16_t vb, vb_bgfetch_queue_t &itms) {
+    ForestVBFile &vbf = *vbFiles[vb];
+    LockHolder lh(vbf.lock);
+    fdb_status status = openVBFile(vb, vbf, false);
+    if (status != FDB_RESULT_SUCCESS) {
+        LOG(EXTENSION_LOG_WARNING,
+            "Warning: failed to open database for data fetch, "
+            "vBucketId = %d numDocs = %d\n",
+            vb, itms.size());
+        st.numGetFailure.fetch_add(itms.size());
+        vb_bgfetch_queue_t::iterator itr = itms.begin();
+        for (; itr != itms.end(); ++itr) {
+            std::list<VBucketBGFetchItem *> &fetches = (*itr).second;
+            std::list<VBucketBGFetchItem *>::iterator fitr = fetches.begin();
+            for (; fitr != fetches.end(); ++fitr) {
+                (*fitr)->value.setStatus(ENGINE_NOT_MY_VBUCKET);
+            }
+        }
+        return;
+    }
+
+    // Look the keys up in order, so the index blocks read for one key are
+    // still cached for the next.
+    std::vector<vb_bgfetch_queue_t::iterator> sorted;
+    sorted.reserve(itms.size());
+    vb_bgfetch_queue_t::iterator itr = itms.begin();
+    for (; itr != itms.end(); ++itr) {
+        sorted.push_back(itr);
+    }
+    std::sort(sorted.begin(), sorted.end(), BGFetchKeyLess());
+
+    std::vector<vb_bgfetch_queue_t::iterator>::iterator sit = sorted.begin();
+    for (; sit != sorted.end(); ++sit) {
+        const std::string &key = (*sit)->first;
+        std::list<VBucketBGFetchItem *> &fetches = (*sit)->second;
 
+        bool meta_only = true;
+        std::list<VBucketBGFetchItem *>::iterator fitr = fetches.begin();
+        for (; fitr != fetches.end(); ++fitr) {
+            if (!((*fitr)->metaDataOnly)) {
+                meta_only = false;
+                break;
+            }
+        }
+
+        GetValue returnVal;
+        status = fetchDoc(vbf.docs, key, returnVal, vb, meta_only, false);
+        if (status != FDB_RESULT_SUCCESS && !meta_only &&
+            status != FDB_RESULT_KEY_NOT_FOUND) {
+            LOG(EXTENSION_LOG_WARNING, "Warning: failed to fetch data from "
+                "database, vBucket=%d key=%s error=%s", vb, key.c_str(),
+                fdb_error_msg(status));
+            st.numGetFailure++;
+        }
+
+        returnVal.setStatus(forestErr2EngineErr(status));
+        for (fitr = fetches.begin(); fitr != fetches.end(); ++fitr) {
+            (*fitr)->value = returnVal;
+            st.readTimeHisto.add((gethrtime() - (*fitr)->initTime) / 1000);
+            if (status == FDB_RESULT_SUCCESS) {
+                st.readSizeHisto.add(returnVal.getValue()->getNKey() +
+                                     returnVal.getValue()->getNBytes());
+            }
+        }
+    }
 }
 
-void ForestKVStore::del(const Item &itm, Callback<int> &cb) {
+void ForestKVStore::delVBucket(uint16_t vbucket) {
+    cb_assert(!isReadOnly());
+
+    ForestVBFile &vbf = *vbFiles[vbucket];
+    LockHolder lh(vbf.lock);
+    closeHandles(vbf);
+    unlinkVBFile(vbucket, dbFileRevMap[vbucket]);
+    ++fileRewinds[vbucket];
+    dbFileRevMap[vbucket] = 1;
+    lh.unlock();
+    notifyReadOnlyPeer(vbucket);
 
+    if (cachedVBStates[vbucket]) {
+        delete cachedVBStates[vbucket];
+    }
+
+    std::string failovers("[{\"id\":0, \"seq\":0}]");
+    cachedVBStates[vbucket] = new vbucket_state(vbucket_state_dead, 0, 0, 0, 0,
+                                                0, 0, 0, INITIAL_DRIFT,
+                                                failovers);
+}
+
+void ForestKVStore::setReadOnlyPeer(KVStore *ro) {
+    cb_assert(!isReadOnly());
+    cb_assert(ro->isReadOnly());
+    readOnlyPeer = static_cast<ForestKVStore*>(ro);
 }
 
-std::vector<vbucket_state *> ForestKVStore::listPersistedVbuckets(void) {
+std::vector<vbucket_state *> ForestKVStore::listPersistedVbuckets() {
     return cachedVBStates;
 }
 
+void ForestKVStore::getPersistedStats(std::map<std::string,
+                                      std::string> &stats) {
+    char *buffer = NULL;
+    std::string fname = dbname + "/stats.json";
+    if (access(fname.c_str(), R_OK) == -1) {
+        return ;
+    }
+
+    std::ifstream session_stats;
+    session_stats.exceptions (session_stats.failbit | session_stats.badbit);
+    try {
+        session_stats.open(fname.c_str(), std::ios::binary);
+        session_stats.seekg(0, std::ios::end);
+        int flen = session_stats.tellg();
+        if (flen < 0) {
+            LOG(EXTENSION_LOG_WARNING,
+                "Warning: error in session stats ifstream!!!");
+            session_stats.close();
+            return;
+        }
+        session_stats.seekg(0, std::ios::beg);
+        buffer = new char[flen + 1];
+        session_stats.read(buffer, flen);
+        session_stats.close();
+        buffer[flen] = '\0';
+
+        cJSON *json_obj = cJSON_Parse(buffer);
+        if (!json_obj) {
+            LOG(EXTENSION_LOG_WARNING,
+                "Warning: failed to parse the session stats json doc!!!");
+            delete[] buffer;
+            return;
+        }
+
+        int json_arr_size = cJSON_GetArraySize(json_obj);
+        for (int i = 0; i < json_arr_size; ++i) {
+            cJSON *obj = cJSON_GetArrayItem(json_obj, i);
+            if (obj) {
+                stats[obj->string] = obj->valuestring ? obj->valuestring : "";
+            }
+        }
+        cJSON_Delete(json_obj);
+
+    } catch (const std::ifstream::failure &e) {
+        LOG(EXTENSION_LOG_WARNING,
+            "Warning: failed to load the engine session stats "
+            " due to IO exception \"%s\"", e.what());
+    } catch (...) {
+        LOG(EXTENSION_LOG_WARNING,
+            "Warning: failed to load the engine session stats "
+            " due to IO exception");
+    }
+
+    delete[] buffer;
+}
+
 bool ForestKVStore::snapshotStats(const std::map<std::string,
-                                  std::string> &engine_stats) {
-    return true;
+                                  std::string> &stats) {
+    cb_assert(!isReadOnly());
+    size_t count = 0;
+    size_t size = stats.size();
+    std::stringstream stats_buf;
+    stats_buf << "{";
+    std::map<std::string, std::string>::const_iterator it = stats.begin();
+    for (; it != stats.end(); ++it) {
+        stats_buf << "\"" << it->first << "\": \"" << it->second << "\"";
+        ++count;
+        if (count < size) {
+            stats_buf << ", ";
+        }
+    }
+    stats_buf << "}";
+
+    bool rv = true;
+    std::string next_fname = dbname + "/stats.json.new";
+    std::ofstream new_stats;
+    new_stats.exceptions (new_stats.failbit | new_stats.badbit);
+    try {
+        new_stats.open(next_fname.c_str());
+        new_stats << stats_buf.str().c_str() << std::endl;
+        new_stats.flush();
+        new_stats.close();
+    } catch (const std::ofstream::failure& e) {
+        LOG(EXTENSION_LOG_WARNING, "Warning: failed to log the engine stats to "
+            "file \"%s\" due to IO exception \"%s\"; Not critical because new "
+            "stats will be dumped later, please ignore.",
+            next_fname.c_str(), e.what());
+        rv = false;
+    }
+
+    if (rv) {
+        std::string old_fname = dbname + "/stats.json.old";
+        std::string stats_fname = dbname + "/stats.json";
+        if (access(old_fname.c_str(), F_OK) == 0 && remove(old_fname.c_str()) != 0) {
+            LOG(EXTENSION_LOG_WARNING, "FATAL: Failed to remove '%s': %s",
+                old_fname.c_str(), strerror(errno));
+            remove(next_fname.c_str());
+            rv = false;
+        } else if (access(stats_fname.c_str(), F_OK) == 0 &&
+                   rename(stats_fname.c_str(), old_fname.c_str()) != 0) {
+            LOG(EXTENSION_LOG_WARNING,
+                "Warning: failed to rename '%s' to '%s': %s",
+                stats_fname.c_str(), old_fname.c_str(), strerror(errno));
+            remove(next_fname.c_str());
+            rv = false;
+        } else if (rename(next_fname.c_str(), stats_fname.c_str()) != 0) {
+            LOG(EXTENSION_LOG_WARNING,
+                "Warning: failed to rename '%s' to '%s': %s",
+                next_fname.c_str(), stats_fname.c_str(), strerror(errno));
+            remove(next_fname.c_str());
+            rv = false;
+        }
+    }
+
+    return rv;
 }
 
-bool ForestKVStore::snapshotVBucket(uint16_t vbucketId,
-                                    vbucket_state &vbstate,
+bool ForestKVStore::snapshotVBucket(uint16_t vbucketId, vbucket_state &vbstate,
                                     Callback<kvstats_ctx> *cb) {
+    cb_assert(!isReadOnly());
+
+    vbucket_state *state = cachedVBStates[vbucketId];
+    if (state) {
+        if (state->state == vbstate.state &&
+            state->checkpointId == vbstate.checkpointId &&
+            state->failovers.compare(vbstate.failovers) == 0) {
+            return true; // no changes
+        }
+        state->state = vbstate.state;
+        state->checkpointId = vbstate.checkpointId;
+        state->failovers = vbstate.failovers;
+        // Note that max deleted seq number is maintained within ForestKVStore
+        vbstate.maxDeletedSeqno = state->maxDeletedSeqno;
+    } else {
+        cachedVBStates[vbucketId] = new vbucket_state(vbstate);
+    }
+
+    if (!setVBucketState(vbucketId, vbstate, cb)) {
+        LOG(EXTENSION_LOG_WARNING,
+                "Warning: failed to set new state, %s, for vbucket %d\n",
+                VBucket::toString(vbstate.state), vbucketId);
+        return false;
+    }
     return true;
 }
 
-bool ForestKVStore::compactVBucket(const uint16_t vbid, compaction_ctx *cookie,
-                                   Callback<kvstats_ctx> &kvcb) {
+bool ForestKVStore::setVBucketState(uint16_t vbucketId, vbucket_state &vbstate,
+                                    Callback<kvstats_ctx> *kvcb) {
+    kvstats_ctx kvctx;
+    kvctx.vbucket = vbucketId;
+
+    ForestVBFile &vbf = *vbFiles[vbucketId];
+    LockHolder lh(vbf.lock);
+    fdb_status status = openVBFile(vbucketId, vbf, true);
+    if (status != FDB_RESULT_SUCCESS) {
+        ++st.numVbSetFailure;
+        LOG(EXTENSION_LOG_WARNING,
+                "Warning: failed to open database, name=%s",
+                getDBFileName(vbucketId, dbFileRevMap[vbucketId]).c_str());
+        return false;
+    }
+
+    vbucket_state *state = cachedVBStates[vbucketId];
+    vbstate.highSeqno = state->highSeqno;
+    vbstate.purgeSeqno = state->purgeSeqno;
+    vbstate.lastSnapStart = state->lastSnapStart;
+    vbstate.lastSnapEnd = state->lastSnapEnd;
+    vbstate.maxDeletedSeqno = state->maxDeletedSeqno;
+    vbstate.maxCas = state->maxCas;
+    vbstate.driftCounter = state->driftCounter;
+
+    status = saveVBState(vbf, vbstate);
+    if (status == FDB_RESULT_SUCCESS) {
+        status = fdb_commit(vbf.file, FDB_COMMIT_NORMAL);
+    }
+    if (status != FDB_RESULT_SUCCESS) {
+        ++st.numVbSetFailure;
+        LOG(EXTENSION_LOG_WARNING,
+                "Warning: failed to save the state of vbucket %d, error=%s",
+                vbucketId, fdb_error_msg(status));
+        closeHandles(vbf);
+        return false;
+    }
+
+    if (kvcb) {
+        fdb_file_info info;
+        if (fdb_get_file_info(vbf.file, &info) == FDB_RESULT_SUCCESS) {
+            kvctx.fileSpaceUsed = info.space_used;
+            kvctx.fileSize = info.file_size;
+        }
+        lh.unlock();
+        kvcb->callback(kvctx);
+    }
+
     return true;
 }
 
+void ForestKVStore::readVBState(ForestVBFile &vbf, uint16_t vbId) {
+    vbucket_state_t state = vbucket_state_dead;
+    uint64_t checkpointId = 0;
+    uint64_t maxDeletedSeqno = 0;
+    int64_t highSeqno = 0;
+    std::string failovers("[{\"id\":0,\"seq\":0}]");
+    uint64_t purgeSeqno = 0;
+    uint64_t lastSnapStart = 0;
+    uint64_t lastSnapEnd = 0;
+    uint64_t maxCas = 0;
+    int64_t driftCounter = INITIAL_DRIFT;
+
+    fdb_seqnum_t seqno = 0;
+    fdb_status status = fdb_get_kvs_seqnum(vbf.docs, &seqno);
+    if (status == FDB_RESULT_SUCCESS) {
+        highSeqno = seqno;
+    } else {
+        LOG(EXTENSION_LOG_WARNING,
+            "Warning: failed to read database info for vBucket = %d", vbId);
+        abort();
+    }
+
+    void *value = NULL;
+    size_t valuelen = 0;
+    if (vbf.local) {
+        status = fdb_get_kv(vbf.local, VBSTATE_KEY, strlen(VBSTATE_KEY),
+                            &value, &valuelen);
+    } else {
+        status = FDB_RESULT_KEY_NOT_FOUND;
+    }
+    if (status != FDB_RESULT_SUCCESS) {
+        LOG(EXTENSION_LOG_DEBUG,
+            "Warning: failed to retrieve stat info for vBucket=%d error=%s",
+            vbId, fdb_error_msg(status));
+    } else {
+        const std::string statjson(static_cast<char *>(value), valuelen);
+        fdb_free_block(value);
+        cJSON *jsonObj = cJSON_Parse(statjson.c_str());
+        if (!jsonObj) {
+            LOG(EXTENSION_LOG_WARNING,
+                "Warning: failed to parse the vbstat json doc for vbucket %d: %s",
+                vbId, statjson.c_str());
+            abort();
+        }
+
+        const std::string vb_state = getJSONObjString(
+                                cJSON_GetObjectItem(jsonObj, "state"));
+        const std::string checkpoint_id = getJSONObjString(
+                                cJSON_GetObjectItem(jsonObj,"checkpoint_id"));
+        const std::string max_deleted_seqno = getJSONObjString(
+                                cJSON_GetObjectItem(jsonObj, "max_deleted_seqno"));
+        const std::string purge_seqno = getJSONObjString(
+                                cJSON_GetObjectItem(jsonObj, "purge_seqno"));
+        const std::string snapStart = getJSONObjString(
+                                cJSON_GetObjectItem(jsonObj, "snap_start"));
+        const std::string snapEnd = getJSONObjString(
+                                cJSON_GetObjectItem(jsonObj, "snap_end"));
+        const std::string maxCasValue = getJSONObjString(
+                                cJSON_GetObjectItem(jsonObj, "max_cas"));
+        const std::string driftCount = getJSONObjString(
+                                cJSON_GetObjectItem(jsonObj, "drift_counter"));
+        cJSON *failover_json = cJSON_GetObjectItem(jsonObj, "failover_table");
+        if (vb_state.compare("") == 0 || checkpoint_id.compare("") == 0
+                || max_deleted_seqno.compare("") == 0) {
+            LOG(EXTENSION_LOG_WARNING,
+                "Warning: state JSON doc for vbucket %d is in the wrong format: %s",
+                vbId, statjson.c_str());
+        } else {
+            state = VBucket::fromString(vb_state.c_str());
+            parseUint64(max_deleted_seqno.c_str(), &maxDeletedSeqno);
+            parseUint64(checkpoint_id.c_str(), &checkpointId);
+
+            if (purge_seqno.compare("") != 0) {
+                parseUint64(purge_seqno.c_str(), &purgeSeqno);
+            }
+
+            if (snapStart.compare("") == 0) {
+                lastSnapStart = highSeqno;
+            } else {
+                parseUint64(snapStart.c_str(), &lastSnapStart);
+            }
+
+            if (snapEnd.compare("") == 0) {
+                lastSnapEnd = highSeqno;
+            } else {
+                parseUint64(snapEnd.c_str(), &lastSnapEnd);
+            }
+
+            if (maxCasValue.compare("") != 0) {
+                parseUint64(maxCasValue.c_str(), &maxCas);
+            }
+
+            if (driftCount.compare("") != 0) {
+                parseInt64(driftCount.c_str(), &driftCounter);
+            }
+
+            if (failover_json) {
+                char* json = cJSON_PrintUnformatted(failover_json);
+                failovers.assign(json);
+                free(json);
+            }
+        }
+        cJSON_Delete(jsonObj);
+    }
+
+    delete cachedVBStates[vbId];
+    cachedVBStates[vbId] = new vbucket_state(state, checkpointId,
+                                             maxDeletedSeqno, highSeqno,
+                                             purgeSeqno, lastSnapStart,
+                                             lastSnapEnd, maxCas, driftCounter,
+                                             failovers);
+}
+
+fdb_status ForestKVStore::saveVBState(ForestVBFile &vbf,
+                                      vbucket_state &vbState) {
+    std::stringstream jsonState;
+
+    jsonState << "{\"state\": \"" << VBucket::toString(vbState.state) << "\""
+              << ",\"checkpoint_id\": \"" << vbState.checkpointId << "\""
+              << ",\"max_deleted_seqno\": \"" << vbState.maxDeletedSeqno << "\""
+              << ",\"purge_seqno\": \"" << vbState.purgeSeqno << "\""
+              << ",\"failover_table\": " << vbState.failovers
+              << ",\"snap_start\": \"" << vbState.lastSnapStart << "\""
+              << ",\"snap_end\": \"" << vbState.lastSnapEnd << "\""
+              << ",\"max_cas\": \"" << vbState.maxCas << "\""
+              << ",\"drift_counter\": \"" << vbState.driftCounter << "\""
+              << "}";
+
+    std::string state = jsonState.str();
+    fdb_status status = fdb_set_kv(vbf.local, VBSTATE_KEY,
+                                   strlen(VBSTATE_KEY), state.c_str(),
+                                   state.size());
+    if (status != FDB_RESULT_SUCCESS) {
+        LOG(EXTENSION_LOG_WARNING,
+            "Warning: fdb_set_kv of the vbucket state failed, error=%s",
+            fdb_error_msg(status));
+    }
+    return status;
+}
+
+StorageProperties ForestKVStore::getStorageProperties(void) {
+    StorageProperties rv(true, true, true, true);
+    return rv;
+}
+
+bool ForestKVStore::commit(Callback<kvstats_ctx> *cb, uint64_t snapStartSeqno,
+                           uint64_t snapEndSeqno, uint64_t maxCas,
+                           uint64_t driftCounter) {
+    cb_assert(!isReadOnly());
+    if (!intransaction) {
+        return true;
+    }
+
+    if (!pendingReqsQ.empty()) {
+        uint16_t vbucket2flush = pendingReqsQ[0]->getVBucketId();
+        kvstats_ctx kvctx;
+        kvctx.vbucket = vbucket2flush;
+        fdb_status status = saveDocs(vbucket2flush, pendingReqsQ, kvctx,
+                                     snapStartSeqno, snapEndSeqno, maxCas,
+                                     driftCounter);
+        if (status != FDB_RESULT_SUCCESS) {
+            LOG(EXTENSION_LOG_WARNING,
+                "Warning: commit failed, cannot save ForestDB docs "
+                "for vbucket = %d rev = %llu\n", vbucket2flush,
+                dbFileRevMap[vbucket2flush]);
+        }
+        if (cb) {
+            cb->callback(kvctx);
+        }
+        commitCallback(pendingReqsQ, kvctx, status);
+
+        for (size_t i = 0; i < pendingReqsQ.size(); ++i) {
+            delete pendingReqsQ[i];
+        }
+        pendingReqsQ.clear();
+    }
+
+    intransaction = false;
+    return true;
+}
+
+bool ForestKVStore::groupCommit(Callback<kvstats_ctx> *cb,
+                                const std::vector<VBucketCommit> &vbCommits) {
+    cb_assert(!isReadOnly());
+    if (!intransaction) {
+        return true;
+    }
+
+    // Split the requests by vbucket, keeping their order.
+    std::map<uint16_t, std::vector<ForestRequest *> > reqsByVb;
+    for (size_t i = 0; i < pendingReqsQ.size(); ++i) {
+        ForestRequest *req = pendingReqsQ[i];
+        cb_assert(req);
+        reqsByVb[req->getVBucketId()].push_back(req);
+    }
+
+    // Every vbucket has a file of its own, committed and synced on its own.
+    size_t numCommitted = 0;
+    std::vector<VBucketCommit>::const_iterator vit = vbCommits.begin();
+    for (; vit != vbCommits.end(); ++vit) {
+        std::map<uint16_t, std::vector<ForestRequest *> >::iterator rit =
+            reqsByVb.find(vit->vbucket);
+        if (rit == reqsByVb.end()) {
+            continue;
+        }
+        kvstats_ctx kvctx;
+        kvctx.vbucket = vit->vbucket;
+        fdb_status status = saveDocs(vit->vbucket, rit->second, kvctx,
+                                     vit->snapStartSeqno, vit->snapEndSeqno,
+                                     vit->maxCas, vit->driftCounter);
+        if (status != FDB_RESULT_SUCCESS) {
+            LOG(EXTENSION_LOG_WARNING,
+                "Warning: commit failed, cannot save ForestDB docs "
+                "for vbucket = %d rev = %llu\n", vit->vbucket,
+                dbFileRevMap[vit->vbucket]);
+        }
+        if (cb) {
+            cb->callback(kvctx);
+        }
+        commitCallback(rit->second, kvctx, status);
+        ++numCommitted;
+    }
+    // Every request must belong to one of the committed vbuckets.
+    cb_assert(numCommitted == reqsByVb.size());
+
+    for (size_t i = 0; i < pendingReqsQ.size(); ++i) {
+        delete pendingReqsQ[i];
+    }
+    pendingReqsQ.clear();
+
+    intransaction = false;
+    return true;
+}
+
+fdb_status ForestKVStore::saveDocs(uint16_t vbid,
+                                   std::vector<ForestRequest *> &reqs,
+                                   kvstats_ctx &kvctx,
+                                   uint64_t snapStartSeqno,
+                                   uint64_t snapEndSeqno, uint64_t maxCas,
+                                   uint64_t driftCounter) {
+    ForestVBFile &vbf = *vbFiles[vbid];
+    LockHolder lh(vbf.lock);
+    fdb_status status = openVBFile(vbid, vbf, true);
+    if (status != FDB_RESULT_SUCCESS) {
+        LOG(EXTENSION_LOG_WARNING,
+                "Warning: failed to open database, vbucketId = %d "
+                "fileRev = %llu numDocs = %d", vbid, dbFileRevMap[vbid],
+                reqs.size());
+        return status;
+    }
+
+    vbucket_state *state = cachedVBStates[vbid];
+    cb_assert(state);
+
+    uint64_t maxDeleted = 0;
+    size_t numLookups = 0;
+    for (size_t idx = 0; idx < reqs.size(); ++idx) {
+        ForestRequest *req = reqs[idx];
+        fdb_doc *doc = req->getDbDoc();
+        const std::string &key = req->getKey();
+
+        // Only look up the keys the engine couldn't tell us about.
+        bool exists = req->getExistence() == KEY_KNOWN_EXISTING;
+        if (req->getExistence() == KEY_EXISTENCE_UNKNOWN) {
+            fdb_doc *found = NULL;
+            if (fdb_doc_create(&found, key.c_str(), key.size(),
+                               NULL, 0, NULL, 0) == FDB_RESULT_SUCCESS) {
+                exists = fdb_get_metaonly(vbf.docs, found) ==
+                             FDB_RESULT_SUCCESS && !found->deleted;
+                fdb_doc_free(found);
+            }
+            ++numLookups;
+        }
+        kvctx.keyStats[key] = std::make_pair(exists, !req->isDelete());
+
+        if (req->isDelete()) {
+            maxDeleted = std::max(maxDeleted, req->getRevSeqno());
+            status = fdb_del(vbf.docs, doc);
+        } else {
+            status = fdb_set(vbf.docs, doc);
+        }
+        if (status != FDB_RESULT_SUCCESS) {
+            LOG(EXTENSION_LOG_WARNING,
+                "Warning: failed to save docs to database, numDocs = %d "
+                "error=%s\n", reqs.size(), fdb_error_msg(status));
+            // Drop what was written of the batch with the handles.
+            closeHandles(vbf);
+            return status;
+        }
+    }
+    st.docInfoLookups.fetch_add(numLookups);
+    st.docInfoLookupsAvoided.fetch_add(reqs.size() - numLookups);
+
+    // update max_deleted_seq in the local doc (vbstate)
+    // before save docs for the given vBucket
+    if (maxDeleted > 0 && state->maxDeletedSeqno < maxDeleted) {
+        state->maxDeletedSeqno = maxDeleted;
+    }
+    state->lastSnapStart = snapStartSeqno;
+    state->lastSnapEnd = snapEndSeqno;
+    if (maxCas > state->maxCas) {
+        state->maxCas = maxCas;
+    }
+    state->driftCounter = driftCounter;
+
+    status = saveVBState(vbf, *state);
+    if (status != FDB_RESULT_SUCCESS) {
+        closeHandles(vbf);
+        return status;
+    }
+
+    hrtime_t cs_begin = gethrtime();
+    status = fdb_commit(vbf.file, FDB_COMMIT_NORMAL);
+    st.commitHisto.add((gethrtime() - cs_begin) / 1000);
+    if (status != FDB_RESULT_SUCCESS) {
+        LOG(EXTENSION_LOG_WARNING,
+            "Warning: fdb_commit failed, error=%s", fdb_error_msg(status));
+        closeHandles(vbf);
+        return status;
+    }
+
+    st.batchSize.add(reqs.size());
+
+    fdb_seqnum_t seqno = 0;
+    if (fdb_get_kvs_seqnum(vbf.docs, &seqno) == FDB_RESULT_SUCCESS) {
+        state->highSeqno = seqno;
+    }
+
+    // retrieve storage system stats for file fragmentation computation
+    fdb_file_info info;
+    if (fdb_get_file_info(vbf.file, &info) == FDB_RESULT_SUCCESS) {
+        kvctx.fileSpaceUsed = info.space_used;
+        kvctx.fileSize = info.file_size;
+    }
+
+    /* update stat */
+    st.docsCommitted = reqs.size();
+
+    return FDB_RESULT_SUCCESS;
+}
+
+void ForestKVStore::commitCallback(std::vector<ForestRequest *> &committedReqs,
+                                   kvstats_ctx &kvctx, fdb_status errCode) {
+    size_t commitSize = committedReqs.size();
+
+    for (size_t index = 0; index < commitSize; index++) {
+        size_t dataSize = committedReqs[index]->getNBytes();
+        size_t keySize = committedReqs[index]->getKey().length();
+        /* update ep stats */
+        ++st.io_num_write;
+        st.io_write_bytes.fetch_add(keySize + dataSize);
+
+        const std::string &key = committedReqs[index]->getKey();
+        if (committedReqs[index]->isDelete()) {
+            int rv = getMutationStatus(errCode);
+            if (rv != -1) {
+                if (kvctx.keyStats[key].first) {
+                    rv = 1; // Deletion is for an existing item on DB file.
+                } else {
+                    rv = 0; // Deletion is for a non-existing item on DB file.
+                }
+            }
+            if (errCode) {
+                ++st.numDelFailure;
+            } else {
+                st.delTimeHisto.add(committedReqs[index]->getDelta() / 1000);
+            }
+            committedReqs[index]->getDelCallback()->callback(rv);
+        } else {
+            int rv = getMutationStatus(errCode);
+            bool insertion = !kvctx.keyStats[key].first;
+            if (errCode) {
+                ++st.numSetFailure;
+            } else {
+                st.writeTimeHisto.add(committedReqs[index]->getDelta() / 1000);
+                st.writeSizeHisto.add(dataSize + keySize);
+            }
+            mutation_result p(rv, insertion);
+            committedReqs[index]->getSetCallback()->callback(p);
+        }
+    }
+}
+
+/**
+ * What the compaction callback needs to purge a vbucket file.
+ */
+struct ForestCompactCtx {
+    compaction_ctx *hook;
+    // Seqno of the latest document, which must be kept even if deleted
+    fdb_seqnum_t lastSeqno;
+};
+
+extern "C" {
+    static fdb_compact_decision forestCompactionCb(fdb_file_handle *fhandle,
+                                                   fdb_compaction_status status,
+                                                   const char *kv_store_name,
+                                                   fdb_doc *doc,
+                                                   uint64_t last_oldfile_offset,
+                                                   uint64_t last_newfile_offset,
+                                                   void *ctx_p) {
+        (void)fhandle; (void)last_oldfile_offset; (void)last_newfile_offset;
+        ForestCompactCtx *fctx = static_cast<ForestCompactCtx *>(ctx_p);
+        compaction_ctx *ctx = fctx->hook;
+
+        if (status != FDB_CS_MOVE_DOC || doc == NULL ||
+            (kv_store_name && strcmp(kv_store_name, LOCAL_KVS_NAME) == 0) ||
+            doc->metalen < FOREST_META_LEN) {
+            return FDB_CS_KEEP_DOC;
+        }
+
+        uint32_t exptime;
+        memcpy(&exptime, static_cast<uint8_t *>(doc->meta) + 8, 4);
+        exptime = ntohl(exptime);
+        if (doc->deleted) {
+            if (doc->seqnum != fctx->lastSeqno) {
+                if (ctx->drop_deletes ||
+                    (exptime < ctx->purge_before_ts &&
+                     (!ctx->purge_before_seq ||
+                      doc->seqnum <= ctx->purge_before_seq))) {
+                    if (ctx->max_purged_seq < doc->seqnum) {
+                        ctx->max_purged_seq = doc->seqnum;
+                    }
+                    return FDB_CS_DROP_DOC;
+                }
+            }
+        } else if (exptime && exptime < ctx->curr_time) {
+            std::string key(static_cast<char *>(doc->key), doc->keylen);
+            uint64_t revSeqno;
+            memcpy(&revSeqno, static_cast<uint8_t *>(doc->meta) + 16, 8);
+            revSeqno = ntohll(revSeqno);
+            ctx->expiryCallback->callback(key, revSeqno);
+        }
+
+        if (ctx->bloomFilterCallback) {
+            bool deleted = doc->deleted;
+            std::string key(static_cast<char *>(doc->key), doc->keylen);
+            ctx->bloomFilterCallback->callback(key, deleted);
+        }
+
+        return FDB_CS_KEEP_DOC;
+    }
+}
+
+bool ForestKVStore::compactVBucket(const uint16_t vbid,
+                                   compaction_ctx *hook_ctx,
+                                   Callback<kvstats_ctx> &kvcb,
+                                   Mutex &vbLock) {
+    cb_assert(!isReadOnly());
+    hrtime_t start = gethrtime();
+    ForestCompactCtx fctx = { hook_ctx, 0 };
+
+    // Compact through a handle of our own, so flushes can carry on through
+    // the vbucket's handles; ForestDB moves those to the new file.
+    LockHolder lh(vbLock);
+    uint64_t fileRev = dbFileRevMap[vbid];
+    uint64_t rewinds = fileRewinds[vbid];
+    lh.unlock();
+
+    std::string dbfile = getDBFileName(vbid, fileRev);
+    std::string new_file = getDBFileName(vbid, fileRev + 1);
+    fdb_config config = fileConfig;
+    config.compaction_cb = forestCompactionCb;
+    config.compaction_cb_mask = FDB_CS_MOVE_DOC;
+    config.compaction_cb_ctx = &fctx;
+
+    fdb_file_handle *file = NULL;
+    fdb_kvs_handle *docs = NULL;
+    fdb_status status = fdb_open(&file, dbfile.c_str(), &config);
+    if (status == FDB_RESULT_SUCCESS) {
+        status = fdb_kvs_open_default(file, &docs, &kvsConfig);
+        if (status == FDB_RESULT_SUCCESS) {
+            status = fdb_get_kvs_seqnum(docs, &fctx.lastSeqno);
+            fdb_kvs_close(docs);
+        }
+        if (status == FDB_RESULT_SUCCESS) {
+            status = fdb_compact(file, new_file.c_str());
+        }
+        fdb_close(file);
+    }
+    if (status != FDB_RESULT_SUCCESS) {
+        LOG(EXTENSION_LOG_WARNING,
+            "Warning: failed to compact database with name=%s error=%s",
+            dbfile.c_str(), fdb_error_msg(status));
+        return false;
+    }
+
+    lh.lock();
+    if (dbFileRevMap[vbid] != fileRev || fileRewinds[vbid] != rewinds) {
+        LOG(EXTENSION_LOG_WARNING,
+            "Warning: vbucket %d was reset or rolled back while it was "
+            "compacted, dropping '%s'", vbid, new_file.c_str());
+        unlinkVBFile(vbid, fileRev + 1);
+        return false;
+    }
+    dbFileRevMap[vbid] = fileRev + 1;
+    notifyReadOnlyPeer(vbid);
+
+    LOG(EXTENSION_LOG_INFO,
+            "INFO: created new forestdb file, name=%s rev=%llu",
+            new_file.c_str(), fileRev + 1);
+
+    kvstats_ctx kvctx;
+    kvctx.vbucket = vbid;
+    ForestVBFile &vbf = *vbFiles[vbid];
+    LockHolder flh(vbf.lock);
+    // Start afresh on the compacted file.
+    closeHandles(vbf);
+    status = openVBFile(vbid, vbf, false);
+    vbucket_state *state = cachedVBStates[vbid];
+    if (status == FDB_RESULT_SUCCESS && state) {
+        if (hook_ctx->max_purged_seq > state->purgeSeqno) {
+            state->purgeSeqno = hook_ctx->max_purged_seq;
+            if (saveVBState(vbf, *state) == FDB_RESULT_SUCCESS) {
+                fdb_commit(vbf.file, FDB_COMMIT_NORMAL);
+            }
+        }
+        fdb_file_info info;
+        if (fdb_get_file_info(vbf.file, &info) == FDB_RESULT_SUCCESS) {
+            kvctx.fileSpaceUsed = info.space_used;
+            kvctx.fileSize = info.file_size;
+        }
+    }
+    flh.unlock();
+    lh.unlock();
+
+    // Update stats to caller
+    kvcb.callback(kvctx);
+    st.compactHisto.add((gethrtime() - start) / 1000);
+
+    return status == FDB_RESULT_SUCCESS;
+}
+
+size_t ForestKVStore::getNumPersistedDeletes(uint16_t vbid) {
+    ForestVBFile &vbf = *vbFiles[vbid];
+    LockHolder lh(vbf.lock);
+    if (openVBFile(vbid, vbf, false) != FDB_RESULT_SUCCESS) {
+        LOG(EXTENSION_LOG_WARNING,
+            "Warning: failed to open database file for "
+            "vBucket = %d rev = %llu\n", vbid, dbFileRevMap[vbid]);
+        return 0;
+    }
+
+    fdb_kvs_info info;
+    fdb_status status = fdb_get_kvs_info(vbf.docs, &info);
+    if (status != FDB_RESULT_SUCCESS) {
+        LOG(EXTENSION_LOG_WARNING,
+            "Warning: failed to read database info for "
+            "vBucket = %d rev = %llu\n", vbid, dbFileRevMap[vbid]);
+        return 0;
+    }
+    return info.deleted_count;
+}
+
+DBFileInfo ForestKVStore::getDbFileInfo(uint16_t vbid) {
+    DBFileInfo vbinfo;
+    ForestVBFile &vbf = *vbFiles[vbid];
+    LockHolder lh(vbf.lock);
+    if (openVBFile(vbid, vbf, false) != FDB_RESULT_SUCCESS) {
+        LOG(EXTENSION_LOG_WARNING,
+            "Warning: failed to open database file for "
+            "vBucket = %d rev = %llu\n", vbid, dbFileRevMap[vbid]);
+        return vbinfo;
+    }
+
+    fdb_file_info finfo;
+    fdb_kvs_info kinfo;
+    if (fdb_get_file_info(vbf.file, &finfo) == FDB_RESULT_SUCCESS &&
+        fdb_get_kvs_info(vbf.docs, &kinfo) == FDB_RESULT_SUCCESS) {
+        vbinfo.itemCount = kinfo.doc_count;
+        vbinfo.fileSize = finfo.file_size;
+        vbinfo.spaceUsed = finfo.space_used;
+    } else {
+        LOG(EXTENSION_LOG_WARNING,
+            "Warning: failed to read database info for "
+            "vBucket = %d rev = %llu\n", vbid, dbFileRevMap[vbid]);
+    }
+    return vbinfo;
+}
+
+/**
+ * Count the changes of a key-value store between two seqnos.
+ */
+static size_t countChanges(fdb_kvs_handle *kvs, uint64_t min_seq,
+                           uint64_t max_seq) {
+    fdb_iterator *itr = NULL;
+    size_t count = 0;
+    if (fdb_iterator_sequence_init(kvs, &itr, min_seq, max_seq,
+                                   FDB_ITR_NONE) != FDB_RESULT_SUCCESS) {
+        return 0;
+    }
+    do {
+        fdb_doc *doc = NULL;
+        if (fdb_iterator_get_metaonly(itr, &doc) != FDB_RESULT_SUCCESS) {
+            break;
+        }
+        ++count;
+        fdb_doc_free(doc);
+    } while (fdb_iterator_next(itr) == FDB_RESULT_SUCCESS);
+    fdb_iterator_close(itr);
+    return count;
+}
+
+size_t ForestKVStore::getNumItems(uint16_t vbid, uint64_t min_seq,
+                                  uint64_t max_seq) {
+    ForestVBFile &vbf = *vbFiles[vbid];
+    LockHolder lh(vbf.lock);
+    if (openVBFile(vbid, vbf, false) != FDB_RESULT_SUCCESS) {
+        LOG(EXTENSION_LOG_WARNING, "Failed to open database file for vBucket"
+            " = %d rev = %llu", vbid, dbFileRevMap[vbid]);
+        return 0;
+    }
+    return countChanges(vbf.docs, min_seq, max_seq);
+}
+
 RollbackResult ForestKVStore::rollback(uint16_t vbid, uint64_t rollbackSeqno,
                                        shared_ptr<RollbackCB> cb) {
-   return RollbackResult(true, 0, 0, 0);
+    cb_assert(!isReadOnly());
+    ForestVBFile &vbf = *vbFiles[vbid];
+    LockHolder lh(vbf.lock);
+    fdb_status status = openVBFile(vbid, vbf, false);
+    if (status != FDB_RESULT_SUCCESS) {
+        LOG(EXTENSION_LOG_WARNING, "Failed to open database, name=%s",
+            getDBFileName(vbid, dbFileRevMap[vbid]).c_str());
+        return RollbackResult(false, 0, 0, 0);
+    }
+
+    fdb_seqnum_t latestSeqno = 0;
+    fdb_snapshot_info_t *markers = NULL;
+    uint64_t numMarkers = 0;
+    if (fdb_get_kvs_seqnum(vbf.docs, &latestSeqno) != FDB_RESULT_SUCCESS ||
+        fdb_get_all_snap_markers(vbf.file, &markers,
+                                 &numMarkers) != FDB_RESULT_SUCCESS) {
+        LOG(EXTENSION_LOG_WARNING, "Failed to read the commit markers of "
+            "vbucket %d", vbid);
+        return RollbackResult(false, 0, 0, 0);
+    }
+
+    // Markers come newest first; take the latest one at or before the
+    // requested seqno.
+    uint64_t idx = 0;
+    while (idx < numMarkers && getMarkerSeqno(markers[idx]) > rollbackSeqno) {
+        ++idx;
+    }
+    if (idx == numMarkers) {
+        //Reset the vbucket and send the entire snapshot,
+        //as a previous commit wasn't found.
+        fdb_free_snap_markers(markers, numMarkers);
+        return RollbackResult(false, 0, 0, 0);
+    }
+    fdb_snapshot_marker_t marker = markers[idx].marker;
+    fdb_seqnum_t markerSeqno = getMarkerSeqno(markers[idx]);
+    fdb_free_snap_markers(markers, numMarkers);
+
+    size_t totSeqCount = countChanges(vbf.docs, 0, latestSeqno);
+    size_t rollbackSeqCount = countChanges(vbf.docs, markerSeqno + 1,
+                                           latestSeqno);
+    if ((totSeqCount / 2) <= rollbackSeqCount) {
+        //rollback is greater than 50%,
+        //reset the vbucket and send the entire snapshot
+        return RollbackResult(false, 0, 0, 0);
+    }
+
+    // Hand the keys changed since the marker to the callback, which reads
+    // their previous versions from the snapshot.
+    fdb_kvs_handle *snapshot = NULL;
+    status = fdb_snapshot_open(vbf.docs, &snapshot, markerSeqno);
+    if (status != FDB_RESULT_SUCCESS) {
+        LOG(EXTENSION_LOG_WARNING, "Failed to open a snapshot of vbucket %d "
+            "at seqno %llu, error=%s", vbid, markerSeqno,
+            fdb_error_msg(status));
+        return RollbackResult(false, 0, 0, 0);
+    }
+    cb->setDbHeader(snapshot);
+
+    shared_ptr<Callback<CacheLookup> > cl(new NoLookupCallback());
+    ScanContext ctx(cb, cl, vbid, 0, markerSeqno + 1, latestSeqno,
+                    true, false, false);
+    scan_error_t error = scanHandle(vbf.docs, &ctx);
+    fdb_kvs_close(snapshot);
+    if (error != scan_success) {
+        return RollbackResult(false, 0, 0, 0);
+    }
+
+    notifyReadOnlyPeer(vbid);
+    status = fdb_rollback_all(vbf.file, marker);
+    ++fileRewinds[vbid];
+    closeHandles(vbf);
+    if (status != FDB_RESULT_SUCCESS) {
+        LOG(EXTENSION_LOG_WARNING, "Failed to roll back vbucket %d to seqno "
+            "%llu, error=%s", vbid, markerSeqno, fdb_error_msg(status));
+        return RollbackResult(false, 0, 0, 0);
+    }
+
+    status = openVBFile(vbid, vbf, false);
+    if (status != FDB_RESULT_SUCCESS) {
+        return RollbackResult(false, 0, 0, 0);
+    }
+    readVBState(vbf, vbid);
+
+    vbucket_state *vb_state = cachedVBStates[vbid];
+    return RollbackResult(true, vb_state->highSeqno,
+                          vb_state->lastSnapStart, vb_state->lastSnapEnd);
 }
+
+void ForestKVStore::pendingTasks() {
+    if (!pendingFileDeletions.empty()) {
+        std::queue<std::string> queue;
+        pendingFileDeletions.getAll(queue);
+
+        while (!queue.empty()) {
+            std::string filename_str = queue.front();
+            int errCode;
+#ifdef _MSC_VER
+            errCode = _unlink(filename_str.c_str());
+#else
+            errCode = unlink(filename_str.c_str());
+#endif
+            if (errCode == -1) {
+                LOG(EXTENSION_LOG_WARNING, "Failed to unlink file '%s' with error "
+                    "code: %d", filename_str.c_str(), errno);
+                if (errno != ENOENT) {
+                    pendingFileDeletions.push(filename_str);
+                }
+            }
+            queue.pop();
+        }
+    }
+}
+
+uint64_t ForestKVStore::getLastPersistedSeqno(uint16_t vbid) {
+    vbucket_state *state = cachedVBStates[vbid];
+    if (state) {
+        return state->highSeqno;
+    }
+    return 0;
+}
+
+ENGINE_ERROR_CODE
+ForestKVStore::getAllKeys(uint16_t vbid, std::string &start_key,
+                          uint32_t count,
+                          shared_ptr<Callback<uint16_t&, char*&> > cb) {
+    ForestVBFile &vbf = *vbFiles[vbid];
+    LockHolder lh(vbf.lock);
+    fdb_status status = openVBFile(vbid, vbf, false);
+    if (status != FDB_RESULT_SUCCESS) {
+        LOG(EXTENSION_LOG_WARNING, "Failed to open database file for "
+                "vbucket = %d rev = %llu, error = %s\n", vbid,
+                dbFileRevMap[vbid], fdb_error_msg(status));
+        return ENGINE_FAILED;
+    }
+
+    fdb_iterator *itr = NULL;
+    status = fdb_iterator_init(vbf.docs, &itr, start_key.c_str(),
+                               start_key.size(), NULL, 0,
+                               FDB_ITR_NO_DELETES);
+    if (status != FDB_RESULT_SUCCESS) {
+        LOG(EXTENSION_LOG_WARNING, "fdb_iterator_init failed for "
+                "database file of vbucket = %d rev = %llu, error = %s\n",
+                vbid, dbFileRevMap[vbid], fdb_error_msg(status));
+        return ENGINE_FAILED;
+    }
+
+    uint32_t remaining = count;
+    while (remaining > 0) {
+        fdb_doc *doc = NULL;
+        if (fdb_iterator_get_metaonly(itr, &doc) != FDB_RESULT_SUCCESS) {
+            break;
+        }
+        uint16_t keylen = static_cast<uint16_t>(doc->keylen);
+        char *key = static_cast<char *>(doc->key);
+        cb->callback(keylen, key);
+        fdb_doc_free(doc);
+        --remaining;
+        if (fdb_iterator_next(itr) != FDB_RESULT_SUCCESS) {
+            break;
+        }
+    }
+    fdb_iterator_close(itr);
+    return ENGINE_SUCCESS;
+}
+
+ScanContext* ForestKVStore::initScanContext(shared_ptr<Callback<GetValue> > cb,
+                                           shared_ptr<Callback<CacheLookup> > cl,
+                                           uint16_t vbid, uint64_t startSeqno,
+                                           bool keysOnly, bool noDeletes,
+                                           bool deletesOnly) {
+    // The scan opens the file on handles of its own: the vbucket's shared
+    // handles are closed by compaction, rollback and deletion, and may only
+    // be used under the vbucket lock.
+    ForestScan *fs = new ForestScan();
+    ForestVBFile &vbf = *vbFiles[vbid];
+    LockHolder lh(vbf.lock);
+    fdb_status status = openVBFile(vbid, fs->handles, false);
+    if (status != FDB_RESULT_SUCCESS) {
+        LOG(EXTENSION_LOG_WARNING, "Failed to open database, "
+            "name=%s", getDBFileName(vbid, dbFileRevMap[vbid]).c_str());
+        delete fs;
+        return NULL;
+    }
+    lh.unlock();
+
+    // Scan a snapshot, so the flushes to the file don't show up mid scan.
+    fdb_seqnum_t seqno = 0;
+    status = fdb_get_kvs_seqnum(fs->handles.docs, &seqno);
+    if (status == FDB_RESULT_SUCCESS && seqno > 0) {
+        status = fdb_snapshot_open(fs->handles.docs, &fs->snapshot, seqno);
+    }
+    if (status != FDB_RESULT_SUCCESS) {
+        LOG(EXTENSION_LOG_WARNING, "Failed to open a snapshot for the "
+            "backfill of vbucket %d, error=%s", vbid, fdb_error_msg(status));
+        fs->snapshot = NULL;
+        closeScan(fs);
+        return NULL;
+    }
+
+    size_t scanId = scanCounter++;
+
+    LockHolder slh(scanLock);
+    scans[scanId] = fs;
+
+    return new ScanContext(cb, cl, vbid, scanId, startSeqno, seqno,
+                           keysOnly, noDeletes, deletesOnly);
+}
+
+scan_error_t ForestKVStore::scan(ScanContext* ctx) {
+    if (!ctx) {
+        return scan_failed;
+    }
+
+    if (ctx->lastReadSeqno == ctx->maxSeqno) {
+        return scan_success;
+    }
+
+    LockHolder lh(scanLock);
+    std::map<size_t, ForestScan *>::iterator itr =
+        scans.find(ctx->scanId);
+    if (itr == scans.end()) {
+        return scan_failed;
+    }
+
+    // Only the scan's own task uses its handles.
+    fdb_kvs_handle *snapshot = itr->second->snapshot;
+    lh.unlock();
+
+    if (snapshot == NULL) {
+        // The vbucket was empty when the scan started.
+        return scan_success;
+    }
+    return scanHandle(snapshot, ctx);
+}
+
+scan_error_t ForestKVStore::scanHandle(fdb_kvs_handle *kvs, ScanContext *ctx) {
+    shared_ptr<Callback<GetValue> > cb = ctx->callback;
+    shared_ptr<Callback<CacheLookup> > cl = ctx->lookup;
+
+    uint64_t start = ctx->startSeqno;
+    if (ctx->lastReadSeqno != 0) {
+        start = ctx->lastReadSeqno + 1;
+    }
+    if (start > ctx->maxSeqno) {
+        return scan_success;
+    }
+
+    fdb_iterator *itr = NULL;
+    fdb_iterator_opt_t options = ctx->noDeletes ? FDB_ITR_NO_DELETES
+                                                : FDB_ITR_NONE;
+    fdb_status status = fdb_iterator_sequence_init(kvs, &itr, start,
+                                                   ctx->maxSeqno, options);
+    if (status != FDB_RESULT_SUCCESS) {
+        LOG(EXTENSION_LOG_WARNING,
+            "fdb_iterator_sequence_init failed for vbucket %d, error=%s",
+            ctx->vbid, fdb_error_msg(status));
+        return scan_failed;
+    }
+
+    scan_error_t rv = scan_success;
+    do {
+        fdb_doc *doc = NULL;
+        if (ctx->onlyKeys) {
+            status = fdb_iterator_get_metaonly(itr, &doc);
+        } else {
+            status = fdb_iterator_get(itr, &doc);
+        }
+        if (status != FDB_RESULT_SUCCESS) {
+            // No more documents in the range.
+            break;
+        }
+
+        uint64_t byseqno = doc->seqnum;
+        if (ctx->onlyDeletes && !doc->deleted) {
+            ctx->lastReadSeqno = byseqno;
+            fdb_doc_free(doc);
+            continue;
+        }
+
+        std::string docKey(static_cast<char *>(doc->key), doc->keylen);
+        CacheLookup lookup(docKey, byseqno, ctx->vbid);
+        cl->callback(lookup);
+        if (cl->getStatus() == ENGINE_KEY_EEXISTS) {
+            ctx->lastReadSeqno = byseqno;
+            fdb_doc_free(doc);
+            continue;
+        } else if (cl->getStatus() == ENGINE_ENOMEM) {
+            fdb_doc_free(doc);
+            rv = scan_again;
+            break;
+        }
+
+        Item *it = makeItem(doc, ctx->vbid, ctx->onlyKeys);
+        fdb_doc_free(doc);
+        GetValue gv(it, ENGINE_SUCCESS, -1, ctx->onlyKeys);
+        cb->callback(gv);
+        if (cb->getStatus() == ENGINE_ENOMEM) {
+            rv = scan_again;
+            break;
+        }
+        ctx->lastReadSeqno = byseqno;
+    } while (fdb_iterator_next(itr) == FDB_RESULT_SUCCESS);
+
+    fdb_iterator_close(itr);
+    return rv;
+}
+
+void ForestKVStore::destroyScanContext(ScanContext* ctx) {
+    if (!ctx) {
+        return;
+    }
+
+    LockHolder lh(scanLock);
+    std::map<size_t, ForestScan *>::iterator itr =
+        scans.find(ctx->scanId);
+    if (itr != scans.end()) {
+        closeScan(itr->second);
+        scans.erase(itr);
+    }
+    delete ctx;
+}
+
+void ForestKVStore::addStats(const std::string &prefix,
+                             ADD_STAT add_stat,
+                             const void *c) {
+    const char *prefix_str = prefix.c_str();
+
+    /* stats for both read-only and read-write threads */
+    addStat(prefix_str, "backend_type",   "forestdb",         add_stat, c);
+    addStat(prefix_str, "open",           st.numOpen,         add_stat, c);
+    addStat(prefix_str, "close",          st.numClose,        add_stat, c);
+    addStat(prefix_str, "readTime",       st.readTimeHisto,   add_stat, c);
+    addStat(prefix_str, "readSize",       st.readSizeHisto,   add_stat, c);
+    addStat(prefix_str, "numLoadedVb",    st.numLoadedVb,     add_stat, c);
+
+    // failure stats
+    addStat(prefix_str, "failure_open",   st.numOpenFailure, add_stat, c);
+    addStat(prefix_str, "failure_get",    st.numGetFailure,  add_stat, c);
+
+    if (!isReadOnly()) {
+        addStat(prefix_str, "failure_set",   st.numSetFailure,   add_stat, c);
+        addStat(prefix_str, "failure_del",   st.numDelFailure,   add_stat, c);
+        addStat(prefix_str, "failure_vbset", st.numVbSetFailure, add_stat, c);
+        addStat(prefix_str, "lastCommDocs",  st.docsCommitted,   add_stat, c);
+        addStat(prefix_str, "docinfo_lookups", st.docInfoLookups,
+                add_stat, c);
+        addStat(prefix_str, "docinfo_lookups_avoided",
+                st.docInfoLookupsAvoided, add_stat, c);
+    }
+
+    addStat(prefix_str, "io_num_read", st.io_num_read, add_stat, c);
+    addStat(prefix_str, "io_num_write", st.io_num_write, add_stat, c);
+    addStat(prefix_str, "io_read_bytes", st.io_read_bytes, add_stat, c);
+    addStat(prefix_str, "io_write_bytes", st.io_write_bytes, add_stat, c);
+}
+
+void ForestKVStore::addTimingStats(const std::string &prefix,
+                                   ADD_STAT add_stat, const void *c) {
+    if (isReadOnly()) {
+        return;
+    }
+    const char *prefix_str = prefix.c_str();
+    addStat(prefix_str, "commit",      st.commitHisto,      add_stat, c);
+    addStat(prefix_str, "compact",     st.compactHisto,     add_stat, c);
+    addStat(prefix_str, "delete",      st.delTimeHisto,     add_stat, c);
+    addStat(prefix_str, "writeTime",   st.writeTimeHisto,   add_stat, c);
+    addStat(prefix_str, "writeSize",   st.writeSizeHisto,   add_stat, c);
+    addStat(prefix_str, "bulkSize",    st.batchSize,        add_stat, c);
+}
+
+template <typename T>
+void ForestKVStore::addStat(const std::string &prefix, const char *stat,
+                            T &val, ADD_STAT add_stat, const void *c) {
+    std::stringstream fullstat;
+    fullstat << prefix << ":" << stat;
+    add_casted_stat(fullstat.str().c_str(), val, add_stat, c);
+}
+
+ENGINE_ERROR_CODE ForestKVStore::forestErr2EngineErr(fdb_status errCode) {
+    switch (errCode) {
+    case FDB_RESULT_SUCCESS:
+        return ENGINE_SUCCESS;
+    case FDB_RESULT_ALLOC_FAIL:
+        return ENGINE_ENOMEM;
+    case FDB_RESULT_KEY_NOT_FOUND:
+        return ENGINE_KEY_ENOENT;
+    case FDB_RESULT_NO_SUCH_FILE:
+    default:
+        // same as the general error return code of
+        // EventuallyPersistentStore::getInternal
+        return ENGINE_TMPFAIL;
+    }
+}
+
+/* end of forest-kvstore.cc */
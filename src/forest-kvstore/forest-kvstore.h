@@ -18,11 +18,224 @@
 #ifndef SRC_FOREST_KVSTORE_FOREST_KVSTORE_H_
 #define SRC_FOREST_KVSTORE_FOREST_KVSTORE_H_ 1
 
+#include "config.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
 #include "libforestdb/forestdb.h"
+#include "atomic.h"
+#include "atomicqueue.h"
+#include "histo.h"
+#include "item.h"
 #include "kvstore.h"
+#include "locks.h"
+
+/**
+ * Stats and timings for ForestKVStore
+ */
+class ForestKVStoreStats {
+
+public:
+    ForestKVStoreStats() :
+        docsCommitted(0), numOpen(0), numClose(0), numLoadedVb(0),
+        numGetFailure(0), numSetFailure(0), numDelFailure(0),
+        numOpenFailure(0), numVbSetFailure(0), io_num_read(0),
+        io_num_write(0), io_read_bytes(0), io_write_bytes(0),
+        docInfoLookups(0), docInfoLookupsAvoided(0) {
+    }
+
+    void reset() {
+        docsCommitted.store(0);
+        numOpen.store(0);
+        numClose.store(0);
+        numLoadedVb.store(0);
+        numGetFailure.store(0);
+        numSetFailure.store(0);
+        numDelFailure.store(0);
+        numOpenFailure.store(0);
+        numVbSetFailure.store(0);
+        docInfoLookups.store(0);
+        docInfoLookupsAvoided.store(0);
+
+        readTimeHisto.reset();
+        readSizeHisto.reset();
+        writeTimeHisto.reset();
+        writeSizeHisto.reset();
+        delTimeHisto.reset();
+        compactHisto.reset();
+        commitHisto.reset();
+        batchSize.reset();
+    }
+
+    // the number of docs committed
+    AtomicValue<size_t> docsCommitted;
+    // the number of open() calls
+    AtomicValue<size_t> numOpen;
+    // the number of close() calls
+    AtomicValue<size_t> numClose;
+    // the number of vbuckets loaded
+    AtomicValue<size_t> numLoadedVb;
+
+    //stats tracking failures
+    AtomicValue<size_t> numGetFailure;
+    AtomicValue<size_t> numSetFailure;
+    AtomicValue<size_t> numDelFailure;
+    AtomicValue<size_t> numOpenFailure;
+    AtomicValue<size_t> numVbSetFailure;
+
+    //! Number of read related io operations
+    AtomicValue<size_t> io_num_read;
+    //! Number of write related io operations
+    AtomicValue<size_t> io_num_write;
+    //! Number of bytes read
+    AtomicValue<size_t> io_read_bytes;
+    //! Number of bytes written
+    AtomicValue<size_t> io_write_bytes;
+    //! Number of keys looked up before a write to count inserts
+    AtomicValue<size_t> docInfoLookups;
+    //! Number of keys written without a lookup as the engine knew the answer
+    AtomicValue<size_t> docInfoLookupsAvoided;
+
+    // How long it takes us to complete a read
+    Histogram<hrtime_t> readTimeHisto;
+    // How big are our reads?
+    Histogram<size_t> readSizeHisto;
+    // How long it takes us to complete a write
+    Histogram<hrtime_t> writeTimeHisto;
+    // How big are our writes?
+    Histogram<size_t> writeSizeHisto;
+    // Time spent in delete() calls.
+    Histogram<hrtime_t> delTimeHisto;
+    // Time spent in forestdb commit
+    Histogram<hrtime_t> commitHisto;
+    // Time spent in forestdb compaction
+    Histogram<hrtime_t> compactHisto;
+    // Batch size of commit calls
+    Histogram<size_t> batchSize;
+};
+
+/**
+ * The handles of an open vbucket file: the file itself, the key-value
+ * store holding the documents and the one holding the vbucket state.
+ */
+struct ForestVBFile {
+    ForestVBFile() : file(NULL), docs(NULL), local(NULL) { }
+
+    bool isOpen() const {
+        return file != NULL;
+    }
+
+    // Serialises users of the handles, which ForestDB doesn't allow to be
+    // shared between threads.
+    Mutex lock;
+    fdb_file_handle *file;
+    fdb_kvs_handle *docs;
+    fdb_kvs_handle *local;
+};
+
+/**
+ * A backfill scan: a snapshot taken on handles of the scan's own, which
+ * compaction, rollback or deletion of the vbucket don't close under it.
+ */
+struct ForestScan {
+    ForestScan() : snapshot(NULL) { }
+
+    ForestVBFile handles;
+    fdb_kvs_handle *snapshot;
+};
+
+/**
+ * Class representing a document to be persisted in ForestDB.
+ */
+class ForestRequest
+{
+public:
+    /**
+     * Constructor
+     *
+     * @param it Item instance to be persisted
+     * @param setCb persistence callback for a set
+     * @param delCb persistence callback for a delete
+     * @param existence whether the key is known to exist in the file
+     */
+    ForestRequest(const Item &it, Callback<mutation_result> *setCb,
+                  Callback<int> *delCb, key_existence_t existence);
+
+    uint16_t getVBucketId(void) const {
+        return vbucketId;
+    }
+
+    /**
+     * Get the ForestDB document to be persisted; its memory is owned by
+     * this request.
+     */
+    fdb_doc *getDbDoc(void) {
+        return &doc;
+    }
+
+    Callback<mutation_result> *getSetCallback(void) {
+        return setCb;
+    }
+
+    Callback<int> *getDelCallback(void) {
+        return delCb;
+    }
+
+    /**
+     * Get the time in ns elapsed since the creation of this instance
+     */
+    hrtime_t getDelta() {
+        return (gethrtime() - start) / 1000;
+    }
+
+    /**
+     * Get the length of a document's metadata and body
+     */
+    size_t getNBytes() {
+        return doc.metalen + doc.bodylen;
+    }
+
+    bool isDelete() const {
+        return delCb != NULL;
+    };
+
+    key_existence_t getExistence() const {
+        return existence;
+    }
+
+    uint64_t getRevSeqno() const {
+        return revSeqno;
+    }
+
+    const std::string& getKey(void) const {
+        return key;
+    }
+
+private:
+    value_t value;
+    uint8_t meta[32];
+    uint16_t vbucketId;
+    uint64_t revSeqno;
+    std::string key;
+    fdb_doc doc;
+    key_existence_t existence;
+    Callback<mutation_result> *setCb;
+    Callback<int> *delCb;
+
+    hrtime_t start;
+};
 
 /**
  * KVStore with ForestDB as the underlying storage system
+ *
+ * Each vbucket lives in its own file, named <vbid>.fdb.<revision>, which
+ * holds a key-value store for the documents and another for the vbucket
+ * state. Documents keep the seqnos the engine assigned them, so the
+ * sequence index serves backfills and rollbacks directly. Compaction
+ * writes the next revision of the file; ForestDB moves every open handle
+ * over to it.
  */
 class ForestKVStore : public KVStore
 {
@@ -31,8 +244,10 @@ class ForestKVStore : public KVStore
      * Constructor
      *
      * @param config    Configuration information
+     * @param read_only flag indicating if this kvstore instance is for
+     *                  read-only operations
      */
-    ForestKVStore(KVStoreConfig &config);
+    ForestKVStore(KVStoreConfig &config, bool read_only = false);
 
     /**
      * Copy constructor
@@ -49,9 +264,7 @@ class ForestKVStore : public KVStore
     /**
      * Reset database to a clean state.
      */
-    void reset(uint16_t vbucketId) {
-        return;
-    }
+    void reset(uint16_t vbucketId);
 
     /**
      * Begin a transaction (if not already in one).
@@ -73,6 +286,14 @@ class ForestKVStore : public KVStore
                 uint64_t snapEndSeqno, uint64_t maxCas,
                 uint64_t driftCounter);
 
+    /**
+     * Commit a transaction holding mutations of several vbuckets.
+     *
+     * @return true if the commit is completed successfully.
+     */
+    bool groupCommit(Callback<kvstats_ctx> *cb,
+                     const std::vector<VBucketCommit> &vbCommits);
+
     /**
      * Rollback a transaction (unless not currently in one).
      */
@@ -96,7 +317,8 @@ class ForestKVStore : public KVStore
      * @param itm instance representing the document to be inserted or updated
      * @param cb callback instance for SET
      */
-    void set(const Item &itm, Callback<mutation_result> &cb);
+    void set(const Item &itm, Callback<mutation_result> &cb,
+             key_existence_t existence = KEY_EXISTENCE_UNKNOWN);
 
     /**
      * Retrieve the document with a given key from the underlying storage system.
@@ -110,6 +332,10 @@ class ForestKVStore : public KVStore
     void get(const std::string &key, uint16_t vb, Callback<GetValue> &cb,
              bool fetchDelete = false);
 
+    /**
+     * Retrieve a document through the given key-value store handle, e.g.
+     * a snapshot handed out during a rollback.
+     */
     void getWithHeader(void *dbHandle, const std::string &key,
                        uint16_t vb, Callback<GetValue> &cb,
                        bool fetchDelete = false);
@@ -128,7 +354,8 @@ class ForestKVStore : public KVStore
      * @param itm instance representing the document to be deleted
      * @param cb callback instance for DELETE
      */
-    void del(const Item &itm, Callback<int> &cb);
+    void del(const Item &itm, Callback<int> &cb,
+             key_existence_t existence = KEY_EXISTENCE_UNKNOWN);
 
     /**
      * Delete a given vbucket database instance from the
@@ -138,6 +365,12 @@ class ForestKVStore : public KVStore
      */
     void delVBucket(uint16_t vbucket);
 
+    /**
+     * Set the read-only store reading the same files, so it can drop its
+     * handles when a file is deleted, reset or rolled back.
+     */
+    void setReadOnlyPeer(KVStore *ro);
+
     /**
      * Retrieve the list of persisted vbucket states
      *
@@ -146,6 +379,11 @@ class ForestKVStore : public KVStore
      */
     std::vector<vbucket_state *>  listPersistedVbuckets(void);
 
+    /**
+     * Retrieve the engine stats persisted by snapshotStats().
+     */
+    void getPersistedStats(std::map<std::string, std::string> &stats);
+
     /**
      * Persist a snapshot of the engine stats in the underlying storage.
      *
@@ -172,10 +410,17 @@ class ForestKVStore : public KVStore
      * @param hook_ctx - details of vbucket which needs to be compacted
      * @param cb - callback to help process newly expired items
      * @param kvcb - callback to update kvstore stats
+     * @param vbLock - lock held by flushes of the vbucket
      * @return true if successful
      */
     bool compactVBucket(const uint16_t vbid, compaction_ctx *cookie,
-                        Callback<kvstats_ctx> &kvcb);
+                        Callback<kvstats_ctx> &kvcb, Mutex &vbLock);
+
+    size_t getNumPersistedDeletes(uint16_t vbid);
+
+    DBFileInfo getDbFileInfo(uint16_t vbid);
+
+    size_t getNumItems(uint16_t vbid, uint64_t min_seq, uint64_t max_seq);
 
     /**
      * Do a rollback to the specified sequence number on the particular vbucket
@@ -188,41 +433,129 @@ class ForestKVStore : public KVStore
     RollbackResult rollback(uint16_t vbid, uint64_t rollbackSeqno,
                             shared_ptr<RollbackCB> cb);
 
-    void pendingTasks() {
-        return;
-    }
+    void pendingTasks();
 
-    uint64_t getLastPersistedSeqno(uint16_t vbid) {
-        return 0;
-    }
+    uint64_t getLastPersistedSeqno(uint16_t vbid);
 
     ENGINE_ERROR_CODE getAllKeys(uint16_t vbid, std::string &start_key,
                                  uint32_t count,
-                                 shared_ptr<Callback<uint16_t&, char*&> > cb) {
-        return ENGINE_SUCCESS;
-    }
+                                 shared_ptr<Callback<uint16_t&, char*&> > cb);
 
     ScanContext *initScanContext(shared_ptr<Callback<GetValue> > cb,
                                  shared_ptr<Callback<CacheLookup> > cl,
                                  uint16_t vbid, uint64_t startSeqno,
                                  bool keysOnly, bool noDeletes,
-                                 bool deletesOnly) {
-        return NULL;
-    }
+                                 bool deletesOnly);
 
-    scan_error_t scan(ScanContext *sctx) {
-        return scan_success;
-    }
+    scan_error_t scan(ScanContext *sctx);
+
+    void destroyScanContext(ScanContext *ctx);
+
+    /**
+     * Show kvstore specific stats.
+     */
+    void addStats(const std::string &prefix, ADD_STAT add_stat,
+                  const void *c);
+
+    /**
+     * Show kvstore specific timing stats.
+     */
+    void addTimingStats(const std::string &prefix, ADD_STAT add_stat,
+                        const void *c);
 
-    void destroyScanContext(ScanContext *ctx) {
-        return;
+    /**
+     * Resets ForestDB stats
+     */
+    void resetStats() {
+        st.reset();
     }
 
+    /**
+     * Close the handles of a vbucket file, so that the next user opens the
+     * given revision afresh. Called on the read-only store by its
+     * read-write peer.
+     */
+    void closeVBFile(uint16_t vbid, uint64_t rev);
+
 private:
-    bool intransaction;
-    const std::string dbname;
+    void initialize();
     void close();
+
+    std::string getDBFileName(uint16_t vbid, uint64_t rev);
+
+    /**
+     * Open the handles of a vbucket file, unless they are open already.
+     * Called with the file's lock held.
+     */
+    fdb_status openVBFile(uint16_t vbid, ForestVBFile &vbf, bool create);
+    void closeHandles(ForestVBFile &vbf);
+    void closeScan(ForestScan *scan);
+
+    /**
+     * Find the latest revision of a vbucket file on disk, in case it has
+     * been compacted by the read-write store.
+     */
+    bool discoverRev(uint16_t vbid);
+
+    fdb_status fetchDoc(fdb_kvs_handle *kvs, const std::string &key,
+                        GetValue &docValue, uint16_t vbId, bool metaOnly,
+                        bool fetchDelete);
+    Item *makeItem(fdb_doc *doc, uint16_t vbId, bool keyOnly);
+
+    /**
+     * Hand the changes of the given key-value store handle in the scan's
+     * seqno range to its callbacks.
+     */
+    scan_error_t scanHandle(fdb_kvs_handle *kvs, ScanContext *ctx);
+
+    fdb_status saveDocs(uint16_t vbid, std::vector<ForestRequest *> &reqs,
+                        kvstats_ctx &kvctx, uint64_t snapStartSeqno,
+                        uint64_t snapEndSeqno, uint64_t maxCas,
+                        uint64_t driftCounter);
+    void commitCallback(std::vector<ForestRequest *> &committedReqs,
+                        kvstats_ctx &kvctx, fdb_status errCode);
+
+    void readVBState(ForestVBFile &vbf, uint16_t vbid);
+    fdb_status saveVBState(ForestVBFile &vbf, vbucket_state &vbState);
+    bool setVBucketState(uint16_t vbid, vbucket_state &vbstate,
+                         Callback<kvstats_ctx> *kvcb);
+
+    void unlinkVBFile(uint16_t vbid, uint64_t rev);
+    void notifyReadOnlyPeer(uint16_t vbid);
+
+    ENGINE_ERROR_CODE forestErr2EngineErr(fdb_status errCode);
+
+    template <typename T>
+    void addStat(const std::string &prefix, const char *nm, T &val,
+                 ADD_STAT add_stat, const void *c);
+
+    KVStoreConfig &configuration;
+    const std::string dbname;
+    uint16_t numDbFiles;
+    bool intransaction;
+    fdb_config fileConfig;
+    fdb_kvs_config kvsConfig;
+
+    std::vector<uint64_t> dbFileRevMap;
+    /* bumped whenever a file is rewound or reset in place; only changed
+     * under the vbucket lock */
+    std::vector<uint64_t> fileRewinds;
+    std::vector<ForestVBFile *> vbFiles;
+    std::vector<ForestRequest *> pendingReqsQ;
+
+    /* vbucket state cache*/
     std::vector<vbucket_state *> cachedVBStates;
+    /* pending file deletions */
+    AtomicQueue<std::string> pendingFileDeletions;
+
+    /* snapshots being scanned, by scan id */
+    AtomicValue<size_t> scanCounter;
+    std::map<size_t, ForestScan *> scans;
+    Mutex scanLock;
+
+    ForestKVStoreStats st;
+    /* read-only store reading the same files (read-write store only) */
+    ForestKVStore *readOnlyPeer;
 };
 
 #endif  // SRC_FOREST_KVSTORE_FOREST_KVSTORE_H_
@@ -0,0 +1,208 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2015 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "config.h"
+
+#include <limits>
+
+#include "futurequeue.h"
+
+FutureQueue::FutureQueue() : incoming(NULL), numFiled(0),
+                             wheel(wheelSlots), wheelEntries(0) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    cursor = toMillis(now);
+}
+
+FutureQueue::~FutureQueue() {
+    Entry *e = incoming.exchange(NULL);
+    while (e) {
+        Entry *next = e->next;
+        delete e;
+        e = next;
+    }
+    for (size_t i = 0; i < wheel.size(); ++i) {
+        for (size_t j = 0; j < wheel[i].size(); ++j) {
+            delete wheel[i][j];
+        }
+    }
+    while (!overflow.empty()) {
+        delete overflow.top();
+        overflow.pop();
+    }
+}
+
+uint64_t FutureQueue::toMillis(const struct timeval &tv) {
+    if (tv.tv_sec == INT_MAX && tv.tv_usec == INT_MAX) {
+        return std::numeric_limits<uint64_t>::max();
+    }
+    // Round up, so that a task is never taken before its waketime
+    return static_cast<uint64_t>(tv.tv_sec) * 1000 +
+           (static_cast<uint64_t>(tv.tv_usec) + 999) / 1000;
+}
+
+void FutureQueue::pushIncoming(Entry *e) {
+    e->next = incoming.load();
+    while (!incoming.compare_exchange_weak(e->next, e)) {
+        // e->next now holds the current head; try again
+    }
+}
+
+void FutureQueue::push(ExTask &task) {
+    uint64_t gen = task->futureGen.load();
+    uint64_t next;
+    do {
+        next = (gen & 1) ? gen + 2 : gen + 1;
+    } while (!task->futureGen.compare_exchange_weak(gen, next));
+    if (!(gen & 1)) {
+        ++numFiled;
+    }
+    pushIncoming(new Entry(task, next, toMillis(task->waketime), false));
+}
+
+void FutureQueue::refile(ExTask &task) {
+    uint64_t gen = task->futureGen.load();
+    do {
+        if (!(gen & 1)) {
+            return;
+        }
+    } while (!task->futureGen.compare_exchange_weak(gen, gen + 2));
+    pushIncoming(new Entry(task, gen + 2, toMillis(task->waketime), false));
+}
+
+void FutureQueue::wake(ExTask &task) {
+    pushIncoming(new Entry(task, task->futureGen.load(), 0, true));
+}
+
+bool FutureQueue::take(Entry *e, std::vector<ExTask> &due) {
+    uint64_t gen = e->gen;
+    if (!(gen & 1) ||
+        !e->task->futureGen.compare_exchange_strong(gen, gen + 1)) {
+        return false;
+    }
+    --numFiled;
+    due.push_back(e->task);
+    delete e;
+    return true;
+}
+
+void FutureQueue::place(Entry *e, uint64_t now, std::vector<ExTask> &due) {
+    if (isStale(e)) {
+        delete e;
+    } else if (e->due <= now) {
+        if (!take(e, due)) {
+            delete e;
+        }
+    } else if (e->due < cursor + wheelSlots) {
+        wheel[e->due % wheelSlots].push_back(e);
+        ++wheelEntries;
+    } else {
+        overflow.push(e);
+    }
+}
+
+void FutureQueue::compactOverflow() {
+    std::vector<Entry *> live;
+    while (!overflow.empty()) {
+        Entry *e = overflow.top();
+        overflow.pop();
+        if (isStale(e)) {
+            delete e;
+        } else {
+            live.push_back(e);
+        }
+    }
+    for (size_t i = 0; i < live.size(); ++i) {
+        overflow.push(live[i]);
+    }
+}
+
+void FutureQueue::popDue(const struct timeval &tv, std::vector<ExTask> &due,
+                         std::vector<ExTask> &woken) {
+    uint64_t now = toMillis(tv);
+
+    // Entries come off the list newest first; put them back in order.
+    Entry *list = incoming.exchange(NULL);
+    Entry *ordered = NULL;
+    while (list) {
+        Entry *next = list->next;
+        list->next = ordered;
+        ordered = list;
+        list = next;
+    }
+    while (ordered) {
+        Entry *e = ordered;
+        ordered = ordered->next;
+        if (e->wake) {
+            if (!take(e, due)) {
+                woken.push_back(e->task);
+                delete e;
+            }
+        } else {
+            place(e, now, due);
+        }
+    }
+
+    if (now >= cursor) {
+        // Everything in the wheel is due once a whole turn has passed.
+        uint64_t end = now - cursor >= wheelSlots ?
+                       cursor + wheelSlots - 1 : now;
+        for (uint64_t t = cursor; t <= end && wheelEntries; ++t) {
+            std::vector<Entry *> &slot = wheel[t % wheelSlots];
+            for (size_t i = 0; i < slot.size(); ++i) {
+                if (!take(slot[i], due)) {
+                    delete slot[i];
+                }
+            }
+            wheelEntries -= slot.size();
+            slot.clear();
+        }
+        cursor = now + 1;
+    }
+
+    while (!overflow.empty() && overflow.top()->due < cursor + wheelSlots) {
+        Entry *e = overflow.top();
+        overflow.pop();
+        place(e, now, due);
+    }
+
+    // Tasks that sleep until woken leave an entry due at the end of time
+    // behind at every wake.
+    if (overflow.size() > 2 * numFiled.load() + 64) {
+        compactOverflow();
+    }
+}
+
+bool FutureQueue::getNextWaketime(struct timeval &tv) {
+    uint64_t next = std::numeric_limits<uint64_t>::max();
+    if (wheelEntries) {
+        for (uint64_t t = cursor; t < cursor + wheelSlots; ++t) {
+            if (!wheel[t % wheelSlots].empty()) {
+                next = t;
+                break;
+            }
+        }
+    } else if (!overflow.empty()) {
+        next = overflow.top()->due;
+    }
+
+    if (next == std::numeric_limits<uint64_t>::max()) {
+        return false;
+    }
+    tv.tv_sec = static_cast<int>(next / 1000);
+    tv.tv_usec = static_cast<int>((next % 1000) * 1000);
+    return true;
+}
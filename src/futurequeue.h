@@ -0,0 +1,158 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2015 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef SRC_FUTUREQUEUE_H_
+#define SRC_FUTUREQUEUE_H_ 1
+
+#include "config.h"
+
+#include <queue>
+#include <vector>
+
+#include "atomic.h"
+#include "tasks.h"
+
+/**
+ * The tasks of a TaskQueue that wait for their waketime.
+ *
+ * Filing or waking a task only pushes an entry onto a lock-free list, so
+ * neither takes a lock. The owning TaskQueue drains that list under its
+ * own lock in popDue(). Each entry is sorted into a timer wheel of one
+ * millisecond slots, or into an overflow heap if it is due beyond the
+ * wheel's span.
+ *
+ * Filing a task again, or waking it, leaves its older entry behind
+ * instead of searching for it. A task's futureGen is odd while it is
+ * filed and changes with every filing, and each entry records the value
+ * it was made with. Entries that no longer match are dropped when they
+ * are reached.
+ */
+class FutureQueue {
+public:
+    FutureQueue();
+
+    ~FutureQueue();
+
+    /**
+     * File a task to become due at its waketime, replacing any earlier
+     * filing of it. Safe to call from any thread.
+     */
+    void push(ExTask &task);
+
+    /**
+     * File a task again at its current waketime, if it is filed at all.
+     * Safe to call from any thread.
+     */
+    void refile(ExTask &task);
+
+    /**
+     * Make a filed task due at the next popDue(). popDue() hands a task
+     * that was not filed back in its woken list instead. Safe to call from
+     * any thread.
+     */
+    void wake(ExTask &task);
+
+    /**
+     * Take out the tasks that are due. Callers must serialize this with
+     * getNextWaketime().
+     *
+     * @param now the current time
+     * @param due filled with the tasks that became due
+     * @param woken filled with the tasks woken while they were not filed
+     */
+    void popDue(const struct timeval &now, std::vector<ExTask> &due,
+                std::vector<ExTask> &woken);
+
+    /**
+     * Get the earliest waketime among the tasks filed as of the last
+     * popDue(). It may be early, never late.
+     *
+     * @return false if no task is due before the end of time
+     */
+    bool getNextWaketime(struct timeval &tv);
+
+    /**
+     * True if entries were pushed since the last popDue().
+     */
+    bool hasIncoming() const {
+        return incoming.load() != NULL;
+    }
+
+    /**
+     * The number of tasks filed.
+     */
+    size_t size() const {
+        return numFiled.load();
+    }
+
+    /**
+     * The number of entries sorted into the wheel and the overflow heap,
+     * stale ones included. Callers must serialize this with popDue().
+     */
+    size_t getNumEntries() const {
+        return wheelEntries + overflow.size();
+    }
+
+private:
+
+    struct Entry {
+        Entry(ExTask &t, uint64_t g, uint64_t d, bool w)
+            : task(t), gen(g), due(d), wake(w), next(NULL) { }
+
+        ExTask task;
+        uint64_t gen;
+        uint64_t due; // in milliseconds
+        bool wake;
+        Entry *next;
+    };
+
+    class EntryLater {
+    public:
+        bool operator()(const Entry *a, const Entry *b) const {
+            return a->due > b->due;
+        }
+    };
+
+    static const uint64_t wheelSlots = 1024;
+
+    static uint64_t toMillis(const struct timeval &tv);
+
+    void pushIncoming(Entry *e);
+
+    bool isStale(const Entry *e) const {
+        return e->task->futureGen.load() != e->gen;
+    }
+
+    bool take(Entry *e, std::vector<ExTask> &due);
+
+    void place(Entry *e, uint64_t now, std::vector<ExTask> &due);
+
+    void compactOverflow();
+
+    AtomicValue<Entry *> incoming;
+    AtomicValue<size_t> numFiled;
+
+    // Only touched by popDue() and getNextWaketime()
+    std::vector<std::vector<Entry *> > wheel;
+    size_t wheelEntries;
+    uint64_t cursor; // the first millisecond not swept yet
+    std::priority_queue<Entry *, std::vector<Entry *>, EntryLater> overflow;
+
+    DISALLOW_COPY_AND_ASSIGN(FutureQueue);
+};
+
+#endif  // SRC_FUTUREQUEUE_H_
@@ -29,6 +29,8 @@
 #include <ostream>
 #include <vector>
 
+#include <platform/platform.h>
+
 #include "atomic.h"
 #include "common.h"
 
@@ -374,6 +376,198 @@ private:
     DISALLOW_COPY_AND_ASSIGN(Histogram);
 };
 
+/**
+ * A histogram of power of two bins whose counters are sharded by thread.
+ *
+ * It has the bins of the default Histogram(n): [min, 1), then [2^(i-1), 2^i)
+ * for 1 <= i <= n, then [2^n, max). A value's bin is found from the
+ * position of its highest set bit rather than by searching the bins, and
+ * every thread counts into the shard its id hashes to, so concurrent adds
+ * rarely touch the same cache line. Reads merge the shards, and are not a
+ * snapshot: an add racing with a read may or may not be counted in it.
+ */
+template <typename T>
+class ShardedHistogram {
+public:
+
+    /**
+     * Build a sharded histogram.
+     *
+     * @param n how many power of two bins this histogram should contain
+     */
+    ShardedHistogram(size_t n=30)
+        : numBins(n + 2),
+          stride((n + 2 + countsPerLine - 1) / countsPerLine * countsPerLine) {
+        cb_assert(n < std::numeric_limits<uint64_t>::digits);
+        // One spare cache line so that every shard can start on one.
+        storage = new AtomicValue<size_t>[numShards * stride + countsPerLine];
+        uintptr_t addr = reinterpret_cast<uintptr_t>(storage);
+        size_t misalign = addr % cacheLineSize;
+        counts = storage;
+        if (misalign) {
+            counts += (cacheLineSize - misalign) / sizeof(AtomicValue<size_t>);
+        }
+        reset();
+    }
+
+    ~ShardedHistogram() {
+        delete []storage;
+    }
+
+    /**
+     * Add a value to this histogram.
+     *
+     * @param amount the size of the thing being added
+     * @param count the quantity at this size being added
+     */
+    void add(T amount, size_t count=1) {
+        counts[shardIndex() * stride + binIndex(amount)].fetch_add(
+                                                count, std::memory_order_relaxed);
+    }
+
+    /**
+     * Set all bins to 0.
+     */
+    void reset() {
+        for (size_t i = 0; i < numShards * stride; ++i) {
+            counts[i].store(0, std::memory_order_relaxed);
+        }
+    }
+
+    /**
+     * Get the total number of samples counted.
+     */
+    size_t total() const {
+        size_t rv = 0;
+        for (size_t i = 0; i < numShards * stride; ++i) {
+            rv += counts[i].load(std::memory_order_relaxed);
+        }
+        return rv;
+    }
+
+    /**
+     * The number of bins, including the ones for the values below 1 and
+     * from 2^n up.
+     */
+    size_t size() const {
+        return numBins;
+    }
+
+    /**
+     * The starting value of the given bin (inclusive).
+     */
+    T binStart(size_t bin) const {
+        if (bin == 0) {
+            return std::numeric_limits<T>::min();
+        }
+        return static_cast<T>(uint64_t(1) << (bin - 1));
+    }
+
+    /**
+     * The ending value of the given bin (exclusive).
+     */
+    T binEnd(size_t bin) const {
+        if (bin == numBins - 1) {
+            return std::numeric_limits<T>::max();
+        }
+        return static_cast<T>(uint64_t(1) << bin);
+    }
+
+    /**
+     * Get the bin the given value is counted in.
+     */
+    size_t binIndex(T amount) const {
+        if (amount < 1) {
+            return 0;
+        }
+        size_t bin = floorLog2(static_cast<uint64_t>(amount)) + 1;
+        return bin < numBins ? bin : numBins - 1;
+    }
+
+    /**
+     * Get the counts of every bin, merged over all the shards.
+     */
+    void getCounts(std::vector<size_t> &out) const {
+        out.assign(numBins, 0);
+        for (size_t shard = 0; shard < numShards; ++shard) {
+            const AtomicValue<size_t> *c = counts + shard * stride;
+            for (size_t bin = 0; bin < numBins; ++bin) {
+                out[bin] += c[bin].load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    /**
+     * Estimate the value below which the given fraction of the samples
+     * fall, interpolating linearly within the bin that holds it. Values in
+     * the last, unbounded bin are reported as its start.
+     *
+     * @param p the fraction of the samples, between 0 and 1
+     * @return the estimate, or 0 if the histogram is empty
+     */
+    T percentile(double p) const {
+        std::vector<size_t> c;
+        getCounts(c);
+        return percentile(c, p);
+    }
+
+    /**
+     * As percentile(p), on counts already read with getCounts().
+     */
+    T percentile(const std::vector<size_t> &c, double p) const {
+        size_t samples = std::accumulate(c.begin(), c.end(), size_t(0));
+        if (samples == 0) {
+            return 0;
+        }
+        double rank = p * samples;
+        size_t seen = 0;
+        for (size_t bin = 0; bin < c.size(); ++bin) {
+            if (c[bin] == 0 || seen + c[bin] < rank) {
+                seen += c[bin];
+                continue;
+            }
+            if (bin == 0 || bin == numBins - 1) {
+                return bin == 0 ? 0 : binStart(bin);
+            }
+            double start = static_cast<double>(binStart(bin));
+            double width = static_cast<double>(binEnd(bin)) - start;
+            return static_cast<T>(start + width * (rank - seen) / c[bin]);
+        }
+        return binStart(numBins - 1);
+    }
+
+private:
+
+    static const size_t shardBits = 3;
+    static const size_t numShards = 1 << shardBits;
+    static const size_t cacheLineSize = 64;
+    static const size_t countsPerLine =
+        cacheLineSize / sizeof(AtomicValue<size_t>);
+
+    static size_t floorLog2(uint64_t v) {
+#ifdef __GNUC__
+        return 63 - __builtin_clzll(v);
+#else
+        size_t rv = 0;
+        while (v >>= 1) {
+            ++rv;
+        }
+        return rv;
+#endif
+    }
+
+    static size_t shardIndex() {
+        return threadShardIndex(shardBits);
+    }
+
+    const size_t numBins;
+    const size_t stride;
+    AtomicValue<size_t> *storage;
+    AtomicValue<size_t> *counts;
+
+    DISALLOW_COPY_AND_ASSIGN(ShardedHistogram);
+};
+
 /**
  * Times blocks automatically and records the values in a histogram.
  */
@@ -386,7 +580,8 @@ public:
      *
      * @param d the histogram that will hold the result
      */
-    BlockTimer(Histogram<hrtime_t> *d, const char *n=NULL, std::ostream *o=NULL)
+    BlockTimer(ShardedHistogram<hrtime_t> *d, const char *n=NULL,
+               std::ostream *o=NULL)
         : dest(d), start(gethrtime()), name(n), out(o) {}
 
     ~BlockTimer() {
@@ -402,7 +597,7 @@ public:
     }
 
 private:
-    Histogram<hrtime_t> *dest;
+    ShardedHistogram<hrtime_t> *dest;
     hrtime_t             start;
     const char          *name;
     std::ostream        *out;
@@ -23,6 +23,9 @@
 
 static const double FREQUENCY(60.0);
 
+// Old buckets migrated per lock acquisition during an incremental resize.
+static const size_t MIGRATE_STEP(256);
+
 /**
  * Look at all the hash tables and make sure they're sized appropriately.
  */
@@ -33,6 +36,10 @@ public:
 
     bool visitBucket(RCPtr<VBucket> &vb) {
         vb->ht.resize();
+        // Drain an incremental resize in small steps so front end
+        // operations only ever wait for one step on their lock.
+        while (vb->ht.resizeStep(MIGRATE_STEP)) {
+        }
         return false;
     }
 
@@ -57,6 +57,46 @@ bool doCompress(const char *buf, size_t len, char *newBuf, size_t *newLen) {
     return true;
 }
 
+Blob* Blob::Compress(const Blob& other) {
+    const size_t len = other.vlength();
+    size_t newLen = snappy_max_compressed_length(len);
+    char *buf = (char *) malloc(newLen);
+    if (buf == NULL || !doCompress(other.getData(), len, buf, &newLen)) {
+        free(buf);
+        return NULL;
+    }
+    // Unless it saves an eighth, the value is not worth inflating on reads.
+    if (newLen > len - len / 8) {
+        free(buf);
+        return NULL;
+    }
+    uint8_t *ext_meta = reinterpret_cast<uint8_t *>(
+                            const_cast<char *>(other.data + FLEX_DATA_OFFSET));
+    Blob *t = New(buf, newLen, ext_meta, other.extMetaLen);
+    t->compressedInMemory = true;
+    free(buf);
+    return t;
+}
+
+Blob* Blob::Inflate(const Blob& other) {
+    size_t len = other.inflatedVlength();
+    uint8_t *ext_meta = reinterpret_cast<uint8_t *>(
+                            const_cast<char *>(other.data + FLEX_DATA_OFFSET));
+    Blob *t = New(len, ext_meta, other.extMetaLen);
+    bool inflated = doUnCompress(other.getData(), other.vlength(),
+                                 const_cast<char *>(t->getData()), &len);
+    cb_assert(inflated && len == t->vlength());
+    return t;
+}
+
+size_t Blob::inflatedVlength() const {
+    cb_assert(compressedInMemory);
+    size_t len = 0;
+    bool valid = getUnCompressedLength(getData(), vlength(), &len);
+    cb_assert(valid);
+    return len;
+}
+
 /**
  * Append another item to this item
  *
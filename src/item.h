@@ -118,6 +118,28 @@ public:
         return t;
     }
 
+    /**
+     * Create a Blob holding the value of the given one compressed with
+     * snappy, for keeping it in memory. The datatype and the rest of the
+     * extended meta data are kept as they are; the value must go through
+     * Inflate() before anything reads it.
+     *
+     * @return the new Blob, or NULL if the value does not compress well
+     */
+    static Blob* Compress(const Blob& other);
+
+    /**
+     * Create a Blob holding the value of one made by Compress(), as it was
+     * before it was compressed.
+     */
+    static Blob* Inflate(const Blob& other);
+
+    /**
+     * Get the length of the value Inflate() gives back for this Blob, which
+     * must have been made by Compress().
+     */
+    size_t inflatedVlength() const;
+
     // Actual accessorish things.
 
     /**
@@ -194,6 +216,46 @@ public:
         return age;
     }
 
+    /**
+     * True if this Blob holds its value compressed by Compress().
+     */
+    bool isCompressedInMemory() const {
+        return compressedInMemory;
+    }
+
+    /**
+     * True if Compress() found that the value does not compress well.
+     */
+    bool isIncompressible() const {
+        return incompressible;
+    }
+
+    /**
+     * Remember that the value does not compress well, so that it is not
+     * tried again.
+     */
+    void markIncompressible() {
+        incompressible = true;
+    }
+
+    /**
+     * True if the value has not been read since markCold().
+     */
+    bool isCold() const {
+        return cold;
+    }
+
+    /**
+     * Mark the value as not read since now; a read clears it again.
+     */
+    void markCold() {
+        cold = true;
+    }
+
+    void clearCold() {
+        cold = false;
+    }
+
     /**
      * Increment the age of the Blob. Saturates at 255.
      */
@@ -237,7 +299,10 @@ private:
                   uint8_t ext_len) :
         size(static_cast<uint32_t>(len + FLEX_DATA_OFFSET + ext_len)),
         extMetaLen(static_cast<uint8_t>(ext_len)),
-        age(0)
+        age(0),
+        compressedInMemory(false),
+        incompressible(false),
+        cold(false)
     {
         *(data) = FLEX_META_CODE;
         std::memcpy(data + FLEX_DATA_OFFSET, ext_meta, ext_len);
@@ -254,7 +319,10 @@ private:
     explicit Blob(const size_t len, uint8_t ext_len) :
         size(static_cast<uint32_t>(len + FLEX_DATA_OFFSET + ext_len)),
         extMetaLen(static_cast<uint8_t>(ext_len)),
-        age(0)
+        age(0),
+        compressedInMemory(false),
+        incompressible(false),
+        cold(false)
     {
 #ifdef VALGRIND
         memset(data, 0, len);
@@ -266,7 +334,10 @@ private:
       : size(other.size),
         extMetaLen(other.extMetaLen),
         // While this is a copy, it is a new allocation therefore reset age.
-        age(0)
+        age(0),
+        compressedInMemory(other.compressedInMemory),
+        incompressible(other.incompressible),
+        cold(other.cold)
     {
         std::memcpy(data, other.data, size);
         ObjectRegistry::onCreateBlob(this);
@@ -277,6 +348,14 @@ private:
 
     // The age of this Blob, in terms of some unspecified units of time.
     uint8_t age;
+    // Flags packed into the byte after age, so that they don't grow the
+    // header. Only changed under the hash table bucket lock.
+    // Set if the value was compressed by Compress().
+    uint8_t compressedInMemory : 1;
+    // Set if Compress() found the value not worth compressing.
+    uint8_t incompressible : 1;
+    // Set if the value has not been read since markCold().
+    uint8_t cold : 1;
     char data[1];
 
     DISALLOW_ASSIGN(Blob);
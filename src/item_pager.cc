@@ -197,7 +197,11 @@ private:
 
     void doEviction(StoredValue *v) {
         item_eviction_policy_t policy = store.getItemEvictionPolicy();
-        std::string key = v->getKey();
+        // Only full eviction needs the key once the value is ejected.
+        std::string key;
+        if (policy == FULL_EVICTION) {
+            key = v->getKey();
+        }
 
         if (currentBucket->ht.unlocked_ejectItem(v, policy)) {
             ++ejected;
@@ -229,6 +233,8 @@ private:
 
 bool ItemPager::run(void) {
     EventuallyPersistentStore *store = engine->getEpStore();
+    // Frees other threads have yet to apply make mem_used read high.
+    stats.flushPendingMemory();
     double current = static_cast<double>(stats.getTotalMemoryUsed());
     double upper = static_cast<double>(stats.mem_high_wat);
     double lower = static_cast<double>(stats.mem_low_wat);
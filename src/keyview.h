@@ -0,0 +1,83 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2015 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef SRC_KEYVIEW_H_
+#define SRC_KEYVIEW_H_ 1
+
+#include "config.h"
+
+#include <string>
+
+/**
+ * A key that is not owned, along with its hash.
+ *
+ * The key is hashed once when the view is made, and neither the view nor
+ * lookups through it copy the key. The bytes it points at must outlive the
+ * view, so never make one from a temporary string other than to pass it as
+ * an argument.
+ */
+class KeyView {
+public:
+    KeyView(const char *k, size_t n) : bytes(k), len(n), h(hash(k, n)) { }
+
+    KeyView(const std::string &k)
+        : bytes(k.data()), len(k.size()), h(hash(k.data(), k.size())) { }
+
+    const char *data() const {
+        return bytes;
+    }
+
+    size_t size() const {
+        return len;
+    }
+
+    /**
+     * The hash the HashTable files this key under.
+     */
+    int getHash() const {
+        return h;
+    }
+
+    /**
+     * Copy the key out, for the paths that need to keep it.
+     */
+    std::string toString() const {
+        return std::string(bytes, len);
+    }
+
+    /**
+     * Compute the hash of the given key.
+     *
+     * @param str the beginning of the key
+     * @param n the number of bytes in the key
+     * @return the hash value
+     */
+    static int hash(const char *str, size_t n) {
+        int rv = 5381;
+        for (size_t i = 0; i < n; ++i) {
+            rv = ((rv << 5) + rv) ^ str[i];
+        }
+        return rv;
+    }
+
+private:
+    const char *bytes;
+    size_t len;
+    int h;
+};
+
+#endif  // SRC_KEYVIEW_H_
@@ -36,9 +36,11 @@ KVShard::KVShard(uint16_t id, EventuallyPersistentStore &store) :
     KVStoreConfig kvconfig(config);
     rwUnderlying = KVStoreFactory::create(kvconfig, false);
     roUnderlying = KVStoreFactory::create(kvconfig, true);
+    rwUnderlying->setReadOnlyPeer(roUnderlying);
 
     flusher = new Flusher(&store, this);
-    bgFetcher = new BgFetcher(&store, this, stats);
+    bgFetcher = new BgFetcher(&store, this, stats,
+                              config.getBgFetchMaxInflight());
 }
 
 KVShard::~KVShard() {
@@ -23,6 +23,7 @@
 
 #include "common.h"
 #include "couch-kvstore/couch-kvstore.h"
+#include "forest-kvstore/forest-kvstore.h"
 #include "kvstore.h"
 #include <platform/dirutils.h>
 #include <sys/types.h>
@@ -32,13 +33,15 @@ using namespace CouchbaseDirectoryUtilities;
 
 KVStoreConfig::KVStoreConfig(Configuration& config)
     : maxVBuckets(config.getMaxVbuckets()), dbname(config.getDbname()),
-      backend(config.getBackend()) {
+      backend(config.getBackend()),
+      dbHandleCacheSize(config.getCouchDbHandleCacheSize()) {
 
 }
 
 KVStoreConfig::KVStoreConfig(uint16_t _maxVBuckets, std::string& _dbname,
-                             std::string& _backend)
-    : maxVBuckets(_maxVBuckets), dbname(_dbname), backend(_backend) {
+                             std::string& _backend, size_t _dbHandleCacheSize)
+    : maxVBuckets(_maxVBuckets), dbname(_dbname), backend(_backend),
+      dbHandleCacheSize(_dbHandleCacheSize) {
 
 }
 
@@ -47,6 +50,8 @@ KVStore *KVStoreFactory::create(KVStoreConfig &config, bool read_only) {
     std::string backend = config.getBackend();
     if (backend.compare("couchdb") == 0) {
         ret = new CouchKVStore(config, read_only);
+    } else if (backend.compare("forestdb") == 0) {
+        ret = new ForestKVStore(config, read_only);
     } else {
         LOG(EXTENSION_LOG_WARNING, "Unknown backend: [%s]", backend.c_str());
     }
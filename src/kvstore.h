@@ -188,6 +188,28 @@ struct KVStatsCtx{
 
 typedef struct KVStatsCtx kvstats_ctx;
 
+/**
+ * What the writer of an item already knows about whether its key exists
+ * as a live document in the store, so that the store can skip looking it
+ * up when counting inserts and deletions.
+ */
+typedef enum {
+    KEY_EXISTENCE_UNKNOWN,
+    KEY_KNOWN_NEW,
+    KEY_KNOWN_EXISTING
+} key_existence_t;
+
+/**
+ * What a commit records for one vbucket along with its mutations.
+ */
+struct VBucketCommit {
+    uint16_t vbucket;
+    uint64_t snapStartSeqno;
+    uint64_t snapEndSeqno;
+    uint64_t maxCas;
+    uint64_t driftCounter;
+};
+
 /**
  * Type of vbucket map.
  *
@@ -238,7 +260,7 @@ public:
     KVStoreConfig(Configuration& config);
 
     KVStoreConfig(uint16_t _maxVBuckets, std::string& _dbname,
-                  std::string& _backend);
+                  std::string& _backend, size_t _dbHandleCacheSize = 0);
 
     uint16_t getMaxVBuckets() {
         return maxVBuckets;
@@ -252,10 +274,15 @@ public:
         return backend;
     }
 
+    size_t getDbHandleCacheSize() {
+        return dbHandleCacheSize;
+    }
+
 private:
     uint16_t maxVBuckets;
     std::string dbname;
     std::string backend;
+    size_t dbHandleCacheSize;
 };
 
 /**
@@ -280,6 +307,12 @@ public:
         (void)c;
     }
 
+    /**
+     * Set the read-only kvstore serving reads from the same files as this
+     * read-write one, so it can be told when those files change.
+     */
+    virtual void setReadOnlyPeer(KVStore *) { }
+
     /**
      * Show kvstore specific timing stats.
      *
@@ -317,6 +350,16 @@ public:
                         uint64_t snapEndSeqno, uint64_t maxCas,
                         uint64_t driftCounter) = 0;
 
+    /**
+     * Commit a transaction holding mutations of several vbuckets. Every
+     * vbucket with a pending mutation must be in vbCommits. The callback
+     * is invoked once per vbucket.
+     *
+     * @return false if the commit fails
+     */
+    virtual bool groupCommit(Callback<kvstats_ctx> *cb,
+                             const std::vector<VBucketCommit> &vbCommits) = 0;
+
     /**
      * Rollback the current transaction.
      */
@@ -331,7 +374,8 @@ public:
      * Set an item into the kv store.
      */
     virtual void set(const Item &item,
-                     Callback<mutation_result> &cb) = 0;
+                     Callback<mutation_result> &cb,
+                     key_existence_t existence = KEY_EXISTENCE_UNKNOWN) = 0;
 
     /**
      * Get an item from the kv store.
@@ -354,7 +398,8 @@ public:
     /**
      * Delete an item from the kv store.
      */
-    virtual void del(const Item &itm, Callback<int> &cb) = 0;
+    virtual void del(const Item &itm, Callback<int> &cb,
+                     key_existence_t existence = KEY_EXISTENCE_UNKNOWN) = 0;
 
     /**
      * Delete a given vbucket database.
@@ -390,10 +435,15 @@ public:
 
     /**
      * Compact a vbucket file.
+     *
+     * The vbucket may be flushed to while it is compacted. The given lock
+     * is the one flushes of the vbucket hold; it is only taken to pick the
+     * file to compact and to switch over to the compacted file.
      */
     virtual bool compactVBucket(const uint16_t vbid,
                                 compaction_ctx *c,
-                                Callback<kvstats_ctx> &kvcb) = 0;
+                                Callback<kvstats_ctx> &kvcb,
+                                Mutex &vbLock) = 0;
 
     /**
      * Check if the underlying store supports dumping all of the keys
@@ -489,9 +489,9 @@ public:
     //! Histogram of block padding sizes.
     Histogram<uint32_t> paddingHisto;
     //! Flush time histogram.
-    Histogram<hrtime_t> flushTimeHisto;
+    ShardedHistogram<hrtime_t> flushTimeHisto;
     //! Sync time histogram.
-    Histogram<hrtime_t> syncTimeHisto;
+    ShardedHistogram<hrtime_t> syncTimeHisto;
     //! Size of the log
     AtomicValue<size_t> logSize;
 
@@ -75,11 +75,12 @@ void ObjectRegistry::onCreateBlob(const Blob *blob)
        if (size == 0) {
            size = blob->getSize();
        } else {
-           stats.blobOverhead.fetch_add(size - blob->getSize());
+           stats.addMemory(PendingMemory::BLOB_OVERHEAD,
+                           size - blob->getSize());
        }
        stats.currentSize.fetch_add(size);
-       stats.totalValueSize.fetch_add(size);
-       stats.numBlob++;
+       stats.addMemory(PendingMemory::TOTAL_VALUE_SIZE, size);
+       stats.addMemory(PendingMemory::NUM_BLOB, 1);
        cb_assert(stats.currentSize.load() < GIGANTOR);
    }
 }
@@ -93,12 +94,14 @@ void ObjectRegistry::onDeleteBlob(const Blob *blob)
        if (size == 0) {
            size = blob->getSize();
        } else {
-           stats.blobOverhead.fetch_sub(size - blob->getSize());
+           stats.addMemory(PendingMemory::BLOB_OVERHEAD,
+                           -static_cast<ssize_t>(size - blob->getSize()));
        }
-       stats.currentSize.fetch_sub(size);
-       stats.totalValueSize.fetch_sub(size);
-       stats.numBlob--;
-       cb_assert(stats.currentSize.load() < GIGANTOR);
+       stats.addMemory(PendingMemory::CURRENT_SIZE,
+                       -static_cast<ssize_t>(size));
+       stats.addMemory(PendingMemory::TOTAL_VALUE_SIZE,
+                       -static_cast<ssize_t>(size));
+       stats.addMemory(PendingMemory::NUM_BLOB, -1);
    }
 }
 
@@ -111,11 +114,11 @@ void ObjectRegistry::onCreateStoredValue(const StoredValue *sv)
        if (size == 0) {
            size = sv->getObjectSize();
        } else {
-           stats.storedValOverhead.fetch_add(size - sv->getObjectSize());
+           stats.addMemory(PendingMemory::STORED_VAL_OVERHEAD,
+                           size - sv->getObjectSize());
        }
-       stats.numStoredVal++;
-       stats.totalStoredValSize.fetch_add(size);
-       cb_assert(stats.currentSize.load() < GIGANTOR);
+       stats.addMemory(PendingMemory::NUM_STORED_VAL, 1);
+       stats.addMemory(PendingMemory::TOTAL_STORED_VAL_SIZE, size);
    }
 }
 
@@ -128,11 +131,12 @@ void ObjectRegistry::onDeleteStoredValue(const StoredValue *sv)
        if (size == 0) {
            size = sv->getObjectSize();
        } else {
-           stats.storedValOverhead.fetch_sub(size - sv->getObjectSize());
+           stats.addMemory(PendingMemory::STORED_VAL_OVERHEAD,
+                           -static_cast<ssize_t>(size - sv->getObjectSize()));
        }
-       stats.totalStoredValSize.fetch_sub(size);
-       stats.numStoredVal--;
-       cb_assert(stats.currentSize.load() < GIGANTOR);
+       stats.addMemory(PendingMemory::TOTAL_STORED_VAL_SIZE,
+                       -static_cast<ssize_t>(size));
+       stats.addMemory(PendingMemory::NUM_STORED_VAL, -1);
    }
 }
 
@@ -144,7 +148,7 @@ void ObjectRegistry::onCreateItem(const Item *pItem)
        EPStats &stats = engine->getEpStats();
        stats.memOverhead.fetch_add(pItem->size() - pItem->getValMemSize());
        cb_assert(stats.memOverhead.load() < GIGANTOR);
-       stats.numItem++;
+       stats.addMemory(PendingMemory::NUM_ITEM, 1);
    }
 }
 
@@ -153,9 +157,10 @@ void ObjectRegistry::onDeleteItem(const Item *pItem)
    EventuallyPersistentEngine *engine = th->get();
    if (verifyEngine(engine)) {
        EPStats &stats = engine->getEpStats();
-       stats.memOverhead.fetch_sub(pItem->size() - pItem->getValMemSize());
-       cb_assert(stats.memOverhead.load() < GIGANTOR);
-       stats.numItem--;
+       size_t overhead = pItem->size() - pItem->getValMemSize();
+       stats.addMemory(PendingMemory::MEM_OVERHEAD,
+                       -static_cast<ssize_t>(overhead));
+       stats.addMemory(PendingMemory::NUM_ITEM, -1);
    }
 }
 
@@ -21,6 +21,7 @@
 
 // Priorities for Read-only IO tasks
 const Priority Priority::BgFetcherPriority(BGFETCHER_ID, 0);
+const Priority Priority::BgFetchBatchPriority(BGFETCH_BATCH_ID, 0);
 const Priority Priority::BgFetcherGetMetaPriority(BGFETCHER_GET_META_ID, 1);
 const Priority Priority::WarmupPriority(WARMUP_ID, 0);
 const Priority Priority::VKeyStatBgFetcherPriority(VKEY_STAT_BGFETCHER_ID, 3);
@@ -110,6 +111,8 @@ const char *Priority::getTypeName(const type_id_t i) {
                 return "conn_manager_tasks";
             case DEFRAGMENTER_ID:
                 return "defragmenter_tasks";
+            case BGFETCH_BATCH_ID:
+                return "bg_fetch_batch_tasks";
             default: break;
         }
 
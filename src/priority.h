@@ -52,6 +52,7 @@ typedef enum {
     PENDING_OPS_ID,
     TAP_CONN_MGR_ID,
     DEFRAGMENTER_ID,
+    BGFETCH_BATCH_ID,
 
     MAX_TYPE_ID // Keep this as the last enum value
 } type_id_t;
@@ -63,6 +64,7 @@ class Priority {
 public:
     // Priorities for Read-only tasks
     static const Priority BgFetcherPriority;
+    static const Priority BgFetchBatchPriority;
     static const Priority BgFetcherGetMetaPriority;
     static const Priority TapBgFetcherPriority;
     static const Priority VKeyStatBgFetcherPriority;
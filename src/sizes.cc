@@ -63,6 +63,15 @@ static void display(const char *name, const Histogram<T> &histo) {
     std::for_each(histo.begin(), histo.end(), histo_for_inner<T>());
 }
 
+template <typename T>
+static void display(const char *name, const ShardedHistogram<T> &histo) {
+    std::cout << name << std::endl;
+    for (size_t i = 0; i < histo.size(); ++i) {
+        HistogramBin<T> bin(histo.binStart(i), histo.binEnd(i));
+        histo_for_inner<T>()(&bin);
+    }
+}
+
 int main(int, char **) {
     std::string s;
 
@@ -84,13 +93,14 @@ int main(int, char **) {
     display("HistogramBin<size_t>", sizeof(HistogramBin<size_t>));
     display("HistogramBin<hrtime_t>", sizeof(HistogramBin<hrtime_t>));
     display("HistogramBin<int>", sizeof(HistogramBin<int>));
+    display("ShardedHistogram<whatever>", sizeof(ShardedHistogram<size_t>));
 
     std::cout << std::endl << "Histogram Ranges" << std::endl << std::endl;
 
     EPStats stats;
     HashTableDepthStatVisitor dv;
     display("Default Histo", stats.diskInsertHisto);
-    display("Commit Histo", stats.diskCommitHisto);
+    display("Storage Age Histo", stats.dirtyAgeHisto);
     display("Hash table depth histo", dv.depthHisto);
     return 0;
 }
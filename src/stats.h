@@ -37,6 +37,84 @@
 
 static const hrtime_t ONE_SECOND(1000000);
 
+/**
+ * Changes to the memory counters of an EPStats that threads have made but
+ * not applied to them yet.
+ *
+ * ObjectRegistry sees every Blob, StoredValue and Item come and go. Rather
+ * than write the shared counters each time, it adds to a delta in the
+ * calling thread's slot and only moves the delta into the counter once it
+ * reaches flushThreshold either way. Threads are spread over the slots by
+ * threadShardIndex(), and each slot has cache lines of its own; threads
+ * that land on the same slot only contend for it.
+ */
+class PendingMemory {
+public:
+    enum Counter {
+        CURRENT_SIZE,
+        NUM_BLOB,
+        BLOB_OVERHEAD,
+        TOTAL_VALUE_SIZE,
+        NUM_STORED_VAL,
+        TOTAL_STORED_VAL_SIZE,
+        STORED_VAL_OVERHEAD,
+        MEM_OVERHEAD,
+        NUM_ITEM,
+        NUM_COUNTERS
+    };
+
+    static const ssize_t flushThreshold = 4096;
+    static const size_t slotBits = 3;
+    static const size_t numSlots = 1 << slotBits;
+
+    PendingMemory() {
+        for (size_t i = 0; i < numSlots; ++i) {
+            for (size_t c = 0; c < NUM_COUNTERS; ++c) {
+                slots[i].deltas[c].store(0);
+            }
+        }
+    }
+
+    /**
+     * Add to the calling thread's delta of a counter.
+     *
+     * @return the delta to apply to the counter now, which is zero until
+     *         the slot's delta reaches flushThreshold
+     */
+    ssize_t add(Counter c, ssize_t delta) {
+        AtomicValue<ssize_t> &d = slots[threadShardIndex(slotBits)].deltas[c];
+        ssize_t pending = d.fetch_add(delta, std::memory_order_relaxed) + delta;
+        if (pending >= flushThreshold || pending <= -flushThreshold) {
+            return d.exchange(0);
+        }
+        return 0;
+    }
+
+    /**
+     * Take the deltas of a counter out of every slot.
+     */
+    ssize_t take(Counter c) {
+        ssize_t rv = 0;
+        for (size_t i = 0; i < numSlots; ++i) {
+            rv += slots[i].deltas[c].exchange(0);
+        }
+        return rv;
+    }
+
+private:
+    static const size_t cacheLineSize = 64;
+
+    struct Slot {
+        AtomicValue<ssize_t> deltas[NUM_COUNTERS];
+        char pad[2 * cacheLineSize -
+                 NUM_COUNTERS * sizeof(AtomicValue<ssize_t>)];
+    };
+
+    Slot slots[numSlots];
+
+    DISALLOW_COPY_AND_ASSIGN(PendingMemory);
+};
+
 /**
  * Global engine stats container.
  */
@@ -55,6 +133,7 @@ public:
         diskQueueSize(0),
         flusher_todo(0),
         flusherCommits(0),
+        flusherCommitItems(0),
         cumulativeFlushTime(0),
         cumulativeCommitTime(0),
         tooYoung(0),
@@ -102,6 +181,7 @@ public:
         bg_fetched(0),
         bg_meta_fetched(0),
         numRemainingBgJobs(0),
+        numBgFetchInflight(0),
         bgNumOperations(0),
         maxRemainingBgJobs(0),
         bgWait(0),
@@ -146,8 +226,12 @@ public:
         rollbackCount(0),
         defragNumVisited(0),
         defragNumMoved(0),
+        compressorNumCompressed(0),
+        compressorBytesSaved(0),
+        compressorCompressTime(0),
+        compressorNumInflated(0),
+        compressorInflateTime(0),
         dirtyAgeHisto(GrowingWidthGenerator<hrtime_t>(0, ONE_SECOND, 1.4), 25),
-        diskCommitHisto(GrowingWidthGenerator<hrtime_t>(0, ONE_SECOND, 1.4), 25),
         mlogCompactorHisto(GrowingWidthGenerator<hrtime_t>(0, ONE_SECOND, 1.4), 25),
         timingLog(NULL),
         maxDataSize(DEFAULT_MAX_DATA_SIZE) {}
@@ -173,6 +257,37 @@ public:
         return currentSize.load() + memOverhead.load();
     }
 
+    /**
+     * Change one of the memory counters ObjectRegistry maintains through
+     * the calling thread's slot of pendingMemory.
+     *
+     * currentSize and memOverhead make up mem_used, which must never read
+     * low or wrap below zero, so only ever pass decreases of those; apply
+     * increases to them directly. mem_used then reads high by less than
+     * 2 * numSlots * flushThreshold bytes until flushPendingMemory().
+     */
+    void addMemory(PendingMemory::Counter c, ssize_t delta) {
+        ssize_t due = pendingMemory.add(c, delta);
+        if (due != 0) {
+            memoryCounter(c).fetch_add(static_cast<size_t>(due));
+        }
+    }
+
+    /**
+     * Apply every change pendingMemory holds, so that the memory counters
+     * read exactly for the updates that have completed.
+     */
+    void flushPendingMemory() {
+        for (int c = 0; c < PendingMemory::NUM_COUNTERS; ++c) {
+            PendingMemory::Counter counter =
+                static_cast<PendingMemory::Counter>(c);
+            ssize_t due = pendingMemory.take(counter);
+            if (due != 0) {
+                memoryCounter(counter).fetch_add(static_cast<size_t>(due));
+            }
+        }
+    }
+
     bool decrDiskQueueSize(size_t decrementBy) {
         size_t oldVal;
         do {
@@ -213,6 +328,8 @@ public:
     AtomicValue<size_t> flusher_todo;
     //! Number of transaction commits.
     AtomicValue<size_t> flusherCommits;
+    //! Number of items written by transaction commits.
+    AtomicValue<size_t> flusherCommitItems;
     //! Total time spent flushing.
     AtomicValue<size_t> cumulativeFlushTime;
     //! Total time spent committing.
@@ -222,15 +339,15 @@ public:
     //! Objects that were forced into persistence for being too old.
     AtomicValue<size_t> tooOld;
     //! Number of items persisted.
-    AtomicValue<size_t> totalPersisted;
+    ShardedCounter totalPersisted;
     //! Cumulative number of items added to the queue.
-    AtomicValue<size_t> totalEnqueued;
+    ShardedCounter totalEnqueued;
     //! Number of times an item flush failed.
     AtomicValue<size_t> flushFailed;
     //! Number of times an item is not flushed due to the item's expiry
     AtomicValue<size_t> flushExpired;
     //! Number of times an object was expired on access.
-    AtomicValue<size_t> expired_access;
+    ShardedCounter expired_access;
     //! Number of times an object was expired by pager.
     AtomicValue<size_t> expired_pager;
     //! Number of times we failed to start a transaction
@@ -265,7 +382,7 @@ public:
     //! Number of times a value could not be ejected
     AtomicValue<size_t> numFailedEjects;
     //! Number of times "Not my bucket" happened
-    AtomicValue<size_t> numNotMyVBuckets;
+    ShardedCounter numNotMyVBuckets;
     //! Total size of stored objects.
     AtomicValue<size_t> currentSize;
     //! Total number of blob objects
@@ -286,6 +403,8 @@ public:
     AtomicValue<size_t> numItem;
     //! The total amount of memory used by this bucket (From memory tracking)
     AtomicValue<size_t> totalMemory;
+    //! Changes to the counters above not applied to them yet.
+    PendingMemory pendingMemory;
     //! True if the memory usage tracker is enabled.
     AtomicValue<bool> memoryTrackerEnabled;
     //! Whether or not to force engine shutdown.
@@ -306,17 +425,19 @@ public:
     AtomicValue<hrtime_t> pendingOpsMaxDuration;
 
     //! Histogram of pending operation wait times.
-    Histogram<hrtime_t> pendingOpsHisto;
+    ShardedHistogram<hrtime_t> pendingOpsHisto;
 
     //! Number of pending vbucket compaction requests
     AtomicValue<size_t> pendingCompactions;
 
     //! Number of times background fetches occurred.
-    AtomicValue<size_t> bg_fetched;
+    ShardedCounter bg_fetched;
     //! Number of times meta background fetches occurred.
-    AtomicValue<size_t> bg_meta_fetched;
+    ShardedCounter bg_meta_fetched;
     //! Number of remaining bg fetch jobs.
     AtomicValue<size_t> numRemainingBgJobs;
+    //! Number of per-vbucket bg fetch batches currently running.
+    AtomicValue<size_t> numBgFetchInflight;
     //! The number of samples the bgWaitDelta and bgLoadDelta contains of
     AtomicValue<size_t> bgNumOperations;
     //! Max number of individual background fetch jobs that we've seen in the queue
@@ -332,7 +453,7 @@ public:
     AtomicValue<hrtime_t> bgMaxWait;
 
     //! Histogram of background wait times.
-    Histogram<hrtime_t> bgWaitHisto;
+    ShardedHistogram<hrtime_t> bgWaitHisto;
 
     /** The sum of the deltas (in usec) from the dispatcher started to load
      *  item until was done
@@ -344,7 +465,7 @@ public:
     AtomicValue<hrtime_t> bgMaxLoad;
 
     //! Histogram of background wait loads.
-    Histogram<hrtime_t> bgLoadHisto;
+    ShardedHistogram<hrtime_t> bgLoadHisto;
 
     //! Max wall time of deleting a vbucket
     AtomicValue<hrtime_t> vbucketDelMaxWalltime;
@@ -352,7 +473,7 @@ public:
     AtomicValue<hrtime_t> vbucketDelTotWalltime;
 
     //! Histogram of setWithMeta latencies.
-    Histogram<hrtime_t> setWithMetaHisto;
+    ShardedHistogram<hrtime_t> setWithMetaHisto;
 
     /* TAP related stats */
     //! The total number of tap events sent (not including noops)
@@ -382,7 +503,7 @@ public:
     AtomicValue<hrtime_t> tapBgMaxWait;
 
     //! Histogram of tap background wait loads.
-    Histogram<hrtime_t> tapBgWaitHisto;
+    ShardedHistogram<hrtime_t> tapBgWaitHisto;
 
     /** The sum of the deltas (in usec) from the dispatcher started to load
      *  a tap item until was done
@@ -394,31 +515,31 @@ public:
     AtomicValue<hrtime_t> tapBgMaxLoad;
 
     //! Histogram of tap background wait loads.
-    Histogram<hrtime_t> tapBgLoadHisto;
+    ShardedHistogram<hrtime_t> tapBgLoadHisto;
 
     //! The number of basic store (add, set, arithmetic, touch, etc.) operations
-    AtomicValue<size_t> numOpsStore;
+    ShardedCounter numOpsStore;
     //! The number of basic delete operations
-    AtomicValue<size_t> numOpsDelete;
+    ShardedCounter numOpsDelete;
     //! The number of basic get operations
-    AtomicValue<size_t> numOpsGet;
+    ShardedCounter numOpsGet;
 
     //! The number of get with meta operations
-    AtomicValue<size_t>  numOpsGetMeta;
+    ShardedCounter numOpsGetMeta;
     //! The number of set with meta operations
-    AtomicValue<size_t>  numOpsSetMeta;
+    ShardedCounter numOpsSetMeta;
     //! The number of delete with meta operations
-    AtomicValue<size_t>  numOpsDelMeta;
+    ShardedCounter numOpsDelMeta;
     //! The number of failed set meta ops due to conflict resoltion
-    AtomicValue<size_t> numOpsSetMetaResolutionFailed;
+    ShardedCounter numOpsSetMetaResolutionFailed;
     //! The number of failed del meta ops due to conflict resoltion
-    AtomicValue<size_t> numOpsDelMetaResolutionFailed;
+    ShardedCounter numOpsDelMetaResolutionFailed;
     //! The number of set returning meta operations
-    AtomicValue<size_t>  numOpsSetRetMeta;
+    ShardedCounter numOpsSetRetMeta;
     //! The number of delete returning meta operations
-    AtomicValue<size_t>  numOpsDelRetMeta;
+    ShardedCounter numOpsDelRetMeta;
     //! The number of background get meta ops due to set_with_meta operations
-    AtomicValue<size_t>  numOpsGetMetaOnSetWithMeta;
+    ShardedCounter numOpsGetMetaOnSetWithMeta;
 
     //! The number of tiems the mutation log compactor is exectued
     AtomicValue<size_t> mlogCompactorRuns;
@@ -445,6 +566,17 @@ public:
      */
     AtomicValue<size_t> defragNumMoved;
 
+    //! Number of values the defragmenter compressed in memory.
+    AtomicValue<size_t> compressorNumCompressed;
+    //! Bytes that the values now compressed in memory save.
+    AtomicValue<size_t> compressorBytesSaved;
+    //! Time spent compressing values in memory (in us).
+    AtomicValue<hrtime_t> compressorCompressTime;
+    //! Number of times a read inflated a value compressed in memory.
+    AtomicValue<size_t> compressorNumInflated;
+    //! Time spent inflating values compressed in memory (in us).
+    AtomicValue<hrtime_t> compressorInflateTime;
+
     //! Histogram of queue processing dirty age.
     Histogram<hrtime_t> dirtyAgeHisto;
 
@@ -456,74 +588,83 @@ public:
     //
 
     //! Histogram of getvbucket timings
-    Histogram<hrtime_t> getVbucketCmdHisto;
+    ShardedHistogram<hrtime_t> getVbucketCmdHisto;
 
     //! Histogram of setvbucket timings
-    Histogram<hrtime_t> setVbucketCmdHisto;
+    ShardedHistogram<hrtime_t> setVbucketCmdHisto;
 
     //! Histogram of delvbucket timings
-    Histogram<hrtime_t> delVbucketCmdHisto;
+    ShardedHistogram<hrtime_t> delVbucketCmdHisto;
 
     //! Histogram of get commands.
-    Histogram<hrtime_t> getCmdHisto;
+    ShardedHistogram<hrtime_t> getCmdHisto;
 
     //! Histogram of store commands.
-    Histogram<hrtime_t> storeCmdHisto;
+    ShardedHistogram<hrtime_t> storeCmdHisto;
 
     //! Histogram of arithmetic commands.
-    Histogram<hrtime_t> arithCmdHisto;
+    ShardedHistogram<hrtime_t> arithCmdHisto;
 
     //! Histogram of tap VBucket reset timings
-    Histogram<hrtime_t> tapVbucketResetHisto;
+    ShardedHistogram<hrtime_t> tapVbucketResetHisto;
 
     //! Histogram of tap mutation timings.
-    Histogram<hrtime_t> tapMutationHisto;
+    ShardedHistogram<hrtime_t> tapMutationHisto;
 
     //! Histogram of tap vbucket set timings.
-    Histogram<hrtime_t> tapVbucketSetHisto;
+    ShardedHistogram<hrtime_t> tapVbucketSetHisto;
 
     //! Time spent notifying completion of IO.
-    Histogram<hrtime_t> notifyIOHisto;
+    ShardedHistogram<hrtime_t> notifyIOHisto;
 
     //! Histogram of get_stats commands.
-    Histogram<hrtime_t> getStatsCmdHisto;
+    ShardedHistogram<hrtime_t> getStatsCmdHisto;
 
     //! Histogram of wait_for_checkpoint_persistence command
-    Histogram<hrtime_t> chkPersistenceHisto;
+    ShardedHistogram<hrtime_t> chkPersistenceHisto;
 
     //
     // DB timers.
     //
 
     //! Histogram of insert disk writes
-    Histogram<hrtime_t> diskInsertHisto;
+    ShardedHistogram<hrtime_t> diskInsertHisto;
 
     //! Histogram of update disk writes
-    Histogram<hrtime_t> diskUpdateHisto;
+    ShardedHistogram<hrtime_t> diskUpdateHisto;
 
     //! Histogram of delete disk writes
-    Histogram<hrtime_t> diskDelHisto;
+    ShardedHistogram<hrtime_t> diskDelHisto;
 
     //! Histogram of execution time of disk vbucket deletions
-    Histogram<hrtime_t> diskVBDelHisto;
+    ShardedHistogram<hrtime_t> diskVBDelHisto;
 
     //! Histogram of disk commits
-    Histogram<hrtime_t> diskCommitHisto;
+    ShardedHistogram<hrtime_t> diskCommitHisto;
 
     //! Histogram of setting vbucket state
-    Histogram<hrtime_t> snapshotVbucketHisto;
+    ShardedHistogram<hrtime_t> snapshotVbucketHisto;
 
     //! Histogram of mutation log compactor
     Histogram<hrtime_t> mlogCompactorHisto;
 
     //! Historgram of batch reads
-    Histogram<hrtime_t> getMultiHisto;
+    ShardedHistogram<hrtime_t> getMultiHisto;
+
+    //! Histogram of the number of items in each bg fetch batch
+    Histogram<size_t> bgFetchBatchSizeHisto;
+
+    //! Histogram of vbuckets waiting for a bg fetch at each dispatch
+    Histogram<size_t> bgFetchQueueDepthHisto;
+
+    //! Histogram of batches in flight on a shard at each dispatch
+    Histogram<size_t> bgFetchConcurrencyHisto;
 
     // ! Histogram of various task wait times
-    Histogram<hrtime_t> *schedulingHisto;
+    ShardedHistogram<hrtime_t> *schedulingHisto;
 
     // ! Histogram of various task run times
-    Histogram<hrtime_t> *taskRuntimeHisto;
+    ShardedHistogram<hrtime_t> *taskRuntimeHisto;
 
     //! Reset all stats to reasonable values.
     void reset() {
@@ -564,6 +705,11 @@ public:
         alogRuns.store(0);
         defragNumVisited.store(0),
         defragNumMoved.store(0);
+        compressorNumCompressed.store(0);
+        compressorBytesSaved.store(0);
+        compressorCompressTime.store(0);
+        compressorNumInflated.store(0);
+        compressorInflateTime.store(0);
 
         pendingOpsHisto.reset();
         bgWaitHisto.reset();
@@ -593,6 +739,9 @@ public:
         dirtyAgeHisto.reset();
         mlogCompactorHisto.reset();
         getMultiHisto.reset();
+        bgFetchBatchSizeHisto.reset();
+        bgFetchQueueDepthHisto.reset();
+        bgFetchConcurrencyHisto.reset();
     }
 
     // Used by stats logging infrastructure.
@@ -600,6 +749,30 @@ public:
 
 private:
 
+    AtomicValue<size_t> &memoryCounter(PendingMemory::Counter c) {
+        switch (c) {
+        case PendingMemory::CURRENT_SIZE:
+            return currentSize;
+        case PendingMemory::NUM_BLOB:
+            return numBlob;
+        case PendingMemory::BLOB_OVERHEAD:
+            return blobOverhead;
+        case PendingMemory::TOTAL_VALUE_SIZE:
+            return totalValueSize;
+        case PendingMemory::NUM_STORED_VAL:
+            return numStoredVal;
+        case PendingMemory::TOTAL_STORED_VAL_SIZE:
+            return totalStoredValSize;
+        case PendingMemory::STORED_VAL_OVERHEAD:
+            return storedValOverhead;
+        case PendingMemory::MEM_OVERHEAD:
+            return memOverhead;
+        case PendingMemory::NUM_ITEM:
+        default:
+            return numItem;
+        }
+    }
+
     //! Max allowable memory size.
     AtomicValue<size_t> maxDataSize;
 
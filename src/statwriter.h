@@ -52,6 +52,11 @@ void add_casted_stat(const char *k, const AtomicValue<T> &v,
     add_casted_stat(k, v.load(), add_stat, cookie);
 }
 
+inline void add_casted_stat(const char *k, const ShardedCounter &v,
+                            ADD_STAT add_stat, const void *cookie) {
+    add_casted_stat(k, v.load(), add_stat, cookie);
+}
+
 /// @cond DETAILS
 /**
  * Convert a histogram into a bunch of calls to add stats.
@@ -80,6 +85,44 @@ void add_casted_stat(const char *k, const Histogram<T> &v,
     std::for_each(v.begin(), v.end(), a);
 }
 
+/**
+ * Add the populated bins of a sharded histogram, followed by its
+ * percentiles as <k>_p50, <k>_p95, <k>_p99 and <k>_p99_9.
+ */
+template <typename T>
+void add_casted_stat(const char *k, const ShardedHistogram<T> &v,
+                            ADD_STAT add_stat, const void *cookie) {
+    std::vector<size_t> counts;
+    v.getCounts(counts);
+    size_t samples = 0;
+    for (size_t i = 0; i < counts.size(); ++i) {
+        if (counts[i]) {
+            std::stringstream ss;
+            ss << k << "_" << v.binStart(i) << "," << v.binEnd(i);
+            add_casted_stat(ss.str().c_str(), counts[i], add_stat, cookie);
+            samples += counts[i];
+        }
+    }
+    if (samples == 0) {
+        return;
+    }
+
+    static const struct {
+        const char *suffix;
+        double fraction;
+    } percentiles[] = {
+        { "_p50", 0.5 }, { "_p95", 0.95 }, { "_p99", 0.99 },
+        { "_p99_9", 0.999 }
+    };
+    for (size_t i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); ++i) {
+        std::string name(k);
+        name.append(percentiles[i].suffix);
+        add_casted_stat(name.c_str(),
+                        v.percentile(counts, percentiles[i].fraction),
+                        add_stat, cookie);
+    }
+}
+
 template <typename P, typename T>
 void add_prefixed_stat(P prefix, const char *nm, T val,
                   ADD_STAT add_stat, const void *cookie) {
@@ -98,6 +141,15 @@ void add_prefixed_stat(P prefix, const char *nm, Histogram<T> &val,
     add_casted_stat(name.str().c_str(), val, add_stat, cookie);
 }
 
+template <typename P, typename T>
+void add_prefixed_stat(P prefix, const char *nm, ShardedHistogram<T> &val,
+                  ADD_STAT add_stat, const void *cookie) {
+    std::stringstream name;
+    name << prefix << ":" << nm;
+
+    add_casted_stat(name.str().c_str(), val, add_stat, cookie);
+}
+
 }
 
 using namespace STATWRITER_NAMESPACE;
@@ -28,6 +28,8 @@
 
 size_t HashTable::defaultNumBuckets = DEFAULT_HT_SIZE;
 size_t HashTable::defaultNumLocks = 193;
+hash_table_layout_t HashTable::defaultLayout = HT_LAYOUT_CHAINED;
+bool HashTable::defaultIncrementalResize = false;
 double StoredValue::mutation_mem_threshold = 0.9;
 const int64_t StoredValue::state_deleted_key = -3;
 const int64_t StoredValue::state_non_existent_key = -4;
@@ -43,6 +45,7 @@ static ssize_t prime_size_table[] = {
 bool StoredValue::ejectValue(HashTable &ht, item_eviction_policy_t policy) {
     if (eligibleForEviction(policy)) {
         reduceCacheSize(ht, value->length());
+        forgetCompressedValue(ht);
         markNotResident();
         value = NULL;
         return true;
@@ -54,6 +57,9 @@ void StoredValue::referenced() {
     if (nru > MIN_NRU_VALUE) {
         --nru;
     }
+    if (value) {
+        value->clearCold();
+    }
 }
 
 void StoredValue::setNRUValue(uint8_t nru_val) {
@@ -162,8 +168,10 @@ bool HashTable::unlocked_ejectItem(StoredValue*& vptr,
             StoredValue::reduceMetaDataSize(*this, stats,
                                             vptr->metaDataSize());
             StoredValue::reduceCacheSize(*this, vptr->size());
+            vptr->forgetCompressedValue(*this);
 
-            int bucket_num = getBucketForHash(hash(vptr->getKey()));
+            int bucket_num = getBucketForHash(hash(vptr->getKeyBytes(),
+                                                   vptr->getKeyLen()));
             StoredValue *v = values[bucket_num];
             // Remove the item from the hash table.
             if (v == vptr) {
@@ -178,6 +186,7 @@ bool HashTable::unlocked_ejectItem(StoredValue*& vptr,
                     }
                 }
             }
+            unlinkTag(bucket_num, vptr);
 
             if (vptr->isResident()) {
                 ++stats.numValueEjects;
@@ -208,8 +217,9 @@ mutation_type_t HashTable::insert(Item &itm, item_eviction_policy_t policy,
     }
 
     int bucket_num(0);
-    LockHolder lh = getLockedBucket(itm.getKey(), &bucket_num);
-    StoredValue *v = unlocked_find(itm.getKey(), bucket_num, true, false);
+    const KeyView key(itm.getKey());
+    LockHolder lh = getLockedBucket(key, &bucket_num);
+    StoredValue *v = unlocked_find(key, bucket_num, true, false);
 
     if (v == NULL) {
         v = valFact(itm, values[bucket_num], *this);
@@ -218,7 +228,7 @@ mutation_type_t HashTable::insert(Item &itm, item_eviction_policy_t policy,
             v->markNotResident();
             ++numNonResidentItems;
         }
-        values[bucket_num] = v;
+        linkValue(bucket_num, v);
         ++numItems;
         v->setNewCacheItem(false);
     } else {
@@ -291,6 +301,118 @@ void HashTable::setDefaultNumLocks(size_t to) {
     }
 }
 
+hash_table_layout_t HashTable::getDefaultLayout() {
+    return defaultLayout;
+}
+
+void HashTable::setDefaultLayout(hash_table_layout_t to) {
+    defaultLayout = to;
+}
+
+void HashTable::setDefaultLayout(const std::string &to) {
+    defaultLayout = (to.compare("tagged") == 0) ? HT_LAYOUT_TAGGED :
+                                                  HT_LAYOUT_CHAINED;
+}
+
+void HashTable::setDefaultIncrementalResize(bool to) {
+    defaultIncrementalResize = to;
+}
+
+size_t HashTable::alignToLocks(size_t s) const {
+    if (!defaultIncrementalResize) {
+        return s;
+    }
+    return ((s + n_locks - 1) / n_locks) * n_locks;
+}
+
+void HashTable::unlocked_migrateBucket(int old_bucket) {
+    while (oldValues[old_bucket]) {
+        StoredValue *v = oldValues[old_bucket];
+        oldValues[old_bucket] = v->next;
+
+        // Old and new sizes are both multiples of n_locks, so the new
+        // bucket is guarded by the lock we already hold.
+        int newBucket = getBucketForHash(hash(v->getKeyBytes(),
+                                              v->getKeyLen()));
+        cb_assert(mutexForBucket(newBucket) == mutexForBucket(old_bucket));
+        v->next = values[newBucket];
+        linkValue(newBucket, v);
+        ++numMigratedItems;
+    }
+}
+
+size_t HashTable::unlocked_migrateStripe(size_t lock, size_t maxBuckets) {
+    size_t migrated = 0;
+    while (migrated < maxBuckets && migrateCursor[lock] < oldSize) {
+        unlocked_migrateBucket(static_cast<int>(migrateCursor[lock]));
+        migrateCursor[lock] += n_locks;
+        --resizeRemaining;
+        ++migrated;
+    }
+    return migrated;
+}
+
+void HashTable::unlocked_completeResize() {
+    // Caller must hold every lock.
+    if (!oldValues) {
+        return;
+    }
+    for (size_t l = 0; l < n_locks; ++l) {
+        unlocked_migrateStripe(l, std::numeric_limits<size_t>::max());
+    }
+    cb_assert(resizeRemaining.load() == 0);
+
+    stats.memOverhead.fetch_sub(memorySize());
+    free(oldValues);
+    oldValues = NULL;
+    free(migrateCursor);
+    migrateCursor = NULL;
+    oldSize.store(0);
+    stats.memOverhead.fetch_add(memorySize());
+    cb_assert(stats.memOverhead.load() < GIGANTOR);
+}
+
+void *HashTable::allocTagLines(size_t n, HashBucketTags **aligned) {
+    // Over-allocate by one line so the first bucket can start on a
+    // cache-line boundary.
+    void *raw = calloc(n + 1, sizeof(HashBucketTags));
+    if (raw) {
+        uintptr_t addr = reinterpret_cast<uintptr_t>(raw);
+        addr = (addr + HashBucketTags::LINE_SIZE - 1) &
+               ~(static_cast<uintptr_t>(HashBucketTags::LINE_SIZE) - 1);
+        *aligned = reinterpret_cast<HashBucketTags*>(addr);
+    } else {
+        *aligned = NULL;
+    }
+    return raw;
+}
+
+void HashTable::addTag(HashBucketTags &line, StoredValue *v, uint16_t tag) {
+    if (line.count < HashBucketTags::TAGS_PER_LINE) {
+        line.values[line.count] = v;
+        line.tags[line.count] = tag;
+        ++line.count;
+    } else {
+        line.overflow = 1;
+    }
+}
+
+void HashTable::removeTag(HashBucketTags &line, StoredValue *v, bool empty) {
+    if (empty) {
+        memset(&line, 0, sizeof(line));
+        return;
+    }
+    for (size_t i = 0; i < line.count; ++i) {
+        if (line.values[i] == v) {
+            --line.count;
+            line.values[i] = line.values[line.count];
+            line.tags[i] = line.tags[line.count];
+            line.values[line.count] = NULL;
+            return;
+        }
+    }
+}
+
 HashTableStatVisitor HashTable::clear(bool deactivate) {
     HashTableStatVisitor rv;
 
@@ -299,6 +421,7 @@ HashTableStatVisitor HashTable::clear(bool deactivate) {
         cb_assert(isActive());
     }
     MultiLockHolder mlh(mutexes, n_locks);
+    unlocked_completeResize();
     if (deactivate) {
         setActiveState(false);
     }
@@ -307,9 +430,13 @@ HashTableStatVisitor HashTable::clear(bool deactivate) {
             StoredValue *v = values[i];
             rv.visit(v);
             values[i] = v->next;
+            v->forgetCompressedValue(*this);
             delete v;
         }
     }
+    if (tagLines) {
+        memset(tagLines, 0, size * sizeof(HashBucketTags));
+    }
 
     stats.currentSize.fetch_sub(rv.memSize - rv.valSize);
     cb_assert(stats.currentSize.load() < GIGANTOR);
@@ -347,6 +474,12 @@ void HashTable::resize(size_t newSize) {
         return;
     }
 
+    // Only one migration at a time; finish any previous one first.
+    unlocked_completeResize();
+
+    bool incremental = defaultIncrementalResize &&
+                       (newSize % n_locks) == 0 && (size % n_locks) == 0;
+
     // Get a place for the new items.
     StoredValue **newValues = static_cast<StoredValue**>(calloc(newSize,
                                                         sizeof(StoredValue*)));
@@ -355,6 +488,52 @@ void HashTable::resize(size_t newSize) {
         return;
     }
 
+    HashBucketTags *newTagLines = NULL;
+    void *newTagLinesAlloc = NULL;
+    if (tagLines) {
+        newTagLinesAlloc = allocTagLines(newSize, &newTagLines);
+        if (!newTagLinesAlloc) {
+            free(newValues);
+            return;
+        }
+    }
+
+    if (incremental) {
+        size_t *cursor = static_cast<size_t*>(calloc(n_locks,
+                                                     sizeof(size_t)));
+        if (!cursor) {
+            free(newValues);
+            free(newTagLinesAlloc);
+            return;
+        }
+
+        stats.memOverhead.fetch_sub(memorySize());
+        ++numResizes;
+
+        // Keep the old array around; every key keeps its lock, so each
+        // stripe can be migrated independently under its own lock.
+        for (size_t l = 0; l < n_locks; ++l) {
+            cursor[l] = l;
+        }
+        migrateCursor = cursor;
+        oldValues = values;
+        oldSize.store(size);
+        resizeRemaining.store(size);
+        resizeStripe.store(0);
+        values = newValues;
+        size.store(newSize);
+        if (newTagLines) {
+            // Old buckets are only walked to migrate them.
+            free(tagLinesAlloc);
+            tagLinesAlloc = newTagLinesAlloc;
+            tagLines = newTagLines;
+        }
+
+        stats.memOverhead.fetch_add(memorySize());
+        cb_assert(stats.memOverhead.load() < GIGANTOR);
+        return;
+    }
+
     stats.memOverhead.fetch_sub(memorySize());
     ++numResizes;
 
@@ -368,21 +547,54 @@ void HashTable::resize(size_t newSize) {
             StoredValue *v = values[i];
             values[i] = v->next;
 
-            int newBucket = getBucketForHash(hash(v->getKeyBytes(),
-                                                  v->getKeyLen()));
+            int h = hash(v->getKeyBytes(), v->getKeyLen());
+            int newBucket = getBucketForHash(h);
             v->next = newValues[newBucket];
             newValues[newBucket] = v;
+            if (newTagLines) {
+                addTag(newTagLines[newBucket], v, tagForHash(h));
+            }
         }
     }
 
     // values still points to the old (now empty) table.
     free(values);
     values = newValues;
+    if (newTagLines) {
+        free(tagLinesAlloc);
+        tagLinesAlloc = newTagLinesAlloc;
+        tagLines = newTagLines;
+    }
 
     stats.memOverhead.fetch_add(memorySize());
     cb_assert(stats.memOverhead.load() < GIGANTOR);
 }
 
+bool HashTable::resizeStep(size_t maxBuckets) {
+    size_t budget = maxBuckets;
+    while (budget > 0 && isResizing()) {
+        size_t l = resizeStripe.load();
+        if (l >= n_locks) {
+            break;
+        }
+        LockHolder lh(mutexes[l]);
+        if (!oldValues) {
+            return false;
+        }
+        budget -= unlocked_migrateStripe(l, budget);
+        if (migrateCursor[l] >= oldSize) {
+            resizeStripe.compare_exchange_strong(l, l + 1);
+        }
+    }
+
+    if (isResizing() && resizeRemaining.load() == 0) {
+        // Everything has moved; release the old array.
+        MultiLockHolder mlh(mutexes, n_locks);
+        unlocked_completeResize();
+    }
+    return isResizing();
+}
+
 static size_t distance(size_t a, size_t b) {
     return std::max(a, b) - std::min(a, b);
 }
@@ -397,6 +609,11 @@ static bool isCurrently(size_t size, ssize_t a, ssize_t b) {
 }
 
 void HashTable::resize() {
+    if (isResizing()) {
+        // Let the in-progress migration finish first.
+        return;
+    }
+
     size_t ni = getNumInMemoryItems();
     int i(0);
     size_t new_size(0);
@@ -413,7 +630,8 @@ void HashTable::resize() {
     } else if (prime_size_table[i] < static_cast<ssize_t>(defaultNumBuckets)) {
         // Was going to be smaller than the configured ht_size.
         new_size = defaultNumBuckets;
-    } else if (isCurrently(size, prime_size_table[i-1], prime_size_table[i])) {
+    } else if (isCurrently(size, alignToLocks(prime_size_table[i-1]),
+                           alignToLocks(prime_size_table[i]))) {
         // If one of the candidate sizes is the current size, maintain
         // the current size in order to remain stable.
         new_size = size;
@@ -422,6 +640,9 @@ void HashTable::resize() {
         new_size = nearest(ni, prime_size_table[i-1], prime_size_table[i]);
     }
 
+    if (new_size != size) {
+        new_size = alignToLocks(new_size);
+    }
     resize(new_size);
 }
 
@@ -435,6 +656,9 @@ void HashTable::visit(HashTableVisitor &visitor) {
     for (int l = 0; isActive() && !aborted && l < static_cast<int>(n_locks);
          l++) {
         LockHolder lh(mutexes[l]);
+        if (oldValues) {
+            unlocked_migrateStripe(l, std::numeric_limits<size_t>::max());
+        }
         for (int i = l; i < static_cast<int>(size); i+= n_locks) {
             cb_assert(l == mutexForBucket(i));
             StoredValue *v = values[i];
@@ -462,6 +686,9 @@ void HashTable::visitDepth(HashTableDepthVisitor &visitor) {
 
     for (int l = 0; l < static_cast<int>(n_locks); l++) {
         LockHolder lh(mutexes[l]);
+        if (oldValues) {
+            unlocked_migrateStripe(l, std::numeric_limits<size_t>::max());
+        }
         for (int i = l; i < static_cast<int>(size); i+= n_locks) {
             size_t depth = 0;
             StoredValue *p = values[i];
@@ -498,6 +725,9 @@ HashTable::pauseResumeVisit(PauseResumeHashTableVisitor& visitor,
 
     for (; isActive() && !paused && lock < n_locks; lock++) {
         LockHolder lh(mutexes[lock]);
+        if (oldValues) {
+            unlocked_migrateStripe(lock, std::numeric_limits<size_t>::max());
+        }
 
         // If the bucket position is *this* lock, then start from the
         // recorded bucket (as long as we haven't resized).
@@ -590,7 +820,7 @@ add_type_t HashTable::unlocked_add(int &bucket_num,
                 }
             }
             v = valFact(itm, values[bucket_num], *this, isDirty);
-            values[bucket_num] = v;
+            linkValue(bucket_num, v);
 
             if (v->isTempItem()) {
                 ++numTempItems;
@@ -698,8 +928,10 @@ bool StoredValue::hasAvailableSpace(EPStats &st, const Item &itm,
     }
 }
 
-Item* StoredValue::toItem(bool lck, uint16_t vbucket) const {
-    Item* itm = new Item(getKey(), getFlags(), getExptime(), value,
+Item* StoredValue::toItem(bool lck, uint16_t vbucket, HashTable &ht) const {
+    // Hand the value out as it was stored, not as it is held.
+    value_t val(getInflatedValue(ht));
+    Item* itm = new Item(getKey(), getFlags(), getExptime(), val,
                          lck ? static_cast<uint64_t>(-1) : getCas(),
                          bySeqno, vbucket, getRevSeqno());
 
@@ -722,13 +954,65 @@ void StoredValue::reallocate() {
     value.reset(new_val);
 }
 
+bool StoredValue::compressValue(HashTable &ht) {
+    cb_assert(isResident() && !value->isCompressedInMemory() &&
+              !value->isIncompressible());
+    hrtime_t start = gethrtime();
+    value_t compressed(Blob::Compress(*value));
+    ht.stats.compressorCompressTime.fetch_add((gethrtime() - start) / 1000);
+    if (!compressed) {
+        value->markIncompressible();
+        return false;
+    }
+
+    size_t saved = value->length() - compressed->length();
+    reduceCacheSize(ht, saved);
+    value.reset(compressed);
+    ++ht.stats.compressorNumCompressed;
+    ht.stats.compressorBytesSaved.fetch_add(saved);
+    return true;
+}
+
+void StoredValue::inflateValue(HashTable &ht) {
+    if (!isResident() || !value->isCompressedInMemory()) {
+        return;
+    }
+    value_t inflated(getInflatedValue(ht));
+    size_t saved = inflated->length() - value->length();
+    increaseCacheSize(ht, saved);
+    ht.stats.compressorBytesSaved.fetch_sub(saved);
+    value.reset(inflated);
+}
+
+value_t StoredValue::getInflatedValue(HashTable &ht) const {
+    if (!value || !value->isCompressedInMemory()) {
+        return value;
+    }
+    hrtime_t start = gethrtime();
+    value_t inflated(Blob::Inflate(*value));
+    ++ht.stats.compressorNumInflated;
+    ht.stats.compressorInflateTime.fetch_add((gethrtime() - start) / 1000);
+    return inflated;
+}
+
+void StoredValue::forgetCompressedValue(HashTable &ht) {
+    if (value && value->isCompressedInMemory()) {
+        ht.stats.compressorBytesSaved.fetch_sub(value->inflatedVlength() -
+                                                value->vlength());
+    }
+}
+
 Item *HashTable::getRandomKeyFromSlot(int slot) {
     LockHolder lh = getLockedBucket(slot);
+    if (oldValues) {
+        unlocked_migrateStripe(mutexForBucket(slot),
+                               std::numeric_limits<size_t>::max());
+    }
     StoredValue *v = values[slot];
 
     while (v) {
         if (!v->isTempItem() && !v->isDeleted() && v->isResident()) {
-            return v->toItem(false, 0);
+            return v->toItem(false, 0, *this);
         }
         v = v->next;
     }
@@ -30,6 +30,7 @@
 #include "histo.h"
 #include "item.h"
 #include "item_pager.h"
+#include "keyview.h"
 #include "locks.h"
 #include "stats.h"
 
@@ -154,6 +155,17 @@ public:
             && (std::memcmp(k.data(), getKeyBytes(), getKeyLen()) == 0);
     }
 
+    /**
+     * True of this item is for the given key.
+     *
+     * @param k the key we're checking
+     * @return true if this item's key is equal to k
+     */
+    bool hasKey(const KeyView &k) const {
+        return k.size() == getKeyLen()
+            && (std::memcmp(k.data(), getKeyBytes(), getKeyLen()) == 0);
+    }
+
     /**
      * Get this item's key.
      */
@@ -208,6 +220,7 @@ public:
     void setValue(Item &itm, HashTable &ht, bool preserveSeqno) {
         size_t currSize = size();
         reduceCacheSize(ht, currSize);
+        forgetCompressedValue(ht);
         value = itm.getValue();
         deleted = false;
         flags = itm.getFlags();
@@ -425,6 +438,7 @@ public:
         }
 
         reduceCacheSize(ht, valuelen());
+        forgetCompressedValue(ht);
         resetValue();
         markDirty();
         if (!isMetaDelete) {
@@ -463,8 +477,9 @@ public:
      *
      * @param lck if true, the new item will return a locked CAS ID.
      * @param vbucket the vbucket containing this item.
+     * @param ht the hashtable that contains this StoredValue instance
      */
-    Item *toItem(bool lck, uint16_t vbucket) const;
+    Item *toItem(bool lck, uint16_t vbucket, HashTable &ht) const;
 
     /**
      * Set the memory threshold on the current bucket quota for accepting a new mutation
@@ -496,8 +511,39 @@ public:
      */
     void reallocate();
 
+    /**
+     * Replace the value with a copy compressed by Blob::Compress(), as long
+     * as it compresses well; otherwise mark it incompressible. The value
+     * must be resident and not tried already.
+     *
+     * @param ht the hashtable that contains this StoredValue instance
+     * @return true if the value was replaced
+     */
+    bool compressValue(HashTable &ht);
+
+    /**
+     * Put back the value as it was stored, if compressValue() compressed it.
+     *
+     * @param ht the hashtable that contains this StoredValue instance
+     */
+    void inflateValue(HashTable &ht);
+
+    /**
+     * Get the value as it was stored, leaving it as it is held: an inflated
+     * copy if compressValue() compressed it.
+     *
+     * @param ht the hashtable that contains this StoredValue instance
+     */
+    value_t getInflatedValue(HashTable &ht) const;
+
 private:
 
+    /**
+     * Take the bytes a value compressed by compressValue() saves off the
+     * stats, before the value is replaced, ejected or deleted.
+     */
+    void forgetCompressedValue(HashTable &ht);
+
     StoredValue(const Item &itm, StoredValue *n, EPStats &stats, HashTable &ht,
                 bool setDirty = true) :
         value(itm.getValue()), next(n), bySeqno(itm.getBySeqno()),
@@ -752,6 +798,34 @@ private:
     EPStats                *stats;
 };
 
+/**
+ * Layout of the hash buckets within a HashTable.
+ */
+typedef enum {
+    HT_LAYOUT_CHAINED, //!< Walk the StoredValue chain comparing full keys.
+    HT_LAYOUT_TAGGED   //!< Probe a cache-line of hash tags before the chain.
+} hash_table_layout_t;
+
+/**
+ * A cache-line sized index over the head of one hash bucket.
+ *
+ * Holds a 16-bit tag (taken from the upper bits of the key hash) and a
+ * pointer for up to TAGS_PER_LINE values of the bucket, so a lookup can
+ * reject non-matching entries without dereferencing them. If the bucket
+ * ever held more values than fit the line, overflow is set and lookups
+ * that miss the line fall back to walking the chain.
+ */
+struct HashBucketTags {
+    static const size_t TAGS_PER_LINE = 6;
+    static const size_t LINE_SIZE = 64;
+
+    StoredValue *values[TAGS_PER_LINE];
+    uint16_t     tags[TAGS_PER_LINE];
+    uint8_t      count;
+    uint8_t      overflow;
+    uint8_t      padding[2];
+};
+
 /**
  * A container of StoredValue instances.
  */
@@ -803,13 +877,17 @@ public:
      * @param st the global stats reference
      * @param s the number of hash table buckets
      * @param l the number of locks in the hash table
+     * @param layout the bucket layout (the default layout if not given)
      */
-    HashTable(EPStats &st, size_t s = 0, size_t l = 0) :
+    HashTable(EPStats &st, size_t s = 0, size_t l = 0,
+              hash_table_layout_t layout = getDefaultLayout()) :
         maxDeletedRevSeqno(0), numTotalItems(0),
         numNonResidentItems(0), numEjects(0),
         memSize(0), cacheSize(0), metaDataMemory(0), stats(st),
         valFact(st), visitors(0), numItems(0), numResizes(0),
-        numTempItems(0)
+        numTempItems(0), tagLines(NULL), tagLinesAlloc(NULL),
+        oldValues(NULL), oldSize(0), migrateCursor(NULL),
+        resizeRemaining(0), resizeStripe(0), numMigratedItems(0)
     {
         size = HashTable::getNumBuckets(s);
         n_locks = HashTable::getNumLocks(l);
@@ -817,6 +895,9 @@ public:
         cb_assert(n_locks > 0);
         cb_assert(visitors == 0);
         values = static_cast<StoredValue**>(calloc(size, sizeof(StoredValue*)));
+        if (layout == HT_LAYOUT_TAGGED) {
+            tagLinesAlloc = allocTagLines(size, &tagLines);
+        }
         mutexes = new Mutex[n_locks];
         activeState = true;
     }
@@ -834,14 +915,26 @@ public:
         delete []mutexes;
         free(values);
         values = NULL;
+        free(tagLinesAlloc);
+        tagLines = NULL;
     }
 
     size_t memorySize() {
         return sizeof(HashTable)
             + (size * sizeof(StoredValue*))
+            + (tagLines ? (size + 1) * sizeof(HashBucketTags) : 0)
+            + (oldSize * sizeof(StoredValue*))
+            + (migrateCursor ? n_locks * sizeof(size_t) : 0)
             + (n_locks * sizeof(Mutex));
     }
 
+    /**
+     * Get the bucket layout of this hash table.
+     */
+    hash_table_layout_t getLayout(void) {
+        return tagLines ? HT_LAYOUT_TAGGED : HT_LAYOUT_CHAINED;
+    }
+
     /**
      * Get the number of hash table buckets this hash table has.
      */
@@ -908,16 +1001,47 @@ public:
 
     /**
      * Resize to the specified size.
+     *
+     * If incremental resizing is enabled and both the current and the
+     * new size are multiples of the number of locks, this only swaps in
+     * the new bucket array; existing items are migrated a lock stripe at
+     * a time by subsequent accesses and resizeStep() calls.  Otherwise
+     * all items are rehashed while holding every lock.
      */
     void resize(size_t to);
 
+    /**
+     * Migrate up to the given number of buckets of an in-progress
+     * incremental resize, holding one lock at a time.
+     *
+     * @param maxBuckets the most old buckets to migrate
+     * @return true if the resize still has buckets left to migrate
+     */
+    bool resizeStep(size_t maxBuckets);
+
+    /**
+     * Is an incremental resize still migrating items?
+     */
+    bool isResizing(void) { return oldSize.load() != 0; }
+
+    /**
+     * Get the number of old buckets an in-progress incremental resize
+     * has yet to migrate.
+     */
+    size_t getResizeRemaining(void) { return resizeRemaining; }
+
+    /**
+     * Get the number of items moved by incremental resizes.
+     */
+    size_t getNumMigratedItems(void) { return numMigratedItems; }
+
     /**
      * Find the item with the given key.
      *
      * @param key the key to find
      * @return a pointer to a StoredValue -- NULL if not found
      */
-    StoredValue *find(std::string &key, bool trackReference=true) {
+    StoredValue *find(const KeyView &key, bool trackReference=true) {
         cb_assert(isActive());
         int bucket_num(0);
         LockHolder lh = getLockedBucket(key, &bucket_num);
@@ -965,8 +1089,9 @@ public:
                         bool hasMetaData = true, item_eviction_policy_t policy = VALUE_ONLY,
                         uint8_t nru=0xff) {
         int bucket_num(0);
-        LockHolder lh = getLockedBucket(val.getKey(), &bucket_num);
-        StoredValue *v = unlocked_find(val.getKey(), bucket_num, true, false);
+        const KeyView key(val.getKey());
+        LockHolder lh = getLockedBucket(key, &bucket_num);
+        StoredValue *v = unlocked_find(key, bucket_num, true, false);
         return unlocked_set(v, val, cas, allowExisting, hasMetaData, policy, nru);
     }
 
@@ -1047,7 +1172,7 @@ public:
         } else {
             int bucket_num = getBucketForHash(hash(itm.getKey()));
             v = valFact(itm, values[bucket_num], *this);
-            values[bucket_num] = v;
+            linkValue(bucket_num, v);
             ++numItems;
             ++numTotalItems;
             if (nru <= MAX_NRU_VALUE && !v->isTempItem()) {
@@ -1098,8 +1223,9 @@ public:
                    bool isDirty = true, bool storeVal = true) {
         cb_assert(isActive());
         int bucket_num(0);
-        LockHolder lh = getLockedBucket(val.getKey(), &bucket_num);
-        StoredValue *v = unlocked_find(val.getKey(), bucket_num, true, false);
+        const KeyView key(val.getKey());
+        LockHolder lh = getLockedBucket(key, &bucket_num);
+        StoredValue *v = unlocked_find(key, bucket_num, true, false);
         return unlocked_add(bucket_num, v, val, policy, isDirty, storeVal);
     }
 
@@ -1149,7 +1275,7 @@ public:
      * @param policy item eviction policy
      * @return an indicator of what the deletion did
      */
-    mutation_type_t softDelete(const std::string &key, uint64_t cas,
+    mutation_type_t softDelete(const KeyView &key, uint64_t cas,
                                item_eviction_policy_t policy = VALUE_ONLY) {
         cb_assert(isActive());
         int bucket_num(0);
@@ -1240,21 +1366,25 @@ public:
      *
      * @return a pointer to a StoredValue -- NULL if not found
      */
-    StoredValue *unlocked_find(const std::string &key, int bucket_num,
+    StoredValue *unlocked_find(const KeyView &key, int bucket_num,
                                bool wantsDeleted=false, bool trackReference=true) {
-        StoredValue *v = values[bucket_num];
-        while (v) {
-            if (v->hasKey(key)) {
-                if (trackReference && !v->isDeleted()) {
-                    v->referenced();
-                }
-                if (wantsDeleted || !v->isDeleted()) {
-                    return v;
-                } else {
-                    return NULL;
-                }
+        StoredValue *v;
+        if (tagLines) {
+            v = unlocked_findTagged(key, bucket_num);
+        } else {
+            v = values[bucket_num];
+            while (v && !v->hasKey(key)) {
+                v = v->next;
+            }
+        }
+
+        if (v) {
+            if (trackReference && !v->isDeleted()) {
+                v->referenced();
+            }
+            if (wantsDeleted || !v->isDeleted()) {
+                return v;
             }
-            v = v->next;
         }
         return NULL;
     }
@@ -1269,13 +1399,7 @@ public:
      */
     inline int hash(const char *str, const size_t len) {
         cb_assert(isActive());
-        int h=5381;
-
-        for(size_t i=0; i < len; i++) {
-            h = ((h << 5) + h) ^ str[i];
-        }
-
-        return h;
+        return KeyView::hash(str, len);
     }
 
     /**
@@ -1313,6 +1437,11 @@ public:
             *bucket = getBucketForHash(h);
             LockHolder rv(mutexes[mutexForBucket(*bucket)]);
             if (*bucket == getBucketForHash(h)) {
+                if (oldValues) {
+                    // Pull the key's old bucket across so it can only
+                    // be found in (and added to) the new array.
+                    unlocked_migrateBucket(abs(h % static_cast<int>(oldSize)));
+                }
                 return rv;
             }
         }
@@ -1335,12 +1464,12 @@ public:
      * Get a lock holder holding a lock for the bucket for the hash of
      * the given key.
      *
-     * @param s the key
+     * @param key the key, already hashed
      * @param bucket output parameter to receive a bucket
      * @return a locked LockHolder
      */
-    inline LockHolder getLockedBucket(const std::string &s, int *bucket) {
-        return getLockedBucket(hash(s.data(), s.size()), bucket);
+    inline LockHolder getLockedBucket(const KeyView &key, int *bucket) {
+        return getLockedBucket(key.getHash(), bucket);
     }
 
     /**
@@ -1368,7 +1497,9 @@ public:
             }
 
             values[bucket_num] = v->next;
+            unlinkTag(bucket_num, v);
             StoredValue::reduceCacheSize(*this, v->size());
+            v->forgetCompressedValue(*this);
             StoredValue::reduceMetaDataSize(*this, stats, v->metaDataSize());
             if (v->isTempItem()) {
                 --numTempItems;
@@ -1388,7 +1519,9 @@ public:
                 }
 
                 v->next = v->next->next;
+                unlinkTag(bucket_num, tmp);
                 StoredValue::reduceCacheSize(*this, tmp->size());
+                tmp->forgetCompressedValue(*this);
                 StoredValue::reduceMetaDataSize(*this, stats, tmp->metaDataSize());
                 if (tmp->isTempItem()) {
                     --numTempItems;
@@ -1483,6 +1616,27 @@ public:
      */
     static void setDefaultNumLocks(size_t);
 
+    /**
+     * Get the bucket layout used for new hash tables.
+     */
+    static hash_table_layout_t getDefaultLayout();
+
+    /**
+     * Set the bucket layout used for new hash tables.
+     */
+    static void setDefaultLayout(hash_table_layout_t);
+
+    /**
+     * Set the bucket layout used for new hash tables from its
+     * configuration name ("chained" or "tagged").
+     */
+    static void setDefaultLayout(const std::string &layout);
+
+    /**
+     * Enable or disable incremental resizing for all hash tables.
+     */
+    static void setDefaultIncrementalResize(bool enabled);
+
     /**
      * Get the max deleted revision seqno seen so far.
      */
@@ -1539,10 +1693,23 @@ private:
     AtomicValue<size_t>       numItems;
     AtomicValue<size_t>       numResizes;
     AtomicValue<size_t>       numTempItems;
+    //! Cache-line aligned tag index (one per bucket), NULL when chained.
+    HashBucketTags      *tagLines;
+    void                *tagLinesAlloc;
+    //! Bucket array being migrated away from, NULL unless resizing.
+    StoredValue        **oldValues;
+    AtomicValue<size_t>       oldSize;
+    //! Per-lock next old bucket to migrate.
+    size_t              *migrateCursor;
+    AtomicValue<size_t>       resizeRemaining;
+    AtomicValue<size_t>       resizeStripe;
+    AtomicValue<size_t>       numMigratedItems;
     bool                 activeState;
 
     static size_t                 defaultNumBuckets;
     static size_t                 defaultNumLocks;
+    static hash_table_layout_t    defaultLayout;
+    static bool                   defaultIncrementalResize;
 
     int getBucketForHash(int h) {
         return abs(h % static_cast<int>(size));
@@ -1557,6 +1724,69 @@ private:
         return lock_num;
     }
 
+    static uint16_t tagForHash(int h) {
+        return static_cast<uint16_t>(static_cast<uint32_t>(h) >> 16);
+    }
+
+    /**
+     * Probe the tag line of a locked bucket, only comparing the full key
+     * of entries whose tag matches.
+     */
+    StoredValue *unlocked_findTagged(const KeyView &key, int bucket_num) {
+        const HashBucketTags &line = tagLines[bucket_num];
+        uint16_t tag = tagForHash(key.getHash());
+        for (size_t i = 0; i < line.count; ++i) {
+            if (line.tags[i] == tag && line.values[i]->hasKey(key)) {
+                return line.values[i];
+            }
+        }
+        if (!line.overflow) {
+            return NULL;
+        }
+
+        StoredValue *v = values[bucket_num];
+        while (v && !v->hasKey(key)) {
+            v = v->next;
+        }
+        return v;
+    }
+
+    /**
+     * Make the given value the head of a locked bucket.
+     */
+    void linkValue(int bucket_num, StoredValue *v) {
+        values[bucket_num] = v;
+        if (tagLines) {
+            addTag(tagLines[bucket_num], v,
+                   tagForHash(hash(v->getKeyBytes(), v->getKeyLen())));
+        }
+    }
+
+    /**
+     * Drop the given value (already unlinked from the chain) from the
+     * tag line of a locked bucket.
+     */
+    void unlinkTag(int bucket_num, StoredValue *v) {
+        if (tagLines) {
+            removeTag(tagLines[bucket_num], v, values[bucket_num] == NULL);
+        }
+    }
+
+    /**
+     * Round a size up to a multiple of the number of locks (when
+     * resizing incrementally) so that every key keeps its lock across
+     * a resize.
+     */
+    size_t alignToLocks(size_t s) const;
+
+    void unlocked_migrateBucket(int old_bucket);
+    size_t unlocked_migrateStripe(size_t lock, size_t maxBuckets);
+    void unlocked_completeResize();
+
+    static void addTag(HashBucketTags &line, StoredValue *v, uint16_t tag);
+    static void removeTag(HashBucketTags &line, StoredValue *v, bool empty);
+    static void *allocTagLines(size_t n, HashBucketTags **aligned);
+
     Item *getRandomKeyFromSlot(int slot);
 
     DISALLOW_COPY_AND_ASSIGN(HashTable);
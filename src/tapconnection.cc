@@ -1228,7 +1228,7 @@ queued_item TapProducer::nextFgFetched_UNLOCKED(bool &shouldPause) {
             }
 
             bool isLastItem = false;
-            queued_item qi = vb->checkpointManager.nextItem(getName(),
+            queued_item qi = vb->checkpointManager.nextItem(it->second.cursor,
                                                             isLastItem);
             switch(qi->getOperation()) {
             case queue_op_set:
@@ -1264,7 +1264,8 @@ queued_item TapProducer::nextFgFetched_UNLOCKED(bool &shouldPause) {
                         // and acked. CHEKCPOINT_END message is going to be sent.
                         addCheckpointMessage_UNLOCKED(qi);
                     } else {
-                        vb->checkpointManager.decrCursorFromCheckpointEnd(getName());
+                        vb->checkpointManager.decrCursorFromCheckpointEnd(
+                                                            it->second.cursor);
                         ++wait_for_ack_count;
                     }
                 }
@@ -1323,7 +1324,7 @@ size_t TapProducer::getRemainingOnCheckpoints_UNLOCKED() {
         if (!vb || (vb->getState() == vbucket_state_dead && !doTakeOver)) {
             continue;
         }
-        numItems += vb->checkpointManager.getNumItemsForCursor(getName());
+        numItems += vb->checkpointManager.getNumItemsForCursor(it->second.cursor);
     }
     return numItems;
 }
@@ -1338,7 +1339,7 @@ bool TapProducer::hasNextFromCheckpoints_UNLOCKED() {
         if (!vb || (vb->getState() == vbucket_state_dead && !doTakeOver)) {
             continue;
         }
-        hasNext = vb->checkpointManager.hasNext(getName());
+        hasNext = vb->checkpointManager.hasNext(it->second.cursor);
         if (hasNext) {
             break;
         }
@@ -1725,7 +1726,10 @@ void TapProducer::registerCursor(const std::map<uint16_t, uint64_t> &lastCheckpo
             bool prev_session_completed =
                 engine_.getTapConnMap().prevSessionReplicaCompleted(getName());
             // Check if the unified queue contains the checkpoint to start with.
+            cit = checkpointState_.find(vbid);
+            cb_assert(cit != checkpointState_.end());
             bool chk_exists = vb->checkpointManager.registerCursor(getName(),
+                                                                   cit->second.cursor,
                                                                    chk_id_to_start);
             if(!prev_session_completed || !chk_exists) {
                 uint64_t chk_id;
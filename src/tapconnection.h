@@ -28,6 +28,7 @@
 #include <vector>
 
 #include "atomic.h"
+#include "checkpoint.h"
 #include "common.h"
 #include "locks.h"
 #include "mutex.h"
@@ -452,11 +453,11 @@ typedef enum {
 class CheckpointState {
 public:
     CheckpointState() :
-        currentCheckpointId(0), lastSeqNum(0), bgResultSize(0),
+        cursor(0), currentCheckpointId(0), lastSeqNum(0), bgResultSize(0),
         bgJobIssued(0), bgJobCompleted(0), lastItem(false), state(backfill) {}
 
     CheckpointState(uint16_t vb, uint64_t checkpointId, proto_checkpoint_state s) :
-        vbucket(vb), currentCheckpointId(checkpointId), lastSeqNum(0),
+        vbucket(vb), cursor(0), currentCheckpointId(checkpointId), lastSeqNum(0),
         bgResultSize(0), bgJobIssued(0), bgJobCompleted(0),
         lastItem(false), state(s) {}
 
@@ -465,6 +466,8 @@ public:
     }
 
     uint16_t vbucket;
+    // Handle of the TAP client's cursor in the vbucket's checkpoint manager.
+    cursor_handle_t cursor;
     // Id of the checkpoint that is currently referenced by the given TAP client's cursor.
     uint64_t currentCheckpointId;
     // Last sequence number sent to the slave.
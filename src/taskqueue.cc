@@ -16,10 +16,15 @@
  */
 #include "config.h"
 
+#include <algorithm>
+
 #include "taskqueue.h"
 #include "executorpool.h"
 #include "executorthread.h"
 
+// How many ready tasks beyond its own a thread may take at once
+static const size_t MAX_CLAIMED_TASKS = 3;
+
 TaskQueue::TaskQueue(ExecutorPool *m, task_type_t t, const char *nm) :
     name(nm), queueType(t), manager(m), sleepers(0)
 {
@@ -40,7 +45,6 @@ size_t TaskQueue::getReadyQueueSize() {
 }
 
 size_t TaskQueue::getFutureQueueSize() {
-    LockHolder lh(mutex);
     return futureQueue.size();
 }
 
@@ -57,6 +61,11 @@ ExTask TaskQueue::_popReadyTask(void) {
 }
 
 void TaskQueue::doWake(size_t &numToWake) {
+    // A thread about to sleep counts itself before its last look for new
+    // tasks, so one that is not counted yet will still see ours.
+    if (!sleepers.load()) {
+        return;
+    }
     LockHolder lh(mutex);
     _doWake_UNLOCKED(numToWake);
 }
@@ -85,13 +94,18 @@ bool TaskQueue::_doSleep(ExecutorThread &t) {
             return false;
         }
         sleepers++;
-        // zzz....
-        struct timeval waketime = t.now;
-        advance_tv(waketime, MIN_SLEEP_TIME); // avoid sleeping more than this
-        if (less_tv(waketime, t.waketime)) { // to prevent losing posts
-            mutex.wait(waketime);
-        } else {
-            mutex.wait(t.waketime);
+        // Tasks are scheduled and woken without our mutex, and signal only
+        // when they see a sleeper; look for any that came before we were
+        // counted.
+        if (!manager->hasIncomingTasks(queueType)) {
+            // zzz....
+            struct timeval waketime = t.now;
+            advance_tv(waketime, MIN_SLEEP_TIME); // avoid sleeping more than this
+            if (less_tv(waketime, t.waketime)) { // to prevent losing posts
+                mutex.wait(waketime);
+            } else {
+                mutex.wait(t.waketime);
+            }
         }
         // ... woke!
         sleepers--;
@@ -120,9 +134,11 @@ bool TaskQueue::_fetchNextTask(ExecutorThread &t, bool toSleep) {
 
     size_t numToWake = _moveReadyTasks(t.now);
 
-    if (!futureQueue.empty() && t.startIndex == queueType &&
-        less_tv(futureQueue.top()->waketime, t.waketime)) {
-        t.waketime = futureQueue.top()->waketime; // record earliest waketime
+    struct timeval nextWaketime;
+    if (t.startIndex == queueType &&
+        futureQueue.getNextWaketime(nextWaketime) &&
+        less_tv(nextWaketime, t.waketime)) {
+        t.waketime = nextWaketime; // record earliest waketime
     }
 
     if (!readyQueue.empty() && readyQueue.top()->isdead()) {
@@ -139,6 +155,7 @@ bool TaskQueue::_fetchNextTask(ExecutorThread &t, bool toSleep) {
 
             ExTask tid = _popReadyTask(); // and pop out the top task
             t.currentTask = tid; // assign task to thread
+            numToWake -= std::min(numToWake, _claimReadyTasks(t));
             ret = true;
         } else if (!readyQueue.empty()) { // We hit limit on max # workers
             ExTask tid = _popReadyTask(); // that can work on current Q type!
@@ -164,19 +181,27 @@ bool TaskQueue::fetchNextTask(ExecutorThread &thread, bool toSleep) {
 }
 
 size_t TaskQueue::_moveReadyTasks(struct timeval tv) {
-    if (!readyQueue.empty()) {
-        return 0;
+    std::vector<ExTask> due;
+    std::vector<ExTask> woken;
+    futureQueue.popDue(tv, due, woken);
+
+    size_t numReady = due.size();
+    for (size_t i = 0; i < due.size(); ++i) {
+        readyQueue.push(due[i]);
     }
 
-    size_t numReady = 0;
-    while (!futureQueue.empty()) {
-        ExTask tid = futureQueue.top();
-        if (less_eq_tv(tid->waketime, tv)) {
-            futureQueue.pop();
-            readyQueue.push(tid);
-            numReady++;
-        } else {
-            break;
+    // Wake thread-count-serialized tasks too
+    for (size_t i = 0; i < woken.size() && !pendingQueue.empty(); ++i) {
+        for (std::list<ExTask>::iterator it = pendingQueue.begin();
+             it != pendingQueue.end();) {
+            ExTask tid = *it;
+            if (tid->getId() == woken[i]->getId() || tid->isdead()) {
+                readyQueue.push(tid);
+                numReady++;
+                it = pendingQueue.erase(it);
+            } else {
+                it++;
+            }
         }
     }
 
@@ -186,6 +211,26 @@ size_t TaskQueue::_moveReadyTasks(struct timeval tv) {
     return numReady ? numReady - 1 : 0;
 }
 
+size_t TaskQueue::_claimReadyTasks(ExecutorThread &t) {
+    // With every thread busy, take a few more ready tasks for this thread
+    // to run next rather than have it come back to this lock for each;
+    // threads that run out of work steal them. They are still counted as
+    // ready, which keeps the other threads from going to sleep on them.
+    if (manager->getNumSleepers()) {
+        return 0;
+    }
+    size_t claimed = 0;
+    while (claimed < MAX_CLAIMED_TASKS && !readyQueue.empty() &&
+           !readyQueue.top()->isdead()) {
+        ExTask tid = readyQueue.top();
+        readyQueue.pop();
+        manager->addLocalWork(queueType);
+        t.pushLocal(tid, this);
+        ++claimed;
+    }
+    return claimed;
+}
+
 void TaskQueue::_checkPendingQueue(void) {
     if (!pendingQueue.empty()) {
         ExTask runnableTask = pendingQueue.front();
@@ -199,11 +244,9 @@ struct timeval TaskQueue::_reschedule(ExTask &task, task_type_t &curTaskType) {
     struct timeval waktime;
     manager->doneWork(curTaskType);
 
-    LockHolder lh(mutex);
-
     futureQueue.push(task);
     if (curTaskType == queueType) {
-        waktime = futureQueue.top()->waketime;
+        waktime = task->waketime;
     } else {
         set_max_tv(waktime);
     }
@@ -219,8 +262,6 @@ struct timeval TaskQueue::reschedule(ExTask &task, task_type_t &curTaskType) {
 }
 
 void TaskQueue::_schedule(ExTask &task) {
-    LockHolder lh(mutex);
-
     futureQueue.push(task);
 
     LOG(EXTENSION_LOG_DEBUG, "%s: Schedule a task \"%s\" id %d",
@@ -228,8 +269,7 @@ void TaskQueue::_schedule(ExTask &task) {
 
     size_t numToWake = 1;
     TaskQueue *sleepQ = manager->getSleepQ(queueType);
-    _doWake_UNLOCKED(numToWake);
-    lh.unlock();
+    doWake(numToWake);
     if (this != sleepQ) {
         sleepQ->doWake(numToWake);
     }
@@ -243,56 +283,24 @@ void TaskQueue::schedule(ExTask &task) {
 
 void TaskQueue::_wake(ExTask &task) {
     struct  timeval    now;
-    size_t numReady = 0;
     gettimeofday(&now, NULL);
 
-    LockHolder lh(mutex);
     LOG(EXTENSION_LOG_DEBUG, "%s: Wake a task \"%s\" id %d", name.c_str(),
             task->getDescription().c_str(), task->getId());
 
-    // MB-9986: Re-sort futureQueue for now. TODO: avoid this O(N) overhead
-    std::queue<ExTask> notReady;
-    while (!futureQueue.empty()) {
-        ExTask tid = futureQueue.top();
-        notReady.push(tid);
-        futureQueue.pop();
-    }
-
-    // Wake thread-count-serialized tasks too
-    for (std::list<ExTask>::iterator it = pendingQueue.begin();
-         it != pendingQueue.end();) {
-        ExTask tid = *it;
-        if (tid->getId() == task->getId() || tid->isdead()) {
-            notReady.push(tid);
-            it = pendingQueue.erase(it);
-        } else {
-            it++;
-        }
-    }
-
     // Note that this task that we are waking may nor may not be blocked in Q
     task->waketime = now;
     task->setState(TASK_RUNNING, TASK_SNOOZED);
 
-    while (!notReady.empty()) {
-        ExTask tid = notReady.front();
-        if (less_eq_tv(tid->waketime, now) || tid->isdead()) {
-            readyQueue.push(tid);
-            numReady++;
-        } else {
-            futureQueue.push(tid);
-        }
-        notReady.pop();
-    }
+    // The next thread through _moveReadyTasks makes it ready, or takes it
+    // out of the pendingQueue.
+    futureQueue.wake(task);
 
-    if (numReady) {
-        manager->addWork(numReady, queueType);
-        _doWake_UNLOCKED(numReady);
-        TaskQueue *sleepQ = manager->getSleepQ(queueType);
-        lh.unlock();
-        if (this != sleepQ) {
-            sleepQ->doWake(numReady);
-        }
+    size_t numToWake = 1;
+    TaskQueue *sleepQ = manager->getSleepQ(queueType);
+    doWake(numToWake);
+    if (this != sleepQ) {
+        sleepQ->doWake(numToWake);
     }
 }
 
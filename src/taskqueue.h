@@ -21,6 +21,7 @@
 
 #include <queue>
 
+#include "futurequeue.h"
 #include "ringbuffer.h"
 #include "task_type.h"
 #include "tasks.h"
@@ -67,18 +68,21 @@ private:
     void _doWake_UNLOCKED(size_t &numToWake);
     size_t _moveReadyTasks(struct timeval tv);
     ExTask _popReadyTask(void);
+    size_t _claimReadyTasks(ExecutorThread &thread);
 
     SyncObject mutex;
     const std::string name;
     task_type_t queueType;
     ExecutorPool *manager;
-    size_t sleepers; // number of threads sleeping in this taskQueue
+    // number of threads sleeping in this taskQueue, only changed under
+    // mutex but read without it by threads that schedule or wake tasks
+    AtomicValue<size_t> sleepers;
 
     // sorted by task priority then waketime ..
     std::priority_queue<ExTask, std::deque<ExTask >,
                         CompareByPriority> readyQueue;
-    std::priority_queue<ExTask, std::deque<ExTask >,
-                        CompareByDueDate> futureQueue;
+    // filled without holding mutex, drained while holding it
+    FutureQueue futureQueue;
 
     std::list<ExTask> pendingQueue;
 };
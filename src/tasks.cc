@@ -88,6 +88,11 @@ bool BgFetcherTask::run() {
     return bgfetcher->run(this);
 }
 
+bool BgFetchBatchTask::run() {
+    bgfetcher->runBatch(vbucket);
+    return false;
+}
+
 bool FlushAllTask::run() {
     engine->getEpStore()->reset();
     return false;
@@ -46,13 +46,15 @@ friend class CompareByDueDate;
 friend class CompareByPriority;
 friend class ExecutorPool;
 friend class ExecutorThread;
+friend class FutureQueue;
 friend class TaskQueue;
 public:
     GlobalTask(EventuallyPersistentEngine *e, const Priority &p,
                double sleeptime = 0, bool completeBeforeShutdown = true) :
           RCValue(), priority(p),
           blockShutdown(completeBeforeShutdown),
-          state(TASK_RUNNING), taskId(nextTaskId()), engine(e) {
+          state(TASK_RUNNING), taskId(nextTaskId()), engine(e),
+          futureGen(0) {
         snooze(sleeptime);
     }
 
@@ -135,6 +137,8 @@ protected:
     const size_t taskId;
     struct timeval waketime;
     EventuallyPersistentEngine *engine;
+    // Odd while the task is filed in a FutureQueue; see futurequeue.h
+    AtomicValue<uint64_t> futureGen;
 
     static AtomicValue<size_t> task_id_counter;
     static size_t nextTaskId() { return task_id_counter.fetch_add(1); }
@@ -332,6 +336,31 @@ private:
     BgFetcher *bgfetcher;
 };
 
+/**
+ * A task that reads one vbucket's batch of pending background fetches.
+ * The BgFetcher dispatches one of these per vbucket so that a slow
+ * vbucket file does not hold up reads for the rest of the shard.
+ */
+class BgFetchBatchTask : public GlobalTask {
+public:
+    BgFetchBatchTask(EventuallyPersistentEngine *e, BgFetcher *b,
+                     uint16_t vbid)
+        : GlobalTask(e, Priority::BgFetchBatchPriority, 0, false),
+          bgfetcher(b), vbucket(vbid) { }
+
+    bool run();
+
+    std::string getDescription() {
+        std::stringstream ss;
+        ss << "Background fetch batch for vbucket " << vbucket;
+        return ss.str();
+    }
+
+private:
+    BgFetcher *bgfetcher;
+    uint16_t vbucket;
+};
+
 /**
  * A task that performs the bucket flush operation.
  */
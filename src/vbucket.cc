@@ -126,8 +126,10 @@ VBucket::~VBucket() {
     stats.decrDiskQueueSize(dirtyQueueSize.load());
 
     size_t num_pending_fetches = 0;
-    vb_bgfetch_queue_t::iterator itr = pendingBGFetches.begin();
-    for (; itr != pendingBGFetches.end(); ++itr) {
+    vb_bgfetch_queue_t leftBGFetches;
+    pendingBGFetches.drain(leftBGFetches);
+    vb_bgfetch_queue_t::iterator itr = leftBGFetches.begin();
+    for (; itr != leftBGFetches.end(); ++itr) {
         std::list<VBucketBGFetchItem *> &bgitems = itr->second;
         std::list<VBucketBGFetchItem *>::iterator vit = bgitems.begin();
         for (; vit != bgitems.end(); ++vit) {
@@ -136,7 +138,6 @@ VBucket::~VBucket() {
         }
     }
     stats.numRemainingBgJobs.fetch_sub(num_pending_fetches);
-    pendingBGFetches.clear();
     delete failovers;
 
     // Clear out the bloomfilter(s)
@@ -277,17 +278,15 @@ void VBucket::addStat(const char *nm, const T &val, ADD_STAT add_stat,
 void VBucket::queueBGFetchItem(const std::string &key,
                                VBucketBGFetchItem *fetch,
                                BgFetcher *bgFetcher) {
-    LockHolder lh(pendingBGFetchesLock);
-    pendingBGFetches[key].push_back(fetch);
-    bgFetcher->addPendingVB(id);
-    lh.unlock();
+    // Only the request that makes the queue non-empty needs to tell the
+    // fetcher; later ones are picked up by the same drain.
+    if (pendingBGFetches.push(key, fetch)) {
+        bgFetcher->addPendingVB(id);
+    }
 }
 
 bool VBucket::getBGFetchItems(vb_bgfetch_queue_t &fetches) {
-    LockHolder lh(pendingBGFetchesLock);
-    fetches.insert(pendingBGFetches.begin(), pendingBGFetches.end());
-    pendingBGFetches.clear();
-    lh.unlock();
+    pendingBGFetches.drain(fetches);
     return fetches.size() > 0;
 }
 
@@ -644,5 +643,8 @@ void VBucket::addStats(bool details, ADD_STAT add_stat, const void *c,
         addStat("drift_counter", getDriftCounter(), add_stat, c);
         addStat("time_sync", time_sync_enabled ? "enabled" : "disabled",
                 add_stat, c);
+        addStat("bg_fetch_batches", bgFetchBatches, add_stat, c);
+        addStat("bg_fetch_items", bgFetchItems, add_stat, c);
+        addStat("bg_fetch_time", bgFetchTime, add_stat, c);
     }
 }
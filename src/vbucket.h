@@ -29,6 +29,7 @@
 #include <vector>
 
 #include "atomic.h"
+#include "bgfetch_queue.h"
 #include "bgfetcher.h"
 #include "bloomfilter.h"
 #include "checkpoint.h"
@@ -165,6 +166,9 @@ public:
         dirtyQueuePendingWrites(0),
         metaDataDisk(0),
         numExpiredItems(0),
+        bgFetchBatches(0),
+        bgFetchItems(0),
+        bgFetchTime(0),
         fileSpaceUsed(0),
         fileSize(0),
         id(i),
@@ -344,7 +348,6 @@ public:
         return pendingBGFetches.size();
     }
     bool hasPendingBGFetchItems(void) {
-        LockHolder lh(pendingBGFetchesLock);
         return !pendingBGFetches.empty();
     }
 
@@ -461,6 +464,9 @@ public:
     AtomicValue<size_t>  metaDataDisk;
 
     AtomicValue<size_t>  numExpiredItems;
+    AtomicValue<size_t>  bgFetchBatches;
+    AtomicValue<size_t>  bgFetchItems;
+    AtomicValue<hrtime_t> bgFetchTime;
     AtomicValue<size_t>  fileSpaceUsed;
     AtomicValue<size_t>  fileSize;
 
@@ -484,8 +490,7 @@ private:
     AtomicValue<int64_t>     drift_counter;
     AtomicValue<bool>        time_sync_enabled;
 
-    Mutex pendingBGFetchesLock;
-    vb_bgfetch_queue_t pendingBGFetches;
+    BGFetchQueue<VBucketBGFetchItem *> pendingBGFetches;
 
     Mutex snapshotMutex;
     uint64_t persisted_snapshot_start;
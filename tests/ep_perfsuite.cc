@@ -0,0 +1,265 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2015 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/*
+ * Benchmarks of the engine run through engine_testapp, which report their
+ * measurements instead of checking them:
+ *
+ *   dcp producer throughput   several producers stepped in turn, each
+ *                             streaming the same checkpoint
+ *   dcp producer step batch   one producer stepped with a single message
+ *                             per step, then with batches of messages
+ *
+ * Run with: engine_testapp -E ep.so -T ep_perfsuite.so
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <platform/dirutils.h>
+#include <platform/platform.h>
+
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "ep_test_apis.h"
+#include "ep_testsuite.h"
+#include "mock/mock_dcp.h"
+
+extern "C" bool abort_msg(const char *expr, const char *msg, int line);
+
+extern "C" {
+#define check(expr, msg) \
+    static_cast<void>((expr) ? 0 : abort_msg(#expr, msg, __LINE__))
+
+struct test_harness testHarness;
+
+bool abort_msg(const char *expr, const char *msg, int line) {
+    fprintf(stderr, "%s:%d Test failed: `%s' (%s)\n",
+            __FILE__, line, msg, expr);
+    abort();
+    // UNREACHABLE
+    return false;
+}
+
+static const char *dbname_env;
+static enum test_result rmdb(void)
+{
+    CouchbaseDirectoryUtilities::rmrf(dbname_env);
+    if (access(dbname_env, F_OK) != -1) {
+        std::cerr << "Failed to remove: " << dbname_env << " " << std::endl;
+        return FAIL;
+    }
+    return SUCCESS;
+}
+
+static bool test_setup(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    wait_for_warmup_complete(h, h1);
+
+    check(set_vbucket_state(h, h1, 0, vbucket_state_active),
+          "Failed to set VB0 state.");
+    wait_for_stat_change(h, h1, "ep_vb_snapshot_total", 0);
+
+    protocol_binary_request_header *pkt =
+        createPacket(PROTOCOL_BINARY_CMD_ENABLE_TRAFFIC);
+    check(h1->unknown_command(h, NULL, pkt, add_response) == ENGINE_SUCCESS,
+          "Failed to enable data traffic");
+    free(pkt);
+
+    return true;
+}
+
+static bool teardown(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    (void)h; (void)h1;
+    vals.clear();
+    return true;
+}
+
+static enum test_result prepare(engine_test_t *test) {
+    (void)test;
+    return rmdb();
+}
+
+static void cleanup(engine_test_t *test, enum test_result result) {
+    (void)test; (void)result;
+    rmdb();
+}
+
+/**
+ * Steps the producers on cookies in turn, like a worker thread serving
+ * several connections, until each of their streams has ended, and returns
+ * the time it took in nanoseconds.
+ */
+static hrtime_t stream_to_end(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                              const std::vector<const void*> &cookies) {
+    struct dcp_message_producers* producers = get_dcp_producers(h, h1);
+    std::vector<bool> done(cookies.size(), false);
+    size_t streams_done = 0;
+    hrtime_t start = gethrtime();
+    while (streams_done < cookies.size()) {
+        for (size_t s = 0; s < cookies.size(); ++s) {
+            if (done[s]) {
+                continue;
+            }
+            dcp_last_op = 0;
+            ENGINE_ERROR_CODE err = h1->dcp.step(h, cookies[s], producers);
+            check(err == ENGINE_SUCCESS || err == ENGINE_WANT_MORE,
+                  "Expected success or engine_want_more");
+            if (dcp_last_op == PROTOCOL_BINARY_CMD_DCP_STREAM_END) {
+                done[s] = true;
+                streams_done++;
+            }
+        }
+    }
+    hrtime_t elapsed = gethrtime() - start;
+    free(producers);
+    return elapsed;
+}
+
+static enum test_result perf_dcp_producer_throughput(ENGINE_HANDLE *h,
+                                                     ENGINE_HANDLE_V1 *h1) {
+    const int num_items = 10000;
+    const int num_streams = 8;
+    store_items_in_checkpoint(h, h1, 0, num_items, std::string(1024, 'x'));
+
+    std::vector<const void*> cookies;
+    for (int s = 0; s < num_streams; ++s) {
+        const void *cookie = testHarness.create_cookie();
+        std::stringstream name;
+        name << "perf" << s;
+        open_dcp_producer_stream(h, h1, cookie, name.str().c_str());
+        cookies.push_back(cookie);
+    }
+
+    dcp_num_mutations = 0;
+    hrtime_t elapsed = stream_to_end(h, h1, cookies);
+    check(dcp_num_mutations == (uint64_t)num_items * num_streams,
+          "Invalid number of mutations");
+
+    std::cout << std::endl << "dcp producer: " << num_streams
+              << " streams, "
+              << static_cast<uint64_t>(num_items / (elapsed / 1e9))
+              << " items/sec per stream" << std::endl;
+
+    for (int s = 0; s < num_streams; ++s) {
+        testHarness.destroy_cookie(cookies[s]);
+    }
+
+    return SUCCESS;
+}
+
+/**
+ * Streams num_items fresh mutations through one producer and returns the
+ * nanoseconds spent per mutation.
+ */
+static double time_dcp_producer_steps(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                                      int num_items) {
+    uint64_t start = get_int_stat(h, h1, "vb_0:high_seqno", "vbucket-seqno");
+    store_items_in_checkpoint(h, h1, 0, num_items, std::string(1024, 'x'));
+
+    std::vector<const void*> cookies(1, testHarness.create_cookie());
+    open_dcp_producer_stream(h, h1, cookies[0], "perf", start);
+
+    dcp_num_mutations = 0;
+    hrtime_t elapsed = stream_to_end(h, h1, cookies);
+    check(dcp_num_mutations == (uint64_t)num_items,
+          "Invalid number of mutations");
+
+    testHarness.destroy_cookie(cookies[0]);
+    return static_cast<double>(elapsed) / num_items;
+}
+
+static enum test_result perf_dcp_producer_step_batch(ENGINE_HANDLE *h,
+                                                     ENGINE_HANDLE_V1 *h1) {
+    const int num_items = 10000;
+    const char *batch_items = "dcp_step_batch_items=64";
+
+    double single = time_dcp_producer_steps(h, h1, num_items);
+
+    std::string config = testHarness.get_current_testcase()->cfg;
+    config.append(";").append(batch_items);
+    testHarness.reload_engine(&h, &h1,
+                              testHarness.engine_path,
+                              config.c_str(),
+                              true, false);
+    wait_for_warmup_complete(h, h1);
+
+    double batched = time_dcp_producer_steps(h, h1, num_items);
+
+    std::cout << std::endl << std::fixed << std::setprecision(1)
+              << "dcp producer: " << single << " ns per mutation, "
+              << batched << " ns with " << batch_items << " ("
+              << std::setprecision(2) << single / batched << "x)"
+              << std::endl;
+
+    return SUCCESS;
+}
+
+static engine_test_t *testcases;
+
+static void add_test(int idx, const char *name,
+                     enum test_result(*tfun)(ENGINE_HANDLE *,
+                                             ENGINE_HANDLE_V1 *),
+                     const char *cfg) {
+    engine_test_t *t = &testcases[idx];
+    memset(t, 0, sizeof(*t));
+    t->name = name;
+    t->tfun = tfun;
+    t->test_setup = test_setup;
+    t->test_teardown = teardown;
+    t->cfg = cfg;
+    t->prepare = prepare;
+    t->cleanup = cleanup;
+}
+
+MEMCACHED_PUBLIC_API
+engine_test_t* get_tests(void) {
+    dbname_env = getenv("EP_TEST_DIR");
+    if (!dbname_env) {
+        dbname_env = "/tmp/test";
+    }
+
+    testcases = static_cast<engine_test_t*>(calloc(2 + 1,
+                                                   sizeof(engine_test_t)));
+    add_test(0, "dcp producer throughput", perf_dcp_producer_throughput,
+             "chk_max_items=20000;chk_period=3600");
+    add_test(1, "dcp producer step batch", perf_dcp_producer_step_batch,
+             "chk_max_items=20000;chk_period=3600");
+    return testcases;
+}
+
+MEMCACHED_PUBLIC_API
+bool setup_suite(struct test_harness *th) {
+    putenv(const_cast<char*>("EP-ENGINE-TESTSUITE=true"));
+    testHarness = *th;
+    return true;
+}
+
+MEMCACHED_PUBLIC_API
+bool teardown_suite() {
+    free(testcases);
+    testcases = NULL;
+    return true;
+}
+
+} // extern "C"
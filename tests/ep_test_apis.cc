@@ -1125,7 +1125,7 @@ void wait_for_persisted_value(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
 }
 
 void dcp_step(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1, const void* cookie) {
-    struct dcp_message_producers* producers = get_dcp_producers();
+    struct dcp_message_producers* producers = get_dcp_producers(h, h1);
     ENGINE_ERROR_CODE err = h1->dcp.step(h, cookie, producers);
     check(err == ENGINE_SUCCESS || err == ENGINE_WANT_MORE,
             "Expected success or engine_want_more");
@@ -1135,6 +1135,49 @@ void dcp_step(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1, const void* cookie) {
     free(producers);
 }
 
+/**
+ * Stores the keys key<first> .. key<first + num_items - 1> and waits until
+ * they are persisted into a single checkpoint, ready to stream from memory.
+ */
+void store_items_in_checkpoint(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                               int first, int num_items,
+                               const std::string &value) {
+    for (int j = first; j < first + num_items; ++j) {
+        item *i = NULL;
+        std::stringstream ss;
+        ss << "key" << j;
+        check(store(h, h1, NULL, OPERATION_SET, ss.str().c_str(),
+                    value.c_str(), &i) == ENGINE_SUCCESS,
+              "Failed to store a value");
+        h1->release(h, NULL, i);
+    }
+
+    wait_for_flusher_to_settle(h, h1);
+    wait_for_stat_to_be(h, h1, "vb_0:num_checkpoints", 1, "checkpoint");
+}
+
+/**
+ * Opens the producer connection name on cookie and requests vbucket 0 from
+ * start up to the current high seqno.
+ */
+void open_dcp_producer_stream(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                              const void *cookie, const char *name,
+                              uint64_t start) {
+    uint64_t end = get_int_stat(h, h1, "vb_0:high_seqno", "vbucket-seqno");
+    uint64_t vb_uuid = get_ull_stat(h, h1, "vb_0:0:id", "failovers");
+
+    uint32_t opaque = 1;
+    check(h1->dcp.open(h, cookie, ++opaque, 0, DCP_OPEN_PRODUCER,
+                       (void*)name, strlen(name)) == ENGINE_SUCCESS,
+          "Failed dcp producer open connection.");
+    uint64_t rollback = 0;
+    check(h1->dcp.stream_req(h, cookie, 0, opaque, 0, start, end, vb_uuid,
+                             start, start, &rollback,
+                             mock_dcp_add_failover_log)
+                == ENGINE_SUCCESS,
+          "Failed to initiate stream request");
+}
+
 void set_degraded_mode(ENGINE_HANDLE *h,
                        ENGINE_HANDLE_V1 *h1,
                        const void* cookie,
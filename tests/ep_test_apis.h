@@ -84,7 +84,13 @@ extern uint64_t dcp_last_snap_end_seqno;
 extern uint16_t dcp_last_nmeta;
 extern void *dcp_last_meta;
 extern std::string dcp_last_key;
+extern std::string dcp_last_value;
 extern vbucket_state_t dcp_last_vbucket_state;
+extern const void* dcp_last_item;
+// Not reset by clear_dcp_data(); counts every mutation sent
+extern uint64_t dcp_num_mutations;
+// Not reset by clear_dcp_data(); sums the packet size of every mutation sent
+extern uint64_t dcp_num_mutation_bytes;
 
 
 void decayingSleep(useconds_t *sleepTime);
@@ -267,6 +273,12 @@ void del_ret_meta(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1, const char *key,
 
 // DCP Operations
 void dcp_step(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1, const void* cookie);
+void store_items_in_checkpoint(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                               int first, int num_items,
+                               const std::string &value);
+void open_dcp_producer_stream(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                              const void *cookie, const char *name,
+                              uint64_t start = 0);
 
 void set_degraded_mode(ENGINE_HANDLE *h,
                        ENGINE_HANDLE_V1 *h1,
@@ -32,6 +32,7 @@
 #include <sys/wait.h>
 #endif
 
+#include <algorithm>
 #include <cstdlib>
 #include <iostream>
 #include <iomanip>
@@ -1002,6 +1003,48 @@ static enum test_result test_append(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     return SUCCESS;
 }
 
+static enum test_result test_append_prepend_cas(ENGINE_HANDLE *h,
+                                               ENGINE_HANDLE_V1 *h1) {
+    item *i = NULL;
+    item_info info;
+    memset(&info, 0, sizeof(info));
+    info.nvalue = 1;
+
+    check(store(h, h1, NULL, OPERATION_SET, "key", "b", &i)
+          == ENGINE_SUCCESS, "Failed set.");
+    check(h1->get_item_info(h, NULL, i, &info), "Failed to get item info.");
+    uint64_t cas = info.cas;
+    h1->release(h, NULL, i);
+
+    // A stale cas is rejected, the current one is taken and replaced.
+    check(store(h, h1, NULL, OPERATION_APPEND, "key", "c", &i, cas + 1)
+          == ENGINE_KEY_EEXISTS, "Expected append with a stale cas to fail.");
+    h1->release(h, NULL, i);
+    check(store(h, h1, NULL, OPERATION_APPEND, "key", "c", &i, cas)
+          == ENGINE_SUCCESS, "Failed append with the current cas.");
+    check(h1->get_item_info(h, NULL, i, &info), "Failed to get item info.");
+    check(info.cas != cas, "Expected append to give the item a new cas.");
+    cas = info.cas;
+    h1->release(h, NULL, i);
+    check(store(h, h1, NULL, OPERATION_PREPEND, "key", "a", &i, cas)
+          == ENGINE_SUCCESS, "Failed prepend with the current cas.");
+    h1->release(h, NULL, i);
+    check_key_value(h, h1, "key", "abc", 3);
+
+    // A locked item can't be added to.
+    getl(h, h1, "key", 0, 15);
+    check(last_status == PROTOCOL_BINARY_RESPONSE_SUCCESS,
+          "Expected getl to succeed.");
+    check(store(h, h1, NULL, OPERATION_APPEND, "key", "d", &i)
+          == ENGINE_TMPFAIL, "Expected append to a locked item to fail.");
+    h1->release(h, NULL, i);
+    check(store(h, h1, NULL, OPERATION_PREPEND, "key", "d", &i)
+          == ENGINE_TMPFAIL, "Expected prepend to a locked item to fail.");
+    h1->release(h, NULL, i);
+    check_key_value(h, h1, "key", "abc", 3);
+    return SUCCESS;
+}
+
 static enum test_result test_prepend(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     item *i = NULL;
     item_info info;
@@ -3147,6 +3190,63 @@ test_multi_vb_compactions_with_workload(ENGINE_HANDLE *h,
     return SUCCESS;
 }
 
+static enum test_result test_compaction_with_writes(ENGINE_HANDLE *h,
+                                                    ENGINE_HANDLE_V1 *h1) {
+    const int num_keys = 5000;
+    for (int j = 0; j < num_keys; ++j) {
+        std::stringstream ss;
+        ss << "key" << j;
+        item *i;
+        check(store(h, h1, NULL, OPERATION_SET, ss.str().c_str(), "old", &i)
+              == ENGINE_SUCCESS, "Failed to store a value");
+        h1->release(h, NULL, i);
+    }
+    wait_for_flusher_to_settle(h, h1);
+
+    // Keep writing while the vbucket is compacted; the flusher must not
+    // be held off and nothing it writes may get lost in the switch. Go
+    // again until some of the writes were flushed during a compaction.
+    for (int round = 0; round < 10; ++round) {
+        cb_thread_t compactor;
+        struct comp_thread_ctx ctx = { h, h1, 0 };
+        check(cb_create_thread(&compactor, compaction_thread, &ctx, 0) == 0,
+              "Failed to start the compaction thread");
+        for (int j = 0; j < num_keys; ++j) {
+            std::stringstream ss;
+            ss << "key" << j;
+            item *i;
+            check(store(h, h1, NULL, OPERATION_SET, ss.str().c_str(), "new",
+                        &i) == ENGINE_SUCCESS, "Failed to store a value");
+            h1->release(h, NULL, i);
+        }
+        check(cb_join_thread(compactor) == 0, "Failed to join the compactor");
+        check(get_int_stat(h, h1, "ep_pending_compactions") == 0,
+        "ep_pending_compactions stat did not tick down after compaction command");
+        wait_for_flusher_to_settle(h, h1);
+        if (get_int_stat(h, h1, "rw_0:compact_caught_up", "kvstore") > 0) {
+            break;
+        }
+    }
+    check(get_int_stat(h, h1, "rw_0:compact_caught_up", "kvstore") > 0,
+          "Expected compaction to catch up with concurrent flushes");
+
+    testHarness.reload_engine(&h, &h1,
+                              testHarness.engine_path,
+                              testHarness.get_current_testcase()->cfg,
+                              true, false);
+    wait_for_warmup_complete(h, h1);
+
+    check(get_int_stat(h, h1, "curr_items") == num_keys,
+          "Expected every key to survive compaction");
+    for (int j = 0; j < num_keys; ++j) {
+        std::stringstream ss;
+        ss << "key" << j;
+        check_key_value(h, h1, ss.str().c_str(), "new", 3);
+    }
+
+    return SUCCESS;
+}
+
 static enum test_result vbucket_destroy(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
                                              const char* value = NULL) {
     check(set_vbucket_state(h, h1, 1, vbucket_state_active), "Failed to set vbucket state.");
@@ -3618,7 +3718,7 @@ static enum test_result test_dcp_noop(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
 
     testHarness.time_travel(201);
 
-    struct dcp_message_producers* producers = get_dcp_producers();
+    struct dcp_message_producers* producers = get_dcp_producers(h, h1);
     bool done = false;
     while (!done) {
         ENGINE_ERROR_CODE err = h1->dcp.step(h, cookie, producers);
@@ -3667,7 +3767,7 @@ static enum test_result test_dcp_noop_fail(ENGINE_HANDLE *h,
 
     testHarness.time_travel(201);
 
-    struct dcp_message_producers* producers = get_dcp_producers();
+    struct dcp_message_producers* producers = get_dcp_producers(h, h1);
     bool done = false;
     bool disconnected = false;
     while (!done) {
@@ -3766,7 +3866,7 @@ static void dcp_stream(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1, const char *name,
     check((uint64_t)get_ull_stat(h, h1, stats_snap_seqno, "dcp")
           == snap_start_seqno, "snap start seqno didn't match");
 
-    struct dcp_message_producers* producers = get_dcp_producers();
+    struct dcp_message_producers* producers = get_dcp_producers(h, h1);
 
     if ((flags & DCP_ADD_STREAM_FLAG_TAKEOVER) == 0 &&
         (flags & DCP_ADD_STREAM_FLAG_DISKONLY) == 0 &&
@@ -4054,6 +4154,132 @@ static enum test_result test_dcp_producer_stream_req_full(ENGINE_HANDLE *h,
     return SUCCESS;
 }
 
+static enum test_result test_dcp_producer_shared_items(ENGINE_HANDLE *h,
+                                                      ENGINE_HANDLE_V1 *h1) {
+    const int num_items = 10000;
+    const int num_streams = 8;
+    const std::string value(1024, 'x');
+    store_items_in_checkpoint(h, h1, 0, num_items, value);
+    verify_curr_items(h, h1, num_items, "Wrong amount of items");
+
+    std::vector<const void*> cookies;
+    for (int s = 0; s < num_streams; ++s) {
+        const void *cookie = testHarness.create_cookie();
+        std::stringstream name;
+        name << "unittest" << s;
+        open_dcp_producer_stream(h, h1, cookie, name.str().c_str());
+        cookies.push_back(cookie);
+    }
+
+    // Step the producers in turn, like a worker thread serving several
+    // connections. Every stream sends the item held by the checkpoint.
+    struct dcp_message_producers* producers = get_dcp_producers(h, h1);
+    std::vector<const void*> items(num_items + 1, (const void*)NULL);
+    std::vector<int> mutations(num_streams, 0);
+    int streams_done = 0;
+    while (streams_done < num_streams) {
+        for (int s = 0; s < num_streams; ++s) {
+            if (mutations[s] < 0) {
+                continue;
+            }
+            dcp_last_op = 0;
+            ENGINE_ERROR_CODE err = h1->dcp.step(h, cookies[s], producers);
+            check(err == ENGINE_SUCCESS || err == ENGINE_WANT_MORE,
+                  "Expected success or engine_want_more");
+            if (dcp_last_op == PROTOCOL_BINARY_CMD_DCP_MUTATION) {
+                check(dcp_last_byseqno > 0 &&
+                      dcp_last_byseqno <= (uint64_t)num_items,
+                      "Unexpected seqno");
+                std::stringstream key;
+                key << "key" << (dcp_last_byseqno - 1);
+                checkeq(key.str(), dcp_last_key, "Wrong key streamed");
+                check(dcp_last_value == value, "Wrong value streamed");
+                const void *&itm = items[dcp_last_byseqno];
+                if (!itm) {
+                    itm = dcp_last_item;
+                }
+                check(itm == dcp_last_item, "Expected a shared item");
+                mutations[s]++;
+            } else if (dcp_last_op == PROTOCOL_BINARY_CMD_DCP_STREAM_END) {
+                check(mutations[s] == num_items,
+                      "Invalid number of mutations");
+                mutations[s] = -1;
+                streams_done++;
+            }
+        }
+    }
+    free(producers);
+
+    for (int s = 0; s < num_streams; ++s) {
+        testHarness.destroy_cookie(cookies[s]);
+    }
+
+    // The streams have ended, so once the checkpoint they read is removed
+    // nothing may hold a reference to its items any more.
+    createCheckpoint(h, h1);
+    store_items_in_checkpoint(h, h1, num_items, 1, value);
+    check(get_int_stat(h, h1, "ep_item_num") < num_items,
+          "Streamed items were not released");
+
+    return SUCCESS;
+}
+
+static enum test_result test_dcp_producer_step_batch(ENGINE_HANDLE *h,
+                                                    ENGINE_HANDLE_V1 *h1) {
+    const int num_items = 10000;
+    const uint64_t batch_items = 64;
+    const uint64_t batch_bytes = 65536;
+
+    // Small values fill a step with dcp_step_batch_items messages, large
+    // ones reach dcp_step_batch_bytes first.
+    store_items_in_checkpoint(h, h1, 0, num_items / 2, std::string(100, 'x'));
+    store_items_in_checkpoint(h, h1, num_items / 2, num_items / 2,
+                              std::string(4000, 'x'));
+    verify_curr_items(h, h1, num_items, "Wrong amount of items");
+
+    const void *cookie = testHarness.create_cookie();
+    open_dcp_producer_stream(h, h1, cookie, "unittest");
+
+    struct dcp_message_producers* producers = get_dcp_producers(h, h1);
+    dcp_num_mutations = 0;
+    dcp_num_mutation_bytes = 0;
+    uint64_t max_step_items = 0;
+    uint64_t max_step_bytes = 0;
+    bool done = false;
+    while (!done) {
+        uint64_t mutations = dcp_num_mutations;
+        uint64_t bytes = dcp_num_mutation_bytes;
+        dcp_last_op = 0;
+        ENGINE_ERROR_CODE err = h1->dcp.step(h, cookie, producers);
+        check(err == ENGINE_SUCCESS || err == ENGINE_WANT_MORE,
+              "Expected success or engine_want_more");
+        mutations = dcp_num_mutations - mutations;
+        bytes = dcp_num_mutation_bytes - bytes;
+
+        check(mutations <= batch_items, "Too many mutations in one step");
+        // Only the message that crosses the limit may go past it.
+        uint64_t last = dcp_last_op == PROTOCOL_BINARY_CMD_DCP_MUTATION ?
+                        dcp_last_packet_size : 0;
+        check(bytes - last < batch_bytes, "Too many bytes in one step");
+
+        max_step_items = std::max(max_step_items, mutations);
+        max_step_bytes = std::max(max_step_bytes, bytes);
+        done = dcp_last_op == PROTOCOL_BINARY_CMD_DCP_STREAM_END;
+    }
+    free(producers);
+
+    check(dcp_num_mutations == (uint64_t)num_items,
+          "Invalid number of mutations");
+    check(max_step_items == batch_items,
+          "Expected steps of dcp_step_batch_items mutations");
+    check(max_step_bytes >= batch_bytes,
+          "Expected steps of dcp_step_batch_bytes");
+
+    testHarness.destroy_cookie(cookie);
+
+    return SUCCESS;
+}
+
 static enum test_result test_dcp_producer_stream_req_disk(ENGINE_HANDLE *h,
                                                           ENGINE_HANDLE_V1 *h1) {
     int num_items = 400;
@@ -4117,6 +4343,81 @@ static enum test_result test_dcp_producer_stream_req_diskonly(ENGINE_HANDLE *h,
     return SUCCESS;
 }
 
+static enum test_result test_dcp_producer_parallel_backfill(ENGINE_HANDLE *h,
+                                                           ENGINE_HANDLE_V1 *h1) {
+    const int num_vbuckets = 8;
+    const int num_items = 1000;
+    for (int vb = 1; vb < num_vbuckets; ++vb) {
+        check(set_vbucket_state(h, h1, vb, vbucket_state_active),
+              "Failed to set vbucket state.");
+    }
+    for (int vb = 0; vb < num_vbuckets; ++vb) {
+        for (int j = 0; j < num_items; ++j) {
+            item *i = NULL;
+            std::stringstream ss;
+            ss << "key" << vb << "_" << j;
+            check(store(h, h1, NULL, OPERATION_SET, ss.str().c_str(), "data",
+                        &i, 0, vb) == ENGINE_SUCCESS,
+                  "Failed to store a value");
+            h1->release(h, NULL, i);
+        }
+    }
+    wait_for_flusher_to_settle(h, h1);
+
+    const void *cookie = testHarness.create_cookie();
+    uint32_t opaque = 1;
+    const char *name = "unittest";
+    check(h1->dcp.open(h, cookie, ++opaque, 0, DCP_OPEN_PRODUCER,
+                       (void*)name, strlen(name)) == ENGINE_SUCCESS,
+          "Failed dcp producer open connection.");
+
+    // All streams start out backfilling from disk at once.
+    for (int vb = 0; vb < num_vbuckets; ++vb) {
+        std::stringstream uuid;
+        uuid << "vb_" << vb << ":0:id";
+        uint64_t vb_uuid = get_ull_stat(h, h1, uuid.str().c_str(),
+                                        "failovers");
+        uint64_t rollback = 0;
+        check(h1->dcp.stream_req(h, cookie, DCP_ADD_STREAM_FLAG_DISKONLY,
+                                 ++opaque, vb, 0, -1, vb_uuid, 0, 0,
+                                 &rollback, mock_dcp_add_failover_log)
+                    == ENGINE_SUCCESS,
+              "Failed to initiate stream request");
+    }
+
+    struct dcp_message_producers* producers = get_dcp_producers(h, h1);
+    dcp_num_mutations = 0;
+    int streams_done = 0;
+    while (streams_done < num_vbuckets) {
+        dcp_last_op = 0;
+        ENGINE_ERROR_CODE err = h1->dcp.step(h, cookie, producers);
+        check(err == ENGINE_SUCCESS || err == ENGINE_WANT_MORE,
+              "Expected success or engine_want_more");
+        if (dcp_last_op == PROTOCOL_BINARY_CMD_DCP_STREAM_END) {
+            streams_done++;
+        } else if (dcp_last_op == 0) {
+            usleep(100);
+        }
+    }
+    free(producers);
+
+    check(dcp_num_mutations == (uint64_t)(num_vbuckets * num_items),
+          "Invalid number of mutations");
+    check(get_int_stat(h, h1, "eq_dcpq:unittest:backfill_items_read", "dcp")
+          == num_vbuckets * num_items, "Expected every item to be scanned");
+    check(get_int_stat(h, h1, "eq_dcpq:unittest:backfill_scans", "dcp")
+          >= num_vbuckets, "Expected a scan per vbucket");
+    check(get_int_stat(h, h1, "ep_dcp_max_backfill_scans", "dcp") == 4,
+          "Expected the configured scan budget");
+    int peak = get_int_stat(h, h1, "ep_dcp_peak_backfill_scans", "dcp");
+    check(peak > 1, "Expected backfill scans to overlap");
+    check(peak <= 4, "Expected no more scans than the budget");
+
+    testHarness.destroy_cookie(cookie);
+
+    return SUCCESS;
+}
+
 static enum test_result test_dcp_producer_stream_req_mem(ENGINE_HANDLE *h,
                                                          ENGINE_HANDLE_V1 *h1) {
     int num_items = 300;
@@ -4355,7 +4656,7 @@ static test_result test_dcp_takeover_no_items(ENGINE_HANDLE *h,
                 == ENGINE_SUCCESS,
           "Failed to initiate stream request");
 
-    struct dcp_message_producers* producers = get_dcp_producers();
+    struct dcp_message_producers* producers = get_dcp_producers(h, h1);
 
     bool done = false;
     int num_snapshot_marker = 0;
@@ -5783,7 +6084,7 @@ static enum test_result test_dcp_consumer_noop(ENGINE_HANDLE *h,
     add_stream_for_consumer(h, h1, cookie, opaque++, 0, 0,
                             PROTOCOL_BINARY_RESPONSE_SUCCESS);
 
-    struct dcp_message_producers* producers = get_dcp_producers();
+    struct dcp_message_producers* producers = get_dcp_producers(h, h1);
     testHarness.time_travel(201);
 
     // No-op not recieved for 201 seconds. Should be ok.
@@ -7105,6 +7406,52 @@ static enum test_result test_io_stats(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     return SUCCESS;
 }
 
+static enum test_result test_docinfo_lookup_stats(ENGINE_HANDLE *h,
+                                                  ENGINE_HANDLE_V1 *h1) {
+    const int num_keys = 10;
+    h1->reset_stats(h, NULL);
+
+    // With value only eviction the hash table knows whether each key is
+    // on disk, so neither the inserts nor the updates are looked up.
+    for (int round = 0; round < 2; ++round) {
+        for (int j = 0; j < num_keys; ++j) {
+            item *i = NULL;
+            std::stringstream ss;
+            ss << "key" << j;
+            check(store(h, h1, NULL, OPERATION_SET, ss.str().c_str(),
+                        "value", &i) == ENGINE_SUCCESS,
+                  "Failed to store a value");
+            h1->release(h, NULL, i);
+        }
+        wait_for_flusher_to_settle(h, h1);
+    }
+
+    check(get_int_stat(h, h1, "rw_0:docinfo_lookups", "kvstore") == 0,
+          "Expected no keys to be looked up");
+    check(get_int_stat(h, h1, "rw_0:docinfo_lookups_avoided", "kvstore")
+          == 2 * num_keys, "Expected every write to skip the lookup");
+    check(get_int_stat(h, h1, "vb_active_ops_create") == num_keys,
+          "Expected the first writes to count as inserts");
+    check(get_int_stat(h, h1, "vb_active_ops_update") == num_keys,
+          "Expected the second writes to count as updates");
+
+    // Deletions still look the key up.
+    for (int j = 0; j < num_keys; ++j) {
+        std::stringstream ss;
+        ss << "key" << j;
+        check(del(h, h1, ss.str().c_str(), 0, 0) == ENGINE_SUCCESS,
+              "Failed to delete a value");
+    }
+    wait_for_flusher_to_settle(h, h1);
+
+    check(get_int_stat(h, h1, "rw_0:docinfo_lookups", "kvstore") == num_keys,
+          "Expected the deletions to be looked up");
+    check(get_int_stat(h, h1, "vb_active_ops_delete") == num_keys,
+          "Expected every deletion to find its key on disk");
+
+    return SUCCESS;
+}
+
 static enum test_result test_vb_file_stats(ENGINE_HANDLE *h,
                                         ENGINE_HANDLE_V1 *h1) {
     wait_for_flusher_to_settle(h, h1);
@@ -13075,6 +13422,8 @@ engine_test_t* get_tests(void) {
         TestCase("append/prepend to JSON", test_append_prepend_to_json,
                  test_setup, teardown,
                  NULL, prepare, cleanup),
+        TestCase("append/prepend with cas", test_append_prepend_cas,
+                 test_setup, teardown, NULL, prepare, cleanup),
         TestCase("replace", test_replace, test_setup, teardown,
                  NULL, prepare, cleanup),
         TestCase("replace with eviction", test_replace_with_eviction,
@@ -13221,6 +13570,8 @@ engine_test_t* get_tests(void) {
                  prepare, cleanup),
         TestCase("io stats", test_io_stats, test_setup, teardown,
                  NULL, prepare, cleanup),
+        TestCase("docinfo lookup stats", test_docinfo_lookup_stats,
+                 test_setup, teardown, NULL, prepare, cleanup),
         TestCase("file stats", test_vb_file_stats, test_setup, teardown,
                  NULL, prepare, cleanup),
         TestCase("file stats post warmup", test_vb_file_stats_after_warmup,
@@ -13492,6 +13843,8 @@ engine_test_t* get_tests(void) {
         TestCase("test multiple vb compactions with workload",
                  test_multi_vb_compactions_with_workload,
                  test_setup, teardown, NULL, prepare, cleanup),
+        TestCase("test compaction with writes", test_compaction_with_writes,
+                 test_setup, teardown, NULL, prepare, cleanup),
         TestCase("test async vbucket destroy", test_async_vbucket_destroy,
                  test_setup, teardown, NULL, prepare, cleanup),
         TestCase("test sync vbucket destroy", test_sync_vbucket_destroy,
@@ -13681,12 +14034,23 @@ engine_test_t* get_tests(void) {
         TestCase("test producer stream request (full)",
                  test_dcp_producer_stream_req_full, test_setup, teardown,
                  "chk_remover_stime=1;chk_max_items=100", prepare, cleanup),
+        TestCase("test producer shared items",
+                 test_dcp_producer_shared_items, test_setup, teardown,
+                 "chk_max_items=20000;chk_period=3600;chk_remover_stime=1",
+                 prepare, cleanup),
+        TestCase("test producer step batch",
+                 test_dcp_producer_step_batch, test_setup, teardown,
+                 "chk_max_items=20000;chk_period=3600;dcp_step_batch_items=64",
+                 prepare, cleanup),
         TestCase("test producer stream request (disk)",
                  test_dcp_producer_stream_req_disk, test_setup, teardown,
                  "chk_remover_stime=1;chk_max_items=100", prepare, cleanup),
         TestCase("test producer stream request (disk only)",
                  test_dcp_producer_stream_req_diskonly, test_setup, teardown,
                  "chk_remover_stime=1;chk_max_items=100", prepare, cleanup),
+        TestCase("test producer parallel backfill",
+                 test_dcp_producer_parallel_backfill, test_setup, teardown,
+                 "dcp_backfill_max_scans=4", prepare, cleanup),
         TestCase("test producer stream request (memory only)",
                  test_dcp_producer_stream_req_mem, test_setup, teardown,
                  "chk_remover_stime=1;chk_max_items=100", prepare, cleanup),
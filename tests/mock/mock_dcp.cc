@@ -42,7 +42,14 @@ uint64_t dcp_last_revseqno;
 void* dcp_last_meta;
 uint16_t dcp_last_nmeta;
 std::string dcp_last_key;
+std::string dcp_last_value;
 vbucket_state_t dcp_last_vbucket_state;
+const void* dcp_last_item;
+uint64_t dcp_num_mutations;
+uint64_t dcp_num_mutation_bytes;
+
+static ENGINE_HANDLE *engine_handle = NULL;
+static ENGINE_HANDLE_V1 *engine_handle_v1 = NULL;
 
 extern "C" {
 
@@ -170,12 +177,12 @@ static ENGINE_ERROR_CODE mock_mutation(const void* cookie,
                                        const void *meta,
                                        uint16_t nmeta,
                                        uint8_t nru) {
-    (void) cookie;
     clear_dcp_data();
     Item* item = reinterpret_cast<Item*>(itm);
     dcp_last_op = PROTOCOL_BINARY_CMD_DCP_MUTATION;
     dcp_last_opaque = opaque;
     dcp_last_key.assign(item->getKey().c_str());
+    dcp_last_value.assign(item->getData(), item->getNBytes());
     dcp_last_vbucket = vbucket;
     dcp_last_byseqno = by_seqno;
     dcp_last_revseqno = rev_seqno;
@@ -186,6 +193,10 @@ static ENGINE_ERROR_CODE mock_mutation(const void* cookie,
     dcp_last_nru = nru;
     dcp_last_packet_size = 55 + dcp_last_key.length() +
                            item->getNBytes() + nmeta;
+    dcp_last_item = itm;
+    dcp_num_mutations++;
+    dcp_num_mutation_bytes += dcp_last_packet_size;
+    engine_handle_v1->release(engine_handle, cookie, itm);
     return ENGINE_SUCCESS;
 }
 
@@ -319,10 +330,15 @@ void clear_dcp_data() {
     dcp_last_meta = NULL;
     dcp_last_nmeta = 0;
     dcp_last_key.clear();
+    dcp_last_value.clear();
     dcp_last_vbucket_state = (vbucket_state_t)0;
+    dcp_last_item = NULL;
 }
 
-struct dcp_message_producers* get_dcp_producers() {
+struct dcp_message_producers* get_dcp_producers(ENGINE_HANDLE *h,
+                                                ENGINE_HANDLE_V1 *h1) {
+    engine_handle = h;
+    engine_handle_v1 = h1;
     dcp_message_producers* producers =
         (dcp_message_producers*)malloc(sizeof(dcp_message_producers));
 
@@ -35,7 +35,13 @@ ENGINE_ERROR_CODE mock_dcp_add_failover_log(vbucket_failover_t* entry,
 
 void clear_dcp_data();
 
-struct dcp_message_producers* get_dcp_producers();
+/**
+ * The mock send path. Items handed to it are released through the given
+ * engine once their message has been recorded, as memcached would do
+ * after writing them to the connection.
+ */
+struct dcp_message_producers* get_dcp_producers(ENGINE_HANDLE *h,
+                                                ENGINE_HANDLE_V1 *h1);
 
 
 
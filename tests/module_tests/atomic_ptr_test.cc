@@ -134,8 +134,33 @@ static void testOperators() {
     cb_assert(Doodad::getNumInstances() == 0);
 }
 
+static void testRetainRelease() {
+    // A retained pointer outlives the smart pointer it came from.
+    Doodad *raw;
+    {
+        SingleThreadedRCPtr<Doodad> dd(new Doodad);
+        raw = dd.retain();
+        cb_assert(raw == dd.get());
+    }
+    cb_assert(Doodad::getNumInstances() == 1);
+    SingleThreadedRCPtr<Doodad>::release(raw);
+    cb_assert(Doodad::getNumInstances() == 0);
+
+    // Releasing while still shared leaves the value alone.
+    SingleThreadedRCPtr<Doodad> dd(new Doodad);
+    SingleThreadedRCPtr<Doodad>::release(dd.retain());
+    cb_assert(Doodad::getNumInstances() == 1);
+    dd.reset();
+    cb_assert(Doodad::getNumInstances() == 0);
+
+    // A value that was never shared is owned by whoever releases it.
+    SingleThreadedRCPtr<Doodad>::release(new Doodad);
+    cb_assert(Doodad::getNumInstances() == 0);
+}
+
 int main() {
     alarm(60);
     testOperators();
+    testRetainRelease();
     testAtomicPtr();
 }
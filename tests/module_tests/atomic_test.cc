@@ -62,6 +62,36 @@ static void testAtomicInt() {
     cb_assert(intgen.latest() == (numThreads * numIterations));
 }
 
+class ShardedCounterTest : public Generator<int> {
+public:
+
+    int operator()() {
+        for (size_t j = 0; j < numIterations; j++) {
+            ++counter;
+            counter += 3;
+            --counter;
+        }
+        return 0;
+    }
+
+    ShardedCounter counter;
+};
+
+static void testShardedCounter() {
+    ShardedCounterTest gen;
+    getCompletedThreads<int>(numThreads, &gen);
+    // Nothing is lost, wherever the threads landed.
+    cb_assert(gen.counter.load() == numThreads * numIterations * 3);
+
+    // Shards that went below zero still add up.
+    ShardedCounter c(5);
+    c.fetch_sub(7);
+    c += 4;
+    cb_assert(c.load() == 2);
+    c.store(0);
+    cb_assert(c.load() == 0);
+}
+
 static void testSetIfLess() {
     AtomicValue<int> x;
 
@@ -123,6 +153,7 @@ int testAtomicCompareExchangeStrong(void) {
 int main() {
     alarm(60);
     testAtomicInt();
+    testShardedCounter();
     testSetIfLess();
     testSetIfBigger();
     return testAtomicCompareExchangeStrong();
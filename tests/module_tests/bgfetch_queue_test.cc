@@ -0,0 +1,184 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2015 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include <platform/cbassert.h>
+
+#include <iostream>
+#include <list>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "bgfetch_queue.h"
+#include "threadtests.h"
+
+typedef unordered_map<std::string, std::list<uint64_t> > fetch_map_t;
+
+static const size_t numKeys = 1000;
+static const size_t itemsPerProducer = 100000;
+
+static std::vector<std::string> keys;
+
+static uint64_t encode(size_t producer, size_t seq) {
+    return (static_cast<uint64_t>(producer) << 32) | seq;
+}
+
+static void testCoalescing() {
+    BGFetchQueue<uint64_t> q;
+    cb_assert(q.empty());
+    cb_assert(q.push("a", 1));
+    cb_assert(!q.push("b", 2));
+    cb_assert(!q.push("a", 3));
+    cb_assert(q.size() == 3);
+
+    fetch_map_t fetches;
+    cb_assert(q.drain(fetches) == 3);
+    cb_assert(q.empty());
+    cb_assert(q.size() == 0);
+    cb_assert(fetches.size() == 2);
+    cb_assert(fetches["a"].size() == 2);
+    cb_assert(fetches["a"].front() == 1);
+    cb_assert(fetches["a"].back() == 3);
+    cb_assert(fetches["b"].size() == 1);
+
+    // The first push after a drain reports the queue as newly non-empty.
+    cb_assert(q.drain(fetches) == 0);
+    cb_assert(q.push("c", 4));
+}
+
+class Producer : public Generator<bool> {
+public:
+    Producer(BGFetchQueue<uint64_t> &queue) : q(queue), next(0) { }
+
+    bool operator()() {
+        size_t me = next++;
+        for (size_t i = 0; i < itemsPerProducer; ++i) {
+            q.push(keys[i % numKeys], encode(me, i));
+        }
+        return true;
+    }
+
+private:
+    BGFetchQueue<uint64_t> &q;
+    AtomicValue<size_t> next;
+};
+
+struct ConsumerCtx {
+    ConsumerCtx(BGFetchQueue<uint64_t> &queue, size_t producers)
+        : q(queue), expected(producers * itemsPerProducer), received(0),
+          drains(0), lastSeq(producers * numKeys, -1),
+          seen(producers * itemsPerProducer, false) { }
+
+    BGFetchQueue<uint64_t> &q;
+    size_t expected;
+    size_t received;
+    size_t drains;
+    std::vector<int64_t> lastSeq;
+    std::vector<bool> seen;
+};
+
+extern "C" {
+    static void consumer_main(void *arg) {
+        ConsumerCtx *ctx = static_cast<ConsumerCtx *>(arg);
+        while (ctx->received < ctx->expected) {
+            fetch_map_t fetches;
+            size_t n = ctx->q.drain(fetches);
+            if (n == 0) {
+                usleep(100);
+                continue;
+            }
+            ++ctx->drains;
+            ctx->received += n;
+
+            fetch_map_t::iterator it;
+            for (it = fetches.begin(); it != fetches.end(); ++it) {
+                std::list<uint64_t>::iterator vit;
+                for (vit = it->second.begin(); vit != it->second.end();
+                     ++vit) {
+                    size_t producer = *vit >> 32;
+                    int64_t seq = *vit & 0xffffffff;
+                    size_t key = seq % numKeys;
+                    cb_assert(keys[key] == it->first);
+                    // Requests from one producer keep their order per key.
+                    int64_t &last = ctx->lastSeq[producer * numKeys + key];
+                    cb_assert(seq > last);
+                    last = seq;
+                    size_t id = producer * itemsPerProducer + seq;
+                    cb_assert(!ctx->seen[id]);
+                    ctx->seen[id] = true;
+                }
+            }
+        }
+    }
+}
+
+static void runProducers(size_t producers) {
+    BGFetchQueue<uint64_t> q;
+    Producer gen(q);
+    ConsumerCtx ctx(q, producers);
+
+    hrtime_t start = gethrtime();
+    cb_thread_t consumer;
+    cb_assert(cb_create_thread(&consumer, consumer_main, &ctx, 0) == 0);
+    getCompletedThreads<bool>(producers, &gen);
+    // Only the intake side is timed; the consumer may still be draining.
+    hrtime_t elapsed = gethrtime() - start;
+    cb_assert(cb_join_thread(consumer) == 0);
+
+    cb_assert(ctx.received == ctx.expected);
+    cb_assert(q.empty());
+    cb_assert(q.size() == 0);
+    // Every request was delivered exactly once.
+    for (size_t i = 0; i < ctx.seen.size(); ++i) {
+        cb_assert(ctx.seen[i]);
+    }
+    for (size_t i = 0; i < ctx.lastSeq.size(); ++i) {
+        size_t key = i % numKeys;
+        size_t lastExpected = itemsPerProducer - numKeys + key;
+        cb_assert(ctx.lastSeq[i] == static_cast<int64_t>(lastExpected));
+    }
+
+    double opsPerSec = ctx.expected / (elapsed / 1e9);
+    std::cout << "  " << producers << " producer(s): "
+              << static_cast<size_t>(opsPerSec) << " pushes/sec in "
+              << ctx.drains << " drains" << std::endl;
+}
+
+static void testProducerScaling() {
+    // The throughput is only reported; what is checked is that no request
+    // is lost or duplicated however many threads push.
+    std::cout << "BGFetchQueue throughput:" << std::endl;
+    size_t counts[] = { 1, 2, 4, 8 };
+    for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); ++i) {
+        runProducers(counts[i]);
+    }
+}
+
+int main(int argc, char **argv) {
+    (void)argc; (void)argv;
+    for (size_t i = 0; i < numKeys; ++i) {
+        std::stringstream ss;
+        ss << "key" << i;
+        keys.push_back(ss.str());
+    }
+
+    testCoalescing();
+    testProducerScaling();
+    return 0;
+}
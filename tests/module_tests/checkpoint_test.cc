@@ -20,6 +20,8 @@
 #include <signal.h>
 
 #include <algorithm>
+#include <iostream>
+#include <map>
 #include <set>
 #include <vector>
 
@@ -53,7 +55,7 @@ struct thread_args {
     RCPtr<VBucket> vbucket;
     CheckpointManager *checkpoint_manager;
     int *counter;
-    std::string name;
+    cursor_handle_t cursor;
 };
 
 extern "C" {
@@ -93,8 +95,8 @@ static void launch_persistence_thread(void *arg) {
     while(true) {
         size_t itemPos;
         std::vector<queued_item> items;
-        const std::string cursor(CheckpointManager::pCursorName);
-        args->checkpoint_manager->getAllItemsForCursor(cursor, items);
+        args->checkpoint_manager->getAllItemsForCursor(
+                                        CheckpointManager::pCursor, items);
         for(itemPos = 0; itemPos < items.size(); ++itemPos) {
             queued_item qi = items.at(itemPos);
             if (qi->getOperation() == queue_op_flush) {
@@ -130,7 +132,7 @@ static void launch_tap_client_thread(void *arg) {
     bool flush = false;
     bool isLastItem = false;
     while(true) {
-        queued_item qi = args->checkpoint_manager->nextItem(args->name,
+        queued_item qi = args->checkpoint_manager->nextItem(args->cursor,
                                                             isLastItem);
         if (qi->getOperation() == queue_op_flush) {
             flush = true;
@@ -216,8 +218,7 @@ void basic_chk_test() {
         tap_t_args[i].mutex = mutex;
         tap_t_args[i].gate = gate;
         tap_t_args[i].counter = counter;
-        tap_t_args[i].name = name.str();
-        checkpoint_manager->registerCursor(name.str());
+        checkpoint_manager->registerCursor(name.str(), tap_t_args[i].cursor);
     }
 
     // Start a timer so that the test can be killed if it doesn't finish in a
@@ -268,9 +269,7 @@ void basic_chk_test() {
     for (i = 0; i < NUM_TAP_THREADS; ++i) {
         rc = cb_join_thread(tap_threads[i]);
         cb_assert(rc == 0);
-        std::stringstream name;
-        name << "tap-client-" << i;
-        checkpoint_manager->removeCursor(name.str());
+        checkpoint_manager->removeCursor(tap_t_args[i].cursor);
     }
 
     rc = cb_join_thread(checkpoint_cleanup_thread);
@@ -304,7 +303,7 @@ void test_reset_checkpoint_id() {
     uint64_t chk = 1;
     size_t lastMutationId = 0;
     std::vector<queued_item> items;
-    const std::string cursor(CheckpointManager::pCursorName);
+    const cursor_handle_t cursor = CheckpointManager::pCursor;
     manager->getAllItemsForCursor(cursor, items);
     for(itemPos = 0; itemPos < items.size(); ++itemPos) {
         queued_item qi = items.at(itemPos);
@@ -333,9 +332,338 @@ void test_reset_checkpoint_id() {
     cb_assert(items.size() == 0);
 }
 
+static std::map<std::string, std::string> chkStats;
+
+extern "C" {
+static void add_chk_stat(const char *key, const uint16_t klen,
+                         const char *val, const uint32_t vlen,
+                         const void *cookie) {
+    (void)cookie;
+    chkStats[std::string(key, klen)] = std::string(val, vlen);
+}
+}
+
+static size_t getChkStat(CheckpointManager *manager, const char *name) {
+    chkStats.clear();
+    manager->addStats(add_chk_stat, NULL);
+    std::string key = std::string("vb_0:") + name;
+    cb_assert(chkStats.find(key) != chkStats.end());
+    return strtoul(chkStats[key].c_str(), NULL, 10);
+}
+
+static void queueKey(CheckpointManager *manager, RCPtr<VBucket> &vbucket,
+                     const std::string &key) {
+    queued_item qi(new Item(key, vbucket->getId(), queue_op_set, 0, 0));
+    manager->queueDirty(vbucket, qi, true);
+}
+
+void test_dedup_with_cursors() {
+    shared_ptr<Callback<uint16_t> > cb(new DummyCB());
+    RCPtr<VBucket> vbucket(new VBucket(0, vbucket_state_active, global_stats,
+                                       checkpoint_config, NULL, 0, 0, 0, NULL,
+                                       cb));
+    CheckpointManager *manager =
+        new CheckpointManager(global_stats, 0, checkpoint_config, 0, 0, 0, cb);
+    cursor_handle_t tap;
+    manager->registerCursor("tap", tap);
+
+    for (int i = 0; i < 10; ++i) {
+        std::stringstream key;
+        key << "key-" << i;
+        queueKey(manager, vbucket, key.str());
+    }
+
+    bool isLastItem = false;
+    cb_assert(manager->nextItem(tap, isLastItem)->getOperation() ==
+              queue_op_checkpoint_start);
+    cb_assert(manager->nextItem(tap, isLastItem)->getKey() == "key-0");
+    cb_assert(manager->nextItem(tap, isLastItem)->getKey() == "key-1");
+
+    // Requeue the item under the tap cursor and one ahead of it.
+    queueKey(manager, vbucket, "key-1");
+    queueKey(manager, vbucket, "key-5");
+    cb_assert(manager->getNumItems() == 11);
+    cb_assert(manager->getNumItemsForCursor(tap) == 9);
+
+    const char *expected[] = { "key-2", "key-3", "key-4", "key-6", "key-7",
+                               "key-8", "key-9", "key-1", "key-5" };
+    for (size_t i = 0; i < 9; ++i) {
+        queued_item qi = manager->nextItem(tap, isLastItem);
+        cb_assert(qi->getKey() == expected[i]);
+        cb_assert(isLastItem == (i == 8));
+    }
+    cb_assert(manager->nextItem(tap, isLastItem)->getOperation() ==
+              queue_op_empty);
+    cb_assert(manager->getNumItemsForCursor(tap) == 0);
+
+    std::vector<queued_item> items;
+    manager->getAllItemsForCursor(CheckpointManager::pCursor, items);
+    cb_assert(items.size() == 11);
+    cb_assert(items[0]->getOperation() == queue_op_checkpoint_start);
+    cb_assert(items[1]->getKey() == "key-0");
+    for (size_t i = 0; i < 9; ++i) {
+        cb_assert(items[i + 2]->getKey() == expected[i]);
+    }
+    // Seqnos of the requeued items are still in queueing order.
+    cb_assert(items[9]->getBySeqno() == 11);
+    cb_assert(items[10]->getBySeqno() == 12);
+
+    delete manager;
+}
+
+void test_hot_key_memory() {
+    shared_ptr<Callback<uint16_t> > cb(new DummyCB());
+    RCPtr<VBucket> vbucket(new VBucket(0, vbucket_state_active, global_stats,
+                                       checkpoint_config, NULL, 0, 0, 0, NULL,
+                                       cb));
+    CheckpointManager *manager =
+        new CheckpointManager(global_stats, 0, checkpoint_config, 0, 0, 0, cb);
+    cursor_handle_t tap;
+    manager->registerCursor("tap", tap);
+
+    queueKey(manager, vbucket, "cold");
+    bool isLastItem = false;
+    manager->nextItem(tap, isLastItem);
+    cb_assert(manager->nextItem(tap, isLastItem)->getKey() == "cold");
+
+    // Deduplicated updates must not grow the checkpoint while the cursors
+    // stay where they are.
+    size_t initial = 0;
+    for (int i = 0; i < 100000; ++i) {
+        queueKey(manager, vbucket, "hot");
+        if (i == 0) {
+            initial = getChkStat(manager, "mem_overhead");
+        }
+    }
+    cb_assert(manager->getNumItems() == 3);
+    cb_assert(getChkStat(manager, "mem_overhead") <= initial + 2048);
+
+    queued_item qi = manager->nextItem(tap, isLastItem);
+    cb_assert(qi->getKey() == "hot");
+    cb_assert(qi->getBySeqno() == 100001);
+    cb_assert(isLastItem);
+
+    std::vector<queued_item> items;
+    manager->getAllItemsForCursor(CheckpointManager::pCursor, items);
+    cb_assert(items.size() == 3);
+    cb_assert(items[1]->getKey() == "cold");
+    cb_assert(items[2]->getKey() == "hot");
+
+    delete manager;
+}
+
+void test_mem_overhead_per_item() {
+    shared_ptr<Callback<uint16_t> > cb(new DummyCB());
+    RCPtr<VBucket> vbucket(new VBucket(0, vbucket_state_active, global_stats,
+                                       checkpoint_config, NULL, 0, 0, 0, NULL,
+                                       cb));
+    CheckpointManager *manager =
+        new CheckpointManager(global_stats, 0, checkpoint_config, 0, 0, 0, cb);
+
+    // Stay below the default chk_max_items, so that all go into one checkpoint.
+    const size_t numKeys = 400;
+    for (size_t i = 0; i < numKeys; ++i) {
+        std::stringstream key;
+        key << "checkpoint-overhead-key-" << i;
+        queueKey(manager, vbucket, key.str());
+    }
+    cb_assert(getChkStat(manager, "num_checkpoint_items") == numKeys + 1);
+
+    size_t perItem = getChkStat(manager, "mem_overhead_per_item");
+    std::cout << "checkpoint overhead: " << perItem << " bytes per item"
+              << std::endl;
+    // An item slot plus its index entry, without a copy of the key.
+    cb_assert(perItem > 0 && perItem < 80);
+
+    delete manager;
+}
+
+void test_cursor_handles() {
+    shared_ptr<Callback<uint16_t> > cb(new DummyCB());
+    RCPtr<VBucket> vbucket(new VBucket(0, vbucket_state_active, global_stats,
+                                       checkpoint_config, NULL, 0, 0, 0, NULL,
+                                       cb));
+    CheckpointManager *manager =
+        new CheckpointManager(global_stats, 0, checkpoint_config, 0, 0, 0, cb);
+    for (int i = 0; i < 5; ++i) {
+        std::stringstream key;
+        key << "key-" << i;
+        queueKey(manager, vbucket, key.str());
+    }
+
+    // Registering an existing name repositions the cursor and keeps its handle.
+    cursor_handle_t tap, again;
+    manager->registerCursor("tap", tap);
+    cb_assert(tap != 0 && tap != CheckpointManager::pCursor);
+    bool isLastItem = false;
+    manager->nextItem(tap, isLastItem);
+    manager->registerCursor("tap", again);
+    cb_assert(again == tap);
+    cb_assert(manager->getNumOfCursors() == 2);
+    cb_assert(manager->getNumItemsForCursor(tap) == 5);
+    cb_assert(manager->getNumItemsForCursor("tap") == 5);
+    cb_assert(getChkStat(manager, "tap:cursor_checkpoint_id") == 1);
+
+    // A removed handle is rejected, even once its slot is reused.
+    cb_assert(manager->removeCursor(tap));
+    cb_assert(!manager->removeCursor(tap));
+    cb_assert(manager->nextItem(tap, isLastItem)->getOperation() ==
+              queue_op_empty);
+    cb_assert(manager->getNumItemsForCursor(tap) == 0);
+    cb_assert(!manager->hasNext(tap));
+    manager->registerCursor("tap", again);
+    cb_assert(again != tap);
+    cb_assert(manager->getNumItemsForCursor(tap) == 0);
+    cb_assert(manager->getNumItemsForCursor(again) == 5);
+
+    // Registering by seqno replaces the cursor of the same name.
+    cursor_handle_t dcp, dcpAgain;
+    manager->registerCursorBySeqno("dcp", 3, dcp);
+    cb_assert(manager->getNumItemsForCursor(dcp) == 2);
+    manager->registerCursorBySeqno("dcp", 0, dcpAgain);
+    cb_assert(dcpAgain != dcp);
+    cb_assert(manager->getNumItemsForCursor(dcp) == 0);
+    cb_assert(manager->getNumItemsForCursor(dcpAgain) == 5);
+    cb_assert(manager->getNumOfCursors() == 3);
+
+    // Cursors copied into another manager keep their handles.
+    CheckpointManager *copy =
+        new CheckpointManager(global_stats, 0, checkpoint_config, 0, 0, 0, cb);
+    copy->resetCursors(manager->getCursors());
+    cb_assert(copy->getNumOfCursors() == 3);
+    queueKey(copy, vbucket, "copied");
+    cb_assert(copy->nextItem(again, isLastItem)->getOperation() ==
+              queue_op_checkpoint_start);
+    cb_assert(copy->nextItem(dcpAgain, isLastItem)->getOperation() ==
+              queue_op_checkpoint_start);
+    cb_assert(copy->nextItem(dcpAgain, isLastItem)->getKey() == "copied");
+    cb_assert(copy->getNumItemsForCursor("dcp") == 0);
+
+    // Removing by name is still possible, e.g. for TAP connection cleanup.
+    cb_assert(manager->removeCursor("tap"));
+    cb_assert(manager->getNumItemsForCursor(again) == 0);
+    cb_assert(manager->getNumOfCursors() == 2);
+
+    delete copy;
+    delete manager;
+}
+
+struct drain_args {
+    CheckpointManager *manager;
+    AtomicValue<bool> *done;
+    std::string name;
+    size_t minItems;
+    size_t drains;
+};
+
+extern "C" {
+static void launch_drain_thread(void *arg) {
+    struct drain_args *args = static_cast<struct drain_args *>(arg);
+    cursor_handle_t cursor = 0;
+    while (!args->done->load()) {
+        // Start over from the beginning every time, like a stream joining a
+        // large open checkpoint.
+        args->manager->registerCursor(args->name, cursor, 1, true);
+        std::vector<queued_item> items;
+        args->manager->getAllItemsForCursor(cursor, items);
+        cb_assert(items.size() >= args->minItems);
+        ++args->drains;
+    }
+    args->manager->removeCursor(cursor);
+}
+}
+
+static hrtime_t percentile(std::vector<hrtime_t> &sorted, double pct) {
+    return sorted[static_cast<size_t>(pct * (sorted.size() - 1))];
+}
+
+static void queue_dirty_latency(size_t numDrainers) {
+    shared_ptr<Callback<uint16_t> > cb(new DummyCB());
+    // A replica vbucket never splits its open checkpoint by item count.
+    RCPtr<VBucket> vbucket(new VBucket(0, vbucket_state_replica, global_stats,
+                                       checkpoint_config, NULL, 0, 0, 0, NULL,
+                                       cb));
+    CheckpointManager *manager =
+        new CheckpointManager(global_stats, 0, checkpoint_config, 0, 0, 0, cb);
+
+    const size_t numKeys = 100000;
+    const size_t numUpdates = 200000;
+    std::vector<std::string> keys;
+    for (size_t i = 0; i < numKeys; ++i) {
+        std::stringstream key;
+        key << "latency-key-" << i;
+        keys.push_back(key.str());
+        queueKey(manager, vbucket, keys.back());
+    }
+
+    AtomicValue<bool> done(false);
+    std::vector<drain_args> args(numDrainers);
+    std::vector<cb_thread_t> threads(numDrainers);
+    for (size_t i = 0; i < numDrainers; ++i) {
+        std::stringstream name;
+        name << "drainer-" << i;
+        args[i].manager = manager;
+        args[i].done = &done;
+        args[i].name = name.str();
+        args[i].minItems = numKeys;
+        args[i].drains = 0;
+        cb_assert(cb_create_thread(&threads[i], launch_drain_thread,
+                                   &args[i], 0) == 0);
+    }
+
+    std::vector<hrtime_t> latencies;
+    latencies.reserve(numUpdates);
+    uint32_t r = 12345;
+    for (size_t i = 0; i < numUpdates; ++i) {
+        r = r * 1103515245 + 12345;
+        queued_item qi(new Item(keys[(r >> 8) % numKeys], 0, queue_op_set,
+                                0, 0));
+        hrtime_t start = gethrtime();
+        manager->queueDirty(vbucket, qi, true);
+        latencies.push_back(gethrtime() - start);
+    }
+
+    done.store(true);
+    size_t drains = 0;
+    for (size_t i = 0; i < numDrainers; ++i) {
+        cb_assert(cb_join_thread(threads[i]) == 0);
+        drains += args[i].drains;
+    }
+    cb_assert(manager->getNumOfCursors() == 1);
+    cb_assert(manager->getNumItems() == numKeys + 1);
+
+    std::vector<queued_item> items;
+    manager->getAllItemsForCursor(CheckpointManager::pCursor, items);
+    cb_assert(items.size() == numKeys + 1);
+    cb_assert(items.back()->getBySeqno() ==
+              static_cast<int64_t>(numKeys + numUpdates));
+
+    std::sort(latencies.begin(), latencies.end());
+    std::cout << "  " << numDrainers << " draining cursor(s), " << drains
+              << " full drains: p50 " << percentile(latencies, 0.5)
+              << " ns, p99 " << percentile(latencies, 0.99)
+              << " ns, p99.9 " << percentile(latencies, 0.999)
+              << " ns, max " << latencies.back() << " ns" << std::endl;
+
+    delete manager;
+}
+
+void test_queue_dirty_latency() {
+    std::cout << "queueDirty latency while cursors drain:" << std::endl;
+    size_t drainers[] = { 0, 1, 2, 4 };
+    for (size_t i = 0; i < sizeof(drainers) / sizeof(drainers[0]); ++i) {
+        queue_dirty_latency(drainers[i]);
+    }
+}
+
 int main(int argc, char **argv) {
     (void)argc; (void)argv;
     putenv(strdup("ALLOW_NO_STATS_UPDATE=yeah"));
     basic_chk_test();
     test_reset_checkpoint_id();
+    test_dedup_with_cursors();
+    test_hot_key_memory();
+    test_mem_overhead_per_item();
+    test_cursor_handles();
+    test_queue_dirty_latency();
 }
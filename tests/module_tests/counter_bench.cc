@@ -0,0 +1,140 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2015 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/*
+ * Measures how counter updates scale with the number of threads. Every
+ * thread bumps the same few neighbouring counters, the way front end
+ * threads bump numOpsGet, numOpsStore and friends in EPStats, once with
+ * the counters as plain AtomicValues and once as ShardedCounters.
+ */
+
+#include "config.h"
+
+#include <getopt.h>
+#include <stdlib.h>
+
+#include <iomanip>
+#include <iostream>
+#include <vector>
+
+#include "atomic.h"
+#include "common.h"
+
+struct AtomicCounters {
+    AtomicCounters() : ops(0), gets(0), stores(0), enqueued(0) { }
+
+    AtomicValue<size_t> ops;
+    AtomicValue<size_t> gets;
+    AtomicValue<size_t> stores;
+    AtomicValue<size_t> enqueued;
+};
+
+struct ShardedCounters {
+    ShardedCounter ops;
+    ShardedCounter gets;
+    ShardedCounter stores;
+    ShardedCounter enqueued;
+};
+
+template <typename C>
+struct BenchThread {
+    C *counters;
+    size_t iterations;
+    cb_thread_t thread;
+};
+
+template <typename C>
+static void bench_main(void *arg) {
+    BenchThread<C> *t = static_cast<BenchThread<C> *>(arg);
+    C &c = *t->counters;
+    for (size_t i = 0; i < t->iterations; ++i) {
+        ++c.ops;
+        if (i & 1) {
+            ++c.stores;
+            ++c.enqueued;
+        } else {
+            ++c.gets;
+        }
+    }
+}
+
+/**
+ * Run the given number of threads over one set of counters.
+ *
+ * @return millions of counter updates per second
+ */
+template <typename C>
+static double run(size_t numThreads, size_t iterations) {
+    C counters;
+    std::vector<BenchThread<C> > threads(numThreads);
+    hrtime_t start = gethrtime();
+    for (size_t i = 0; i < numThreads; ++i) {
+        threads[i].counters = &counters;
+        threads[i].iterations = iterations;
+        cb_assert(cb_create_thread(&threads[i].thread, bench_main<C>,
+                                   &threads[i], 0) == 0);
+    }
+    for (size_t i = 0; i < numThreads; ++i) {
+        cb_assert(cb_join_thread(threads[i].thread) == 0);
+    }
+    hrtime_t elapsed = gethrtime() - start;
+
+    size_t updates = counters.ops + counters.gets + counters.stores +
+                     counters.enqueued;
+    cb_assert(updates == numThreads * (iterations + (iterations + 1) / 2 +
+                                       iterations / 2 * 2));
+    return updates * 1000.0 / elapsed;
+}
+
+static void usage(const char *name) {
+    std::cerr << "Usage: " << name << " [-t max threads] [-i iterations]"
+              << std::endl;
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+    size_t maxThreads = 32;
+    size_t iterations = 1000000;
+    int cmd;
+
+    while ((cmd = getopt(argc, argv, "t:i:")) != -1) {
+        switch (cmd) {
+        case 't':
+            maxThreads = strtoul(optarg, NULL, 10);
+            break;
+        case 'i':
+            iterations = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (maxThreads == 0 || iterations == 0) {
+        usage(argv[0]);
+    }
+
+    std::cout << std::setw(8) << "threads" << std::setw(16) << "atomic Mops/s"
+              << std::setw(16) << "sharded Mops/s" << std::endl;
+    for (size_t n = 1; n <= maxThreads; n *= 2) {
+        double atomic = run<AtomicCounters>(n, iterations);
+        double sharded = run<ShardedCounters>(n, iterations);
+        std::cout << std::setw(8) << n << std::fixed << std::setprecision(1)
+                  << std::setw(16) << atomic << std::setw(16) << sharded
+                  << std::endl;
+    }
+    return 0;
+}
@@ -0,0 +1,217 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2015 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include <platform/cbassert.h>
+
+#include <algorithm>
+#include <iostream>
+#include <list>
+#include <vector>
+
+#include "dcp/ready-queue.h"
+#include "locks.h"
+#include "threadtests.h"
+
+static const size_t numVBuckets = 1024;
+static const size_t numNotifies = 1000000;
+static const size_t pushesPerProducer = 200000;
+
+/**
+ * The previous ready list: a locked list searched on every notification
+ * to avoid queueing a vbucket twice. Kept here as the baseline.
+ */
+class ListReadyQueue {
+public:
+    bool push(uint16_t vbid) {
+        LockHolder lh(lock);
+        if (std::find(ready.begin(), ready.end(), vbid) != ready.end()) {
+            return false;
+        }
+        ready.push_back(vbid);
+        return true;
+    }
+
+    bool pop(uint16_t &vbid) {
+        LockHolder lh(lock);
+        if (ready.empty()) {
+            return false;
+        }
+        vbid = ready.front();
+        ready.pop_front();
+        return true;
+    }
+
+private:
+    Mutex lock;
+    std::list<uint16_t> ready;
+};
+
+static void testOrdering() {
+    VBReadyQueue q(numVBuckets);
+    uint16_t vbid;
+    cb_assert(q.empty());
+    cb_assert(!q.pop(vbid));
+
+    cb_assert(q.push(5));
+    cb_assert(q.push(1023));
+    cb_assert(!q.push(5));
+    cb_assert(q.push(0));
+    cb_assert(!q.empty());
+
+    cb_assert(q.pop(vbid) && vbid == 5);
+    // Once taken, a vbucket can be queued again, behind the others.
+    cb_assert(q.push(5));
+    cb_assert(q.pop(vbid) && vbid == 1023);
+    cb_assert(q.pop(vbid) && vbid == 0);
+    cb_assert(q.pop(vbid) && vbid == 5);
+    cb_assert(!q.pop(vbid));
+    cb_assert(q.empty());
+
+    // Every vbucket fits at once, and the ring wraps around.
+    for (size_t round = 0; round < 3; ++round) {
+        for (size_t i = 0; i < numVBuckets; ++i) {
+            cb_assert(q.push((i + round) % numVBuckets));
+        }
+        for (size_t i = 0; i < numVBuckets; ++i) {
+            cb_assert(q.pop(vbid) && vbid == (i + round) % numVBuckets);
+        }
+        cb_assert(!q.pop(vbid));
+    }
+}
+
+class Notifier : public Generator<bool> {
+public:
+    Notifier(VBReadyQueue &queue) : q(queue), next(0) { }
+
+    bool operator()() {
+        size_t me = next++;
+        for (size_t i = 0; i < pushesPerProducer; ++i) {
+            q.push((i * 7 + me) % numVBuckets);
+        }
+        return true;
+    }
+
+private:
+    VBReadyQueue &q;
+    AtomicValue<size_t> next;
+};
+
+struct StepperCtx {
+    StepperCtx(VBReadyQueue &queue) : q(queue), done(false), popped(0) { }
+
+    VBReadyQueue &q;
+    AtomicValue<bool> done;
+    AtomicValue<size_t> popped;
+};
+
+extern "C" {
+    static void stepper_main(void *arg) {
+        StepperCtx *ctx = static_cast<StepperCtx *>(arg);
+        uint16_t vbid;
+        while (!ctx->done) {
+            while (ctx->q.pop(vbid)) {
+                cb_assert(vbid < numVBuckets);
+                ++ctx->popped;
+            }
+        }
+    }
+}
+
+static void testConcurrentNotify() {
+    VBReadyQueue q(numVBuckets);
+    Notifier gen(q);
+    StepperCtx ctx(q);
+
+    cb_thread_t stepper;
+    cb_assert(cb_create_thread(&stepper, stepper_main, &ctx, 0) == 0);
+    getCompletedThreads<bool>(4, &gen);
+    while (ctx.popped == 0) {
+        usleep(100);
+    }
+    ctx.done = true;
+    cb_assert(cb_join_thread(stepper) == 0);
+
+    // What is left holds every vbucket at most once, and afterwards every
+    // vbucket can be queued again.
+    std::vector<bool> seen(numVBuckets, false);
+    uint16_t vbid;
+    while (q.pop(vbid)) {
+        cb_assert(!seen[vbid]);
+        seen[vbid] = true;
+    }
+    for (size_t i = 0; i < numVBuckets; ++i) {
+        cb_assert(q.push(i));
+    }
+}
+
+template <typename Q>
+static double notifyCost(Q &q) {
+    // All streams are ready: the common case while a producer streams a
+    // whole bucket, and the worst one for a search.
+    for (size_t i = 0; i < numVBuckets; ++i) {
+        cb_assert(q.push(i));
+    }
+
+    size_t queued = 0;
+    hrtime_t start = gethrtime();
+    for (size_t i = 0; i < numNotifies; ++i) {
+        uint16_t vbid;
+        if (q.push((i * 7) % numVBuckets)) {
+            ++queued;
+        }
+        // Step one stream now and then, as the producer would.
+        if ((i & 7) == 0 && q.pop(vbid)) {
+            q.push(vbid);
+        }
+    }
+    hrtime_t elapsed = gethrtime() - start;
+    cb_assert(queued == 0);
+
+    // Every stream is still queued exactly once.
+    std::vector<bool> seen(numVBuckets, false);
+    size_t popped = 0;
+    uint16_t vbid;
+    while (q.pop(vbid)) {
+        cb_assert(!seen[vbid]);
+        seen[vbid] = true;
+        ++popped;
+    }
+    cb_assert(popped == numVBuckets);
+    return static_cast<double>(elapsed) / numNotifies;
+}
+
+static void testNotifyCost() {
+    ListReadyQueue list;
+    VBReadyQueue ring(numVBuckets);
+    double listNs = notifyCost(list);
+    double ringNs = notifyCost(ring);
+
+    std::cout << "notify cost with " << numVBuckets << " ready streams:"
+              << std::endl
+              << "  list:   " << listNs << " ns" << std::endl
+              << "  bitmap: " << ringNs << " ns" << std::endl;
+}
+
+int main(int argc, char **argv) {
+    (void)argc; (void)argv;
+    testOrdering();
+    testConcurrentNotify();
+    testNotifyCost();
+    return 0;
+}
@@ -100,6 +100,119 @@ static size_t benchmarkDefragment(VBucket& vbucket, size_t passes,
     return size_t(visited / duration_s);
 }
 
+/* Check that the defragmenter compresses values that have not been accessed
+ * for a pass, keeping their datatype, and that reads get back the values
+ * as they were stored.
+ */
+static void testCompressColdValues(EPStats& stats) {
+    CheckpointConfig config;
+    shared_ptr<Callback<uint16_t> > cb(new DummyCB());
+    VBucket vbucket(1, vbucket_state_active, stats, config, NULL, 0, 0, 0,
+                    NULL, cb);
+
+    std::string json("{\"list\": [");
+    for (int i = 0; i < 50; i++) {
+        json.append("\"element\", ");
+    }
+    json.append("\"last\"]}");
+    uint8_t datatype = PROTOCOL_BINARY_DATATYPE_JSON;
+
+    const size_t ndocs = 100;
+    std::vector<std::string> keys;
+    for (size_t i = 0; i < ndocs; i++) {
+        std::stringstream ss;
+        ss << "json" << i;
+        keys.push_back(ss.str());
+        Item item(keys[i].c_str(), keys[i].length(), 0, 0, json.data(),
+                  json.length(), &datatype, EXT_META_LEN);
+        vbucket.ht.add(item, VALUE_ONLY);
+    }
+    char noise[512];
+    for (size_t i = 0; i < sizeof(noise); i++) {
+        noise[i] = static_cast<char>(rand());
+    }
+    const std::string noiseKey("noise");
+    Item noiseItem(noiseKey.c_str(), noiseKey.length(), 0, 0, noise,
+                   sizeof(noise));
+    vbucket.ht.add(noiseItem, VALUE_ONLY);
+    // A value the client stored compressed isn't tried again.
+    uint8_t snappy = PROTOCOL_BINARY_DATATYPE_COMPRESSED;
+    const std::string snappyKey("snappy");
+    Item snappyItem(snappyKey.c_str(), snappyKey.length(), 0, 0, json.data(),
+                    json.length(), &snappy, EXT_META_LEN);
+    vbucket.ht.add(snappyItem, VALUE_ONLY);
+
+    // Dirty values are left alone until they are persisted.
+    DefragmentVisitor visitor(std::numeric_limits<uint8_t>::max(), true);
+    cb_assert(visitor.visit(1, vbucket.ht));
+    cb_assert(visitor.getCompressCount() == 0);
+    for (size_t i = 0; i < ndocs; i++) {
+        vbucket.ht.find(keys[i], false)->markClean();
+    }
+    vbucket.ht.find(noiseKey, false)->markClean();
+    vbucket.ht.find(snappyKey, false)->markClean();
+
+    // The first pass only marks the values cold; one read between the
+    // passes keeps its value from being compressed.
+    cb_assert(visitor.visit(1, vbucket.ht));
+    cb_assert(visitor.getCompressCount() == 0);
+    vbucket.ht.find(keys[0]);
+    const size_t cacheSize = vbucket.ht.cacheSize.load();
+    cb_assert(visitor.visit(1, vbucket.ht));
+    cb_assert(visitor.getCompressCount() == ndocs - 1);
+    cb_assert(stats.compressorNumCompressed == ndocs - 1);
+    cb_assert(cacheSize - vbucket.ht.cacheSize.load() ==
+              stats.compressorBytesSaved);
+    cb_assert(!vbucket.ht.find(keys[0], false)->getValue()->
+              isCompressedInMemory());
+    const value_t &noiseValue = vbucket.ht.find(noiseKey, false)->getValue();
+    cb_assert(!noiseValue->isCompressedInMemory());
+    cb_assert(noiseValue->isIncompressible());
+    const value_t &snappyValue = vbucket.ht.find(snappyKey, false)->getValue();
+    cb_assert(!snappyValue->isCompressedInMemory());
+    cb_assert(!snappyValue->isIncompressible());
+
+    StoredValue *v = vbucket.ht.find(keys[1], false);
+    cb_assert(v->getValue()->isCompressedInMemory());
+    // The pager's NRU clock is left alone.
+    cb_assert(v->getNRUValue() == INITIAL_NRU_VALUE);
+    cb_assert(v->getValue()->getDataType() == PROTOCOL_BINARY_DATATYPE_JSON);
+    cb_assert(v->valuelen() < json.length());
+
+    // Items handed out carry the value as stored...
+    Item *itm = v->toItem(false, 1, vbucket.ht);
+    cb_assert(itm->getDataType() == PROTOCOL_BINARY_DATATYPE_JSON);
+    cb_assert(itm->getValue()->to_s() == json);
+    delete itm;
+    cb_assert(v->getValue()->isCompressedInMemory());
+    cb_assert(stats.compressorNumInflated == 1);
+
+    // ...and a read puts it back in the hashtable.
+    const size_t saved = json.length() - v->getValue()->vlength();
+    const size_t totalSaved = stats.compressorBytesSaved;
+    v->inflateValue(vbucket.ht);
+    cb_assert(!v->getValue()->isCompressedInMemory());
+    cb_assert(v->getValue()->getDataType() == PROTOCOL_BINARY_DATATYPE_JSON);
+    cb_assert(v->getValue()->to_s() == json);
+    cb_assert(stats.compressorNumInflated == 2);
+    cb_assert(stats.compressorBytesSaved == totalSaved - saved);
+    cb_assert(cacheSize - vbucket.ht.cacheSize.load() ==
+              stats.compressorBytesSaved);
+
+    // The savings go when compressed values are ejected, replaced or
+    // dropped with the hashtable.
+    v = vbucket.ht.find(keys[2], false);
+    cb_assert(v->getValue()->isCompressedInMemory());
+    cb_assert(v->ejectValue(vbucket.ht, VALUE_ONLY));
+    cb_assert(stats.compressorBytesSaved == totalSaved - 2 * saved);
+    Item update(keys[3].c_str(), keys[3].length(), 0, 0, json.data(),
+                json.length(), &datatype, EXT_META_LEN);
+    cb_assert(vbucket.ht.set(update) == WAS_CLEAN);
+    cb_assert(stats.compressorBytesSaved == totalSaved - 3 * saved);
+    vbucket.ht.clear();
+    cb_assert(stats.compressorBytesSaved == 0);
+}
+
 void printResult(const std::string label, size_t value, const std::string units) {
     std::cout.imbue(std::locale(""));
 
@@ -119,6 +232,8 @@ int main(void) {
     EPStats stats;
     CheckpointConfig config;
     shared_ptr<Callback<uint16_t> > cb(new DummyCB());
+    testCompressColdValues(stats);
+
     VBucket vbucket(0, vbucket_state_active, stats, config, NULL, 0, 0, 0, NULL,
                     cb);
 
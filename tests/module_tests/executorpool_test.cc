@@ -0,0 +1,343 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2015 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include <platform/cbassert.h>
+
+#include <algorithm>
+#include <climits>
+#include <cstdlib>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include "executorpool.h"
+#include "executorthread.h"
+#include "futurequeue.h"
+#include "taskqueue.h"
+
+/**
+ * A task that is only ever queued, never run.
+ */
+class TestTask : public GlobalTask {
+public:
+    TestTask(const std::string &n)
+        : GlobalTask(NULL, Priority::PendingOpsPriority), name(n) { }
+
+    bool run() {
+        return false;
+    }
+
+    std::string getDescription() {
+        return name;
+    }
+
+    void setWaketime(const struct timeval &tv) {
+        waketime = tv;
+    }
+
+    const struct timeval &getWaketime() const {
+        return waketime;
+    }
+
+private:
+    std::string name;
+};
+
+static struct timeval baseTime;
+
+static struct timeval at(uint64_t ms) {
+    struct timeval tv = baseTime;
+    tv.tv_sec += ms / 1000;
+    tv.tv_usec = (ms % 1000) * 1000;
+    return tv;
+}
+
+static ExTask makeTask(const std::string &name, uint64_t ms) {
+    TestTask *t = new TestTask(name);
+    t->setWaketime(at(ms));
+    return ExTask(t);
+}
+
+static std::string names(const std::vector<ExTask> &tasks) {
+    std::string rv;
+    for (size_t i = 0; i < tasks.size(); ++i) {
+        rv += tasks[i]->getDescription();
+    }
+    return rv;
+}
+
+static std::string popDue(FutureQueue &fq, uint64_t ms) {
+    std::vector<ExTask> due;
+    std::vector<ExTask> woken;
+    fq.popDue(at(ms), due, woken);
+    cb_assert(woken.empty());
+    return names(due);
+}
+
+static void testPushOrdering() {
+    FutureQueue fq;
+    ExTask a = makeTask("a", 30);
+    ExTask b = makeTask("b", 10);
+    ExTask c = makeTask("c", 20);
+    fq.push(a);
+    fq.push(b);
+    fq.push(c);
+    cb_assert(fq.size() == 3);
+
+    cb_assert(popDue(fq, 5) == "");
+    cb_assert(popDue(fq, 10) == "b");
+    cb_assert(popDue(fq, 100) == "ca");
+    cb_assert(fq.size() == 0);
+    cb_assert(popDue(fq, 200) == "");
+}
+
+static void testRefileAndWake() {
+    FutureQueue fq;
+    ExTask a = makeTask("a", 30);
+    ExTask b = makeTask("b", 40);
+
+    // Filing again replaces the earlier filing.
+    fq.push(a);
+    fq.push(a);
+    cb_assert(fq.size() == 1);
+
+    // Refiling picks up the new waketime; the old entry is dropped.
+    static_cast<TestTask *>(a.get())->setWaketime(at(5));
+    fq.refile(a);
+    cb_assert(fq.size() == 1);
+    cb_assert(popDue(fq, 5) == "a");
+    cb_assert(popDue(fq, 100) == "");
+
+    // Refiling a task that isn't filed doesn't file it.
+    fq.refile(a);
+    cb_assert(fq.size() == 0);
+
+    // A filed task becomes due at once when woken...
+    fq.push(b);
+    fq.wake(b);
+    std::vector<ExTask> due;
+    std::vector<ExTask> woken;
+    fq.popDue(at(1), due, woken);
+    cb_assert(names(due) == "b" && woken.empty());
+    cb_assert(popDue(fq, 100) == "");
+
+    // ... and one that isn't filed is handed back as woken.
+    due.clear();
+    fq.wake(a);
+    fq.popDue(at(101), due, woken);
+    cb_assert(due.empty() && names(woken) == "a");
+}
+
+static void testCompactOverflow() {
+    FutureQueue fq;
+    ExTask t(new TestTask("t"));
+    static_cast<TestTask *>(t.get())->snooze(INT_MAX);
+
+    // A task that sleeps until woken leaves an entry due at the end of
+    // time behind at every wake; they must not pile up.
+    for (int i = 0; i < 10000; ++i) {
+        fq.push(t);
+        fq.wake(t);
+        cb_assert(popDue(fq, i) == "t");
+        cb_assert(fq.getNumEntries() <= 2 * fq.size() + 65);
+    }
+    cb_assert(fq.size() == 0);
+
+    struct timeval tv;
+    fq.push(t);
+    popDue(fq, 10000);
+    cb_assert(!fq.getNextWaketime(tv));
+    cb_assert(fq.size() == 1);
+}
+
+static void testWheelWrap() {
+    FutureQueue fq;
+    ExTask near = makeTask("n", 500);
+    ExTask far = makeTask("f", 1500);
+    ExTask farther = makeTask("F", 2600);
+    fq.push(near);
+    fq.push(far);
+    fq.push(farther);
+
+    cb_assert(popDue(fq, 1200) == "n");
+    cb_assert(popDue(fq, 1499) == "");
+    cb_assert(popDue(fq, 1500) == "f");
+
+    // Filed after the wheel moved on, into slots it already swept once.
+    ExTask again = makeTask("a", 1510);
+    fq.push(again);
+    cb_assert(popDue(fq, 1509) == "");
+    cb_assert(popDue(fq, 1510) == "a");
+
+    // Jumping more than a whole turn ahead takes everything due.
+    ExTask late = makeTask("l", 2000);
+    fq.push(late);
+    cb_assert(popDue(fq, 9000) == "lF");
+    cb_assert(fq.size() == 0);
+}
+
+static uint64_t toMillis(const struct timeval &tv) {
+    return static_cast<uint64_t>(tv.tv_sec - baseTime.tv_sec) * 1000 +
+           (tv.tv_usec + 999) / 1000;
+}
+
+static void testNextWaketimeNeverLate() {
+    FutureQueue fq;
+    std::vector<ExTask> tasks;
+    std::vector<bool> filed;
+    for (int i = 0; i < 200; ++i) {
+        tasks.push_back(makeTask("t", 1 + random() % 5000));
+        filed.push_back(true);
+        fq.push(tasks.back());
+    }
+
+    uint64_t now = 0;
+    size_t taken = 0;
+    while (taken < tasks.size()) {
+        now += 1 + random() % 300;
+
+        // File some tasks again, earlier or later, as we go.
+        size_t r = random() % tasks.size();
+        ExTask &t = tasks[r];
+        if (filed[r]) {
+            static_cast<TestTask *>(t.get())->setWaketime(
+                                        at(now + random() % 2000));
+            fq.refile(t);
+        }
+
+        std::vector<ExTask> due;
+        std::vector<ExTask> woken;
+        fq.popDue(at(now), due, woken);
+        for (size_t i = 0; i < due.size(); ++i) {
+            cb_assert(toMillis(static_cast<TestTask *>(due[i].get())
+                               ->getWaketime()) <= now);
+            for (size_t j = 0; j < tasks.size(); ++j) {
+                if (tasks[j].get() == due[i].get()) {
+                    cb_assert(filed[j]);
+                    filed[j] = false;
+                }
+            }
+        }
+        taken += due.size();
+
+        // Nothing due is left behind, and no task is due before the next
+        // waketime reported.
+        uint64_t earliest = std::numeric_limits<uint64_t>::max();
+        for (size_t i = 0; i < tasks.size(); ++i) {
+            if (filed[i]) {
+                uint64_t w = toMillis(static_cast<TestTask *>(tasks[i].get())
+                                      ->getWaketime());
+                cb_assert(w > now);
+                earliest = std::min(earliest, w);
+            }
+        }
+        struct timeval tv;
+        if (earliest != std::numeric_limits<uint64_t>::max()) {
+            cb_assert(fq.getNextWaketime(tv));
+            cb_assert(toMillis(tv) <= earliest);
+        }
+    }
+    cb_assert(fq.size() == 0);
+}
+
+/**
+ * Drives the ExecutorPool's handling of the tasks threads queue for
+ * themselves, without starting any threads.
+ */
+class ExecutorPoolTest {
+public:
+    static void testLocalTasks() {
+        ExecutorPool *pool = new ExecutorPool(3, NUM_TASK_GROUPS, 0, 0, 0, 2);
+        for (size_t i = 0; i < NUM_TASK_GROUPS; ++i) {
+            pool->hpTaskQ.push_back(new TaskQueue(pool, (task_type_t)i,
+                                                  "HiPrioQ_"));
+        }
+        pool->isHiPrioQset = true;
+        TaskQueue *q = pool->hpTaskQ[NONIO_TASK_IDX];
+
+        ExecutorThread a(pool, NONIO_TASK_IDX, "a");
+        ExecutorThread b(pool, NONIO_TASK_IDX, "b");
+        ExecutorThread c(pool, NONIO_TASK_IDX, "c");
+        pool->threadQ.push_back(&a);
+        pool->threadQ.push_back(&b);
+        pool->threadQ.push_back(&c);
+
+        struct timeval past;
+        gettimeofday(&past, NULL);
+        past.tv_sec -= 1;
+        std::vector<ExTask> tasks;
+        for (int i = 0; i < 4; ++i) {
+            TestTask *t = new TestTask(std::string(1, '0' + i));
+            t->setWaketime(past);
+            tasks.push_back(ExTask(t));
+            q->schedule(tasks.back());
+        }
+
+        // With nobody asleep, a takes 0 to run and claims 1, 2 and 3. They
+        // stay counted as ready, so no other thread goes to sleep on them.
+        cb_assert(q->fetchNextTask(a, false));
+        cb_assert(a.getTaskName() == "0");
+        cb_assert(pool->getNumReadyTasks() == 3);
+        cb_assert(!pool->trySleep(NONIO_TASK_IDX));
+
+        // b steals the newest claim.
+        cb_assert(pool->_stealTask(b) == q);
+        cb_assert(b.getTaskName() == "3");
+        cb_assert(pool->getNumReadyTasks() == 2);
+
+        // Both NonIO workers are busy: what c steals goes back to the
+        // shared queue rather than being lost.
+        cb_assert(pool->_stealTask(c) == NULL);
+        cb_assert(pool->getNumReadyTasks() == 1);
+        cb_assert(q->getFutureQueueSize() == 1);
+
+        // A claimed task snoozed before its thread got to it is filed again.
+        tasks[1]->snooze(60);
+        task_type_t done = NONIO_TASK_IDX;
+        pool->doneWork(done);
+        cb_assert(pool->_nextLocalTask(a) == NULL);
+        cb_assert(pool->getNumReadyTasks() == 0);
+        cb_assert(q->getFutureQueueSize() == 2);
+        cb_assert(pool->_nextLocalTask(a) == NULL);
+        cb_assert(pool->_stealTask(c) == NULL);
+
+        // The stolen task runs from the shared queue; the snoozed one waits.
+        cb_assert(q->fetchNextTask(c, false));
+        cb_assert(c.getTaskName() == "2");
+        cb_assert(q->getFutureQueueSize() == 1);
+
+        pool->threadQ.clear();
+        delete pool;
+    }
+};
+
+int main(int argc, char **argv) {
+    (void)argc; (void)argv;
+    gettimeofday(&baseTime, NULL);
+    baseTime.tv_sec += 1;
+    baseTime.tv_usec = 0;
+
+    testPushOrdering();
+    testRefileAndWake();
+    testCompactOverflow();
+    testWheelWrap();
+    testNextWaketimeNeverLate();
+    ExecutorPoolTest::testLocalTasks();
+    return 0;
+}
@@ -23,7 +23,10 @@
 #include <stats.h>
 
 #include <algorithm>
+#include <cstdlib>
+#include <iostream>
 #include <limits>
+#include <new>
 
 #include "threadtests.h"
 
@@ -47,6 +50,25 @@ extern "C" {
 
 EPStats global_stats;
 
+// Count the allocations made while countAllocations is set.
+static bool countAllocations = false;
+static size_t numAllocations = 0;
+
+void *operator new(size_t size) throw(std::bad_alloc) {
+    if (countAllocations) {
+        ++numAllocations;
+    }
+    void *p = malloc(size ? size : 1);
+    if (!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void *p) throw() {
+    free(p);
+}
+
 class Counter : public HashTableVisitor {
 public:
 
@@ -599,6 +621,297 @@ static void testItemAge() {
     cb_assert(v->getValue()->getAge() == 1);
 }
 
+static void testTaggedLayout() {
+    // A single bucket forces the tag line to overflow into the chain.
+    HashTable h(global_stats, 1, 1, HT_LAYOUT_TAGGED);
+    cb_assert(h.getLayout() == HT_LAYOUT_TAGGED);
+
+    std::vector<std::string> keys = generateKeys(100);
+    storeMany(h, keys);
+    verifyFound(h, keys);
+
+    // Remove from both the tag line and the overflow part of the chain.
+    std::vector<std::string>::iterator it;
+    for (it = keys.begin(); it != keys.end(); it += 2) {
+        cb_assert(h.del(*it));
+    }
+    for (size_t i = 0; i < keys.size(); ++i) {
+        cb_assert((h.find(keys[i]) != NULL) == (i % 2 == 1));
+    }
+    cb_assert(count(h) == 50);
+
+    // Rehashing rebuilds the tag lines.
+    h.resize(769);
+    for (size_t i = 0; i < keys.size(); ++i) {
+        cb_assert((h.find(keys[i]) != NULL) == (i % 2 == 1));
+    }
+
+    h.clear();
+    cb_assert(count(h) == 0);
+    std::string missing("key1");
+    cb_assert(h.find(missing) == NULL);
+}
+
+static void testFindWithoutAllocating() {
+    HashTable h(global_stats, 5, 1);
+    // Too long for the short string optimization to hide a copy.
+    std::string key("a key long enough to always need the heap");
+    store(h, key);
+
+    countAllocations = true;
+    numAllocations = 0;
+    std::string copy(key);
+    cb_assert(numAllocations == 1);
+
+    // The read path of a GET hit: lock the bucket, find, take the value.
+    numAllocations = 0;
+    KeyView k(key.data(), key.length());
+    {
+        int bucket_num(0);
+        LockHolder lh = h.getLockedBucket(k, &bucket_num);
+        StoredValue *v = h.unlocked_find(k, bucket_num);
+        cb_assert(v != NULL);
+        cb_assert(v->hasKey(k));
+        value_t val = v->getValue();
+        cb_assert(val->vlength() == key.length());
+    }
+    cb_assert(h.find(k) != NULL);
+    countAllocations = false;
+    cb_assert(numAllocations == 0);
+}
+
+static void testIncrementalResize() {
+    HashTable::setDefaultIncrementalResize(true);
+    HashTable h(global_stats, 9, 3);
+
+    std::vector<std::string> keys = generateKeys(5000);
+    storeMany(h, keys);
+
+    // Only the bucket array is swapped; items move over as they are
+    // accessed or stepped.
+    h.resize(6144);
+    cb_assert(h.getSize() == 6144);
+    cb_assert(h.isResizing());
+    cb_assert(h.getResizeRemaining() == 9);
+
+    for (size_t i = 0; i < keys.size(); i += 2) {
+        cb_assert(h.del(keys[i]));
+    }
+    for (size_t i = 0; i < keys.size(); ++i) {
+        cb_assert((h.find(keys[i]) != NULL) == (i % 2 == 1));
+    }
+
+    // Step through what's left a bucket at a time.
+    while (h.resizeStep(1)) {
+    }
+    cb_assert(!h.isResizing());
+    cb_assert(h.getResizeRemaining() == 0);
+    cb_assert(count(h) == 2500);
+
+    // Visitors see everything in the middle of a migration.
+    for (size_t i = 0; i < keys.size(); i += 2) {
+        store(h, keys[i]);
+    }
+    h.resize(768);
+    cb_assert(h.isResizing());
+    cb_assert(count(h) == 5000);
+    cb_assert(h.getNumMigratedItems() > 0);
+    verifyFound(h, keys);
+
+    // Automatic sizing keeps the size a multiple of the lock count.
+    while (h.resizeStep(64)) {
+    }
+    h.resize();
+    cb_assert(h.getSize() % h.getNumLocks() == 0);
+    while (h.resizeStep(64)) {
+    }
+    verifyFound(h, keys);
+
+    // Clearing mid-migration drops both arrays.
+    h.resize(h.getSize() * 2);
+    cb_assert(h.isResizing());
+    h.clear();
+    cb_assert(!h.isResizing());
+    cb_assert(count(h) == 0);
+
+    HashTable::setDefaultIncrementalResize(false);
+}
+
+struct ResizeLatencyArgs {
+    HashTable *ht;
+    std::vector<std::string> *keys;
+    AtomicValue<bool> started;
+    AtomicValue<bool> done;
+    AtomicValue<hrtime_t> maxLatency;
+    AtomicValue<size_t> gets;
+};
+
+extern "C" {
+    static void launch_resize_reader(void *arg) {
+        ResizeLatencyArgs *args = static_cast<ResizeLatencyArgs*>(arg);
+        size_t i = 0;
+        hrtime_t maxLatency = 0;
+        args->started.store(true);
+        while (!args->done.load()) {
+            std::string &key = (*args->keys)[i++ % args->keys->size()];
+            hrtime_t start = gethrtime();
+            cb_assert(args->ht->find(key, false));
+            maxLatency = std::max(maxLatency, gethrtime() - start);
+            ++args->gets;
+        }
+        args->maxLatency.store(maxLatency);
+    }
+}
+
+static hrtime_t blockingRehashTime(const std::vector<std::string> &keys,
+                                   size_t from, size_t to, size_t locks) {
+    HashTable h(global_stats, from, locks);
+    std::vector<std::string> k(keys);
+    storeMany(h, k);
+    hrtime_t start = gethrtime();
+    h.resize(to);
+    return gethrtime() - start;
+}
+
+static void testResizeGetLatency() {
+    const size_t locks = 64;
+    const size_t from = locks * 16;
+    const size_t to = locks * 4096;
+    std::vector<std::string> keys = generateKeys(200000);
+
+    // How long a GET could stall behind a resize holding every lock.
+    hrtime_t blocking = blockingRehashTime(keys, from, to, locks);
+
+    HashTable::setDefaultIncrementalResize(true);
+    HashTable h(global_stats, from, locks);
+    storeMany(h, keys);
+
+    ResizeLatencyArgs args;
+    args.ht = &h;
+    args.keys = &keys;
+    args.started.store(false);
+    args.done.store(false);
+    args.maxLatency.store(0);
+    args.gets.store(0);
+
+    cb_thread_t reader;
+    cb_assert(cb_create_thread(&reader, launch_resize_reader, &args, 0) == 0);
+    while (!args.started.load()) {
+        usleep(100);
+    }
+
+    // Every key is found between each step of the migration; the reader
+    // asserts on each GET.  Each step migrates exactly its budget of old
+    // buckets, whatever the reader's GETs have pulled across meanwhile,
+    // so the old array is only emptied by the last step.
+    const size_t budget = 256;
+    hrtime_t start = gethrtime();
+    h.resize(to);
+    cb_assert(h.isResizing());
+    size_t remaining = h.getResizeRemaining();
+    cb_assert(remaining == from);
+    size_t steps = 0;
+    bool more;
+    do {
+        size_t gets = args.gets.load();
+        while (args.gets.load() == gets) {
+            usleep(10);
+        }
+        more = h.resizeStep(budget);
+        ++steps;
+        size_t left = h.getResizeRemaining();
+        cb_assert(remaining - left == std::min(budget, remaining));
+        cb_assert(more == (left > 0));
+        cb_assert(more == h.isResizing());
+        remaining = left;
+    } while (more);
+    hrtime_t incremental = gethrtime() - start;
+
+    args.done.store(true);
+    cb_assert(cb_join_thread(reader) == 0);
+    HashTable::setDefaultIncrementalResize(false);
+
+    verifyFound(h, keys);
+    cb_assert(!h.isResizing());
+    cb_assert(steps == from / budget);
+
+    std::cout << "resize " << from << " -> " << to << " buckets: blocking "
+              << blocking / 1000 << " us, incremental " << incremental / 1000
+              << " us over " << steps << " steps, slowest get "
+              << args.maxLatency.load() / 1000 << " us" << std::endl;
+}
+
+struct pending_memory_ctx {
+    EPStats *stats;
+    size_t seed;
+    AtomicValue<size_t> *live; // bytes allocated and not freed yet
+};
+
+static void pending_memory_main(void *arg) {
+    pending_memory_ctx *ctx = static_cast<pending_memory_ctx *>(arg);
+    EPStats &stats = *ctx->stats;
+    std::vector<size_t> sizes;
+    size_t r = ctx->seed;
+    for (size_t round = 0; round < 200; ++round) {
+        for (size_t i = 0; i < 50; ++i) {
+            r = r * 1103515245 + 12345;
+            size_t size = 1 + (r >> 16) % 2000;
+            sizes.push_back(size);
+            ctx->live->fetch_add(size);
+            // Increases of currentSize are applied as they happen.
+            stats.currentSize.fetch_add(size);
+            stats.addMemory(PendingMemory::NUM_BLOB, 1);
+        }
+        // Free all but a few, so that something stays pending.
+        while (sizes.size() > 3) {
+            size_t size = sizes.back();
+            sizes.pop_back();
+            stats.addMemory(PendingMemory::CURRENT_SIZE,
+                            -static_cast<ssize_t>(size));
+            stats.addMemory(PendingMemory::NUM_BLOB, -1);
+            ctx->live->fetch_sub(size);
+        }
+    }
+}
+
+static void testPendingMemoryBound() {
+    const size_t numThreads = 8;
+    const size_t bound = PendingMemory::numSlots *
+                         PendingMemory::flushThreshold;
+    EPStats *stats = new EPStats();
+    AtomicValue<size_t> live(0);
+
+    std::vector<pending_memory_ctx> ctxs(numThreads);
+    std::vector<cb_thread_t> threads(numThreads);
+    for (size_t i = 0; i < numThreads; ++i) {
+        ctxs[i].stats = stats;
+        ctxs[i].seed = i + 1;
+        ctxs[i].live = &live;
+        cb_assert(cb_create_thread(&threads[i], pending_memory_main,
+                                   &ctxs[i], 0) == 0);
+    }
+    for (size_t i = 0; i < numThreads; ++i) {
+        cb_assert(cb_join_thread(threads[i]) == 0);
+    }
+
+    // Pending frees only ever make currentSize read high, and by less than
+    // the threshold of each slot.
+    size_t current = stats->currentSize.load();
+    cb_assert(current >= live.load());
+    cb_assert(current - live.load() < bound);
+
+    // Counters that go both ways may be off either way, just as little.
+    size_t blobs = stats->numBlob.load();
+    size_t exactBlobs = numThreads * 3;
+    cb_assert((blobs > exactBlobs ? blobs - exactBlobs :
+                                    exactBlobs - blobs) < bound);
+
+    stats->flushPendingMemory();
+    cb_assert(stats->currentSize.load() == live.load());
+    cb_assert(stats->numBlob.load() == exactBlobs);
+    delete stats;
+}
+
 int main() {
     putenv(strdup("ALLOW_NO_STATS_UPDATE=yeah"));
     global_stats.setMaxDataSize(64*1024*1024);
@@ -623,5 +936,20 @@ int main() {
     testSizeStatsEject();
     testSizeStatsEjectFlush();
     testItemAge();
+    testFindWithoutAllocating();
+    testIncrementalResize();
+    testResizeGetLatency();
+    testPendingMemoryBound();
+
+    // Run the lookup, deletion and resize tests again on tagged buckets.
+    HashTable::setDefaultLayout(HT_LAYOUT_TAGGED);
+    testTaggedLayout();
+    testReverseDeletions();
+    testForwardDeletions();
+    testFind();
+    testFindWithoutAllocating();
+    testResize();
+    testConcurrentAccessResize();
+    testSizeStatsEject();
     exit(0);
 }
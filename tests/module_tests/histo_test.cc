@@ -22,6 +22,7 @@
 #include <cmath>
 #include <functional>
 #include <sstream>
+#include <vector>
 
 #include "histo.h"
 
@@ -107,10 +108,121 @@ static void test_complete_range() {
     } while (i != 0);
 }
 
+static void test_sharded_bins() {
+    // The bins must be the ones of a default Histogram of the same size.
+    Histogram<hrtime_t> histo(static_cast<size_t>(20));
+    ShardedHistogram<hrtime_t> sharded(20);
+    Histogram<hrtime_t>::iterator it = histo.begin();
+    for (size_t i = 0; i < sharded.size(); ++i, ++it) {
+        cb_assert(it != histo.end());
+        cb_assert((*it)->start() == sharded.binStart(i));
+        cb_assert((*it)->end() == sharded.binEnd(i));
+    }
+    cb_assert(it == histo.end());
+
+    hrtime_t values[] = { 0, 1, 2, 3, 4, 1023, 1024, 1025, (1 << 20) - 1,
+                          1 << 20, 1ULL << 40,
+                          std::numeric_limits<hrtime_t>::max() };
+    for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); ++i) {
+        size_t bin = sharded.binIndex(values[i]);
+        cb_assert(histo.getBin(values[i])->start() == sharded.binStart(bin));
+        sharded.add(values[i], i + 1);
+        histo.add(values[i], i + 1);
+    }
+
+    std::vector<size_t> counts;
+    sharded.getCounts(counts);
+    it = histo.begin();
+    for (size_t i = 0; i < counts.size(); ++i, ++it) {
+        cb_assert((*it)->count() == counts[i]);
+    }
+    cb_assert(histo.total() == sharded.total());
+
+    sharded.reset();
+    cb_assert(0 == sharded.total());
+}
+
+static void test_sharded_percentiles() {
+    ShardedHistogram<hrtime_t> histo;
+    cb_assert(0 == histo.percentile(0.5));
+
+    // Uniform over [0, 10000): every estimate must land in the bin of the
+    // exact value, and within that bin's width of it.
+    for (hrtime_t i = 0; i < 10000; ++i) {
+        histo.add(i);
+    }
+    double fractions[] = { 0.5, 0.95, 0.99, 0.999 };
+    for (size_t i = 0; i < sizeof(fractions) / sizeof(fractions[0]); ++i) {
+        hrtime_t exact = static_cast<hrtime_t>(fractions[i] * 10000);
+        hrtime_t estimate = histo.percentile(fractions[i]);
+        size_t bin = histo.binIndex(exact);
+        cb_assert(histo.binIndex(estimate) == bin ||
+                  (estimate == histo.binEnd(bin) &&
+                   histo.binIndex(estimate) == bin + 1));
+        hrtime_t width = histo.binEnd(bin) - histo.binStart(bin);
+        hrtime_t diff = estimate > exact ? estimate - exact : exact - estimate;
+        cb_assert(diff <= width);
+    }
+
+    // A single bin: the estimate interpolates across it.
+    histo.reset();
+    histo.add(1024, 100);
+    cb_assert(histo.percentile(0.5) == 1536);
+    cb_assert(histo.percentile(1.0) == 2048);
+
+    // Values past the last bounded bin are reported as its start.
+    ShardedHistogram<hrtime_t> small(4);
+    small.add(1000000);
+    cb_assert(small.percentile(0.99) == 16);
+}
+
+struct sharded_add_ctx {
+    ShardedHistogram<hrtime_t> *histo;
+    size_t adds;
+};
+
+static void sharded_add_main(void *arg) {
+    sharded_add_ctx *ctx = static_cast<sharded_add_ctx *>(arg);
+    for (size_t i = 0; i < ctx->adds; ++i) {
+        ctx->histo->add(i % 5000);
+    }
+}
+
+static void test_sharded_contention() {
+    const size_t numThreads = 16;
+    const size_t adds = 100000;
+    ShardedHistogram<hrtime_t> histo;
+    sharded_add_ctx ctx = { &histo, adds };
+
+    std::vector<cb_thread_t> threads(numThreads);
+    for (size_t i = 0; i < numThreads; ++i) {
+        cb_assert(cb_create_thread(&threads[i], sharded_add_main, &ctx, 0) == 0);
+    }
+    for (size_t i = 0; i < numThreads; ++i) {
+        cb_assert(cb_join_thread(threads[i]) == 0);
+    }
+
+    // No add may be lost however the threads landed on the shards.
+    cb_assert(histo.total() == numThreads * adds);
+    Histogram<hrtime_t> expected;
+    for (size_t i = 0; i < adds; ++i) {
+        expected.add(i % 5000, numThreads);
+    }
+    std::vector<size_t> counts;
+    histo.getCounts(counts);
+    Histogram<hrtime_t>::iterator it = expected.begin();
+    for (size_t i = 0; i < counts.size(); ++i, ++it) {
+        cb_assert((*it)->count() == counts[i]);
+    }
+}
+
 int main() {
     test_basic();
     test_fixed_input();
     test_exponential();
     test_complete_range();
+    test_sharded_bins();
+    test_sharded_percentiles();
+    test_sharded_contention();
     return 0;
 }
@@ -0,0 +1,516 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2015 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/*
+ * Drives a KVStore created by KVStoreFactory through the operations the
+ * engine issues, without the engine around it, and reports throughput and
+ * latency percentiles for each of them:
+ *
+ *   set       batches of sets, one commit per batch
+ *   get       single gets of random keys through the read-only store
+ *   getmulti  batches of random keys of one vbucket through getMulti()
+ *   scan      a full seqno scan of every vbucket
+ *   compact   compactVBucket() of every vbucket
+ *   rollback  an extra batch written to every vbucket, then rolled back
+ */
+
+#include "config.h"
+
+#include <getopt.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <platform/dirutils.h>
+
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "callbacks.h"
+#include "common.h"
+#include "kvstore.h"
+
+extern "C" {
+    static rel_time_t basic_current_time(void) {
+        return 0;
+    }
+
+    rel_time_t (*ep_current_time)() = basic_current_time;
+
+    time_t ep_real_time() {
+        return time(NULL);
+    }
+}
+
+struct BenchConfig {
+    BenchConfig() : backend("couchdb"), dbname("/tmp/kvstore-bench"),
+                    workloads("set,get,getmulti,scan,compact,rollback"),
+                    numKeys(100000), valueSize(256), numVBuckets(16),
+                    batchSize(1000), numGets(100000), multiGetSize(32),
+                    handleCacheSize(0), seed(0) { }
+
+    std::string backend;
+    std::string dbname;
+    std::string workloads;
+    size_t numKeys;
+    size_t valueSize;
+    uint16_t numVBuckets;
+    size_t batchSize;
+    size_t numGets;
+    size_t multiGetSize;
+    size_t handleCacheSize;
+    unsigned int seed;
+};
+
+/**
+ * Latencies of one workload and the number of items they covered.
+ */
+class BenchResult {
+public:
+    BenchResult(const std::string &nm) : name(nm), items(0), total(0) { }
+
+    void add(hrtime_t latency, size_t numItems) {
+        samples.push_back(latency);
+        items += numItems;
+        total += latency;
+    }
+
+    void report() {
+        if (samples.empty()) {
+            std::cout << std::left << std::setw(10) << name
+                      << "no samples" << std::endl;
+            return;
+        }
+        std::sort(samples.begin(), samples.end());
+        double secs = static_cast<double>(total) / 1000000000.0;
+        std::cout << std::left << std::setw(10) << name
+                  << std::right << std::setw(12) << std::fixed
+                  << std::setprecision(0) << (items / secs) << " items/s"
+                  << "  ops " << samples.size()
+                  << "  p50 " << hrtime2text(percentile(0.5))
+                  << "  p95 " << hrtime2text(percentile(0.95))
+                  << "  p99 " << hrtime2text(percentile(0.99))
+                  << "  p99.9 " << hrtime2text(percentile(0.999))
+                  << "  max " << hrtime2text(samples.back())
+                  << std::endl;
+    }
+
+private:
+    hrtime_t percentile(double p) {
+        size_t idx = static_cast<size_t>(p * (samples.size() - 1));
+        return samples[idx];
+    }
+
+    std::string name;
+    std::vector<hrtime_t> samples;
+    size_t items;
+    hrtime_t total;
+};
+
+class NoopMutationCallback : public Callback<mutation_result> {
+public:
+    void callback(mutation_result &result) {
+        if (result.first != 1) {
+            ++failures;
+        }
+    }
+
+    static size_t failures;
+};
+
+size_t NoopMutationCallback::failures = 0;
+
+class NoopStatsCallback : public Callback<kvstats_ctx> {
+public:
+    void callback(kvstats_ctx &ctx) {
+        (void)ctx;
+    }
+};
+
+class CountingGetCallback : public Callback<GetValue> {
+public:
+    CountingGetCallback() : found(0), missed(0) { }
+
+    void callback(GetValue &result) {
+        if (result.getStatus() == ENGINE_SUCCESS) {
+            ++found;
+        } else {
+            ++missed;
+        }
+        delete result.getValue();
+    }
+
+    size_t found;
+    size_t missed;
+};
+
+class NoopLookupCallback : public Callback<CacheLookup> {
+public:
+    void callback(CacheLookup &lookup) {
+        (void)lookup;
+    }
+};
+
+class NoopExpiryCallback : public Callback<std::string&, uint64_t&> {
+public:
+    void callback(std::string &key, uint64_t &revSeqno) {
+        (void)key; (void)revSeqno;
+    }
+};
+
+class NoopRollbackCallback : public RollbackCB {
+public:
+    NoopRollbackCallback() : keys(0) { }
+
+    void callback(GetValue &result) {
+        ++keys;
+        delete result.getValue();
+    }
+
+    size_t keys;
+};
+
+static std::string makeKey(size_t i) {
+    std::stringstream ss;
+    ss << "key_" << std::setfill('0') << std::setw(10) << i;
+    return ss.str();
+}
+
+static uint16_t vbucketOf(const BenchConfig &cfg, size_t i) {
+    return static_cast<uint16_t>(i % cfg.numVBuckets);
+}
+
+class KVStoreBench {
+public:
+    KVStoreBench(BenchConfig &c)
+        : cfg(c), kvconfig(c.numVBuckets, c.dbname, c.backend,
+                           c.handleCacheSize),
+          rw(NULL), ro(NULL), highSeqnos(c.numVBuckets, 0),
+          value(c.valueSize, 'x') {
+        CouchbaseDirectoryUtilities::rmrf(cfg.dbname.c_str());
+        rw = KVStoreFactory::create(kvconfig, false);
+        ro = KVStoreFactory::create(kvconfig, true);
+        if (rw == NULL || ro == NULL) {
+            std::cerr << "Unknown backend: " << cfg.backend << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        rw->setReadOnlyPeer(ro);
+
+        std::string failovers("[{\"id\":0,\"seq\":0}]");
+        vbucket_state state(vbucket_state_active, 0, 0, 0, 0, 0, 0, 0, 0,
+                            failovers);
+        NoopStatsCallback sc;
+        for (uint16_t vb = 0; vb < cfg.numVBuckets; ++vb) {
+            rw->snapshotVBucket(vb, state, &sc);
+        }
+    }
+
+    ~KVStoreBench() {
+        delete ro;
+        delete rw;
+        CouchbaseDirectoryUtilities::rmrf(cfg.dbname.c_str());
+    }
+
+    void run(const std::string &workload) {
+        BenchResult result(workload);
+        if (workload == "set") {
+            runSets(result);
+        } else if (workload == "get") {
+            runGets(result);
+        } else if (workload == "getmulti") {
+            runGetMultis(result);
+        } else if (workload == "scan") {
+            runScans(result);
+        } else if (workload == "compact") {
+            runCompactions(result);
+        } else if (workload == "rollback") {
+            runRollbacks(result);
+        } else {
+            std::cerr << "Unknown workload: " << workload << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        result.report();
+    }
+
+private:
+    /**
+     * Write the given keys of one vbucket in batches of batchSize, each
+     * batch with a commit of its own.
+     */
+    void writeKeys(uint16_t vb, const std::vector<size_t> &keys,
+                   BenchResult *result) {
+        NoopMutationCallback wc;
+        NoopStatsCallback sc;
+        for (size_t i = 0; i < keys.size(); i += cfg.batchSize) {
+            size_t end = std::min(keys.size(), i + cfg.batchSize);
+            uint64_t snapStart = highSeqnos[vb] + 1;
+            std::vector<Item*> items;
+            for (size_t k = i; k < end; ++k) {
+                std::string key = makeKey(keys[k]);
+                int64_t seqno = ++highSeqnos[vb];
+                items.push_back(new Item(key.c_str(), key.size(), 0, 0,
+                                         value.c_str(), value.size(),
+                                         NULL, 0, seqno, seqno, vb));
+            }
+
+            hrtime_t start = gethrtime();
+            rw->begin();
+            for (size_t k = 0; k < items.size(); ++k) {
+                rw->set(*items[k], wc);
+            }
+            while (!rw->commit(&sc, snapStart, highSeqnos[vb], 0, 0)) {
+                usleep(1000);
+            }
+            if (result) {
+                result->add(gethrtime() - start, items.size());
+            }
+
+            for (size_t k = 0; k < items.size(); ++k) {
+                delete items[k];
+            }
+        }
+    }
+
+    void runSets(BenchResult &result) {
+        std::vector<std::vector<size_t> > keysByVb(cfg.numVBuckets);
+        for (size_t i = 0; i < cfg.numKeys; ++i) {
+            keysByVb[vbucketOf(cfg, i)].push_back(i);
+        }
+        for (uint16_t vb = 0; vb < cfg.numVBuckets; ++vb) {
+            writeKeys(vb, keysByVb[vb], &result);
+        }
+        if (NoopMutationCallback::failures) {
+            std::cerr << NoopMutationCallback::failures
+                      << " sets failed" << std::endl;
+        }
+    }
+
+    void runGets(BenchResult &result) {
+        CountingGetCallback gc;
+        for (size_t i = 0; i < cfg.numGets; ++i) {
+            size_t k = rand() % cfg.numKeys;
+            hrtime_t start = gethrtime();
+            ro->get(makeKey(k), vbucketOf(cfg, k), gc);
+            result.add(gethrtime() - start, 1);
+        }
+        if (gc.missed) {
+            std::cerr << gc.missed << " gets missed" << std::endl;
+        }
+    }
+
+    void runGetMultis(BenchResult &result) {
+        size_t numBatches = cfg.numGets / cfg.multiGetSize;
+        size_t keysPerVb = cfg.numKeys / cfg.numVBuckets;
+        if (keysPerVb == 0) {
+            return;
+        }
+        size_t missed = 0;
+        for (size_t b = 0; b < numBatches; ++b) {
+            uint16_t vb = static_cast<uint16_t>(rand() % cfg.numVBuckets);
+            vb_bgfetch_queue_t fetches;
+            for (size_t i = 0; i < cfg.multiGetSize; ++i) {
+                // The keys of a vbucket are those equal to it modulo the
+                // number of vbuckets.
+                size_t k = (rand() % keysPerVb) * cfg.numVBuckets + vb;
+                fetches[makeKey(k)].push_back(
+                                    new VBucketBGFetchItem(NULL, false));
+            }
+
+            hrtime_t start = gethrtime();
+            ro->getMulti(vb, fetches);
+            result.add(gethrtime() - start, fetches.size());
+
+            vb_bgfetch_queue_t::iterator it = fetches.begin();
+            for (; it != fetches.end(); ++it) {
+                std::list<VBucketBGFetchItem *>::iterator fit;
+                for (fit = it->second.begin(); fit != it->second.end();
+                     ++fit) {
+                    if ((*fit)->value.getStatus() != ENGINE_SUCCESS) {
+                        ++missed;
+                    }
+                    (*fit)->delValue();
+                    delete *fit;
+                }
+            }
+        }
+        if (missed) {
+            std::cerr << missed << " multi-gets missed" << std::endl;
+        }
+    }
+
+    void runScans(BenchResult &result) {
+        shared_ptr<CountingGetCallback> cb(new CountingGetCallback());
+        shared_ptr<Callback<CacheLookup> > cl(new NoopLookupCallback());
+        for (uint16_t vb = 0; vb < cfg.numVBuckets; ++vb) {
+            size_t before = cb->found;
+            hrtime_t start = gethrtime();
+            ScanContext *ctx = ro->initScanContext(cb, cl, vb, 1, false,
+                                                   false, false);
+            if (ctx == NULL) {
+                std::cerr << "Failed to scan vbucket " << vb << std::endl;
+                continue;
+            }
+            ro->scan(ctx);
+            ro->destroyScanContext(ctx);
+            result.add(gethrtime() - start, cb->found - before);
+        }
+    }
+
+    void runCompactions(BenchResult &result) {
+        NoopStatsCallback sc;
+        for (uint16_t vb = 0; vb < cfg.numVBuckets; ++vb) {
+            compaction_ctx ctx;
+            ctx.purge_before_ts = 0;
+            ctx.purge_before_seq = 0;
+            ctx.max_purged_seq = 0;
+            ctx.drop_deletes = 0;
+            ctx.curr_time = ep_real_time();
+            ctx.expiryCallback.reset(new NoopExpiryCallback());
+
+            Mutex vbLock;
+            hrtime_t start = gethrtime();
+            if (!rw->compactVBucket(vb, &ctx, sc, vbLock)) {
+                std::cerr << "Failed to compact vbucket " << vb << std::endl;
+                continue;
+            }
+            result.add(gethrtime() - start, 1);
+        }
+    }
+
+    void runRollbacks(BenchResult &result) {
+        // Rewrite a tenth of every vbucket's keys in one more batch, then
+        // roll that batch back.
+        size_t batch = cfg.batchSize;
+        for (uint16_t vb = 0; vb < cfg.numVBuckets; ++vb) {
+            uint64_t rollbackTo = highSeqnos[vb];
+            std::vector<size_t> keys;
+            for (size_t i = vb; i < cfg.numKeys && keys.size() < batch;
+                 i += cfg.numVBuckets * 10) {
+                keys.push_back(i);
+            }
+            cfg.batchSize = keys.size() + 1;
+            writeKeys(vb, keys, NULL);
+            cfg.batchSize = batch;
+
+            shared_ptr<NoopRollbackCallback> cb(new NoopRollbackCallback());
+            hrtime_t start = gethrtime();
+            RollbackResult rv = rw->rollback(vb, rollbackTo, cb);
+            hrtime_t elapsed = gethrtime() - start;
+            if (!rv.success) {
+                std::cerr << "Failed to roll back vbucket " << vb
+                          << std::endl;
+                continue;
+            }
+            highSeqnos[vb] = rv.highSeqno;
+            result.add(elapsed, cb->keys);
+        }
+    }
+
+    BenchConfig &cfg;
+    KVStoreConfig kvconfig;
+    KVStore *rw;
+    KVStore *ro;
+    std::vector<uint64_t> highSeqnos;
+    std::string value;
+};
+
+static void usage(void) {
+    std::cerr << "Usage: ep-engine_kvstore_bench [options]" << std::endl
+              << "\t-b backend      couchdb or forestdb (couchdb)" << std::endl
+              << "\t-d dir          data directory, wiped before and after "
+              << "the run (/tmp/kvstore-bench)" << std::endl
+              << "\t-w workloads    comma separated, run in order "
+              << "(set,get,getmulti,scan,compact,rollback)" << std::endl
+              << "\t-k keys         number of keys (100000)" << std::endl
+              << "\t-s size         value size in bytes (256)" << std::endl
+              << "\t-v vbuckets     number of vbuckets (16)" << std::endl
+              << "\t-B batch        sets per commit (1000)" << std::endl
+              << "\t-g gets         number of keys read by get and "
+              << "getmulti (100000)" << std::endl
+              << "\t-m keys         keys per getMulti batch (32)" << std::endl
+              << "\t-c handles      read handle cache size (0)" << std::endl
+              << "\t-r seed         random seed (0)" << std::endl;
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+    BenchConfig cfg;
+    int cmd;
+
+    while ((cmd = getopt(argc, argv, "b:d:w:k:s:v:B:g:m:c:r:")) != -1) {
+        switch (cmd) {
+        case 'b':
+            cfg.backend = optarg;
+            break;
+        case 'd':
+            cfg.dbname = optarg;
+            break;
+        case 'w':
+            cfg.workloads = optarg;
+            break;
+        case 'k':
+            cfg.numKeys = strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            cfg.valueSize = strtoul(optarg, NULL, 10);
+            break;
+        case 'v':
+            cfg.numVBuckets = static_cast<uint16_t>(strtoul(optarg, NULL, 10));
+            break;
+        case 'B':
+            cfg.batchSize = strtoul(optarg, NULL, 10);
+            break;
+        case 'g':
+            cfg.numGets = strtoul(optarg, NULL, 10);
+            break;
+        case 'm':
+            cfg.multiGetSize = strtoul(optarg, NULL, 10);
+            break;
+        case 'c':
+            cfg.handleCacheSize = strtoul(optarg, NULL, 10);
+            break;
+        case 'r':
+            cfg.seed = static_cast<unsigned int>(strtoul(optarg, NULL, 10));
+            break;
+        default:
+            usage();
+        }
+    }
+    if (cfg.numKeys == 0 || cfg.numVBuckets == 0 || cfg.batchSize == 0 ||
+        cfg.multiGetSize == 0) {
+        usage();
+    }
+
+    putenv(strdup("ALLOW_NO_STATS_UPDATE=yeah"));
+    srand(cfg.seed);
+
+    std::cout << "backend " << cfg.backend << ", " << cfg.numKeys
+              << " keys of " << cfg.valueSize << " bytes in "
+              << cfg.numVBuckets << " vbuckets, " << cfg.batchSize
+              << " sets per commit" << std::endl;
+
+    KVStoreBench bench(cfg);
+    std::stringstream workloads(cfg.workloads);
+    std::string workload;
+    while (std::getline(workloads, workload, ',')) {
+        bench.run(workload);
+    }
+    return 0;
+}
@@ -19,6 +19,11 @@
 
 #include <platform/dirutils.h>
 
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
 #include "callbacks.h"
 #include "common.h"
 #include "kvstore.h"
@@ -65,9 +70,8 @@ public:
 
 };
 
-void basic_kvstore_test() {
+void basic_kvstore_test(std::string backend) {
     std::string data_dir("/tmp/kvstore-test");
-    std::string backend("couchdb");
 
     CouchbaseDirectoryUtilities::rmrf(data_dir.c_str());
 
@@ -82,7 +86,7 @@ void basic_kvstore_test() {
 
     kvstore->begin();
 
-    Item item("key", 3, 0, 0, "value", 5);
+    Item item("key", 3, 0, 0, "value", 5, NULL, 0, 1, 1, 0);
     WriteCallback wc;
     kvstore->set(item, wc);
 
@@ -94,9 +98,273 @@ void basic_kvstore_test() {
     delete kvstore;
 }
 
+class StatusCallback : public Callback<GetValue> {
+public:
+    StatusCallback() : status(ENGINE_FAILED) {}
+
+    void callback(GetValue &result) {
+        status = result.getStatus();
+        delete result.getValue();
+    }
+
+    ENGINE_ERROR_CODE status;
+};
+
+static std::map<std::string, std::string> collectedStats;
+
+extern "C" {
+    static void collect_stat(const char *key, const uint16_t klen,
+                             const char *val, const uint32_t vlen,
+                             const void *cookie) {
+        (void)cookie;
+        collectedStats[std::string(key, klen)] = std::string(val, vlen);
+    }
+}
+
+static size_t getStat(KVStore *kvstore, const char *name) {
+    collectedStats.clear();
+    kvstore->addStats("ro", collect_stat, NULL);
+    return strtoul(collectedStats[std::string("ro:") + name].c_str(),
+                   NULL, 10);
+}
+
+static void setAndCommit(KVStore *kvstore, const char *key) {
+    StatsCallback sc;
+    WriteCallback wc;
+    kvstore->begin();
+    Item item(key, strlen(key), 0, 0, "value", 5);
+    kvstore->set(item, wc);
+    kvstore->commit(&sc, 1, 1, 1, 0);
+}
+
+class DelCallback : public Callback<int> {
+public:
+    DelCallback() {}
+
+    void callback(int &result) {
+        (void)result;
+    }
+};
+
+static void queueFetch(vb_bgfetch_queue_t &q, const char *key) {
+    q[key].push_back(new VBucketBGFetchItem(NULL, false));
+}
+
+static ENGINE_ERROR_CODE fetchStatus(vb_bgfetch_queue_t &q, const char *key) {
+    VBucketBGFetchItem *fetch = q[key].front();
+    ENGINE_ERROR_CODE rv = fetch->value.getStatus();
+    fetch->delValue();
+    delete fetch;
+    return rv;
+}
+
+class SeqnoCollector : public Callback<GetValue> {
+public:
+    SeqnoCollector() {}
+
+    void callback(GetValue &result) {
+        Item *it = result.getValue();
+        seqnos.push_back(it->getBySeqno());
+        if (it->isDeleted()) {
+            deleted.insert(it->getKey());
+        }
+        delete it;
+    }
+
+    std::vector<int64_t> seqnos;
+    std::set<std::string> deleted;
+};
+
+class NoopLookup : public Callback<CacheLookup> {
+public:
+    void callback(CacheLookup &lookup) {
+        (void)lookup;
+    }
+};
+
+class KeyRollbackCB : public RollbackCB {
+public:
+    void callback(GetValue &result) {
+        cb_assert(dbHandle);
+        keys.insert(result.getValue()->getKey());
+        delete result.getValue();
+    }
+
+    std::set<std::string> keys;
+};
+
+static void storeAt(KVStore *kvstore, const std::string &key, int64_t seqno) {
+    Item item(key.c_str(), key.size(), 0, 0, "value", 5, NULL, 0, seqno,
+              seqno, 0);
+    WriteCallback wc;
+    kvstore->set(item, wc);
+}
+
+static ENGINE_ERROR_CODE getStatus(KVStore *kvstore, const std::string &key,
+                                   bool fetchDelete = false) {
+    StatusCallback cb;
+    kvstore->get(key, 0, cb, fetchDelete);
+    return cb.status;
+}
+
+static std::vector<int64_t> scanFrom(KVStore *kvstore, uint64_t start,
+                                     bool noDeletes) {
+    shared_ptr<SeqnoCollector> cb(new SeqnoCollector());
+    shared_ptr<Callback<CacheLookup> > cl(new NoopLookup());
+    ScanContext *ctx = kvstore->initScanContext(cb, cl, 0, start, false,
+                                                noDeletes, false);
+    cb_assert(ctx);
+    cb_assert(kvstore->scan(ctx) == scan_success);
+    kvstore->destroyScanContext(ctx);
+    return cb->seqnos;
+}
+
+/*
+ * Every backend has to pass this: mutations and deletions, single and
+ * batched reads, seqno scans, vbucket state surviving a restart, and
+ * rollbacks.
+ */
+void backend_suite_test(std::string backend) {
+    std::string data_dir("/tmp/kvstore-test");
+    CouchbaseDirectoryUtilities::rmrf(data_dir.c_str());
+
+    KVStoreConfig config(1024, data_dir, backend);
+    KVStore *kvstore = KVStoreFactory::create(config);
+    cb_assert(kvstore);
+
+    StatsCallback sc;
+    std::string failoverLog("[{\"id\":1,\"seq\":0}]");
+    vbucket_state state(vbucket_state_active, 0, 0, 0, 0, 0, 0, 0, 0,
+                        failoverLog);
+    cb_assert(kvstore->snapshotVBucket(0, state, &sc));
+
+    // key0 .. key9 at seqnos 1 .. 10, then key0 deleted at 11
+    kvstore->begin();
+    for (int i = 0; i < 10; ++i) {
+        std::stringstream key;
+        key << "key" << i;
+        storeAt(kvstore, key.str(), i + 1);
+    }
+    cb_assert(kvstore->commit(&sc, 1, 10, 10, 0));
+
+    kvstore->begin();
+    Item gone("key0", 4, 0, 0, NULL, 0, NULL, 0, 11, 11, 0, 2);
+    gone.setDeleted();
+    DelCallback dc;
+    kvstore->del(gone, dc);
+    cb_assert(kvstore->commit(&sc, 11, 11, 11, 0));
+    cb_assert(kvstore->getLastPersistedSeqno(0) == 11);
+
+    GetCallback gc;
+    kvstore->get("key1", 0, gc);
+    cb_assert(getStatus(kvstore, "key0") == ENGINE_KEY_ENOENT);
+    cb_assert(getStatus(kvstore, "key0", true) == ENGINE_SUCCESS);
+    cb_assert(getStatus(kvstore, "nokey") == ENGINE_KEY_ENOENT);
+
+    vb_bgfetch_queue_t fetches;
+    queueFetch(fetches, "key3");
+    queueFetch(fetches, "key9");
+    queueFetch(fetches, "nokey");
+    kvstore->getMulti(0, fetches);
+    cb_assert(fetchStatus(fetches, "key3") == ENGINE_SUCCESS);
+    cb_assert(fetchStatus(fetches, "key9") == ENGINE_SUCCESS);
+    cb_assert(fetchStatus(fetches, "nokey") == ENGINE_KEY_ENOENT);
+
+    // The deletion replaced key0's mutation in the sequence index.
+    std::vector<int64_t> seqnos = scanFrom(kvstore, 1, false);
+    cb_assert(seqnos.size() == 10);
+    for (size_t i = 0; i < seqnos.size(); ++i) {
+        cb_assert(seqnos[i] == static_cast<int64_t>(i + 2));
+    }
+    cb_assert(scanFrom(kvstore, 1, true).size() == 9);
+    cb_assert(scanFrom(kvstore, 6, false).size() == 6);
+    cb_assert(kvstore->getNumItems(0, 0, 11) == 10);
+
+    // The vbucket state is found again after a restart.
+    delete kvstore;
+    kvstore = KVStoreFactory::create(config);
+    std::vector<vbucket_state *> states = kvstore->listPersistedVbuckets();
+    cb_assert(states[0]);
+    cb_assert(states[0]->state == vbucket_state_active);
+    cb_assert(states[0]->highSeqno == 11);
+    cb_assert(states[0]->lastSnapEnd == 11);
+    cb_assert(states[0]->maxDeletedSeqno == 2);
+    cb_assert(states[0]->failovers == failoverLog);
+    cb_assert(getStatus(kvstore, "key5") == ENGINE_SUCCESS);
+
+    // Roll back a later batch: the callback sees every key it touched.
+    kvstore->begin();
+    storeAt(kvstore, "key1", 12);
+    storeAt(kvstore, "new1", 13);
+    storeAt(kvstore, "new2", 14);
+    cb_assert(kvstore->commit(&sc, 12, 14, 14, 0));
+    cb_assert(getStatus(kvstore, "new1") == ENGINE_SUCCESS);
+
+    shared_ptr<KeyRollbackCB> rcb(new KeyRollbackCB());
+    RollbackResult result = kvstore->rollback(0, 11, rcb);
+    cb_assert(result.success);
+    cb_assert(result.highSeqno == 11);
+    cb_assert(rcb->keys.size() == 3);
+    cb_assert(rcb->keys.count("key1") == 1);
+    cb_assert(getStatus(kvstore, "new1") == ENGINE_KEY_ENOENT);
+    cb_assert(getStatus(kvstore, "key1") == ENGINE_SUCCESS);
+    cb_assert(kvstore->getLastPersistedSeqno(0) == 11);
+
+    delete kvstore;
+}
+
+void read_handle_cache_test() {
+    std::string data_dir("/tmp/kvstore-test");
+    std::string backend("couchdb");
+
+    CouchbaseDirectoryUtilities::rmrf(data_dir.c_str());
+
+    KVStoreConfig config(1024, data_dir, backend, 4);
+    KVStore *rw = KVStoreFactory::create(config, false);
+    KVStore *ro = KVStoreFactory::create(config, true);
+    rw->setReadOnlyPeer(ro);
+
+    StatsCallback sc;
+    std::string failoverLog("");
+    vbucket_state state(vbucket_state_active, 0, 0, 0, 0, 0, 0, 0, 0,
+                        failoverLog);
+    rw->snapshotVBucket(0, state, &sc);
+    setAndCommit(rw, "key");
+
+    // The second read reuses the handle opened by the first.
+    StatusCallback first, second;
+    ro->get("key", 0, first);
+    ro->get("key", 0, second);
+    cb_assert(first.status == ENGINE_SUCCESS);
+    cb_assert(second.status == ENGINE_SUCCESS);
+    cb_assert(getStat(ro, "db_handle_cache_misses") == 1);
+    cb_assert(getStat(ro, "db_handle_cache_hits") == 1);
+
+    // A commit makes the cached handle's header stale.
+    setAndCommit(rw, "key2");
+    StatusCallback afterCommit;
+    ro->get("key2", 0, afterCommit);
+    cb_assert(afterCommit.status == ENGINE_SUCCESS);
+    cb_assert(getStat(ro, "db_handle_cache_misses") == 2);
+
+    // Deleting the vbucket drops the cached handle for its file.
+    rw->delVBucket(0);
+    StatusCallback afterDelete;
+    ro->get("key", 0, afterDelete);
+    cb_assert(afterDelete.status != ENGINE_SUCCESS);
+    cb_assert(getStat(ro, "db_handle_cache_hits") == 1);
+
+    delete ro;
+    delete rw;
+}
 
 int main(int argc, char **argv) {
     (void)argc; (void)argv;
     putenv(strdup("ALLOW_NO_STATS_UPDATE=yeah"));
-    basic_kvstore_test();
+    const char *backends[] = { "couchdb", "forestdb" };
+    for (size_t i = 0; i < sizeof(backends) / sizeof(backends[0]); ++i) {
+        basic_kvstore_test(backends[i]);
+        backend_suite_test(backends[i]);
+    }
+    read_handle_cache_test();
 }